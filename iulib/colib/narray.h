@@ -259,6 +259,7 @@ namespace colib {
         narray<T> &truncate(index_t d0) {
             check(d0<=dims[0] && dims[1]==0,"can only truncate 1D arrays to smaller arrays");
             setdims_(d0);
+            return *this;
         }
 
         /// Resizes the array, possibly destroying any data previously held by it.
@@ -89,6 +89,21 @@ namespace {
         return count;
     }
 
+    // stack a list of vectors into the rows of a matrix, padding
+    // shorter vectors with zeros
+
+    void rowstack(floatarray &result,narray<floatarray> &rows) {
+        int n = rows.length();
+        int m = 0;
+        for(int i=0;i<n;i++) m = max(m,rows(i).length());
+        result.resize(n,m);
+        result.fill(0);
+        for(int i=0;i<n;i++) {
+            floatarray &v = rows(i);
+            for(int j=0;j<v.length();j++)
+                result(i,j) = v(j);
+        }
+    }
 }
 
 namespace glinerec {
@@ -105,7 +120,8 @@ namespace glinerec {
         // submodels
         virtual int nmodels() { return 0; }
         virtual void setModel(IModel *,int i) { throw "no submodels"; }
-        virtual IComponent &getModel(int i) { throw "no submodels"; }
+        // returns 0 for an unset submodel
+        virtual IModel *getModel(int i) { throw "no submodels"; }
 
         // update this model in place
         virtual void copy(IModel &) { throw Unimplemented(); }
@@ -118,6 +134,23 @@ namespace glinerec {
             return outputs(temp,v);
         }
 
+        // batch version of outputs: each row of inputs is a feature
+        // vector, the corresponding row of result receives its outputs and
+        // costs receives the values returned by outputs(); classifiers that
+        // can evaluate many vectors more efficiently at once override this
+        virtual void batchOutputs(floatarray &result,floatarray &costs,floatarray &inputs) {
+            int n = inputs.dim(0);
+            narray<floatarray> rows(n);
+            costs.resize(n);
+#pragma omp parallel for schedule(dynamic,10)
+            for(int i=0;i<n;i++) {
+                floatarray v;
+                rowget(v,inputs,i);
+                costs(i) = outputs(rows(i),v);
+            }
+            rowstack(result,rows);
+        }
+
         // convenience function
         virtual int classify(floatarray &v) {
             floatarray p;
@@ -169,7 +202,7 @@ namespace glinerec {
             pprint(stream,depth);
             iprintf(stream,depth,"mapping from %d to %d dimensions\n",
                    c2i.dim(0),i2c.dim(0));
-            if(!!cf) cf->info(depth+1);
+            if(!!cf) cf->info(depth+1,stream);
         }
         int nmodels() {
             return 1;
@@ -177,8 +210,8 @@ namespace glinerec {
         void setModel(IModel *cf,int which) {
             this->cf = cf;
         }
-        IModel &getModel(int i) {
-            return *cf;
+        IModel *getModel(int i) {
+            return cf.ptr();
         }
         int nfeatures() {
             return cf->nfeatures();
@@ -224,6 +257,15 @@ namespace glinerec {
             ctranslate_vec(z,i2c);
             return result;
         }
+        void batchOutputs(floatarray &z,floatarray &costs,floatarray &x) {
+            floatarray raw;
+            cf->batchOutputs(raw,costs,x);
+            z.resize(raw.dim(0),max(i2c)+1);
+            z.fill(0);
+            for(int i=0;i<raw.dim(0);i++)
+                for(int j=0;j<raw.dim(1);j++)
+                    z(i,i2c(j)) = raw(i,j);
+        }
 
         static void hist(intarray &h,intarray &a) {
             h.resize(max(a)+1);
@@ -273,6 +315,9 @@ namespace glinerec {
 
     void least_square(floatarray &xf,floatarray &Af,floatarray &bf);
 
+    float estimate_errors_batch(IModel &classifier,IDataset &ds,double *seconds=0);
+    int quantize_mlps(IModel &model);
+
     inline IModel *make_model(const char *name) {
         IModel *result = dynamic_cast<IModel*>(component_construct(name));
         CHECK(result!=0);
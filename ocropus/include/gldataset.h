@@ -262,6 +262,167 @@ namespace glinerec {
         }
     };
 
+    ////////////////////////////////////////////////////////////////
+    // On-disk float8 datasets.  A ds8 file starts with a Ds8Header,
+    // followed by a class histogram (ds8_nhist ints; classes beyond
+    // that only show up in nclasses) and, at header_size, by records
+    // of record_size bytes: int class, int id, nfeatures float8
+    // values and zero padding.  Records are only ever appended, and
+    // the header is updated after the records it counts have been
+    // written, so a file can be read while other processes append
+    // to it.
+    ////////////////////////////////////////////////////////////////
+
+    enum { ds8_version=1, ds8_nhist=4096 };
+
+    struct Ds8Header {
+        char magic[8];          // "ocrods8\n"
+        int version;
+        int header_size;
+        int nfeatures;
+        int record_size;
+        int nclasses;
+        int nhist;
+        long long nsamples;
+        long long next_id;      // next id handed out by Ds8Writer
+        int reserved[8];
+    };
+
+    bool ds8_check_magic(FILE *stream);
+    void ds8_write(FILE *stream,IDataset &ds);
+
+    // a ds8 file mapped into memory; samples are converted to float
+    // when they are accessed and never copied otherwise
+
+    struct MmapDataset : IDataset {
+        Ds8Header header;
+        int *hist;
+        char *records;
+        void *base;
+        size_t mapped;
+        MmapDataset();
+        ~MmapDataset();
+        const char *name() {
+            return "mmapdataset";
+        }
+        void open(const char *path);
+        void open(FILE *stream);
+        void close();
+        int nsamples() {
+            return int(header.nsamples);
+        }
+        int nclasses() {
+            return header.nclasses;
+        }
+        int nfeatures() {
+            return header.nfeatures;
+        }
+        int count(int c) {
+            return unsigned(c)<unsigned(header.nhist) ? hist[c] : -1;
+        }
+        char *record(int i) {
+            if(unsigned(i)>=unsigned(header.nsamples)) throw "MmapDataset: index out of range";
+            return records + size_t(i)*header.record_size;
+        }
+        int cls(int i) {
+            return ((int*)record(i))[0];
+        }
+        int id(int i) {
+            return ((int*)record(i))[1];
+        }
+        void input(floatarray &v,int i) {
+            signed char *p = (signed char*)(record(i)+2*sizeof (int));
+            v.resize(header.nfeatures);
+            for(int j=0;j<header.nfeatures;j++)
+                v.unsafe_at(j) = p[j]/100.0;
+        }
+    };
+
+    // append mode for ds8 files: samples are buffered and written in
+    // batches under an exclusive lock, so that several processes can
+    // append to the same file; the file is created on the first flush
+
+    struct Ds8Writer {
+        enum { batch=1024 };
+        iucstring path;
+        int nfeatures;
+        int record_size;
+        bytearray buffer;
+        intarray pending;       // 1 if the sample shares the previous id
+        int last_id;
+        int buffered;
+        Ds8Writer();
+        ~Ds8Writer();
+        void open(const char *path);
+        // same_id marks repeated presentations of the same sample
+        void add(floatarray &v,int c,bool same_id=false);
+        void flush();
+        void close();
+    };
+
+    // several datasets with the same features addressed as one;
+    // sample i is sample i-offset(k) of shard k
+
+    struct ShardedDataset : IDataset {
+        narray<IDataset*> shards;
+        intarray offsets;
+        int nc;
+        ShardedDataset() {
+            offsets.push(0);
+            nc = 0;
+        }
+        const char *name() {
+            return "shardeddataset";
+        }
+        void add(IDataset &ds) {
+            if(shards.length()>0) CHECK(ds.nfeatures()==nfeatures());
+            shards.push(&ds);
+            offsets.push(offsets.last()+ds.nsamples());
+            nc = max(nc,ds.nclasses());
+        }
+        int nshards() {
+            return shards.length();
+        }
+        // global indexes of the samples in shard k, e.g. for a Datasubset
+        void shard_samples(intarray &samples,int k) {
+            samples.clear();
+            for(int i=offsets(k);i<offsets(k+1);i++) samples.push(i);
+        }
+        int locate(int &j,int i) {
+            if(unsigned(i)>=unsigned(offsets.last())) throw "ShardedDataset: index out of range";
+            int lo = 0, hi = shards.length();
+            while(hi-lo>1) {
+                int mid = (lo+hi)/2;
+                if(offsets(mid)<=i) lo = mid;
+                else hi = mid;
+            }
+            j = i-offsets(lo);
+            return lo;
+        }
+        int nsamples() {
+            return offsets.last();
+        }
+        int nclasses() {
+            return nc;
+        }
+        int nfeatures() {
+            return shards.length()>0 ? shards(0)->nfeatures() : -1;
+        }
+        int cls(int i) {
+            int j,k = locate(j,i);
+            return shards(k)->cls(j);
+        }
+        void input(floatarray &v,int i) {
+            int j,k = locate(j,i);
+            shards(k)->input(v,j);
+        }
+        int id(int i) {
+            // keep ids from different shards apart
+            int j,k = locate(j,i);
+            return shards(k)->id(j)*shards.length()+k;
+        }
+    };
+
     struct AugmentedDataset : IDataset {
         IDataset &ds;
         narray<floatarray> augments;
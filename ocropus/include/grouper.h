@@ -97,6 +97,14 @@ namespace ocropus {
 
         virtual void setClass(int i,int cls,float cost) = 0;
 
+        // Set the costs for all classes of group i at once; costs(cls)
+        // is the cost for class cls, INFINITY leaves the class unset.
+
+        virtual void setClasses(int i,floatarray &costs) {
+            for(int cls=0;cls<costs.length();cls++)
+                if(costs(cls)<INFINITY) setClass(i,cls,costs(cls));
+        }
+
         // Space handling.  For any component, pixelSpace gets the amount
         // of subsequent space (-1 for the last component).
 
@@ -56,6 +56,98 @@ namespace ocropus {
 
     OcroFST *make_OcroFST();
 
+    /// \brief A read-only OcroFST with flat arc storage.
+    ///
+    /// The arcs of all states are kept in two contiguous arrays, one with
+    /// the arcs of each state sorted by input and one with them sorted by
+    /// output; the arcs of state i are at offsets[i] to offsets[i+1]-1 in
+    /// both.  The heuristics (the cost of the best path to an accept
+    /// state) are computed once by fst_freeze().  Nothing changes after
+    /// that, so the same FrozenFst can be searched by several threads at
+    /// once, e.g. as a language model shared by all of them.
+    ///
+    /// save() writes the arrays as they are in memory (see
+    /// fst_frozen_check_magic()), and load() maps such a file read-only
+    /// instead of parsing it, so processes that load the same language
+    /// model share one copy of it in the page cache.
+    struct FrozenFst : IGenericFst {
+        struct Arc {
+            int input;
+            int output;
+            int target;
+            float cost;
+        };
+        int start;
+        int nstates;
+        int narcs;
+        // these point into image or into the mapped file
+        int *offsets;
+        Arc *by_input;
+        Arc *by_output;
+        float *accept_costs;
+        float *heuristics;
+
+        autofree<char> image;
+        size_t allocated;
+        void *base;
+        size_t mapped;
+
+        FrozenFst();
+        ~FrozenFst();
+        virtual const char *description();
+        virtual int nStates();
+        virtual int getStart();
+        virtual float getAcceptCost(int node);
+        virtual void arcs(intarray &inputs,
+                          intarray &targets,
+                          intarray &outputs,
+                          floatarray &costs,
+                          int from);
+        virtual void bestpath(nustring &result);
+        /// writes the native format
+        virtual void save(const char *path);
+        /// maps a file in the native format, or loads an FST file in
+        /// OpenFST format and freezes it
+        virtual void load(const char *path);
+        /// maps a file in the native format
+        void map(const char *path);
+        /// forget the arcs, unmapping the file if there is one
+        void release();
+        /// allocate image for the given size, laid out like the file,
+        /// and point the arrays into it
+        void allocate(int nstates, int narcs);
+
+        // the writing methods throw
+        virtual void clear();
+        virtual int newState();
+        virtual void addTransition(int from,int to,int output,float cost,int input);
+        virtual void setStart(int node);
+        virtual void setAccept(int node,float cost=0.0);
+        virtual int special(const char *s);
+    private:
+        // a copy would unmap the file a second time
+        FrozenFst(const FrozenFst &);
+        void operator=(const FrozenFst &);
+    };
+
+    /// \brief Check whether a file holds a FrozenFst in the native format.
+    ///
+    /// The native format is the header followed by offsets, accept costs,
+    /// heuristics and the arcs by input and by output, each aligned to 64
+    /// bytes, in little-endian byte order.
+    bool fst_frozen_check_magic(const char *path);
+
+    /// \brief Copy an OcroFST into a FrozenFst.
+    ///
+    /// This sorts the arcs of fst by input, but doesn't change it otherwise.
+    void fst_freeze(FrozenFst &frozen, OcroFST &fst);
+
+    /// \brief Write an FST to a stream in the OpenFST format.
+    void fst_write(FILE *stream, IGenericFst &fst);
+
+    /// \brief Read an FST in the OpenFST format from a stream.
+    void fst_read(IGenericFst &fst, FILE *stream);
+
     /// \brief Copy one FST to another.
     ///
     /// \param[out]     dst     The destination. Will be cleared before copying.
@@ -69,10 +161,71 @@ namespace ocropus {
     /// \param[in]      src     The FST to copy.
     void fst_copy_best_arcs_only(IGenericFst &dst, IGenericFst &src);
 
+    /// \brief Copy an FST without the arcs that are unlikely to be used.
+    ///
+    /// An arc is removed if the best path through it costs more than
+    /// beam above the best path of the FST, or if it isn't among the
+    /// max_arcs cheapest of those (by the same measure) that go between
+    /// the same two states, i.e. the classes of one segment in a line
+    /// lattice.  The states are kept as they are.
+    ///
+    /// \param[out]     dst      The destination. Will be cleared before copying.
+    /// \param[in]      src      The FST to prune.
+    /// \param          beam     Negative to keep arcs regardless of their cost.
+    /// \param          max_arcs 0 for no limit.
+    void fst_prune(IGenericFst &dst, IGenericFst &src, float beam, int max_arcs=0);
+
+    /// \brief Copy the states of an FST that are on some path from the
+    /// start to an accepting state, numbered in breadth-first order.
+    void fst_connect(IGenericFst &dst, IGenericFst &src);
+
+    /// \brief Copy an FST without epsilon arcs (no input, no output).
+    ///
+    /// Every state gets the arcs and the acceptance of the states it
+    /// reaches by epsilons, at the cost of the best epsilon path there.
+    /// The epsilon arcs must not have negative costs.
+    void fst_remove_epsilons(IGenericFst &dst, IGenericFst &src);
+
+    /// \brief Determinize an epsilon-free FST.
+    ///
+    /// The (input, output) pairs are treated as the labels, so the result
+    /// has at most one arc per pair out of every state and the same best
+    /// cost for every pair of strings, up to a rounding of 1/1024.
+    ///
+    /// Back-off language models usually grow a lot, so there is a limit.
+    ///
+    /// \param     max_arcs    give up (leaving dst alone) when the result
+    ///                        would get more arcs; 0 for no limit.
+    /// \returns   false if it gave up
+    bool fst_determinize(IGenericFst &dst, IGenericFst &src, int max_arcs=0);
+
+    /// \brief Push the costs of an FST towards the start.
+    ///
+    /// Every arc costs what it adds to the best path to acceptance,
+    /// which lets a beam search see the cost of a choice when it makes
+    /// it.  The cost of every path stays the same.  The FST should be
+    /// connected (see fst_connect()).  Negative arc or accept costs
+    /// aren't supported and make it throw.
+    void fst_push_weights(IGenericFst &dst, IGenericFst &src);
+
+    /// \brief Merge the equivalent states of a deterministic FST.
+    ///
+    /// Costs are compared rounded to 1/1024, so the weights should be
+    /// pushed first (see fst_push_weights()).
+    void fst_minimize(IGenericFst &dst, IGenericFst &src);
+
+    /// \brief Make a language model accepting words of a list separated
+    /// by single spaces.
+    ///
+    /// Each word costs costs[i]; the result is a trie, not minimized.
+    void fst_word_list(IGenericFst &dst, objlist<nustring> &words, floatarray &costs);
+
     /// \brief Compose two FSTs.
     ///
     /// This function copies the composition of two given FSTs.
     /// That causes expansion (storing all arcs explicitly).
+    /// Only states reachable from the start are copied; they are
+    /// numbered in the order they are reached.
     void fst_expand_composition(IGenericFst &out, OcroFST &, OcroFST &);
 
 
@@ -111,6 +264,9 @@ namespace ocropus {
     /// \returns total cost
     double a_star(nustring &result, OcroFST &fst);
 
+    /// \brief a_star() using the precomputed heuristics of a FrozenFst.
+    double a_star(nustring &result, FrozenFst &fst);
+
     /// \brief Simplified interface for a_star_in_composition().
     ///
     /// \param[out] result      FST output with epsilons removed,
@@ -119,6 +275,10 @@ namespace ocropus {
     /// \returns total cost
     double a_star(nustring &result, OcroFST &fst1, OcroFST &fst2);
 
+    /// \brief a_star() in the composition with a FrozenFst (usually the
+    /// language model).
+    double a_star(nustring &result, OcroFST &fst1, FrozenFst &fst2);
+
 
     // TODO/mezhirov document return value
     /// \brief Search for the best path through the composition of 2 FSTs
@@ -181,6 +341,153 @@ namespace ocropus {
     double beam_search(nustring &result, OcroFST &fst1, OcroFST &fst2,
                        int beam_width=1000);
 
+    /// \brief Beam search against a FrozenFst.
+    ///
+    /// Unlike the version for two OcroFSTs, this doesn't modify fst2,
+    /// so several threads can search the same fst2 at the same time.
+    void beam_search(intarray &vertices1,
+                     intarray &vertices2,
+                     intarray &inputs,
+                     intarray &outputs,
+                     floatarray &costs,
+                     OcroFST &fst1,
+                     FrozenFst &fst2,
+                     int beam_width=1000);
+
+    double beam_search(nustring &result, OcroFST &fst1, FrozenFst &fst2,
+                       int beam_width=1000);
+
+    /// \brief Counters of a BeamDecoder, summed over all its searches.
+    struct BeamStats {
+        int beam_width;
+        int lines;
+        long generations;
+        long entries;         // beam sizes, summed over generations
+        double load;          // hash table loads, summed over generations
+        long insertions;      // states that entered the beam
+        long replacements;    // better paths to states already in the beam
+        long evictions;       // states pushed out of a full beam
+        long rejections;      // arcs that didn't change the beam
+        long probes;          // hash table probes
+        int max_tree;         // largest search tree of a line
+        long indexed;         // joins done through an LmStateCache
+
+        BeamStats() {
+            beam_width = 0;
+            lines = 0;
+            generations = 0;
+            entries = 0;
+            load = 0;
+            insertions = 0;
+            replacements = 0;
+            evictions = 0;
+            rejections = 0;
+            probes = 0;
+            max_tree = 0;
+            indexed = 0;
+        }
+    };
+
+    /// \brief Repeated beam search against the same FrozenFst.
+    ///
+    /// A BeamDecoder keeps its search arrays from one call to the next.
+    /// The FrozenFst is only read, so decoders in different threads can
+    /// share it, but each thread needs its own decoder.
+    struct BeamDecoder {
+        virtual ~BeamDecoder() {}
+        /// same as the corresponding beam_search()
+        virtual void decode(intarray &vertices1,
+                            intarray &vertices2,
+                            intarray &inputs,
+                            intarray &outputs,
+                            floatarray &costs,
+                            OcroFST &fst1) = 0;
+        virtual double decode(nustring &result, OcroFST &fst1) = 0;
+        virtual BeamStats &stats() = 0;
+    };
+
+    BeamDecoder *make_BeamDecoder(FrozenFst &fst2, int beam_width=1000);
+
+    /// \brief Label index of the busy states of a FrozenFst, shared by
+    /// several decoders.
+    ///
+    /// For a state with many arcs, the index lists the distinct input
+    /// labels and where their arcs start, so that the search looks up the
+    /// arcs matching each arc of the lattice instead of merging both arc
+    /// lists.  States are indexed when a decoder first reaches them, by
+    /// whichever thread gets there first; the index never takes more than
+    /// maxbytes, and states that don't fit any more are merged as before.
+    struct LmStateCache {
+        virtual ~LmStateCache() {}
+        /// the number of indexed states and the bytes they take
+        virtual void counts(int &states, long &bytes) = 0;
+    };
+
+    LmStateCache *make_LmStateCache(FrozenFst &fst2, long maxbytes);
+
+    /// A BeamDecoder that joins through the given cache, which must
+    /// belong to the same FrozenFst and outlive the decoder.
+    BeamDecoder *make_BeamDecoder(FrozenFst &fst2, LmStateCache &cache,
+                                  int beam_width=1000);
+
+    /// \brief The result of decoding one line with a BatchDecoder.
+    struct DecodedLine {
+        intarray vertices1;
+        intarray vertices2;
+        intarray inputs;
+        intarray outputs;
+        floatarray costs;
+        double cost;        // sum of costs; above 1e10 if there is no path
+        double time;        // seconds spent on this line
+        iucstring error;    // what the search threw, if anything
+    };
+
+    /// \brief Decodes a batch of lattices at a time against one FrozenFst.
+    ///
+    /// The lines of a batch are spread over the OpenMP threads.  Each
+    /// thread keeps its own BeamDecoder from one batch to the next, and
+    /// all of them share one LmStateCache.  decode() itself must not be
+    /// called from several threads at once.
+    struct BatchDecoder {
+        virtual ~BatchDecoder() {}
+        /// decode lattices(i) into result(i); result is resized to match
+        virtual void decode(objlist<DecodedLine> &result,
+                            narray<OcroFST*> &lattices) = 0;
+        /// the counters of all the decoders, summed
+        virtual void stats(BeamStats &result) = 0;
+        virtual LmStateCache &cache() = 0;
+    };
+
+    BatchDecoder *make_BatchDecoder(FrozenFst &fst2, int beam_width=1000,
+                                    long cache_bytes=1<<22);
+
+    /// \brief The best paths through an FST or a composition, best first.
+    ///
+    /// Each call of next() continues an A* search over partial paths
+    /// that uses the heuristics of the FSTs, so only what is needed for
+    /// the paths returned so far is expanded.  The arrays are like those
+    /// of a_star_in_composition(): one entry per arc, and a last one with
+    /// the accept cost.  With unique, paths whose output (without
+    /// epsilons) has been returned before are skipped.  The FSTs must
+    /// outlive the NBestPaths; OcroFSTs get sorted as for a_star().
+    struct NBestPaths {
+        virtual ~NBestPaths() {}
+        /// returns false when there are no more paths
+        virtual bool next(intarray &inputs,
+                          intarray &outputs,
+                          floatarray &costs) = 0;
+        virtual bool next(nustring &result, double &cost) = 0;
+        /// true if next() returned false because the search hit its
+        /// limit on partial paths rather than running out of paths
+        virtual bool truncated() = 0;
+    };
+
+    /// \param n   the number of paths that will be asked for; paths
+    ///             after the first n may be missing
+    NBestPaths *make_NBestPaths(OcroFST &fst, int n, bool unique=false);
+    NBestPaths *make_NBestPaths(OcroFST &fst1, OcroFST &fst2, int n, bool unique=false);
+    NBestPaths *make_NBestPaths(OcroFST &fst1, FrozenFst &fst2, int n, bool unique=false);
+
 };
 
 #endif
@@ -62,6 +62,7 @@ namespace ocropus {
 #include "grid.h"
 #include "grouper.h"
 #include "logger.h"
+#include "stats.h"
 #include "narray-io.h"
 #include "segmentation.h"
 #include "docproc.h"
@@ -74,6 +75,8 @@ namespace ocropus {
 #include "resource-path.h"
 #include "segmentation.h"
 #include "sysutil.h"
+#include "linecache.h"
+#include "bookstore.h"
 #include "xml-entities.h"
 #include "init-ocropus.h"
 
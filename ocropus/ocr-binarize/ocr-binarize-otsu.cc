@@ -56,6 +56,7 @@ namespace ocropus {
         }
 
         void binarize(bytearray &bin_image, bytearray &gray_image){
+            StatsTimer timer("binarize");
             if(bin_image.length1d()!=gray_image.length1d())
                 makelike(bin_image,gray_image);
 
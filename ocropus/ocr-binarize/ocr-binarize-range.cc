@@ -73,6 +73,7 @@ namespace ocropus {
         }
 
         void binarize(bytearray &out,floatarray &in) {
+            StatsTimer timer("binarize");
             binarize_by_range(out,in,fraction);
         }
 
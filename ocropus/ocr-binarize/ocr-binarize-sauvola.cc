@@ -75,6 +75,7 @@ binarization algorithm based on integral images.\n";
         }
 
         void binarize(bytearray &bin_image, bytearray &gray_image){
+            StatsTimer timer("binarize");
             whalf = w>>1;
             // fprintf(stderr,"[sauvola %g %d]\n",k,w);
             CHECK_ARG(k>=0.05 && k<=0.95);
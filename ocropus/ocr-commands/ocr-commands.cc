@@ -26,9 +26,15 @@
 #define __warn_unused_result__ __far__
 
 #include <cctype>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <glob.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include "colib/colib.h"
 #include "iulib/iulib.h"
@@ -56,6 +62,25 @@ namespace ocropus {
     param_string eval_flags("eval_flags","space","which features to ignore during evaluation");
     param_bool continue_partial("continue_partial",0,"don't compute outputs that already exist");
     param_bool old_csegs("old_csegs",0,"use old csegs (spaces are not counted)");
+    param_int line_cache("line_cache",0,"megabytes of results to keep for repeated lines (0=no cache)");
+    param_bool line_cache_save("line_cache_save",1,"keep the line cache of lines2fsts in dir/linecache between runs");
+    param_float prune_beam("prune_beam",-1,"lines2fsts drops arcs whose best path costs this much more than the best one (<0=keep all)");
+    param_int prune_arcs("prune_arcs",0,"lines2fsts keeps only this many classes per segment (0=all)");
+    param_int nbest("nbest",10,"number of hypotheses per line for fsts2nbest");
+    param_bool nbest_unique("nbest_unique",1,"fsts2nbest skips hypotheses with the same text as a better one");
+    param_bool nbest_lmodel("nbest_lmodel",1,"fsts2nbest composes the lattices with lmodel");
+    param_float lm_max_growth("lm_max_growth",1.5,"compilelm skips epsilon removal or determinization when it multiplies the arcs by more than this");
+    param_int book2text_segmenters("book2text_segmenters",1,"book2text threads segmenting pages");
+    param_int book2text_recognizers("book2text_recognizers",0,"book2text threads recognizing lines (0=one per processor)");
+    param_int book2text_decoders("book2text_decoders",1,"book2text threads decoding lattices with lmodel");
+    param_int book2text_queue("book2text_queue",32,"book2text lines waiting between two stages");
+    param_string book2text_dump("book2text_dump","","book2text also writes pages, lines, fsts and text to this directory, as book2pages ... fsts2text would");
+    param_int serve_queue("serve_queue",64,"requests ocropus serve keeps waiting for a worker; more are refused with 503");
+    param_int serve_max_request("serve_max_request",64,"largest image ocropus serve accepts, in megabytes");
+    param_int serve_max_beam("serve_max_beam",10000,"largest beam=... ocropus serve accepts; more is refused with 400");
+    param_int serve_connections("serve_connections",256,"connections ocropus serve handles at once; more are refused with 503");
+    param_string stats_json("stats_json","","when the command ends, write the time spent in each stage (binarize, segment, recognizeLine/setLine, beam_search, ...) and the bytes read and written as JSON to this file (-=stderr)");
+    param_int page_threads("page_threads",0,"pages processed at the same time by page, book2lines and pages2lines (0=one per OpenMP thread); each holds its images in memory");
     param_float maxheight("max_line_height",300,"maximum line height");
     param_float maxaspect("max_line_aspect",0.5,"maximum line aspect ratio");
 
@@ -66,6 +91,8 @@ namespace ocropus {
 
     // these are used for the single page recognizer
     param_int beam_width("beam_width", 100, "number of nodes in a beam generation");
+    param_int decode_batch("decode_batch",256,"lattices fsts2text reads and decodes together");
+    param_int lm_cache("lm_cache",4,"megabytes of language model state indexes shared by the fsts2text decoders");
 
     void cleanup_for_eval(iucstring &s) {
         bool space = strflag(eval_flags,"space");
@@ -104,14 +131,47 @@ namespace ocropus {
         str.toNustring(output);
     }
 
-    static void store_costs(const char *base, floatarray &costs) {
-        iucstring s;
-        s = base;
-        s.append(".costs");
-        stdio stream(s,"w");
+    static void store_costs(Book &book, int page, int line, floatarray &costs) {
+        BookWriter stream(book, page, line, ".costs");
         for(int i=0;i<costs.length();i++) {
             fprintf(stream,"%d %g\n",i,costs(i));
         }
+        stream.close();
+    }
+
+    static int count_arcs(IGenericFst &fst) {
+        intarray inputs,targets,outputs;
+        floatarray costs;
+        int total = 0;
+        for(int i=0;i<fst.nStates();i++) {
+            fst.arcs(inputs,targets,outputs,costs,i);
+            total += targets.length();
+        }
+        return total;
+    }
+
+    static bool pruning() {
+        return prune_beam>=0 || prune_arcs>0;
+    }
+
+    // summary of the per-line times of a run; lines that weren't
+    // processed have negative times
+    static void report_latencies(const char *what,floatarray &times,double elapsed) {
+        floatarray sorted;
+        for(int i=0;i<times.length();i++)
+            if(times(i)>=0) sorted.push(times(i));
+        int n = sorted.length();
+        if(n==0) return;
+        quicksort(sorted);
+        debugf("info","%s %d lines in %.2fs, %.1f lines/s, latency p50 %.1fms p95 %.1fms max %.1fms\n",
+                what,n,elapsed,n/max(elapsed,1e-9),1000*sorted(n/2),
+                1000*sorted(min(n-1,int(0.95*n))),1000*sorted(n-1));
+    }
+
+    static void report_cache(LineCache &cache) {
+        int hits,misses,entries;
+        cache.counts(hits,misses,entries);
+        debugf("info","line cache hits %d misses %d entries %d\n",hits,misses,entries);
     }
 
     static void rseg_to_cseg(intarray &cseg, intarray &rseg, intarray &ids) {
@@ -135,37 +195,30 @@ namespace ocropus {
             cseg.at1d(i) = map[rseg.at1d(i)];
     }
 
-    static void rseg_to_cseg(const char *base, intarray &ids) {
-        iucstring s;
-        s = base;
-        s += ".rseg.png";
+    static void rseg_to_cseg(Book &book, int page, int line, intarray &ids) {
         intarray rseg;
-        read_image_packed(rseg, s.c_str());
+        read_image_packed(rseg, BookReader(book, page, line, ".rseg.png"), "png");
         make_line_segmentation_black(rseg);
         intarray cseg;
 
         rseg_to_cseg(cseg, rseg, ids);
 
         ::make_line_segmentation_white(cseg);
-        s = base;
-        s += ".cseg.png";
-        write_image_packed(s, cseg);
+        BookWriter stream(book, page, line, ".cseg.png");
+        write_image_packed(stream, cseg, "png");
+        stream.close();
     }
 
     // Read a line and make an FST out of it.
-    void read_transcript(IGenericFst &fst, const char *path) {
+    void read_transcript(IGenericFst &fst, FILE *stream) {
         nustring gt;
-        read_utf8_line(gt, stdio(path, "r"));
+        read_utf8_line(gt, stream);
         fst_line(fst, gt);
     }
 
-    // Reads a "ground truth" FST (with extra spaces) by basename
-    void read_gt(IGenericFst &fst, const char *base) {
-        strbuf gt_path;
-        gt_path = base;
-        gt_path += ".gt.txt";
-
-        read_transcript(fst, gt_path);
+    // Reads a "ground truth" FST (with extra spaces) for a line
+    void read_gt(IGenericFst &fst, Book &book, int page, int line) {
+        read_transcript(fst, BookReader(book, page, line, ".gt.txt"));
         for(int i = 0; i < fst.nStates(); i++)
             fst.addTransition(i, i, 0, 0, ' ');
     }
@@ -192,6 +245,27 @@ namespace ocropus {
         }
     };
 
+    // the files of the page specs (images or @lists) on the command line
+    static void collect_pages(narray<iucstring> &files,int argc,char **argv,int first) {
+        for(int arg=first;arg<argc;arg++) {
+            Pages pages;
+            pages.parseSpec(argv[arg]);
+            for(int i=0;i<pages.length();i++)
+                files.push() = pages.files[i];
+        }
+    }
+
+    // the number of pages to work on at the same time; every worker gets
+    // its own segmenter and recognizer, indexed by THREAD
+    static int page_workers() {
+        if(page_threads>0) return page_threads;
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
     // _______________________________________________________________________
 
     void hocr_dump_preamble(FILE *output) {
@@ -211,7 +285,7 @@ namespace ocropus {
         fprintf(output, "</head>\n");
     }
 
-    void hocr_dump_line(FILE *output, const char *path,
+    void hocr_dump_line(FILE *output, nustring &s,
                         RegionExtractor &r, int index, int h) {
         fprintf(output, "<span class=\"ocr_line\"");
         if(index > 0 && index < r.length()) {
@@ -220,12 +294,17 @@ namespace ocropus {
                         r.x1(index), h - 1 - r.y1(index));
         }
         fprintf(output, ">\n");
-        nustring s;
-        read_utf8_line(s, stdio(path, "r"));
         write_utf8(output, s);
         fprintf(output, "</span>");
     }
 
+    void hocr_dump_line(FILE *output, const char *path,
+                        RegionExtractor &r, int index, int h) {
+        nustring s;
+        read_utf8_line(s, stdio(path, "r"));
+        hocr_dump_line(output, s, r, index, h);
+    }
+
     void hocr_dump_page(FILE *output, const char *path) {
         iucstring pattern;
 
@@ -255,40 +334,49 @@ namespace ocropus {
     // _______________________________________________________________________
 
     int main_book2lines(int argc,char **argv) {
-        int pageno = 0;
-        autodel<ISegmentPage> segmenter;
-        segmenter = make_SegmentPageByRAST();
         const char *outdir = argv[1];
-        if(mkdir(outdir,0777)) {
+        if(!is_bookstore(outdir) && mkdir(outdir,0777)) {
             fprintf(stderr,"error creating OCR working directory\n");
             perror(outdir);
             exit(1);
         }
-        iucstring s;
-        for(int arg=2;arg<argc;arg++) {
-            Pages pages;
-            pages.parseSpec(argv[arg]);
-            while(pages.nextPage()) {
-                pageno++;
+        Book book(outdir,true);
+        narray<iucstring> files;
+        collect_pages(files,argc,argv,2);
+        int workers = page_workers();
+        narray< autodel<ISegmentPage> > segmenters(workers);
+        for(int i=0;i<workers;i++)
+            segmenters[i] = make_SegmentPageByRAST();
+        // pages are numbered by their position, whichever thread gets them
+#pragma omp parallel for num_threads(workers) schedule(dynamic,1)
+        for(int index=0;index<files.length();index++) {
+            int pageno = index+1;
+            try {
                 debugf("info","page %d\n",pageno);
-                sprintf(s,"%s/%04d",outdir,pageno);
-                mkdir(s,0777);
-                bytearray page_binary,page_gray;
-                pages.getBinary(page_binary);
-                pages.getGray(page_gray);
+                Pages pages;
+                pages.addFile(files[index]);
+                if(!pages.nextPage()) throw "cannot read page";
                 intarray page_seg;
-                segmenter->segment(page_seg,page_binary);
+                segmenters[THREAD]->segment(page_seg,pages.getBinary());
                 RegionExtractor regions;
                 regions.setPageLines(page_seg);
                 for(int lineno=1;lineno<regions.length();lineno++) {
                     bytearray line_image;
-                    regions.extract(line_image,page_gray,lineno,1);
+                    regions.extract(line_image,pages.getGray(),lineno,1);
                     // MAYBE output log of coordinates here
-                    sprintf(s,"%s/%04d/%04d.png",outdir,pageno,lineno);
-                    write_image_gray(s,line_image);
+                    BookWriter stream(book,pageno,lineno,".png");
+                    write_image_gray(stream,line_image,"png");
+                    stream.close();
                 }
-                debugf("info","#lines = %d\n",regions.length());
+                debugf("info","page %d: #lines = %d\n",pageno,regions.length());
                 // MAYBE output images here
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR: page %d: %s\n",pageno,error);
+                if(abort_on_error) abort();
+            } catch(...) {
+                // nothing may leave the parallel loop
+                fprintf(stderr,"ERROR: page %d: (no details)\n",pageno);
+                if(abort_on_error) abort();
             }
         }
         return 0;
@@ -325,16 +413,60 @@ namespace ocropus {
         return 0;
     }
 
+    int main_dir2book(int argc,char **argv) {
+        if(argc!=3 || !is_bookstore(argv[2])) throw "usage: ocropus dir2book dir output.book";
+        Book src(argv[1]);
+        Book dst(argv[2],true);
+        int n = book_copy(dst,src);
+        debugf("info","%d files\n",n);
+        return 0;
+    }
+
+    int main_book2dir(int argc,char **argv) {
+        if(argc!=3 || !is_bookstore(argv[1])) throw "usage: ocropus book2dir input.book dir";
+        mkdir_if_necessary(argv[2]);
+        Book src(argv[1]);
+        Book dst(argv[2],true);
+        int n = book_copy(dst,src);
+        debugf("info","%d files\n",n);
+        return 0;
+    }
+
     int main_lines2fsts(int argc,char **argv) {
-        if(argc!=2) throw "usage: cmodel=... ocropus lines2fsts dir";
+        if(argc!=2) throw "usage: cmodel=... ocropus lines2fsts dir|book";
         dinit(512,512);
         autodel<IRecognizeLine> linerec;
-        iucstring pattern;
-        sprintf(pattern,"%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].png",argv[1]);
-        Glob files(pattern);
+        Book book(argv[1],true);
+        intarray pages,lines;
+        book.list(pages,lines,".png");
         int finished = 0;
-        int nfiles = min(files.length(),nrecognize);
+        int nfiles = min(pages.length(),nrecognize);
         int eval_total=0,eval_tchars=0,eval_pchars=0,eval_lines=0,eval_no_ground_truth=0;
+        int arcs_before=0,arcs_after=0;
+        // the cache is shared by all threads
+        autodel<LineCache> cache;
+        iucstring cache_file;
+        if(line_cache>0) {
+            cache = new LineCache(line_cache*(1L<<20));
+            // the workers load their recognizers later; the key needs
+            // the parameters of one as loaded
+            autodel<IRecognizeLine> reference(glinerec::make_Linerec());
+            try {
+                reference->load(cmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)cmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load character model",(const char*)cmodel);
+            }
+            cache->setModel(cmodel,*reference);
+            if(book.store) sprintf(cache_file,"%s.linecache",argv[1]);
+            else sprintf(cache_file,"%s/linecache",argv[1]);
+            FILE *stream = fopen(cache_file.c_str(),"r");
+            if(stream) {
+                fclose(stream);
+                if(line_cache_save) cache->load(cache_file);
+            }
+        }
 #pragma omp parallel for private(linerec) shared(finished) schedule(dynamic,20)
         for(int index=0;index<nfiles;index++) {
 #pragma omp critical
@@ -350,16 +482,13 @@ namespace ocropus {
                     }
                 }
             }
-            iucstring base;
-            base = files(index);
-            base.erase(base.length()-4);
+            int page = pages[index], line = lines[index];
+            iucstring base,file;
+            book.name(base,page,line,"");
+            book.name(file,page,line,".png");
             debugf("progress","line %s\n",base.c_str());
             if(continue_partial) {
-                iucstring s;
-                sprintf(s,"%s.fst",base.c_str());
-                FILE *stream = fopen(s.c_str(),"r");
-                if(stream) {
-                    fclose(stream);
+                if(book.exists(page,line,".fst")) {
                     // debugf("info","skipping line %s\n",base.c_str());
 #pragma omp atomic
                     finished++;
@@ -370,13 +499,15 @@ namespace ocropus {
             }
             bytearray image;
             // FIXME output binary versions, intermediate results for debugging
-            read_image_gray(image,files(index));
+            read_image_gray(image,BookReader(book,page,line,".png"),"png");
             autodel<IGenericFst> result(make_OcroFST());
             intarray segmentation;
             try {
                 CHECK_ARG(image.dim(1)<maxheight);
                 CHECK_ARG(image.dim(1)*1.0/image.dim(0)<maxaspect);
-                try {
+                if(cache) {
+                    cache->recognizeLine(*linerec,segmentation,*result,image);
+                } else try {
                     linerec->recognizeLine(segmentation,*result,image);
                 } catch(Unimplemented unimplemented) {
                     linerec->recognizeLine(*result,image);
@@ -394,18 +525,36 @@ namespace ocropus {
                 continue;
             }
 
-            if(save_fsts) {
-                iucstring s;
-                sprintf(s,"%s.fst",base.c_str());
-                result->save(s);
+            if(pruning()) {
+                // the cache keeps the full lattice, so changing the
+                // pruning parameters doesn't require recognizing again
+                autodel<IGenericFst> pruned(make_OcroFST());
+                fst_prune(*pruned,*result,prune_beam,prune_arcs);
+                int before = count_arcs(*result), after = count_arcs(*pruned);
+#pragma omp atomic
+                arcs_before += before;
+#pragma omp atomic
+                arcs_after += after;
+                result = pruned;
+            }
+
+            if(save_fsts) try {
+                BookWriter fst_stream(book,page,line,".fst");
+                fst_write(fst_stream,*result);
+                fst_stream.close();
                 if(segmentation.length()>0) {
                     dsection("line_segmentation");
                     make_line_segmentation_white(segmentation);
-                    sprintf(s,"%s.rseg.png",base.c_str());
-                    write_image_packed(s,segmentation);
+                    BookWriter rseg_stream(book,page,line,".rseg.png");
+                    write_image_packed(rseg_stream,segmentation,"png");
+                    rseg_stream.close();
                     dshowr(segmentation);
                     dwait();
                 }
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR: %s: %s\n",base.c_str(),error);
+                if(abort_on_error) abort();
+                continue;
             }
 
             nustring str;
@@ -413,12 +562,11 @@ namespace ocropus {
             try {
                 result->bestpath(str);
                 nustring_convert(predicted,str);
-                debugf("transcript","%s\t%s\n",files(index),predicted.c_str());
+                debugf("transcript","%s\t%s\n",file.c_str(),predicted.c_str());
                 if(save_fsts) {
-                    iucstring s;
-                    s = base;
-                    s += ".txt";
-                    fprintf(stdio(s.c_str(),"w"),"%s",predicted.c_str());
+                    BookWriter stream(book,page,line,".txt");
+                    fprintf(stream,"%s",predicted.c_str());
+                    stream.close();
                 }
             } catch(const char *error) {
                 fprintf(stderr,"ERROR in bestpath: %s\n",error);
@@ -427,20 +575,17 @@ namespace ocropus {
             }
 
             try {
-                iucstring s;
-                s = base;
-                s += ".gt.txt";
                 char buf[100000];
-                fgets(buf,sizeof buf,stdio(s,"r"));
+                fgets(buf,sizeof buf,BookReader(book,page,line,".gt.txt"));
                 iucstring truth;
                 truth = buf;
                 cleanup_for_eval(truth);
                 cleanup_for_eval(predicted);
-                debugf("truth","%s\t%s\n",files(index),truth.c_str());
+                debugf("truth","%s\t%s\n",file.c_str(),truth.c_str());
                 nustring ntruth,npredicted;
                 nustring_convert(ntruth,truth);
                 nustring_convert(npredicted,predicted);
-                float dist = edit_distance(ntruth,npredicted);
+                float dist = fast_edit_distance(ntruth,npredicted);
 #pragma omp atomic
                 eval_total += dist;
 #pragma omp atomic
@@ -460,15 +605,27 @@ namespace ocropus {
                 if(finished%100==0) {
                     if(eval_total>0)
                         debugf("info","finished %d/%d estimate %g errs %d ntrue %d npred %d lines %d nogt %d\n",
-                                finished,files.length(),
+                                finished,pages.length(),
                                 eval_total/float(eval_tchars),eval_total,eval_tchars,eval_pchars,
                                 eval_lines,eval_no_ground_truth);
                     else
-                        debugf("info","finished %d/%d\n",finished,files.length());
+                        debugf("info","finished %d/%d\n",finished,pages.length());
+                    if(cache) report_cache(*cache);
                 }
             }
         }
 
+        if(cache) {
+            report_cache(*cache);
+            if(line_cache_save) cache->save(cache_file);
+        }
+        if(pruning()) {
+            // each arc takes 16 bytes in an OpenFST file
+            debugf("info","pruning kept %d of %d arcs (%.1f%%), %ld bytes saved\n",
+                    arcs_after,arcs_before,100.0*arcs_after/max(arcs_before,1),
+                    16L*(arcs_before-arcs_after));
+        }
+
         debugf("info","rate %g errs %d ntrue %d npred %d lines %d nogt %d\n",
                 eval_total/float(eval_tchars),eval_total,eval_tchars,eval_pchars,
                 eval_lines,eval_no_ground_truth);
@@ -483,36 +640,54 @@ namespace ocropus {
         if(argc!=2) throw "usage: ... dir";
         dinit(1000,1000);
         const char *outdir = argv[1];
-        autodel<ISegmentPage> segmenter;
-        segmenter = make_SegmentPageByRAST();
-        iucstring s;
-        sprintf(s,"%s/[0-9][0-9][0-9][0-9].png",outdir);
-        Glob files(s);
+        iucstring pattern;
+        sprintf(pattern,"%s/[0-9][0-9][0-9][0-9].png",outdir);
+        Glob files(pattern);
         if(files.length()<1)
             throw "no pages found";
+        int workers = page_workers();
+        narray< autodel<ISegmentPage> > segmenters(workers);
+        for(int i=0;i<workers;i++)
+            segmenters[i] = make_SegmentPageByRAST();
+#pragma omp parallel for num_threads(workers) schedule(dynamic,1)
         for(int index=0;index<files.length();index++) {
-            char buf[1000];
             int pageno=9999;
+            iucstring s;
 
-            CHECK(sscanf(files(index),"%[^/]/%d.png",buf,&pageno)==2);
+            // the page number is the name of the file
+            const char *name = strrchr(files(index),'/');
+            if(!name || sscanf(name+1,"%d.png",&pageno)!=1) {
+                fprintf(stderr,"ERROR: %s: not a page\n",files(index));
+                continue;
+            }
             debugf("info","page %d\n",pageno);
 
             sprintf(s,"%s/%04d",outdir,pageno);
             mkdir(s,0777);          // ignore errors
 
+            RegionExtractor regions;
             bytearray page_gray;
-            read_image_gray(page_gray,files(index));
-            bytearray page_binary;
-            sprintf(s,"%s/%04d.bin.png",outdir,pageno);
-            read_image_binary(page_binary,s);
+            try {
+                read_image_gray(page_gray,files(index));
+                bytearray page_binary;
+                sprintf(s,"%s/%04d.bin.png",outdir,pageno);
+                read_image_binary(page_binary,s);
 
-            intarray page_seg;
-            segmenter->segment(page_seg,page_binary);
-            sprintf(s,"%s/%04d.seg.png",outdir,pageno);
-            write_image_packed(s, page_seg);
+                intarray page_seg;
+                segmenters[THREAD]->segment(page_seg,page_binary);
+                sprintf(s,"%s/%04d.seg.png",outdir,pageno);
+                write_image_packed(s, page_seg);
+                regions.setPageLines(page_seg);
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR: page %d: %s\n",pageno,error);
+                if(abort_on_error) abort();
+                continue;
+            } catch(...) {
+                fprintf(stderr,"ERROR: page %d: (no details)\n",pageno);
+                if(abort_on_error) abort();
+                continue;
+            }
 
-            RegionExtractor regions;
-            regions.setPageLines(page_seg);
             for(int lineno=1;lineno<regions.length();lineno++) {
                 try {
                     bytearray line_image;
@@ -533,36 +708,35 @@ namespace ocropus {
                     if(abort_on_error) abort();
                 }
             }
-            debugf("info","#lines = %d\n",regions.length());
+            debugf("info","page %d: #lines = %d\n",pageno,regions.length());
             // TODO/mezhirov output other blocks here
         }
         return 0;
     }
 
     int main_evaluate(int argc,char **argv) {
-        if(argc!=2) throw "usage: ... dir";
-        iucstring s;
-        sprintf(s, "%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].gt.txt",argv[1]);
-        Glob files(s);
+        if(argc!=2) throw "usage: ... dir|book";
+        Book book(argv[1]);
+        intarray pages,lines_;
+        book.list(pages,lines_,".gt.txt");
         float total = 0.0, tchars = 0, pchars = 0, lines = 0;
-        for(int index=0;index<files.length();index++) {
+        for(int index=0;index<pages.length();index++) {
+            int page = pages[index], line = lines_[index];
+            iucstring file;
+            book.name(file,page,line,".gt.txt");
             if(index%1000==0)
-                debugf("info","%s (%d/%d)\n",files(index),index,files.length());
-
-            iucstring base = files(index);
-            base.erase(base.find("."));
+                debugf("info","%s (%d/%d)\n",file.c_str(),index,pages.length());
 
             iucstring truth;
             try {
-                fgets(truth, stdio(files(index),"r"));
+                fgets(truth, BookReader(book,page,line,".gt.txt"));
             } catch(const char *error) {
                 continue;
             }
 
-            iucstring s = base + ".txt";
             iucstring predicted;
             try {
-                fgets(predicted, stdio(s,"r"));
+                fgets(predicted, BookReader(book,page,line,".txt"));
             } catch(const char *error) {
                 continue;
             }
@@ -572,7 +746,7 @@ namespace ocropus {
             nustring ntruth,npredicted;
             truth.toNustring(ntruth);
             predicted.toNustring(npredicted);
-            float dist = edit_distance(ntruth,npredicted);
+            float dist = fast_edit_distance(ntruth,npredicted);
 
             total += dist;
             tchars += truth.length();
@@ -582,7 +756,7 @@ namespace ocropus {
             debugf("transcript",
                     "%g\t%s\t%s\t%s\n",
                     dist,
-                    files(index),
+                    file.c_str(),
                     truth.c_str(),
                     predicted.c_str());
         }
@@ -731,7 +905,7 @@ namespace ocropus {
         truth.toNustring(ntruth);
         predicted.toNustring(npredicted);
 
-        float dist = edit_distance(ntruth,npredicted);
+        float dist = fast_edit_distance(ntruth,npredicted);
         printf("dist %g tchars %d pchars %d\n",
                 dist,truth.length(),predicted.length());
         return 0;
@@ -813,213 +987,1353 @@ namespace ocropus {
     }
 
     int main_page(int argc,char **argv) {
-        // create the segmenter
-        autodel<ISegmentPage> segmenter;
-        segmenter = make_SegmentPageByRAST();
-        // load the line recognizer
-        autodel<IRecognizeLine> linerec;
-        linerec = make_Linerec();
-        try {
-            linerec->load(cmodel);
-        } catch(const char *s) {
-            throwf("%s: failed to load (%s)",(const char*)cmodel,s);
-        } catch(...) {
-            throwf("%s: failed to load character model",(const char*)cmodel);
+        int workers = page_workers();
+        // every worker gets its own segmenter, recognizer and decoder
+        narray< autodel<ISegmentPage> > segmenters(workers);
+        narray< autodel<IRecognizeLine> > linerecs(workers);
+        for(int i=0;i<workers;i++) {
+            segmenters[i] = make_SegmentPageByRAST();
+            linerecs[i] = make_Linerec();
+            try {
+                linerecs[i]->load(cmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)cmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load character model",(const char*)cmodel);
+            }
         }
         // load the language model
-        autodel<OcroFST> langmod(make_OcroFST());
+        FrozenFst langmod;
         try {
-            langmod->load(lmodel);
+            langmod.load(lmodel);
         } catch(const char *s) {
             throwf("%s: failed to load (%s)",(const char*)lmodel,s);
         } catch(...) {
             throwf("%s: failed to load language model",(const char*)lmodel);
         }
-        // now iterate through the pages
-        for(int arg=1;arg<argc;arg++) {
-            Pages pages;
-            pages.parseSpec(argv[arg]);
-            while(pages.nextPage()) {
-                bytearray page_binary,page_gray;
+        narray< autodel<BeamDecoder> > decoders(workers);
+        for(int i=0;i<workers;i++)
+            decoders[i] = make_BeamDecoder(langmod,beam_width);
+        // running headers etc. are recognized only once
+        autodel<LineCache> cache;
+        if(line_cache>0) {
+            cache = new LineCache(line_cache*(1L<<20));
+            cache->setModel(cmodel,*linerecs[0]);
+        }
+        narray<iucstring> files;
+        collect_pages(files,argc,argv,1);
+        // now iterate through the pages; the text of each page is kept
+        // until the pages before it are printed
+        floatarray times;
+        double start = now();
+#pragma omp parallel for num_threads(workers) schedule(dynamic,1) ordered
+        for(int index=0;index<files.length();index++) {
+            ISegmentPage &segmenter = *segmenters[THREAD];
+            IRecognizeLine &linerec = *linerecs[THREAD];
+            BeamDecoder &decoder = *decoders[THREAD];
+            objlist<iucstring> text;
+            floatarray page_times;
+            try {
+                Pages pages;
+                pages.addFile(files[index]);
+                if(!pages.nextPage()) throw "cannot read page";
                 intarray page_seg;
-                pages.getBinary(page_binary);
-                pages.getGray(page_gray);
-                segmenter->segment(page_seg,page_binary);
+                segmenter.segment(page_seg,pages.getBinary());
                 RegionExtractor regions;
                 regions.setPageLines(page_seg);
                 for(int i=1;i<regions.length();i++) {
                     try {
                         bytearray line_image;
-                        regions.extract(line_image,page_gray,i,1);
+                        regions.extract(line_image,pages.getGray(),i,1);
                         autodel<OcroFST> result(make_OcroFST());
-                        linerec->recognizeLine(*result,line_image);
-                        nustring str;
-                        if(0) {
-                            result->bestpath(str);
+                        if(cache) {
+                            intarray segmentation;
+                            cache->recognizeLine(linerec,segmentation,*result,line_image);
                         } else {
-                            double cost = beam_search(str,*result,*langmod,beam_width);
-                            if(cost>1e10) throw "beam search failed";
+                            linerec.recognizeLine(*result,line_image);
                         }
-                        iucstring output;
-                        nustring_convert(output,str);
-                        printf("%s\n",output.c_str());
+                        nustring str;
+                        double t = now();
+                        double cost = decoder.decode(str,*result);
+                        page_times.push(now()-t);
+                        if(cost>1e10) throw "beam search failed";
+                        nustring_convert(text.push(),str);
                     } catch(const char *error) {
                         fprintf(stderr,"[%s]\n",error);
+                    } catch(BadTextLine &error) {
+                        fprintf(stderr,"[%s: line %d: bad text line]\n",files[index].c_str(),i);
                     }
                 }
+            } catch(const char *error) {
+                fprintf(stderr,"[%s: %s]\n",files[index].c_str(),error);
+            } catch(...) {
+                // nothing may leave the parallel loop
+                fprintf(stderr,"[%s: no details]\n",files[index].c_str());
+            }
+#pragma omp ordered
+            {
+                for(int i=0;i<text.length();i++)
+                    printf("%s\n",text(i).c_str());
+                fflush(stdout);
+                for(int i=0;i<page_times.length();i++)
+                    times.push(page_times[i]);
             }
         }
+        if(cache) report_cache(*cache);
+        // the lines are decoded in parallel with each other
+        report_latencies("decoded",times,now()-start);
         return 0;
     }
 
-    int main_recognize1(int argc,char **argv) {
-        if(argc<3) throwf("usage: %s %s model image ...",command,argv[0]);
-        if(!getenv("ocrolog"))
-            throwf("please set ocrolog=glr in the environment");
-        if(!getenv("ocrologdir"))
-            throwf("please set ocrologdir to the target directory for the log");
-        Logger logger("glr");
-        dinit(512,512);
-        autodel<IRecognizeLine> linerecp(make_Linerec());
-        IRecognizeLine &linerec = *linerecp;
-        stdio model(argv[1],"r");
-        linerec.load(model);
-        for(int i=3;i<argc;i++) {
-            logger.html("<hr><br>");
-            logger.format("Recognizing %s",argv[i]);
-            bytearray image;
-            read_image_gray(image,argv[i]);
-            autodel<IGenericFst> result(make_OcroFST());
-            linerec.recognizeLine(*result,image);
+    // _______________________________________________________________________
 
-            // dump the corresponding FST for display
-            // print_fst_simple(*result);
-            // result->save("rec_temp.fst");
-            dump_fst("rec_temp.dot",*result);
-            intarray fst_image;
-            fst_to_image(fst_image,*result);
-            logger.log("fst",fst_image);
+    // book2text runs the stages of book2pages ... fsts2text in one process,
+    // handing pages and lines from one group of threads to the next
+    // through bounded queues, so that a page can be segmented while the
+    // lines of the one before are still being recognized.
+
+    struct BookPage {
+        int pageno;
+        bytearray gray,binary;
+        int nlines;         // -1 until segmented
+        int remaining;      // lines not yet decoded, plus one until the
+                            // segmenter is done with the page
+        objlist<nustring> text;
+        bytearray ok;
+    };
 
-            // output the result
-            nustring str;
-            str.clear();
-            result->bestpath(str);
-            if(str.length()<1) throw "recognition failed";
-            if(debug("detail")) {
-                debugf("detail","nustring result: ");
-                for(int i=0;i<str.length();i++)
-                    printf(" %d",str(i).ord());
-                printf("\n");
-            }
-            narray<char> s;
-            str.utf8Encode(s);
-            s.push(0);
-            printf("%s\t%s\n",argv[i],&s[0]);
+    struct BookLine {
+        BookPage *page;
+        int lineno;
+        double start;
+        bytearray image;
+        autodel<OcroFST> lattice;
+    };
 
-            // log the string to the output file
-            char buffer[10000];
-            sprintf(buffer,"<font style='color: green; font-size: 36pt;'>%s</font>\n",&s[0]);
-            //logger.log("result",&s[0]);
-            logger.html(buffer);
+    struct BookPipeline {
+        int argc;
+        char **argv;
+        const char *dump;
+        BlockingQueue<BookPage*> order;     // every page, for the output
+        BlockingQueue<BookPage*> pages;     // loaded and binarized
+        BlockingQueue<BookLine*> lines;     // extracted
+        BlockingQueue<BookLine*> lattices;  // recognized
+        narray<IRecognizeLine*> linerecs;   // one per recognizer thread
+        int next_linerec;
+        LineCache *cache;
+        FrozenFst langmod;
+        floatarray times;
+        pthread_mutex_t mutex;
+        pthread_cond_t finished;            // a page has all its lines
+
+        BookPipeline(int nsegmenters,int nrecognizers,int queue)
+            : order(max(2*queue,2)),pages(2),lines(queue,nsegmenters),
+              lattices(queue,nrecognizers),next_linerec(0),cache(0) {
+            pthread_mutex_init(&mutex,0);
+            pthread_cond_init(&finished,0);
         }
-        return 0;
-    }
-
-    int main_fsts2text(int argc,char **argv) {
-        if(argc!=2) throw "usage: lmodel=... ocropus fsts2text dir";
-        autodel<OcroFST> langmod(make_OcroFST());
-        try {
-            langmod->load(lmodel);
-        } catch(const char *s) {
-            throwf("%s: failed to load (%s)",(const char*)lmodel,s);
-        } catch(...) {
-            throwf("%s: failed to load language model",(const char*)lmodel);
+        ~BookPipeline() {
+            for(int i=0;i<linerecs.length();i++)
+                delete linerecs[i];
+            pthread_cond_destroy(&finished);
+            pthread_mutex_destroy(&mutex);
+        }
+        // called after each line of a page, and with lineno 0 when the
+        // segmenter is done with the page; the page may be deleted as
+        // soon as this returns for the last time
+        void lineDone(BookPage *page,int lineno,nustring *text,double start) {
+            pthread_mutex_lock(&mutex);
+            if(text) {
+                move(page->text(lineno-1),*text);
+                page->ok[lineno-1] = 1;
+                times.push(now()-start);
+            }
+            page->remaining--;
+            if(page->remaining==0)
+                pthread_cond_broadcast(&finished);
+            pthread_mutex_unlock(&mutex);
+        }
+        void waitFor(BookPage *page) {
+            pthread_mutex_lock(&mutex);
+            while(page->nlines<0 || page->remaining>0)
+                pthread_cond_wait(&finished,&mutex);
+            pthread_mutex_unlock(&mutex);
         }
+    };
+
+    static void *book2text_load(void *arg) {
+        BookPipeline &p = *(BookPipeline*)arg;
         iucstring s;
-        sprintf(s,"%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].fst",argv[1]);
-        Glob files(s);
-#pragma omp parallel for schedule(dynamic,20)
-        for(int index=0;index<files.length();index++) {
-            if(index%1000==0)
-                debugf("info","%s (%d/%d)\n",files(index),index,files.length());
-            autodel<OcroFST> fst(make_OcroFST());
-            fst->load(files(index));
-            nustring str;
-            try {
-                intarray v1;
-                intarray v2;
-                intarray in;
-                intarray out;
-                floatarray costs;
-                beam_search(v1, v2, in, out, costs,
-                            *fst, *langmod, beam_width);
-                double cost = sum(costs);
-                remove_epsilons(str, out);
-                if(cost < 1e10) {
-                    iucstring output;
-                    nustring_convert(output,str);
-                    debugf("transcript","%s\t%s\n",files(index), output.c_str());
-                    iucstring base;
-                    base = files(index);
-                    base.erase(base.length()-4);
+        int pageno = 0;
+        for(int arg=1;arg<p.argc;arg++) {
+            Pages pages;
+            pages.parseSpec(p.argv[arg]);
+            while(1) {
+                try {
+                    if(!pages.nextPage()) break;
+                } catch(const char *error) {
+                    fprintf(stderr,"ERROR: %s: %s\n",pages.getFileName(),error);
+                    if(abort_on_error) abort();
+                    continue;
+                } catch(...) {
+                    fprintf(stderr,"ERROR: %s: cannot read the page\n",pages.getFileName());
+                    if(abort_on_error) abort();
+                    continue;
+                }
+                BookPage *page = new BookPage();
+                page->pageno = ++pageno;
+                page->nlines = -1;
+                page->remaining = 0;
+                pages.getGray(page->gray);
+                pages.getBinary(page->binary);
+                debugf("info","page %d\n",page->pageno);
+                if(p.dump) {
+                    // a page that can't be dumped is still recognized
                     try {
-                        rseg_to_cseg(base, in);
-                        store_costs(base, costs);
-                    } catch(const char *err) {
-                        fprintf(stderr,"ERROR in cseg reconstruction: %s\n",err);
+                        sprintf(s,"%s/%04d.png",p.dump,page->pageno);
+                        write_image_gray(s,page->gray);
+                        sprintf(s,"%s/%04d.bin.png",p.dump,page->pageno);
+                        write_image_binary(s,page->binary);
+                    } catch(const char *error) {
+                        fprintf(stderr,"ERROR: page %d: %s\n",page->pageno,error);
+                        if(abort_on_error) abort();
+                    } catch(...) {
+                        fprintf(stderr,"ERROR: page %d: cannot write %s\n",page->pageno,s.c_str());
                         if(abort_on_error) abort();
                     }
-                    base += ".txt";
-                    fprintf(stdio(base,"w"),"%s\n",output.c_str());
-                } else {
-                    debugf("info","%s\t%f\n",files(index), cost);
                 }
-            } catch(const char *error) {
-                fprintf(stderr,"ERROR in bestpath: %s\n",error);
-                if(abort_on_error) abort();
+                p.order.put(page);
+                p.pages.put(page);
             }
         }
-
+        p.order.close();
+        p.pages.close();
         return 0;
     }
 
-
-    int main_align(int argc,char **argv) {
-        if(argc!=2) throw "usage: ... dir";
+    static void *book2text_segment(void *arg) {
+        BookPipeline &p = *(BookPipeline*)arg;
+        autodel<ISegmentPage> segmenter(make_SegmentPageByRAST());
         iucstring s;
-        s = argv[1];
-        s += "/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].fst";
-        Glob files(s);
-        for(int index=0;index<files.length();index++) {
-            if(index%1000==0)
-                debugf("info","%s (%d/%d)\n",files(index),index,files.length());
-
-            iucstring base;
-            base = files(index);
-            base.erase(base.length()-4);
-
-            autodel<OcroFST> gt_fst(make_OcroFST());
-            read_gt(*gt_fst, base);
-
-            autodel<OcroFST> fst(make_OcroFST());
-            fst->load(files(index));
-            nustring str;
-            intarray v1;
-            intarray v2;
-            intarray in;
-            intarray out;
-            floatarray costs;
+        BookPage *page;
+        while(p.pages.get(page)) {
+            RegionExtractor regions;
+            intarray page_seg;
+            bool segmented = false;
             try {
-                beam_search(v1, v2, in, out, costs,
-                            *fst, *gt_fst, beam_width);
-                // recolor rseg to cseg
+                segmenter->segment(page_seg,page->binary);
+                regions.setPageLines(page_seg);
+                segmented = true;
             } catch(const char *error) {
-                fprintf(stderr,"ERROR in bestpath: %s\n",error);
+                fprintf(stderr,"ERROR: page %d: %s\n",page->pageno,error);
                 if(abort_on_error) abort();
-            }
+            } catch(...) {
+                fprintf(stderr,"ERROR: page %d: cannot segment the page\n",page->pageno);
+                if(abort_on_error) abort();
+            }
+            if(segmented && p.dump) {
+                try {
+                    sprintf(s,"%s/%04d.seg.png",p.dump,page->pageno);
+                    write_image_packed(s,page_seg);
+                } catch(const char *error) {
+                    fprintf(stderr,"ERROR: page %d: %s\n",page->pageno,error);
+                    if(abort_on_error) abort();
+                } catch(...) {
+                    fprintf(stderr,"ERROR: page %d: cannot write %s\n",page->pageno,s.c_str());
+                    if(abort_on_error) abort();
+                }
+                sprintf(s,"%s/%04d",p.dump,page->pageno);
+                mkdir(s,0777);
+            }
+            page_seg.dealloc();
+            int n = segmented ? max(regions.length()-1,0) : 0;
+            pthread_mutex_lock(&p.mutex);
+            page->text.resize(n);
+            page->ok.resize(n);
+            fill(page->ok,0);
+            page->nlines = n;
+            // the page stays until the lineDone() below, even if all the
+            // lines are decoded before that
+            page->remaining = n+1;
+            pthread_mutex_unlock(&p.mutex);
+            debugf("info","page %d: #lines = %d\n",page->pageno,n);
+            for(int lineno=1;lineno<=n;lineno++) {
+                BookLine *line = new BookLine();
+                line->page = page;
+                line->lineno = lineno;
+                line->start = now();
+                const char *error = 0;
+                try {
+                    regions.extract(line->image,page->gray,lineno,1);
+                    CHECK_ARG(line->image.dim(1)<maxheight);
+                    CHECK_ARG(line->image.dim(1)*1.0/line->image.dim(0)<maxaspect);
+                } catch(const char *message) {
+                    error = message;
+                } catch(...) {
+                    error = "cannot extract the line";
+                }
+                if(error) {
+                    fprintf(stderr,"ERROR: page %d line %d: %s\n",page->pageno,lineno,error);
+                    if(abort_on_error) abort();
+                    delete line;
+                    p.lineDone(page,lineno,0,0);
+                    continue;
+                }
+                if(p.dump) {
+                    try {
+                        sprintf(s,"%s/%04d/%04d.png",p.dump,page->pageno,lineno);
+                        write_image_gray(s,line->image);
+                    } catch(const char *error) {
+                        fprintf(stderr,"ERROR: page %d line %d: %s\n",page->pageno,lineno,error);
+                        if(abort_on_error) abort();
+                    } catch(...) {
+                        fprintf(stderr,"ERROR: page %d line %d: cannot write %s\n",page->pageno,lineno,s.c_str());
+                        if(abort_on_error) abort();
+                    }
+                }
+                p.lines.put(line);
+            }
+            // the lines have their own copies now
+            page->gray.dealloc();
+            page->binary.dealloc();
+            p.lineDone(page,0,0,0);
+        }
+        p.lines.close();
+        return 0;
+    }
+
+    static void *book2text_recognize(void *arg) {
+        BookPipeline &p = *(BookPipeline*)arg;
+        pthread_mutex_lock(&p.mutex);
+        IRecognizeLine &linerec = *p.linerecs[p.next_linerec++];
+        pthread_mutex_unlock(&p.mutex);
+        iucstring s;
+        BookLine *line;
+        while(p.lines.get(line)) {
+            try {
+                line->lattice = make_OcroFST();
+                if(p.cache) {
+                    intarray segmentation;
+                    p.cache->recognizeLine(linerec,segmentation,*line->lattice,line->image);
+                } else {
+                    linerec.recognizeLine(*line->lattice,line->image);
+                }
+                line->image.dealloc();
+                if(p.dump) {
+                    sprintf(s,"%s/%04d/%04d.fst",p.dump,line->page->pageno,line->lineno);
+                    line->lattice->save(s);
+                }
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR: page %d line %d: %s\n",line->page->pageno,line->lineno,error);
+                if(abort_on_error) abort();
+                p.lineDone(line->page,line->lineno,0,0);
+                delete line;
+                continue;
+            } catch(BadTextLine &error) {
+                fprintf(stderr,"ERROR: page %d line %d: bad text line\n",line->page->pageno,line->lineno);
+                p.lineDone(line->page,line->lineno,0,0);
+                delete line;
+                continue;
+            } catch(...) {
+                fprintf(stderr,"ERROR: page %d line %d: cannot recognize the line\n",line->page->pageno,line->lineno);
+                if(abort_on_error) abort();
+                p.lineDone(line->page,line->lineno,0,0);
+                delete line;
+                continue;
+            }
+            p.lattices.put(line);
+        }
+        p.lattices.close();
+        return 0;
+    }
+
+    static void *book2text_decode(void *arg) {
+        BookPipeline &p = *(BookPipeline*)arg;
+        autodel<BeamDecoder> decoder(make_BeamDecoder(p.langmod,beam_width));
+        iucstring s;
+        BookLine *line;
+        while(p.lattices.get(line)) {
+            nustring str;
+            try {
+                double cost = decoder->decode(str,*line->lattice);
+                if(cost>1e10) throw "beam search failed";
+                if(p.dump) {
+                    iucstring output;
+                    nustring_convert(output,str);
+                    sprintf(s,"%s/%04d/%04d.txt",p.dump,line->page->pageno,line->lineno);
+                    fprintf(stdio(s,"w"),"%s\n",output.c_str());
+                }
+                p.lineDone(line->page,line->lineno,&str,line->start);
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR: page %d line %d: %s\n",line->page->pageno,line->lineno,error);
+                if(abort_on_error) abort();
+                p.lineDone(line->page,line->lineno,0,0);
+            } catch(...) {
+                fprintf(stderr,"ERROR: page %d line %d: cannot decode the line\n",line->page->pageno,line->lineno);
+                if(abort_on_error) abort();
+                p.lineDone(line->page,line->lineno,0,0);
+            }
+            delete line;
+        }
+        return 0;
+    }
+
+    int main_book2text(int argc,char **argv) {
+        if(argc<2) throw "usage: cmodel=... lmodel=... ocropus book2text image image ...";
+        int nsegmenters = max(int(book2text_segmenters),1);
+        int nrecognizers = book2text_recognizers;
+        if(nrecognizers<1) nrecognizers = max(int(sysconf(_SC_NPROCESSORS_ONLN)),1);
+        int ndecoders = max(int(book2text_decoders),1);
+        BookPipeline p(nsegmenters,nrecognizers,max(int(book2text_queue),1));
+        p.argc = argc;
+        p.argv = argv;
+        p.dump = book2text_dump;
+        if(!*p.dump) p.dump = 0;
+        if(p.dump && mkdir(p.dump,0777)) {
+            perror(p.dump);
+            throw "error creating the book2text_dump directory";
+        }
+        for(int i=0;i<nrecognizers;i++) {
+            p.linerecs.push(make_Linerec());
+            try {
+                p.linerecs.last()->load(cmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)cmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load character model",(const char*)cmodel);
+            }
+        }
+        try {
+            p.langmod.load(lmodel);
+        } catch(const char *s) {
+            throwf("%s: failed to load (%s)",(const char*)lmodel,s);
+        } catch(...) {
+            throwf("%s: failed to load language model",(const char*)lmodel);
+        }
+        autodel<LineCache> cache;
+        if(line_cache>0) {
+            cache = new LineCache(line_cache*(1L<<20));
+            cache->setModel(cmodel,*p.linerecs[0]);
+            p.cache = cache.ptr();
+        }
+        debugf("info","%d segmenters, %d recognizers, %d decoders, queues of %d lines\n",
+                nsegmenters,nrecognizers,ndecoders,int(book2text_queue));
+        double start = now();
+        ThreadGroup threads;
+        threads.start(book2text_load,&p);
+        threads.start(book2text_segment,&p,nsegmenters);
+        threads.start(book2text_recognize,&p,nrecognizers);
+        threads.start(book2text_decode,&p,ndecoders);
+        // the text comes out in the order of the pages and lines
+        BookPage *page;
+        while(p.order.get(page)) {
+            p.waitFor(page);
+            for(int i=0;i<page->nlines;i++) {
+                if(!page->ok[i]) continue;
+                iucstring output;
+                nustring_convert(output,page->text(i));
+                printf("%s\n",output.c_str());
+            }
+            fflush(stdout);
+            delete page;
+        }
+        threads.join();
+        if(cache) report_cache(*cache);
+        // from extraction to decoded text, including the time in the queues
+        report_latencies("recognized",p.times,now()-start);
+        return 0;
+    }
+
+    // _______________________________________________________________________
+
+    // ocropus serve keeps the models loaded and recognizes images sent
+    // to a Unix domain socket.  It speaks just enough HTTP/1.0 for
+    // curl --unix-socket and local metrics scrapers, one request per
+    // connection:
+    //
+    //   GET /health                  ok once the models are loaded
+    //   GET /metrics                 queue depth, counters and a latency
+    //                                histogram in the Prometheus text format
+    //   POST /page?output=text|hocr  a page image (png, jpeg or pnm)
+    //   POST /line?output=text|fst   a line image; fst is the lattice
+    //
+    // /page and /line also take beam=... (beam_width) and lmodel=0 (best
+    // path without the language model).  The connection threads hand the
+    // requests to a pool of workers, each with its own segmenter,
+    // recognizer and decoder; when serve_queue requests are waiting,
+    // more are refused with 503, and so are connections beyond
+    // serve_connections.  beam=... is limited to serve_max_beam.
+
+    enum { serve_page, serve_line, serve_kinds };
+    static const char *serve_kind_names[serve_kinds] = {"page","line"};
+    enum { serve_buckets = 12 };
+    static const double serve_limits[serve_buckets-1] = {
+        0.01,0.025,0.05,0.1,0.25,0.5,1,2.5,5,10,30
+    };
+
+    struct ServeRequest {
+        int kind;
+        iucstring output;
+        int beam;
+        bool use_lmodel;
+        bytearray body;
+        double start;
+        // filled in by the worker
+        int status;
+        const char *content_type;
+        char *response;
+        size_t response_size;
+        bool done;
+        pthread_mutex_t mutex;
+        pthread_cond_t finished;
+
+        ServeRequest() : kind(serve_page),beam(beam_width),use_lmodel(true),start(now()),
+                status(500),content_type("text/plain"),response(0),response_size(0),done(false) {
+            output = "text";
+            pthread_mutex_init(&mutex,0);
+            pthread_cond_init(&finished,0);
+        }
+        ~ServeRequest() {
+            free(response);
+            pthread_cond_destroy(&finished);
+            pthread_mutex_destroy(&mutex);
+        }
+        void finish() {
+            pthread_mutex_lock(&mutex);
+            done = true;
+            pthread_cond_signal(&finished);
+            pthread_mutex_unlock(&mutex);
+        }
+        void wait() {
+            pthread_mutex_lock(&mutex);
+            while(!done)
+                pthread_cond_wait(&finished,&mutex);
+            pthread_mutex_unlock(&mutex);
+        }
+    };
+
+    struct Server {
+        BlockingQueue<ServeRequest*> requests;
+        narray<ISegmentPage*> segmenters;   // one per worker
+        narray<IRecognizeLine*> linerecs;
+        int next_worker;
+        LineCache *cache;
+        FrozenFst langmod;
+        bool has_lmodel;
+        double started;
+        pthread_mutex_t mutex;
+        pthread_cond_t idle;                // the last connection ended
+        int connections,busy;
+        long refused_connections;           // beyond serve_connections
+        int capacity;                       // of the queue
+        int reading;                        // request bodies being read
+        long ok[serve_kinds],failed[serve_kinds],refused[serve_kinds];
+        long histogram[serve_kinds][serve_buckets];
+        double latency_sum[serve_kinds];
+
+        Server(int queue)
+            : requests(queue),next_worker(0),cache(0),has_lmodel(false),started(now()),
+              connections(0),busy(0),refused_connections(0),capacity(queue),reading(0) {
+            pthread_mutex_init(&mutex,0);
+            pthread_cond_init(&idle,0);
+            for(int k=0;k<serve_kinds;k++) {
+                ok[k] = failed[k] = refused[k] = 0;
+                latency_sum[k] = 0;
+                for(int i=0;i<serve_buckets;i++) histogram[k][i] = 0;
+            }
+        }
+        ~Server() {
+            for(int i=0;i<linerecs.length();i++) {
+                delete segmenters[i];
+                delete linerecs[i];
+            }
+            pthread_cond_destroy(&idle);
+            pthread_mutex_destroy(&mutex);
+        }
+        // the latency counts from the end of reading the request to the
+        // end of recognizing it, including the time in the queue
+        void record(ServeRequest &r) {
+            double latency = now()-r.start;
+            int bucket = 0;
+            while(bucket<serve_buckets-1 && latency>serve_limits[bucket]) bucket++;
+            pthread_mutex_lock(&mutex);
+            if(r.status==200) ok[r.kind]++;
+            else failed[r.kind]++;
+            histogram[r.kind][bucket]++;
+            latency_sum[r.kind] += latency;
+            pthread_mutex_unlock(&mutex);
+        }
+        void metrics(FILE *out) {
+            pthread_mutex_lock(&mutex);
+            fprintf(out,"# TYPE ocropus_uptime_seconds gauge\n");
+            fprintf(out,"ocropus_uptime_seconds %.3f\n",now()-started);
+            fprintf(out,"# TYPE ocropus_workers gauge\n");
+            fprintf(out,"ocropus_workers %d\n",linerecs.length());
+            fprintf(out,"# TYPE ocropus_workers_busy gauge\n");
+            fprintf(out,"ocropus_workers_busy %d\n",busy);
+            fprintf(out,"# TYPE ocropus_queue_depth gauge\n");
+            fprintf(out,"ocropus_queue_depth %d\n",requests.length());
+            fprintf(out,"# TYPE ocropus_connections gauge\n");
+            fprintf(out,"ocropus_connections %d\n",connections);
+            fprintf(out,"# TYPE ocropus_connections_refused_total counter\n");
+            fprintf(out,"ocropus_connections_refused_total %ld\n",refused_connections);
+            fprintf(out,"# TYPE ocropus_requests_total counter\n");
+            for(int k=0;k<serve_kinds;k++) {
+                const char *name = serve_kind_names[k];
+                fprintf(out,"ocropus_requests_total{endpoint=\"%s\",result=\"ok\"} %ld\n",name,ok[k]);
+                fprintf(out,"ocropus_requests_total{endpoint=\"%s\",result=\"failed\"} %ld\n",name,failed[k]);
+                fprintf(out,"ocropus_requests_total{endpoint=\"%s\",result=\"refused\"} %ld\n",name,refused[k]);
+            }
+            fprintf(out,"# TYPE ocropus_request_seconds histogram\n");
+            for(int k=0;k<serve_kinds;k++) {
+                const char *name = serve_kind_names[k];
+                long total = 0;
+                for(int i=0;i<serve_buckets;i++) {
+                    total += histogram[k][i];
+                    if(i<serve_buckets-1)
+                        fprintf(out,"ocropus_request_seconds_bucket{endpoint=\"%s\",le=\"%g\"} %ld\n",
+                                name,serve_limits[i],total);
+                    else
+                        fprintf(out,"ocropus_request_seconds_bucket{endpoint=\"%s\",le=\"+Inf\"} %ld\n",
+                                name,total);
+                }
+                fprintf(out,"ocropus_request_seconds_sum{endpoint=\"%s\"} %.6f\n",name,latency_sum[k]);
+                fprintf(out,"ocropus_request_seconds_count{endpoint=\"%s\"} %ld\n",name,total);
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+    };
+
+    struct ServeWorker {
+        Server &server;
+        ISegmentPage &segmenter;
+        IRecognizeLine &linerec;
+        autodel<BeamDecoder> decoder;
+        int decoder_beam;
+
+        ServeWorker(Server &server,int i)
+            : server(server),segmenter(*server.segmenters[i]),linerec(*server.linerecs[i]),
+              decoder_beam(-1) {
+        }
+        void recognize(OcroFST &result,bytearray &image) {
+            if(server.cache) {
+                intarray segmentation;
+                server.cache->recognizeLine(linerec,segmentation,result,image);
+            } else {
+                linerec.recognizeLine(result,image);
+            }
+        }
+        void decode(nustring &str,OcroFST &lattice,ServeRequest &r) {
+            if(!r.use_lmodel) {
+                lattice.bestpath(str);
+                return;
+            }
+            if(!server.has_lmodel) throw "no language model loaded";
+            if(decoder_beam!=r.beam) {
+                decoder = make_BeamDecoder(server.langmod,r.beam);
+                decoder_beam = r.beam;
+            }
+            double cost = decoder->decode(str,lattice);
+            if(cost>1e10) throw "beam search failed";
+        }
+        void line(FILE *out,bytearray &image,ServeRequest &r) {
+            autodel<OcroFST> lattice(make_OcroFST());
+            recognize(*lattice,image);
+            if(r.output=="fst") {
+                fst_write(out,*lattice);
+                r.content_type = "application/octet-stream";
+                return;
+            }
+            if(r.output!="text") throw "output must be text or fst";
+            nustring str;
+            decode(str,*lattice,r);
+            write_utf8(out,str);
+        }
+        void page(FILE *out,bytearray &image,ServeRequest &r) {
+            bool hocr = r.output=="hocr";
+            if(!hocr && r.output!="text") throw "output must be text or hocr";
+            Pages pages;
+            pages.setImage(image);
+            intarray page_seg;
+            segmenter.segment(page_seg,pages.getBinary());
+            RegionExtractor regions;
+            regions.setPageLines(page_seg);
+            int h = page_seg.dim(1);
+            if(hocr) {
+                hocr_dump_preamble(out);
+                fprintf(out,"<html>\n");
+                hocr_dump_head(out);
+                fprintf(out,"<body>\n<div class=\"ocr_page\">\n");
+                r.content_type = "text/html; charset=utf-8";
+            }
+            for(int i=1;i<regions.length();i++) {
+                nustring str;
+                try {
+                    bytearray line_image;
+                    regions.extract(line_image,pages.getGray(),i,1);
+                    autodel<OcroFST> lattice(make_OcroFST());
+                    recognize(*lattice,line_image);
+                    decode(str,*lattice,r);
+                } catch(const char *error) {
+                    debugf("info","line %d: %s\n",i,error);
+                    continue;
+                } catch(BadTextLine &error) {
+                    continue;
+                }
+                if(hocr) {
+                    hocr_dump_line(out,str,regions,i,h);
+                    fprintf(out,"\n");
+                } else {
+                    write_utf8(out,str);
+                }
+            }
+            if(hocr) fprintf(out,"</div>\n</body>\n</html>\n");
+        }
+        // replace whatever was written with an error message
+        void fail(ServeRequest &r,FILE *&out,int status,const char *message) {
+            if(out) fclose(out);
+            out = 0;
+            free(r.response);
+            r.response = 0;
+            r.response_size = 0;
+            r.status = status;
+            r.content_type = "text/plain";
+            int n = asprintf(&r.response,"%s\n",message);
+            if(n<0) r.response = 0;
+            else r.response_size = n;
+        }
+        void run(ServeRequest &r) {
+            FILE *out = 0;
             try {
-                rseg_to_cseg(base, in);
-                store_costs(base, costs);
+                out = open_memstream(&r.response,&r.response_size);
+                if(!out) {
+                    fail(r,out,500,"open_memstream failed");
+                    return;
+                }
+                if(r.body.length()==0) throw "empty request";
+                bytearray image;
+                read_image_gray(image,stdio(fmemopen(&r.body[0],r.body.length(),"r")));
+                r.body.dealloc();
+                r.content_type = "text/plain; charset=utf-8";
+                if(r.kind==serve_page) page(out,image,r);
+                else line(out,image,r);
+                fclose(out);
+                out = 0;
+                r.status = 200;
+            } catch(const char *error) {
+                fail(r,out,422,error);
+            } catch(BadTextLine &error) {
+                fail(r,out,422,"bad text line");
+            } catch(...) {
+                // one bad request must not take the server down
+                fail(r,out,500,"internal error");
+            }
+        }
+    };
+
+    static void *serve_work(void *arg) {
+        Server &server = *(Server*)arg;
+        pthread_mutex_lock(&server.mutex);
+        ServeWorker worker(server,server.next_worker++);
+        pthread_mutex_unlock(&server.mutex);
+        ServeRequest *r;
+        while(server.requests.get(r)) {
+            pthread_mutex_lock(&server.mutex);
+            server.busy++;
+            pthread_mutex_unlock(&server.mutex);
+            worker.run(*r);
+            pthread_mutex_lock(&server.mutex);
+            server.busy--;
+            pthread_mutex_unlock(&server.mutex);
+            server.record(*r);
+            r->finish();
+        }
+        return 0;
+    }
+
+    static void serve_write(int fd,const char *data,size_t n) {
+        while(n>0) {
+            ssize_t k = write(fd,data,n);
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0) return;        // the client went away
+            data += k;
+            n -= k;
+        }
+    }
+
+    static void serve_respond(int fd,int status,const char *content_type,const char *body,size_t n) {
+        const char *reason = "Error";
+        switch(status) {
+        case 200: reason = "OK"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        case 413: reason = "Request Entity Too Large"; break;
+        case 422: reason = "Unprocessable Entity"; break;
+        case 500: reason = "Internal Server Error"; break;
+        case 503: reason = "Service Unavailable"; break;
+        }
+        char header[256];
+        int k = snprintf(header,sizeof header,
+                "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                status,reason,content_type,(unsigned long)n);
+        serve_write(fd,header,k);
+        serve_write(fd,body,n);
+    }
+
+    static void serve_error(int fd,int status,const char *message) {
+        iucstring s;
+        sprintf(s,"%s\n",message);
+        serve_respond(fd,status,"text/plain",s.c_str(),s.length());
+    }
+
+    // the value of a query parameter, e.g. output in /page?output=hocr
+    static bool serve_query(iucstring &value,const char *query,const char *name) {
+        int n = strlen(name);
+        for(const char *p=query;p && *p;) {
+            const char *end = strchr(p,'&');
+            if(!end) end = p+strlen(p);
+            if(!strncmp(p,name,n) && p[n]=='=') {
+                value = "";
+                for(const char *q=p+n+1;q<end;q++) value.push_back(*q);
+                return true;
+            }
+            p = *end ? end+1 : end;
+        }
+        return false;
+    }
+
+    struct ServeConnection {
+        Server *server;
+        int fd;
+    };
+
+    // the body of a request: what came with the header, then the rest
+    static bool serve_read_body(ServeRequest &r,int fd,narray<char> &buffer,int header_end,long length) {
+        long have = buffer.length()-1-header_end;
+        r.body.resize(length);
+        if(have>length) have = length;
+        if(have>0) memcpy(&r.body[0],&buffer[header_end],have);
+        while(have<length) {
+            ssize_t k = read(fd,&r.body[have],length-have);
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0) return false;
+            have += k;
+        }
+        return true;
+    }
+
+    // A request body may only be read if there will be room for it in the
+    // queue, so that an overloaded server refuses requests before it has
+    // buffered their images.
+    struct ServeSlot {
+        Server &server;
+        bool reserved;
+        ServeSlot(Server &server) : server(server) {
+            pthread_mutex_lock(&server.mutex);
+            reserved = server.requests.length()+server.reading<server.capacity;
+            if(reserved) server.reading++;
+            pthread_mutex_unlock(&server.mutex);
+        }
+        ~ServeSlot() {
+            if(!reserved) return;
+            pthread_mutex_lock(&server.mutex);
+            server.reading--;
+            pthread_mutex_unlock(&server.mutex);
+        }
+    };
+
+    static void serve_refuse(Server &server,int fd,int kind) {
+        pthread_mutex_lock(&server.mutex);
+        server.refused[kind]++;
+        pthread_mutex_unlock(&server.mutex);
+        serve_error(fd,503,"too many requests waiting (serve_queue)");
+    }
+
+    static void serve_request(Server &server,int fd) {
+        // the header, and whatever part of the body came with it
+        narray<char> buffer;
+        int header_end = -1;
+        char chunk[4096];
+        while(header_end<0) {
+            ssize_t k = read(fd,chunk,sizeof chunk);
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0) return;
+            for(int i=0;i<k;i++) buffer.push(chunk[i]);
+            for(int i=3;i<buffer.length();i++)
+                if(!memcmp(&buffer[i-3],"\r\n\r\n",4)) {
+                    header_end = i+1;
+                    break;
+                }
+            if(header_end<0 && buffer.length()>65536) {
+                serve_error(fd,400,"header too long");
+                return;
+            }
+        }
+        buffer.push(0);
+        char method[16],target[1024];
+        if(sscanf(&buffer[0],"%15s %1023s",method,target)!=2) {
+            serve_error(fd,400,"bad request line");
+            return;
+        }
+        long length = 0;
+        for(char *p=strstr(&buffer[0],"\r\n");p && p<&buffer[header_end];p=strstr(p+2,"\r\n"))
+            if(!strncasecmp(p+2,"Content-Length:",15)) length = atol(p+17);
+        char *query = strchr(target,'?');
+        if(query) *query++ = 0;
+        if(!strcmp(target,"/health") || !strcmp(target,"/metrics")) {
+            if(strcmp(method,"GET")) {
+                serve_error(fd,405,"use GET");
+                return;
+            }
+            char *data = 0;
+            size_t n = 0;
+            FILE *out = open_memstream(&data,&n);
+            if(!strcmp(target,"/health")) fprintf(out,"ok\n");
+            else server.metrics(out);
+            fclose(out);
+            serve_respond(fd,200,"text/plain; version=0.0.4",data,n);
+            free(data);
+            return;
+        }
+        int kind;
+        if(!strcmp(target,"/page")) kind = serve_page;
+        else if(!strcmp(target,"/line")) kind = serve_line;
+        else {
+            serve_error(fd,404,"unknown endpoint; use /page, /line, /health or /metrics");
+            return;
+        }
+        if(strcmp(method,"POST")) {
+            serve_error(fd,405,"use POST with the image as the body");
+            return;
+        }
+        if(length<0 || length>serve_max_request*(1L<<20)) {
+            serve_error(fd,413,"image too large (serve_max_request)");
+            return;
+        }
+        // the beam is checked before the image is read; the search
+        // allocates for the whole beam in every generation
+        int beam = beam_width;
+        iucstring value;
+        if(serve_query(value,query,"beam")) {
+            long b = strtol(value.c_str(),0,10);
+            if(b>serve_max_beam) {
+                serve_error(fd,400,"beam too large (serve_max_beam)");
+                return;
+            }
+            beam = b<1 ? 1 : int(b);
+        }
+        autodel<ServeRequest> r;
+        {
+            ServeSlot slot(server);
+            if(!slot.reserved) {
+                serve_refuse(server,fd,kind);
+                return;
+            }
+            r = new ServeRequest();
+            if(!serve_read_body(*r,fd,buffer,header_end,length)) return;
+        }
+        r->kind = kind;
+        r->beam = beam;
+        if(serve_query(value,query,"output")) r->output = value;
+        if(serve_query(value,query,"lmodel")) r->use_lmodel = atoi(value.c_str())!=0;
+        r->start = now();
+        // the slot is given back just before this, so another connection
+        // may have taken the room; offer() decides
+        if(!server.requests.offer(r.ptr())) {
+            serve_refuse(server,fd,kind);
+            return;
+        }
+        r->wait();
+        serve_respond(fd,r->status,r->content_type,r->response,r->response_size);
+    }
+
+    static void *serve_connection(void *arg) {
+        ServeConnection c = *(ServeConnection*)arg;
+        delete (ServeConnection*)arg;
+        Server &server = *c.server;
+        try {
+            serve_request(server,c.fd);
+        } catch(const char *error) {
+            fprintf(stderr,"ERROR: %s\n",error);
+        } catch(...) {
+            fprintf(stderr,"ERROR: (no details)\n");
+        }
+        close(c.fd);
+        pthread_mutex_lock(&server.mutex);
+        if(--server.connections==0)
+            pthread_cond_broadcast(&server.idle);
+        pthread_mutex_unlock(&server.mutex);
+        return 0;
+    }
+
+    static volatile sig_atomic_t serve_stop = 0;
+
+    static void serve_signal(int) {
+        serve_stop = 1;
+    }
+
+    int main_serve(int argc,char **argv) {
+        if(argc!=2) throw "usage: cmodel=... lmodel=... ocropus serve socket";
+        const char *path = argv[1];
+        int workers = page_workers();
+        Server server(max(int(serve_queue),1));
+        for(int i=0;i<workers;i++) {
+            server.segmenters.push(make_SegmentPageByRAST());
+            server.linerecs.push(make_Linerec());
+            try {
+                server.linerecs.last()->load(cmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)cmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load character model",(const char*)cmodel);
+            }
+        }
+        if(*(const char*)lmodel) {
+            try {
+                server.langmod.load(lmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)lmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load language model",(const char*)lmodel);
+            }
+            server.has_lmodel = true;
+        }
+        autodel<LineCache> cache;
+        if(line_cache>0) {
+            cache = new LineCache(line_cache*(1L<<20));
+            cache->setModel(cmodel,*server.linerecs[0]);
+            server.cache = cache.ptr();
+        }
+
+        struct sockaddr_un address;
+        memset(&address,0,sizeof address);
+        address.sun_family = AF_UNIX;
+        if(strlen(path)>=sizeof address.sun_path) throwf("%s: socket path too long",path);
+        strcpy(address.sun_path,path);
+        int listener = socket(AF_UNIX,SOCK_STREAM,0);
+        if(listener<0) throwf("socket: %s",strerror(errno));
+        unlink(path);
+        if(bind(listener,(struct sockaddr*)&address,sizeof address) || listen(listener,64)) {
+            close(listener);
+            throwf("%s: %s",path,strerror(errno));
+        }
+        signal(SIGPIPE,SIG_IGN);
+        signal(SIGINT,serve_signal);
+        signal(SIGTERM,serve_signal);
+
+        ThreadGroup threads;
+        threads.start(serve_work,&server,workers);
+        debugf("info","serving on %s with %d workers\n",path,workers);
+        while(!serve_stop) {
+            struct pollfd p;
+            p.fd = listener;
+            p.events = POLLIN;
+            if(poll(&p,1,500)<=0) continue;
+            int fd = accept(listener,0,0);
+            if(fd<0) continue;
+            // a client that stops sending doesn't keep its thread forever
+            struct timeval timeout = {60,0};
+            setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof timeout);
+            // every connection has a thread; beyond the limit, the
+            // refusal is sent from here without one
+            pthread_mutex_lock(&server.mutex);
+            bool refused = server.connections>=max(int(serve_connections),1);
+            if(refused) server.refused_connections++;
+            else server.connections++;
+            pthread_mutex_unlock(&server.mutex);
+            if(refused) {
+                // the answer fits into the socket buffer; a client that
+                // doesn't read it mustn't hold up the accept loop
+                fcntl(fd,F_SETFL,O_NONBLOCK);
+                serve_error(fd,503,"too many connections (serve_connections)");
+                close(fd);
+                continue;
+            }
+            ServeConnection *c = new ServeConnection();
+            c->server = &server;
+            c->fd = fd;
+            pthread_t thread;
+            if(pthread_create(&thread,0,serve_connection,c)) {
+                close(fd);
+                delete c;
+                pthread_mutex_lock(&server.mutex);
+                server.connections--;
+                pthread_mutex_unlock(&server.mutex);
+                continue;
+            }
+            pthread_detach(thread);
+        }
+        // finish what was accepted, then stop
+        close(listener);
+        unlink(path);
+        pthread_mutex_lock(&server.mutex);
+        while(server.connections>0)
+            pthread_cond_wait(&server.idle,&server.mutex);
+        pthread_mutex_unlock(&server.mutex);
+        server.requests.close();
+        threads.join();
+        debugf("info","stopped\n");
+        return 0;
+    }
+
+    int main_recognize1(int argc,char **argv) {
+        if(argc<3) throwf("usage: %s %s model image ...",command,argv[0]);
+        if(!getenv("ocrolog"))
+            throwf("please set ocrolog=glr in the environment");
+        if(!getenv("ocrologdir"))
+            throwf("please set ocrologdir to the target directory for the log");
+        Logger logger("glr");
+        dinit(512,512);
+        autodel<IRecognizeLine> linerecp(make_Linerec());
+        IRecognizeLine &linerec = *linerecp;
+        stdio model(argv[1],"r");
+        linerec.load(model);
+        for(int i=3;i<argc;i++) {
+            logger.html("<hr><br>");
+            logger.format("Recognizing %s",argv[i]);
+            bytearray image;
+            read_image_gray(image,argv[i]);
+            autodel<IGenericFst> result(make_OcroFST());
+            linerec.recognizeLine(*result,image);
+
+            // dump the corresponding FST for display
+            // print_fst_simple(*result);
+            // result->save("rec_temp.fst");
+            dump_fst("rec_temp.dot",*result);
+            intarray fst_image;
+            fst_to_image(fst_image,*result);
+            logger.log("fst",fst_image);
+
+            // output the result
+            nustring str;
+            str.clear();
+            result->bestpath(str);
+            if(str.length()<1) throw "recognition failed";
+            if(debug("detail")) {
+                debugf("detail","nustring result: ");
+                for(int i=0;i<str.length();i++)
+                    printf(" %d",str(i).ord());
+                printf("\n");
+            }
+            narray<char> s;
+            str.utf8Encode(s);
+            s.push(0);
+            printf("%s\t%s\n",argv[i],&s[0]);
+
+            // log the string to the output file
+            char buffer[10000];
+            sprintf(buffer,"<font style='color: green; font-size: 36pt;'>%s</font>\n",&s[0]);
+            //logger.log("result",&s[0]);
+            logger.html(buffer);
+        }
+        return 0;
+    }
+
+    int main_fsts2text(int argc,char **argv) {
+        if(argc!=2) throw "usage: lmodel=... ocropus fsts2text dir|book";
+        // the language model is prepared once and then only read by
+        // the decoders of all threads
+        FrozenFst langmod;
+        try {
+            langmod.load(lmodel);
+        } catch(const char *s) {
+            throwf("%s: failed to load (%s)",(const char*)lmodel,s);
+        } catch(...) {
+            throwf("%s: failed to load language model",(const char*)lmodel);
+        }
+        Book book(argv[1],true);
+        intarray pages,lines;
+        book.list(pages,lines,".fst");
+        floatarray times(pages.length());
+        fill(times,-1);
+        double start = now();
+        // the lattices are read, decoded and written back a batch at a
+        // time; the decoders share the index of the busy states of the
+        // language model
+        autodel<BatchDecoder> decoder(make_BatchDecoder(langmod,beam_width,lm_cache*(1L<<20)));
+        int batch = max(int(decode_batch),1);
+        for(int first=0;first<pages.length();first+=batch) {
+            int n = min(batch,pages.length()-first);
+            objlist<OcroFST> fsts;
+            fsts.resize(n);
+#pragma omp parallel for schedule(dynamic,20)
+            for(int i=0;i<n;i++) {
+                int page = pages[first+i], line = lines[first+i];
+                try {
+                    autodel<OcroFST> fst(make_OcroFST());
+                    fst_read(*fst,BookReader(book,page,line,".fst"));
+                    fsts.set(i,fst.move());
+                } catch(const char *error) {
+                    fprintf(stderr,"ERROR reading %04d/%04d.fst: %s\n",page,line,error);
+                    if(abort_on_error) abort();
+                } catch(...) {
+                    fprintf(stderr,"ERROR reading %04d/%04d.fst\n",page,line);
+                    if(abort_on_error) abort();
+                }
+            }
+            // decode the lines that could be read
+            narray<OcroFST*> lattices;
+            intarray which;
+            for(int i=0;i<n;i++) {
+                if(!fsts.ptr(i)) continue;
+                lattices.push(fsts.ptr(i));
+                which.push(first+i);
+            }
+            objlist<DecodedLine> decoded;
+            decoder->decode(decoded,lattices);
+#pragma omp parallel for schedule(dynamic,20)
+            for(int i=0;i<which.length();i++) {
+                int index = which[i];
+                int page = pages[index], line = lines[index];
+                DecodedLine &result = decoded(i);
+                times(index) = result.time;
+                iucstring file;
+                book.name(file,page,line,".fst");
+                if(index%1000==0)
+                    debugf("info","%s (%d/%d)\n",file.c_str(),index,pages.length());
+                if(result.error.length()>0) {
+                    fprintf(stderr,"ERROR in bestpath: %s\n",result.error.c_str());
+                    if(abort_on_error) abort();
+                    continue;
+                }
+                try {
+                    nustring str;
+                    remove_epsilons(str, result.outputs);
+                    if(result.cost < 1e10) {
+                        iucstring output;
+                        nustring_convert(output,str);
+                        debugf("transcript","%s\t%s\n",file.c_str(), output.c_str());
+                        try {
+                            rseg_to_cseg(book, page, line, result.inputs);
+                            store_costs(book, page, line, result.costs);
+                        } catch(const char *err) {
+                            fprintf(stderr,"ERROR in cseg reconstruction: %s\n",err);
+                            if(abort_on_error) abort();
+                        }
+                        BookWriter stream(book,page,line,".txt");
+                        fprintf(stream,"%s\n",output.c_str());
+                        stream.close();
+                    } else {
+                        debugf("info","%s\t%f\n",file.c_str(), result.cost);
+                    }
+                } catch(const char *error) {
+                    fprintf(stderr,"ERROR writing %s: %s\n",file.c_str(),error);
+                    if(abort_on_error) abort();
+                } catch(...) {
+                    fprintf(stderr,"ERROR writing %s\n",file.c_str());
+                    if(abort_on_error) abort();
+                }
+            }
+        }
+        int states;
+        long bytes;
+        decoder->cache().counts(states,bytes);
+        BeamStats stats;
+        decoder->stats(stats);
+        debugf("info","language model index: %d states in %ld bytes, used for %ld joins\n",
+               states,bytes,stats.indexed);
+        report_latencies("decoded",times,now()-start);
+        return 0;
+    }
+
+
+    int main_fsts2nbest(int argc,char **argv) {
+        if(argc!=2) throw "usage: lmodel=... nbest=... ocropus fsts2nbest dir";
+        FrozenFst langmod;
+        if(nbest_lmodel) {
+            try {
+                langmod.load(lmodel);
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)lmodel,s);
+            } catch(...) {
+                throwf("%s: failed to load language model",(const char*)lmodel);
+            }
+        }
+        iucstring s;
+        sprintf(s,"%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].fst",argv[1]);
+        Glob files(s);
+        int ntruncated = 0;
+#pragma omp parallel for schedule(dynamic,20) reduction(+:ntruncated)
+        for(int index=0;index<files.length();index++) {
+            if(index%1000==0)
+                debugf("info","%s (%d/%d)\n",files(index),index,files.length());
+            try {
+                autodel<OcroFST> fst(make_OcroFST());
+                fst->load(files(index));
+                autodel<NBestPaths> paths;
+                if(nbest_lmodel)
+                    paths = make_NBestPaths(*fst,langmod,nbest,nbest_unique);
+                else
+                    paths = make_NBestPaths(*fst,nbest,nbest_unique);
+                iucstring base;
+                base = files(index);
+                base.erase(base.length()-4);
+                base += ".nbest.txt";
+                stdio stream(base,"w");
+                nustring str;
+                double cost;
+                int i = 0;
+                for(;i<nbest && paths->next(str,cost);i++) {
+                    iucstring output;
+                    nustring_convert(output,str);
+                    fprintf(stream,"%g\t%s\n",cost,output.c_str());
+                }
+                if(i<nbest && paths->truncated()) {
+                    fprintf(stderr,"WARNING in nbest: %s: search limit reached, %d of %d hypotheses\n",
+                            files(index),i,int(nbest));
+                    ntruncated++;
+                }
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR in nbest: %s: %s\n",files(index),error);
+                if(abort_on_error) abort();
+            } catch(...) {
+                // nothing may leave the parallel loop
+                fprintf(stderr,"ERROR in nbest: %s: (no details)\n",files(index));
+                if(abort_on_error) abort();
+            }
+        }
+        if(ntruncated>0)
+            debugf("info","%d of %d lines have fewer than %d hypotheses (search limit)\n",
+                   ntruncated,files.length(),int(nbest));
+        return 0;
+    }
+
+    int main_align(int argc,char **argv) {
+        if(argc!=2) throw "usage: ... dir|book";
+        Book book(argv[1],true);
+        intarray pages,lines;
+        book.list(pages,lines,".fst");
+        for(int index=0;index<pages.length();index++) {
+            int page = pages[index], line = lines[index];
+            if(index%1000==0) {
+                iucstring file;
+                book.name(file,page,line,".fst");
+                debugf("info","%s (%d/%d)\n",file.c_str(),index,pages.length());
+            }
+
+            autodel<OcroFST> gt_fst(make_OcroFST());
+            read_gt(*gt_fst, book, page, line);
+
+            autodel<OcroFST> fst(make_OcroFST());
+            fst_read(*fst,BookReader(book,page,line,".fst"));
+            nustring str;
+            intarray v1;
+            intarray v2;
+            intarray in;
+            intarray out;
+            floatarray costs;
+            try {
+                beam_search(v1, v2, in, out, costs,
+                            *fst, *gt_fst, beam_width);
+                // recolor rseg to cseg
+            } catch(const char *error) {
+                fprintf(stderr,"ERROR in bestpath: %s\n",error);
+                if(abort_on_error) abort();
+            }
+            try {
+                rseg_to_cseg(book, page, line, in);
+                store_costs(book, page, line, costs);
                 debugf("dcost","--------------------------------\n");
                 for(int i=0;i<out.length();i++) {
                     debugf("dcost","%3d %10g %c\n",i,costs(i),out(i));
@@ -1034,16 +2348,18 @@ namespace ocropus {
 
 
     int main_loadseg(int argc,char **argv) {
-        if(argc!=3) throw "usage: ... model dir";
+        if(argc<3) throw "usage: ... model dataset...";
         dinit(512,512);
         autodel<IRecognizeLine> linerecp(make_Linerec());
         IRecognizeLine &linerec = *linerecp;
         struct stat sbuf;
         if(argv[1][0]!='.' && !stat(argv[1],&sbuf))
             throw "output model file already exists; please remove first";
-        fprintf(stderr,"loading %s\n",argv[2]);
         linerec.startTraining("");
-        linerec.set("load_ds8",argv[2]);
+        for(int i=2;i<argc;i++) {
+            fprintf(stderr,"loading %s\n",argv[i]);
+            linerec.set("load_ds8",argv[i]);
+        }
         linerec.finishTraining();
         fprintf(stderr,"saving %s\n",argv[1]);
         stdio stream(argv[1],"w");
@@ -1051,6 +2367,241 @@ namespace ocropus {
         return 0;
     }
 
+    int main_quantize(int argc,char **argv) {
+        if(argc!=3 && argc!=4) throw "usage: ... input-model output-model [dataset]";
+        autodel<IRecognizeLine> linerec(make_Linerec());
+        linerec->load(stdio(argv[1],"r"));
+        float error = 0, qerror = 0;
+        double seconds = 0, qseconds = 0;
+        int nsamples = 0;
+        if(argc==4) {
+            CHECK(sscanf(linerec->command("evaluate_ds8",argv[3]),"%g %lg %d",
+                         &error,&seconds,&nsamples)==3);
+        }
+        int n = atoi(linerec->command("quantize"));
+        fprintf(stderr,"quantized %d networks\n",n);
+        if(argc==4) {
+            CHECK(sscanf(linerec->command("evaluate_ds8",argv[3]),"%g %lg %d",
+                         &qerror,&qseconds,&nsamples)==3);
+            printf("samples %d\n",nsamples);
+            printf("float error %.4f time %.3fs\n",error,seconds);
+            printf("int8 error %.4f time %.3fs\n",qerror,qseconds);
+            printf("delta error %+.4f speedup %.2f\n",qerror-error,seconds/max(qseconds,1e-9));
+        }
+        linerec->save(stdio(argv[2],"w"));
+        struct stat in,out;
+        if(!stat(argv[1],&in) && !stat(argv[2],&out))
+            printf("model size %ld -> %ld bytes\n",long(in.st_size),long(out.st_size));
+        return 0;
+    }
+
+    int main_fmapbench(int argc,char **argv) {
+        if(argc<2) throw "usage: ... line-image...";
+        autodel<IRecognizeLine> linerec(make_Linerec());
+        double setline[2] = {0,0}, extract[2] = {0,0};
+        int total = 0;
+        for(int i=1;i<argc;i++) {
+            for(int pyramid=0;pyramid<2;pyramid++) {
+                int n;
+                double s,e;
+                const char *result = linerec->command("time_features",argv[i],pyramid?"1":"0");
+                CHECK(sscanf(result,"%d %lg %lg",&n,&s,&e)==3);
+                printf("%s pyramid %d vectors %d setline %.3fs extract %.3fs\n",
+                       argv[i],pyramid,n,s,e);
+                setline[pyramid] += s;
+                extract[pyramid] += e;
+                if(pyramid) total += n;
+            }
+        }
+        for(int pyramid=0;pyramid<2;pyramid++)
+            printf("pyramid %d: %d vectors, %.1f vectors/s (%.1f/s without setLine)\n",
+                   pyramid,total,total/max(setline[pyramid]+extract[pyramid],1e-9),
+                   total/max(extract[pyramid],1e-9));
+        return 0;
+    }
+
+    int main_fstbench(int argc,char **argv) {
+        if(argc<2) throw "usage: lmodel=... ocropus fstbench lattice.fst...";
+        enum { repeat=5 };
+        double start = now();
+        autodel<OcroFST> langmod(make_OcroFST());
+        langmod->load(lmodel);
+        double loaded = now();
+        FrozenFst frozen;
+        fst_freeze(frozen,*langmod);
+        double frozen_at = now();
+        printf("%s: %d states %d arcs, load %.3fs freeze %.3fs\n",
+               (const char*)lmodel,frozen.nStates(),frozen.narcs,
+               loaded-start,frozen_at-loaded);
+        autodel<BeamDecoder> decoder(make_BeamDecoder(frozen,beam_width));
+        double total[2] = {0,0};
+        int mismatches = 0;
+        for(int i=1;i<argc;i++) {
+            autodel<OcroFST> fst(make_OcroFST());
+            fst->load(argv[i]);
+            nustring result[2];
+            double cost[2];
+            for(int frozen_lm=0;frozen_lm<2;frozen_lm++) {
+                double t = now();
+                for(int r=0;r<repeat;r++) {
+                    if(frozen_lm)
+                        cost[frozen_lm] = decoder->decode(result[frozen_lm],*fst);
+                    else
+                        cost[frozen_lm] = beam_search(result[frozen_lm],*fst,*langmod,beam_width);
+                }
+                t = (now()-t)/repeat;
+                total[frozen_lm] += t;
+                printf("%s frozen %d cost %g time %.4fs\n",argv[i],frozen_lm,cost[frozen_lm],t);
+            }
+            if(cost[0]!=cost[1] || !equal(result[0],result[1])) mismatches++;
+        }
+        printf("objlist layout %.4fs frozen %.4fs per lattice, speedup %.2f, %d mismatches\n",
+               total[0]/(argc-1),total[1]/(argc-1),total[0]/max(total[1],1e-9),mismatches);
+        BeamStats &stats = decoder->stats();
+        double generations = max(stats.generations,1L);
+        printf("beam width %d mean fill %.1f hash load %.3f probes/offer %.2f "
+               "evictions %ld replacements %ld rejections %ld max tree %d\n",
+               stats.beam_width,stats.entries/generations,stats.load/generations,
+               stats.probes/max(double(stats.insertions+stats.replacements+stats.evictions+stats.rejections),1.0),
+               stats.evictions,stats.replacements,stats.rejections,stats.max_tree);
+        return mismatches>0;
+    }
+
+    int main_fst2frozen(int argc,char **argv) {
+        if(argc!=3) throw "usage: ocropus fst2frozen input.fst output.ofst";
+        FrozenFst frozen;
+        frozen.load(argv[1]);
+        frozen.save(argv[2]);
+        struct stat in,out;
+        if(!stat(argv[1],&in) && !stat(argv[2],&out))
+            printf("%d states %d arcs, size %ld -> %ld bytes\n",frozen.nStates(),frozen.narcs,
+                   long(in.st_size),long(out.st_size));
+        return 0;
+    }
+
+    int main_fstloadbench(int argc,char **argv) {
+        if(argc!=3) throw "usage: ocropus fstloadbench lmodel.fst lmodel.ofst";
+        enum { repeat=3 };
+        double parse = 1e30, freeze = 1e30, map = 1e30, touch = 1e30;
+        int mismatches = 0;
+        long checksum = 0;
+        long private_bytes = 0, shared_bytes = 0;
+        for(int r=0;r<repeat;r++) {
+            double start = now();
+            autodel<OcroFST> fst(make_OcroFST());
+            fst->load(argv[1]);
+            double parsed = now();
+            FrozenFst frozen;
+            fst_freeze(frozen,*fst);
+            double frozen_at = now();
+            FrozenFst mapped;
+            mapped.map(argv[2]);
+            double mapped_at = now();
+            // the first search faults the pages in; this is the upper
+            // bound for that (every page of the file)
+            long sum = 0;
+            for(int i=0;i<mapped.nstates;i++)
+                sum += mapped.offsets[i]+(mapped.accept_costs[i]<1e30)+(mapped.heuristics[i]<1e30);
+            for(int i=0;i<mapped.narcs;i++)
+                sum += mapped.by_input[i].target+mapped.by_output[i].target;
+            double touched = now();
+            checksum = sum;
+            parse = min(parse,parsed-start);
+            freeze = min(freeze,frozen_at-parsed);
+            map = min(map,mapped_at-frozen_at);
+            touch = min(touch,touched-mapped_at);
+            private_bytes = long(frozen.allocated);
+            shared_bytes = long(mapped.mapped);
+            int n = frozen.nstates, m = frozen.narcs;
+            if(n!=mapped.nstates || m!=mapped.narcs || frozen.start!=mapped.start ||
+               memcmp(frozen.offsets,mapped.offsets,(n+1)*sizeof (int)) ||
+               memcmp(frozen.accept_costs,mapped.accept_costs,n*sizeof (float)) ||
+               memcmp(frozen.heuristics,mapped.heuristics,n*sizeof (float)) ||
+               memcmp(frozen.by_input,mapped.by_input,m*sizeof (FrozenFst::Arc)) ||
+               memcmp(frozen.by_output,mapped.by_output,m*sizeof (FrozenFst::Arc)))
+                mismatches++;
+        }
+        printf("OpenFST parse %.3fs freeze %.3fs (%ld private bytes per process)\n",
+               parse,freeze,private_bytes);
+        printf("native map %.6fs touch all pages %.3fs (%ld shared bytes) checksum %ld\n",
+               map,touch,shared_bytes,checksum);
+        printf("startup speedup %.0fx, %d mismatches\n",(parse+freeze)/max(map+touch,1e-9),mismatches);
+        return mismatches>0;
+    }
+
+    int main_fstprunebench(int argc,char **argv) {
+        if(argc<2) throw "usage: lmodel=... prune_beam=... prune_arcs=... ocropus fstprunebench lattice.fst...";
+        if(!pruning()) throw "set prune_beam and/or prune_arcs";
+        FrozenFst langmod;
+        langmod.load(lmodel);
+        autodel<BeamDecoder> decoder(make_BeamDecoder(langmod,beam_width));
+        char tmp[] = "/tmp/fstpruneXXXXXX";
+        int fd = mkstemp(tmp);
+        if(fd<0) throw "cannot create a temporary file";
+        close(fd);
+        long bytes[2] = {0,0};
+        int arcs[2] = {0,0}, errors[2] = {0,0};
+        double time[2] = {0,0};
+        int changed = 0, distance = 0, truths = 0, chars = 0;
+        for(int i=1;i<argc;i++) {
+            autodel<OcroFST> fst[2];
+            fst[0] = make_OcroFST();
+            fst[0]->load(argv[i]);
+            fst[1] = make_OcroFST();
+            fst_prune(*fst[1],*fst[0],prune_beam,prune_arcs);
+            nustring result[2];
+            for(int p=0;p<2;p++) {
+                arcs[p] += count_arcs(*fst[p]);
+                fst[p]->save(tmp);
+                struct stat sbuf;
+                if(!stat(tmp,&sbuf)) bytes[p] += sbuf.st_size;
+                double t = now();
+                decoder->decode(result[p],*fst[p]);
+                time[p] += now()-t;
+            }
+            if(!equal(result[0],result[1])) {
+                changed++;
+                distance += fast_edit_distance(result[0],result[1]);
+            }
+            iucstring base,s;
+            base = argv[i];
+            base.erase(base.length()-4);
+            sprintf(s,"%s.gt.txt",base.c_str());
+            FILE *stream = fopen(s.c_str(),"r");
+            if(stream) {
+                char buf[100000];
+                if(!fgets(buf,sizeof buf,stream)) buf[0] = 0;
+                fclose(stream);
+                iucstring truth;
+                truth = buf;
+                cleanup_for_eval(truth);
+                nustring ntruth;
+                nustring_convert(ntruth,truth);
+                for(int p=0;p<2;p++) {
+                    iucstring predicted;
+                    nustring_convert(predicted,result[p]);
+                    cleanup_for_eval(predicted);
+                    nustring npredicted;
+                    nustring_convert(npredicted,predicted);
+                    errors[p] += fast_edit_distance(ntruth,npredicted);
+                }
+                chars += truth.length();
+                truths++;
+            }
+        }
+        unlink(tmp);
+        int n = argc-1;
+        printf("prune_beam %g prune_arcs %d, %d lattices\n",float(prune_beam),int(prune_arcs),n);
+        printf("arcs %d -> %d (%.1f%%), bytes %ld -> %ld\n",arcs[0],arcs[1],
+               100.0*arcs[1]/max(arcs[0],1),bytes[0],bytes[1]);
+        printf("decode %.4fs -> %.4fs per lattice, speedup %.2f\n",time[0]/n,time[1]/n,
+               time[0]/max(time[1],1e-9));
+        printf("%d results changed, total edit distance %d\n",changed,distance);
+        if(truths>0)
+            printf("errors against %d ground truth lines (%d chars): %d -> %d\n",truths,chars,errors[0],errors[1]);
+        return 0;
+    }
+
     int main_trainseg_or_saveseg(int argc,char **argv) {
         if(argc!=3) throw "usage: ... model dir";
         dinit(512,512);
@@ -1225,6 +2776,148 @@ namespace ocropus {
         throw Unimplemented();
     }
 
+    static bool has_suffix(const char *s,const char *suffix) {
+        int n = strlen(s), m = strlen(suffix);
+        return n>=m && !strcmp(s+n-m,suffix);
+    }
+
+    // one word per line, optionally followed by a tab and its cost
+    static void read_word_list(objlist<nustring> &words,floatarray &costs,const char *path) {
+        stdio stream(path,"r");
+        char buf[10000];
+        while(fgets(buf,sizeof buf,stream)) {
+            int n = strlen(buf);
+            while(n>0 && (buf[n-1]=='\n' || buf[n-1]=='\r')) buf[--n] = 0;
+            float cost = 0;
+            char *tab = strchr(buf,'\t');
+            if(tab) {
+                *tab = 0;
+                cost = atof(tab+1);
+            }
+            if(!buf[0]) continue;
+            iucstring word;
+            word = buf;
+            nustring_convert(words.push(),word);
+            costs.push(cost);
+        }
+    }
+
+    static void report_stage(const char *what,IGenericFst &fst,double &t) {
+        double t1 = now();
+        printf("%-14s %9d states %9d arcs %7.2fs\n",what,fst.nStates(),count_arcs(fst),t1-t);
+        t = t1;
+    }
+
+    static double decode_all(nustring *results,double *costs,FrozenFst &langmod,char **files,int n) {
+        enum { repeat=3 };
+        autodel<BeamDecoder> decoder(make_BeamDecoder(langmod,beam_width));
+        double best = 1e30;
+        for(int r=0;r<repeat;r++) {
+            double total = 0;
+            for(int i=0;i<n;i++) {
+                autodel<OcroFST> fst(make_OcroFST());
+                fst->load(files[i]);
+                double t = now();
+                costs[i] = decoder->decode(results[i],*fst);
+                total += now()-t;
+            }
+            best = min(best,total);
+        }
+        return best/max(n,1);
+    }
+
+    int main_compilelm(int argc,char **argv) {
+        if(argc<3) throw "usage: ocropus compilelm words.txt|lmodel.fst output.ofst [lattice.fst...]";
+        double t = now();
+        autodel<OcroFST> fst(make_OcroFST());
+        FrozenFst original;
+        bool from_fst = has_suffix(argv[1],".fst") || has_suffix(argv[1],".ofst");
+        if(from_fst) {
+            original.load(argv[1]);
+            fst_copy(*fst,original);
+        } else {
+            objlist<nustring> words;
+            floatarray costs;
+            read_word_list(words,costs,argv[1]);
+            fst_word_list(*fst,words,costs);
+        }
+        report_stage("input",*fst,t);
+        fst_connect(*fst,*fst);
+        report_stage("connected",*fst,t);
+        // both steps can blow up back-off models; the result is
+        // equivalent without them, only with more work for the search
+        int max_arcs = int(lm_max_growth*count_arcs(*fst));
+        autodel<OcroFST> step(make_OcroFST());
+        fst_remove_epsilons(*step,*fst);
+        fst_connect(*step,*step);
+        if(count_arcs(*step)<=max_arcs) {
+            fst = step;
+            step = make_OcroFST();
+            report_stage("epsilon-free",*fst,t);
+        } else {
+            printf("epsilon removal gives %d arcs, more than lm_max_growth allows; skipped\n",count_arcs(*step));
+            t = now();
+        }
+        if(fst_determinize(*step,*fst,max_arcs)) {
+            fst = step;
+            report_stage("determinized",*fst,t);
+        } else {
+            printf("determinization gives more than %d arcs; skipped\n",max_arcs);
+            t = now();
+        }
+        fst_push_weights(*fst,*fst);
+        report_stage("pushed",*fst,t);
+        fst_minimize(*fst,*fst);
+        fst_connect(*fst,*fst);
+        report_stage("minimized",*fst,t);
+        FrozenFst optimized;
+        fst_freeze(optimized,*fst);
+        if(has_suffix(argv[2],".ofst"))
+            optimized.save(argv[2]);
+        else
+            fst->save(argv[2]);
+        report_stage("saved",*fst,t);
+        int n = argc-3;
+        if(n==0) return 0;
+        if(!from_fst) {
+            printf("no language model to compare with\n");
+            return 0;
+        }
+        narray<nustring> results[2];
+        narray<double> costs[2];
+        double time[2];
+        FrozenFst *langmods[2] = {&original,&optimized};
+        for(int p=0;p<2;p++) {
+            results[p].resize(n);
+            costs[p].resize(n);
+            time[p] = decode_all(&results[p][0],&costs[p][0],*langmods[p],argv+3,n);
+        }
+        // beam search is approximate, so the optimized model can change
+        // the results; a lower cost means the search got closer to the best path
+        const char *names[2] = {"original","optimized"};
+        for(int p=0;p<2;p++) {
+            int failed = 0;
+            double total = 0;
+            for(int i=0;i<n;i++) {
+                if(costs[p][i]<1e30) total += costs[p][i];
+                else failed++;
+            }
+            printf("%-9s decode %.4fs per lattice (beam_width %d), mean cost %.3f, %d without a result\n",
+                   names[p],time[p],int(beam_width),total/max(n-failed,1),failed);
+        }
+        int changed = 0, better = 0, distance = 0;
+        for(int i=0;i<n;i++) {
+            if(costs[1][i]<costs[0][i]) better++;
+            if(!equal(results[0][i],results[1][i])) {
+                changed++;
+                distance += fast_edit_distance(results[0][i],results[1][i]);
+            }
+        }
+        printf("speedup %.2f, %d of %d results changed (%d with a lower cost), total edit distance %d\n",
+               time[0]/max(time[1],1e-9),changed,n,better,distance);
+        return 0;
+    }
+
     void usage(const char *program) {
         fprintf(stderr,"usage:\n");
 #define D(s,s2) {fprintf(stderr,"    %s %s\n",program,s); fprintf(stderr,"        %s\n",s2); }
@@ -1235,15 +2928,21 @@ namespace ocropus {
                 "convert the input into a set of pages under dir/...");
         D("pages2lines dir",
                 "convert the pages in dir/... into lines");
+        D("dir2book dir output.book",
+                "copy the files in dir/... into a single indexed file; lines2fsts, fsts2text, align and evaluate take it in place of dir");
+        D("book2dir input.book dir",
+                "copy the files of a .book back into dir/...");
         SECTION("line recognition and language modeling")
-        D("lines2fsts dir",
-                    "convert the lines in dir/... into fsts (lattices); cmodel=...")
+        D("lines2fsts dir|book",
+                    "convert the lines in dir/... into fsts (lattices); cmodel=... prune_beam=... prune_arcs=...")
         D("fsts2bestpaths dir",
                 "find the best interpretation of the fsts in dir/... without a language model");
-        D("fsts2textdir",
+        D("fsts2nbest dir",
+                "write the nbest best transcriptions of each line to dir/.../....nbest.txt; nbest_unique=0 nbest_lmodel=0");
+        D("fsts2text dir|book",
                 "find the best interpretation of the fsts in dir/...; lmodel=...");
         SECTION("evaluation");
-        D("evaluate dir",
+        D("evaluate dir|book",
                 "evaluate the quality of the OCR output in dir/...");
         D("evalconf dir",
                 "evaluate the quality of the OCR output in dir/... and outputs confusion matrix");
@@ -1252,17 +2951,35 @@ namespace ocropus {
         D("evaluate1 file1 file2",
                 "compute the edit distance between the two files");
         SECTION("training");
-        D("align dir",
+        D("align dir|book",
                 "align fsts with ground truth transcripts");
         D("trainseg model dir",
                 "train a model for the ground truth in dir/...");
         D("saveseg dataset dir",
                 "perform dataset extraction on the book directory and save it");
-        D("loadseg model dataset",
-                "perform training on the dataset (saveseg + loadseg is the same as trainseg)");
+        D("loadseg model dataset...",
+                "perform training on the datasets (saveseg + loadseg is the same as trainseg); linerec_ds8_append=file makes trainseg write one");
+        D("quantize model output [dataset]",
+                "convert the MLPs in model to int8 and report the change in error on a saveseg dataset");
+        D("fmapbench line1 line2...",
+                "time feature extraction on line images with and without sfmap_pyramid");
+        D("fstbench lattice.fst...",
+                "time beam search of lattices against lmodel, as loaded and as a FrozenFst");
+        D("fstprunebench lattice.fst...",
+                "report the size, decoding time and accuracy of lattices with prune_beam/prune_arcs against lmodel");
+        D("fst2frozen input.fst output.ofst",
+                "convert an FST to the native format that FrozenFst::load maps without parsing");
+        D("compilelm words.txt|lmodel.fst output.ofst [lattice.fst...]",
+                "make an epsilon-free, determinized, pushed and minimized language model from a word list (word[TAB cost] per line) or an FST, and compare decoding lattices with both; lm_max_growth=...");
+        D("fstloadbench lmodel.fst lmodel.ofst",
+                "time loading an FST in OpenFST format and mapping it in the native format");
         SECTION("other recognizers");
         D("recognize1 logdir model line1 line2...",
                 "recognize images of individual lines of text given on the command line; ocrolog=glr ocrologdir=...");
+        D("book2text image image ...",
+                "recognize pages in one process, with the stages running in threads connected by queues; book2text_recognizers=... book2text_dump=dir");
+        D("serve socket",
+                "keep the models loaded and recognize images POSTed to /page or /line on a Unix domain socket (HTTP/1.0; ?output=text|hocr|fst&beam=...&lmodel=0); GET /health and /metrics; page_threads=... serve_queue=... serve_connections=... serve_max_beam=...");
         D("page image.png",
                 "recognize a single page of text without adaptivity, but with a language model");
         SECTION("components");
@@ -1279,10 +2996,65 @@ namespace ocropus {
         D("cleanhtml dir",
                 "removes all files from dir/... that aren't needed for the HTML output");
 #endif
+        P("\nstats_json=file with any command writes the time spent in each stage as JSON");
         exit(1);
     }
 
+    static int run_command(int argc,char **argv) {
+        if(!strcmp(argv[1],"book2dir")) return main_book2dir(argc-1,argv+1);
+        if(!strcmp(argv[1],"book2lines")) return main_book2lines(argc-1,argv+1);
+        if(!strcmp(argv[1],"book2text")) return main_book2text(argc-1,argv+1);
+        if(!strcmp(argv[1],"book2pages")) return main_book2pages(argc-1,argv+1);
+        if(!strcmp(argv[1],"buildhtml")) return main_buildhtml(argc-1,argv+1);
+        if(!strcmp(argv[1],"cinfo")) return main_cinfo(argc-1,argv+1);
+        if(!strcmp(argv[1],"cleanhtml")) return main_buildhtml(argc-1,argv+1);
+        if(!strcmp(argv[1],"compilelm")) return main_compilelm(argc-1,argv+1);
+        if(!strcmp(argv[1],"components")) return main_components(argc-1,argv+1);
+        if(!strcmp(argv[1],"dir2book")) return main_dir2book(argc-1,argv+1);
+        if(!strcmp(argv[1],"evalconf")) return main_evalconf(argc-1,argv+1);
+        if(!strcmp(argv[1],"evaluate")) return main_evaluate(argc-1,argv+1);
+        if(!strcmp(argv[1],"evaluate1")) return main_evalfiles(argc-1,argv+1);
+        if(!strcmp(argv[1],"findconf")) return main_findconf(argc-1,argv+1);
+        if(!strcmp(argv[1],"fmapbench")) return main_fmapbench(argc-1,argv+1);
+        if(!strcmp(argv[1],"fst2frozen")) return main_fst2frozen(argc-1,argv+1);
+        if(!strcmp(argv[1],"fstbench")) return main_fstbench(argc-1,argv+1);
+        if(!strcmp(argv[1],"fstloadbench")) return main_fstloadbench(argc-1,argv+1);
+        if(!strcmp(argv[1],"fstprunebench")) return main_fstprunebench(argc-1,argv+1);
+        if(!strcmp(argv[1],"fsts2bestpaths")) return main_fsts2bestpaths(argc-1,argv+1);
+        if(!strcmp(argv[1],"fsts2nbest")) return main_fsts2nbest(argc-1,argv+1);
+        if(!strcmp(argv[1],"fsts2text")) return main_fsts2text(argc-1,argv+1);
+        if(!strcmp(argv[1],"lines2fsts")) return main_lines2fsts(argc-1,argv+1);
+        if(!strcmp(argv[1],"loadseg")) return main_loadseg(argc-1,argv+1);
+        if(!strcmp(argv[1],"align")) return main_align(argc-1,argv+1);
+        if(!strcmp(argv[1],"page")) return main_page(argc-1,argv+1);
+        if(!strcmp(argv[1],"pages2images")) return main_pages2images(argc-1,argv+1);
+        if(!strcmp(argv[1],"pages2lines")) return main_pages2lines(argc-1,argv+1);
+        if(!strcmp(argv[1],"params")) return main_params(argc-1,argv+1);
+        if(!strcmp(argv[1],"quantize")) return main_quantize(argc-1,argv+1);
+        if(!strcmp(argv[1],"recognize1")) return main_recognize1(argc-1,argv+1);
+        if(!strcmp(argv[1],"saveseg")) return main_trainseg_or_saveseg(argc-1,argv+1);
+        if(!strcmp(argv[1],"serve")) return main_serve(argc-1,argv+1);
+        if(!strcmp(argv[1],"trainseg")) return main_trainseg_or_saveseg(argc-1,argv+1);
+        usage(argv[0]);
+        return 1;
+    }
+
+    static void write_stats(const char *subcommand) {
+        if(!strcmp(stats_json,"-")) {
+            stats_write(stderr,subcommand);
+            return;
+        }
+        FILE *stream = fopen(stats_json,"w");
+        if(!stream) {
+            perror(stats_json);
+            return;
+        }
+        stats_write(stream,subcommand);
+        fclose(stream);
+    }
+
     int main_ocropus(int argc,char **argv) {
+        int result = 0;
         try {
             command = argv[0];
             init_ocropus_components();
@@ -1290,32 +3062,12 @@ namespace ocropus {
             init_glfmaps();
             init_linerec();
             if(argc<2) usage(argv[0]);
-            if(!strcmp(argv[1],"book2lines")) return main_pages2lines(argc-1,argv+1);
-            if(!strcmp(argv[1],"book2pages")) return main_book2pages(argc-1,argv+1);
-            if(!strcmp(argv[1],"buildhtml")) return main_buildhtml(argc-1,argv+1);
-            if(!strcmp(argv[1],"cinfo")) return main_cinfo(argc-1,argv+1);
-            if(!strcmp(argv[1],"cleanhtml")) return main_buildhtml(argc-1,argv+1);
-            if(!strcmp(argv[1],"components")) return main_components(argc-1,argv+1);
-            if(!strcmp(argv[1],"evalconf")) return main_evalconf(argc-1,argv+1);
-            if(!strcmp(argv[1],"evaluate")) return main_evaluate(argc-1,argv+1);
-            if(!strcmp(argv[1],"evaluate1")) return main_evalfiles(argc-1,argv+1);
-            if(!strcmp(argv[1],"findconf")) return main_findconf(argc-1,argv+1);
-            if(!strcmp(argv[1],"fsts2bestpaths")) return main_fsts2bestpaths(argc-1,argv+1);
-            if(!strcmp(argv[1],"fsts2text")) return main_fsts2text(argc-1,argv+1);
-            if(!strcmp(argv[1],"lines2fsts")) return main_lines2fsts(argc-1,argv+1);
-            if(!strcmp(argv[1],"loadseg")) return main_loadseg(argc-1,argv+1);
-            if(!strcmp(argv[1],"align")) return main_align(argc-1,argv+1);
-            if(!strcmp(argv[1],"page")) return main_page(argc-1,argv+1);
-            if(!strcmp(argv[1],"pages2images")) return main_pages2images(argc-1,argv+1);
-            if(!strcmp(argv[1],"pages2lines")) return main_pages2lines(argc-1,argv+1);
-            if(!strcmp(argv[1],"params")) return main_params(argc-1,argv+1);
-            if(!strcmp(argv[1],"recognize1")) return main_recognize1(argc-1,argv+1);
-            if(!strcmp(argv[1],"saveseg")) return main_trainseg_or_saveseg(argc-1,argv+1);
-            if(!strcmp(argv[1],"trainseg")) return main_trainseg_or_saveseg(argc-1,argv+1);
-            usage(argv[0]);
+            if(*(const char*)stats_json) stats_enable();
+            result = run_command(argc,argv);
         } catch(const char *s) {
             fprintf(stderr,"FATAL: %s\n",s);
         }
-        return 0;
+        if(stats_enabled) write_stats(argv[1]);
+        return result;
     }
 }
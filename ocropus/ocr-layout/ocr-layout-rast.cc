@@ -214,6 +214,7 @@ namespace ocropus {
     void SegmentPageByRAST::segment(intarray &result,
                                     bytearray &in_not_inverted,
                                     rectarray &obstacles) {
+        StatsTimer timer("segment");
         intarray debug_image;
         if(debug_segm) {
             segmentInternal(debug_image, result, in_not_inverted, true, obstacles);
@@ -322,6 +322,7 @@ namespace ocropus {
     }
 
     void SegmentPageByWCUTS::segment(intarray &image,bytearray &in_not_inverted) {
+        StatsTimer timer("segment");
 
         bytearray in;
         copy(in, in_not_inverted);
@@ -369,6 +369,7 @@ namespace ocropus {
     
     
     void SegmentPageByXYCUTS::segment(intarray &image,bytearray &in) {
+        StatsTimer timer("segment");
         if(!contains_only(in,byte(0),byte(255))){
             fprintf(stderr,"X-Y Cut algorithm needs binary input image.\n");
             exit(1);
@@ -1,7 +1,11 @@
 // classifier implementations for glinerec
 
 #include <unistd.h>
+#include <limits.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "glinerec.h"
 #include "gsl.h"
 
@@ -92,50 +96,322 @@ namespace glinerec {
         return -total;
     }
 
-    double nearest_neighbor_error(IDataset &data,int ntrials=1000) {
-        int total = 0;
-        ntrials = min(data.nsamples(),ntrials);
-        for(int i=0;i<data.nsamples();i++) {
-            // FIXME use sampling without replacement
-            int i = lrand48()%data.nsamples();
-            floatarray u;
-            data.input(u,i);
-            int n = data.nsamples();
-            floatarray dists(n);
-#pragma omp parallel for shared(dists)
-            for(int j=0;j<data.nsamples();j++) {
-                if(j==i) {
-                    dists(j)= 1e30;
-                } else {
-                    floatarray v;
-                    data.input(v,j);
-                    dists(j) = dist2squared(u,v);
-                }
+    ////////////////////////////////////////////////////////////////
+    // exact nearest neighbor search
+    ////////////////////////////////////////////////////////////////
+
+    // Squared Euclidean distance between two zero-padded rows of
+    // length n (a multiple of 16); v must be 16-byte aligned.  Gives
+    // up and returns a partial sum larger than bound as soon as the
+    // distance is known to exceed it.
+
+    inline float dist2_bounded(const float *u,const float *v,int n,float bound) {
+#ifdef __SSE2__
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+        float total = 0.0;
+        for(int j=0;j<n;) {
+            int block = min(n,j+64);
+            for(;j<block;j+=8) {
+                __m128 d0 = _mm_sub_ps(_mm_loadu_ps(u+j),_mm_load_ps(v+j));
+                __m128 d1 = _mm_sub_ps(_mm_loadu_ps(u+j+4),_mm_load_ps(v+j+4));
+                s0 = _mm_add_ps(s0,_mm_mul_ps(d0,d0));
+                s1 = _mm_add_ps(s1,_mm_mul_ps(d1,d1));
             }
-            int index = argmin(dists);
-            if(data.cls(index)!=data.cls(i)) total++;
+            float t[4];
+            _mm_storeu_ps(t,_mm_add_ps(s0,s1));
+            total = t[0]+t[1]+t[2]+t[3];
+            if(total>bound) return total;
         }
-        return total/double(data.nsamples());
+        return total;
+#else
+        float total = 0.0;
+        for(int j=0;j<n;) {
+            int block = min(n,j+64);
+            for(;j<block;j++) {
+                float d = u[j]-v[j];
+                total += d*d;
+            }
+            if(total>bound) return total;
+        }
+        return total;
+#endif
     }
 
-    double nearest_neighbor_error(IDataset &training,IDataset &testing) {
-        int total = 0;
-        for(int i=0;i<testing.nsamples();i++) {
-            floatarray u;
-            testing.input(u,i);
+    // Prototype vectors stored as contiguous 64-byte aligned rows,
+    // padded with zeros to a multiple of 16 floats so that the distance
+    // kernel never needs a scalar tail.
 
-            int n = training.nsamples();
-            floatarray dists(n);
-#pragma omp parallel for shared(dists)
-            for(int j=0;j<training.nsamples();j++) {
-                floatarray v;
-                training.input(v,j);
-                dists(j) = dist2squared(u,v);
+    struct ProtoMatrix {
+        float *data;
+        int nrows,ncols,stride;
+        ProtoMatrix() {
+            data = 0;
+            nrows = ncols = stride = 0;
+        }
+        ~ProtoMatrix() {
+            clear();
+        }
+        void clear() {
+            free(data);
+            data = 0;
+            nrows = ncols = stride = 0;
+        }
+        void alloc(int n,int m) {
+            clear();
+            if(n==0) return;
+            nrows = n;
+            ncols = m;
+            stride = (ncols+15)/16*16;
+            void *p = 0;
+            if(posix_memalign(&p,64,sizeof (float)*size_t(nrows)*stride))
+                throw "ProtoMatrix: out of memory";
+            data = (float*)p;
+        }
+        void put(int i,floatarray &v) {
+            CHECK_ARG(v.length()==ncols);
+            float *r = row(i);
+            for(int j=0;j<ncols;j++) r[j] = v.at1d(j);
+            for(int j=ncols;j<stride;j++) r[j] = 0;
+        }
+        void set(floatarray &a) {
+            CHECK_ARG(a.rank()==2 || a.length()==0);
+            if(a.length()==0) { clear(); return; }
+            alloc(a.dim(0),a.dim(1));
+            floatarray v;
+            for(int i=0;i<nrows;i++) {
+                rowget(v,a,i);
+                put(i,v);
+            }
+        }
+        // read the samples straight from the dataset, without going
+        // through an intermediate floatarray
+        void set(IDataset &ds) {
+            alloc(ds.nsamples(),ds.nfeatures());
+            floatarray v;
+            for(int i=0;i<nrows;i++) {
+                ds.input(v,i);
+                put(i,v);
+            }
+        }
+        float *row(int i) {
+            return data+size_t(i)*stride;
+        }
+        // copy row i back out, without the padding
+        void get(floatarray &v,int i) {
+            v.resize(ncols);
+            memcpy(&v(0),row(i),sizeof (float)*ncols);
+        }
+        // reorder the rows in place so that row i becomes the old row
+        // perm(i); this follows the cycles of the permutation, so it
+        // only needs a single row of scratch space
+        void permute(intarray &perm) {
+            CHECK_ARG(perm.length()==nrows);
+            if(nrows==0) return;
+            bytearray done(nrows);
+            fill(done,0);
+            floatarray temp(stride);
+            size_t size = sizeof (float)*stride;
+            for(int i=0;i<nrows;i++) {
+                if(done(i)) continue;
+                memcpy(&temp(0),row(i),size);
+                int j = i;
+                while(perm(j)!=i) {
+                    memcpy(row(j),row(perm(j)),size);
+                    done(j) = 1;
+                    j = perm(j);
+                }
+                memcpy(row(j),&temp(0),size);
+                done(j) = 1;
+            }
+        }
+        // copy a query vector into a zero-padded buffer
+        void pad(floatarray &q,floatarray &v) {
+            CHECK_ARG(v.length()==ncols);
+            q.resize(stride);
+            fill(q,0);
+            for(int j=0;j<ncols;j++) q(j) = v.at1d(j);
+        }
+        float dist2(floatarray &q,int i,float bound=1e30) {
+            return dist2_bounded(&q(0),row(i),stride,bound);
+        }
+    };
+
+    // Vantage point tree over the rows of a ProtoMatrix.  Building the
+    // tree reorders the rows so that every subtree is a contiguous
+    // block; perm maps row positions back to the original prototype
+    // numbers.  Searches are exact (they return the same neighbors as a
+    // linear scan, up to ties) and only read the tree, so they can run
+    // in parallel.
+
+    struct VpTree {
+        struct Node {
+            int vp;             // position of the vantage point, -1 for leaves
+            float mu;           // median distance from the vantage point
+            int inside,outside; // children (d<=mu, d>=mu)
+            int start,end;      // range of positions for leaves
+        };
+        enum { leafsize=8 };
+        ProtoMatrix *protos;
+        narray<Node> nodes;
+        intarray perm;
+
+        VpTree() {
+            protos = 0;
+        }
+        void clear() {
+            protos = 0;
+            nodes.dealloc();
+            perm.dealloc();
+        }
+        void build(ProtoMatrix &m) {
+            protos = &m;
+            nodes.clear();
+            perm.resize(m.nrows);
+            for(int i=0;i<perm.length();i++) perm(i) = i;
+            if(m.nrows>0) build(0,m.nrows);
+            m.permute(perm);
+        }
+        // inverse of perm: where(id) is the row position of prototype id
+        void positions(intarray &where) {
+            where.resize(perm.length());
+            for(int i=0;i<perm.length();i++) where(perm(i)) = i;
+        }
+        float dist(int i,int j) {
+            return sqrt(dist2_bounded(protos->row(i),protos->row(j),protos->stride,1e30));
+        }
+        int build(int lo,int hi) {
+            int self = nodes.length();
+            Node node;
+            node.vp = -1;
+            node.mu = 0;
+            node.inside = node.outside = -1;
+            node.start = lo;
+            node.end = hi;
+            nodes.push(node);
+            if(hi-lo<=leafsize) return self;
+            swap(perm(lo),perm(lo+lrand48()%(hi-lo)));
+            int vp = perm(lo);
+            intarray index;
+            floatarray dists(hi-lo-1);
+            for(int i=lo+1;i<hi;i++) dists(i-lo-1) = dist(vp,perm(i));
+            quicksort(index,dists);
+            intarray rest(index.length());
+            for(int i=0;i<index.length();i++) rest(i) = perm(lo+1+index(i));
+            for(int i=0;i<rest.length();i++) perm(lo+1+i) = rest(i);
+            int h = index.length()/2;
+            float mu = dists(index(h));
+            int inside = build(lo+1,lo+1+h);
+            int outside = build(lo+1+h,hi);
+            Node &n = nodes(self);
+            n.vp = lo;
+            n.mu = mu;
+            n.inside = inside;
+            n.outside = outside;
+            return self;
+        }
+        // search radius implied by the current n-best list
+        static float radius(NBest &nbest) {
+            if(nbest.length()<nbest.n) return 1e30;
+            return -nbest.values[nbest.n-1];
+        }
+        static float bound2(float r) {
+            return r<1e15 ? r*r : 1e30;
+        }
+        void consider(NBest &nbest,floatarray &q,int pos,int exclude,bool skipzero) {
+            int id = perm(pos);
+            if(id==exclude) return;
+            float tau = radius(nbest);
+            float d = sqrt(protos->dist2(q,pos,bound2(tau)));
+            if(skipzero && d<1e-6) return;
+            if(d<tau) nbest.add(id,-d);
+        }
+        void search(NBest &nbest,floatarray &q,int exclude=-1,bool skipzero=false) {
+            if(nodes.length()>0) search(0,nbest,q,exclude,skipzero);
+        }
+        void search(int self,NBest &nbest,floatarray &q,int exclude,bool skipzero) {
+            Node &n = nodes(self);
+            if(n.vp<0) {
+                for(int i=n.start;i<n.end;i++)
+                    consider(nbest,q,i,exclude,skipzero);
+                return;
+            }
+            // past mu+tau only the outside can contain neighbors
+            float tau = radius(nbest);
+            float d = sqrt(protos->dist2(q,n.vp,bound2(n.mu+tau)));
+            if(d>n.mu+tau) {
+                search(n.outside,nbest,q,exclude,skipzero);
+                return;
+            }
+            if(perm(n.vp)!=exclude && !(skipzero && d<1e-6) && d<tau)
+                nbest.add(perm(n.vp),-d);
+            if(d<n.mu) {
+                if(d-radius(nbest)<=n.mu) search(n.inside,nbest,q,exclude,skipzero);
+                if(d+radius(nbest)>=n.mu) search(n.outside,nbest,q,exclude,skipzero);
+            } else {
+                if(d+radius(nbest)>=n.mu) search(n.outside,nbest,q,exclude,skipzero);
+                if(d-radius(nbest)<=n.mu) search(n.inside,nbest,q,exclude,skipzero);
             }
-            int index = argmin(dists);
-            if(training.cls(index)!=testing.cls(i)) total++;
         }
-        return total/double(testing.nsamples());
+    };
+
+    void dataset_classes(intarray &classes,IDataset &ds) {
+        classes.resize(ds.nsamples());
+        for(int i=0;i<ds.nsamples();i++)
+            classes(i) = ds.cls(i);
+    }
+
+    // the samples are only held once, in the ProtoMatrix, and the
+    // queries are taken from its rows
+
+    double nearest_neighbor_error(IDataset &data,int ntrials=1000) {
+        intarray classes;
+        dataset_classes(classes,data);
+        ProtoMatrix protos;
+        protos.set(data);
+        VpTree tree;
+        tree.build(protos);
+        intarray trials(data.nsamples());
+        for(int i=0;i<trials.length();i++) trials(i) = i;
+        shuffle(trials);
+        ntrials = min(data.nsamples(),ntrials);
+        if(ntrials<1) return 0.0;
+        intarray where;
+        tree.positions(where);
+        int total = 0;
+#pragma omp parallel for reduction(+:total) schedule(dynamic,16)
+        for(int t=0;t<ntrials;t++) {
+            int i = trials(t);
+            int pos = where(i);
+            floatarray q(protos.stride);
+            memcpy(&q(0),protos.row(pos),sizeof (float)*protos.stride);
+            NBest nbest(1);
+            tree.search(nbest,q,i);
+            if(nbest.length()<1 || classes(nbest[0])!=classes(i)) total++;
+        }
+        return total/double(ntrials);
+    }
+
+    double nearest_neighbor_error(IDataset &training,IDataset &testing) {
+        intarray classes,tclasses;
+        dataset_classes(classes,training);
+        dataset_classes(tclasses,testing);
+        ProtoMatrix protos,tests;
+        protos.set(training);
+        tests.set(testing);
+        VpTree tree;
+        tree.build(protos);
+        if(tests.nrows<1) return 0.0;
+        CHECK_ARG(tests.stride==protos.stride);
+        int total = 0;
+#pragma omp parallel for reduction(+:total) schedule(dynamic,16)
+        for(int i=0;i<tests.nrows;i++) {
+            floatarray q(tests.stride);
+            memcpy(&q(0),tests.row(i),sizeof (float)*tests.stride);
+            NBest nbest(1);
+            tree.search(nbest,q);
+            if(nbest.length()<1 || classes(nbest[0])!=tclasses(i)) total++;
+        }
+        return total/double(tests.nrows);
     }
 
     float estimate_errors(IModel &classifier,IDataset &ds,int n=1000000) {
@@ -154,6 +430,35 @@ namespace glinerec {
         return errors/float(count);
     }
 
+    // like estimate_errors, but classifies the samples in batches with
+    // batchOutputs; optionally returns the time spent in the classifier
+
+    float estimate_errors_batch(IModel &classifier,IDataset &ds,double *seconds) {
+        enum { batch=1024 };
+        int errors = 0;
+        int count = 0;
+        double total = 0.0;
+        for(int start=0;start<ds.nsamples();start+=batch) {
+            int end = min(start+batch,ds.nsamples());
+            floatarray inputs(end-start,ds.nfeatures()),outputs,costs,v;
+            for(int i=start;i<end;i++) {
+                ds.input(v,i);
+                rowput(inputs,i-start,v);
+            }
+            double t = now();
+            classifier.batchOutputs(outputs,costs,inputs);
+            total += now()-t;
+            for(int i=start;i<end;i++) {
+                int cls = ds.cls(i);
+                if(cls==-1) continue;
+                count++;
+                if(rowargmax(outputs,i-start)!=cls) errors++;
+            }
+        }
+        if(seconds) *seconds = total;
+        return errors/float(max(count,1));
+    }
+
     float estimate_errors_sampled(IModel &classifier,floatarray &data,intarray &classes,int n=1000) {
         int errors = 0;
         for(int i=0;i<n;i++) {
@@ -309,17 +614,32 @@ namespace glinerec {
 
     // param_int show_knn("show_knn",0,"show knn matches for debugging");
 
+    // While prototypes are being added they are collected in vectors;
+    // updateModel() moves them into the aligned ProtoMatrix (reordered
+    // by the search tree, where maps prototype numbers to rows) and
+    // releases vectors, so only one copy is kept at any time.
+
     struct KnnClassifier : IModel {
         int ncls;
         floatarray vectors;
         intarray classes;
         int ndim;
+        int k;
+        iucstring index;
+        ProtoMatrix protos;
+        VpTree tree;
+        intarray where;
+        bool stale;
 
         KnnClassifier() {
             ncls = 0;
             ndim = -1;
             ncls = 0;
+            stale = true;
             pdef("k",1,"number of nearest neighbors");
+            pdef("index","vptree","nearest neighbor index (none, vptree)");
+            pbind("k",k);
+            pbind("index",index);
         }
         const char *name() {
             return "knn";
@@ -327,51 +647,107 @@ namespace glinerec {
         void info(int depth,FILE *stream) {
             iprintf(stream,depth,"k-NN Classifier\n");
             pprint(stream,depth);
-            int k = pgetf("k");
+            pupdate();
             iprintf(stream,depth,"k=%d ndim=%d nclasses=%d\n",k,ndim,nclasses());
         }
         void clear() {
             ncls = 0;
+            ndim = -1;
             vectors.clear();
             classes.clear();
+            tree.clear();
+            protos.clear();
+            where.clear();
+            stale = true;
         }
         void dealloc() {
-            ncls = 0;
+            clear();
             vectors.dealloc();
             classes.dealloc();
+            where.dealloc();
         }
         int nfeatures() {
-            return vectors.dim(1);
+            return max(ndim,0);
         }
         int nclasses() {
             return max(classes)+1;
         }
         float complexity() {
-            return vectors.dim(0);
+            return classes.length();
         }
         int nprotos() {
-            return vectors.dim(0);
+            return classes.length();
+        }
+        int position(int i) {
+            return where.length()>0 ? where(i) : i;
         }
         void getproto(floatarray &v,int &c,int i) {
-            rowget(v,vectors,i);
+            if(stale) rowget(v,vectors,i);
+            else protos.get(v,position(i));
             c = classes(i);
         }
+        // move the prototypes back into vectors so that more can be added
+        void thaw() {
+            if(stale) return;
+            if(protos.nrows>0) vectors.resize(protos.nrows,ndim);
+            else vectors.clear();
+            floatarray v;
+            for(int i=0;i<protos.nrows;i++) {
+                protos.get(v,position(i));
+                rowput(vectors,i,v);
+            }
+            protos.clear();
+            tree.clear();
+            where.clear();
+            stale = true;
+        }
         void save(FILE *stream) {
             psave(stream);
-            narray_write(stream,vectors);
+            if(stale) {
+                narray_write(stream,vectors);
+            } else {
+                // same format as narray_write, one row at a time
+                unsigned magic = magic_number<float>();
+                CHECK(fwrite(&magic,sizeof magic,1,stream)==1);
+                int dims[4] = {protos.nrows,protos.nrows>0?ndim:0,0,0};
+                CHECK(fwrite(dims,sizeof dims[0],4,stream)==4);
+                for(int i=0;i<protos.nrows;i++)
+                    CHECK(fwrite(protos.row(position(i)),sizeof (float),ndim,stream)==size_t(ndim));
+            }
             narray_write(stream,classes);
         }
         void load(FILE *stream) {
             pload(stream);
+            clear();
             narray_read(stream,vectors);
             narray_read(stream,classes);
+            ndim = vectors.length()>0 ? vectors.dim(1) : -1;
+            ncls = classes.length()>0 ? max(classes)+1 : 0;
+            updateModel();
         }
         void train(IDataset &ds) {
-            floatarray v;
-            for(int i=0;i<ds.nsamples();i++) {
-                ds.input(v,i);
-                add(v,ds.cls(i));
+            if(classes.length()>0 || ds.nsamples()==0) {
+                floatarray v;
+                for(int i=0;i<ds.nsamples();i++) {
+                    ds.input(v,i);
+                    add(v,ds.cls(i));
+                }
+                updateModel();
+                return;
+            }
+            // nothing to merge with, so read the samples directly
+            // into the prototype matrix
+            pupdate();
+            protos.set(ds);
+            ndim = protos.ncols;
+            for(int i=0;i<protos.nrows;i++) {
+                float *r = protos.row(i);
+                for(int j=0;j<ndim;j++) CHECK(r[j]>-100 && r[j]<100);
             }
+            dataset_classes(classes,ds);
+            CHECK(min(classes)>=0);
+            ncls = max(classes)+1;
+            buildIndex();
         }
         void add(floatarray &v,int c) {
             CHECK(min(v)>-100 && max(v)<100);
@@ -380,23 +756,64 @@ namespace glinerec {
             CHECK(c>=0);
             if(ndim<0) ndim = v.dim(0);
             else CHECK(v.dim(0)==ndim);
+            thaw();
             rowpush(vectors,v);
             classes.push(c);
             if(c>=ncls) ncls = c+1;
             ASSERT(vectors.dim(0)==classes.length());
         }
+        // move the prototypes into aligned storage and (re)build the
+        // search index; add() undoes both
         void updateModel() {
+            pupdate();
+            thaw();
+            protos.set(vectors);
+            vectors.dealloc();
+            buildIndex();
+        }
+        void buildIndex() {
+            tree.clear();
+            where.clear();
+            if(!strcmp(index,"vptree")) {
+                tree.build(protos);
+                tree.positions(where);
+            } else if(strcmp(index,"none")) {
+                throwf("%s: unknown knn index",(const char*)index);
+            }
+            stale = false;
+        }
+        // find the k nearest prototypes, skipping the query itself if
+        // it is one of them
+        void neighbors(NBest &nbest,floatarray &v,int exclude=-1,bool skipzero=true) {
+            if(stale) {
+                for(int i=0;i<vectors.dim(0);i++) {
+                    if(i==exclude) continue;
+                    double d = rowdist_euclidean(vectors,i,v);
+                    if(skipzero && fabs(d)<1e-6) continue; // training vectors...
+                    nbest.add(i,-d);
+                }
+                return;
+            }
+            floatarray q;
+            protos.pad(q,v);
+            if(tree.nodes.length()>0) {
+                tree.search(nbest,q,exclude,skipzero);
+                return;
+            }
+            for(int i=0;i<protos.nrows;i++) {
+                if(i==exclude) continue;
+                float tau = VpTree::radius(nbest);
+                double d = sqrt(protos.dist2(q,i,VpTree::bound2(tau)));
+                if(skipzero && d<1e-6) continue;
+                if(d<tau) nbest.add(i,-d);
+            }
         }
         float outputs(floatarray &result,floatarray &v) {
-            int k = pgetf("k");
+            pupdate();
             CHECK(min(v)>-100 && max(v)<100);
             CHECK(v.dim(0)==ndim);
             NBest nbest(k);
-            for(int i=0;i<vectors.dim(0);i++) {
-                double d = rowdist_euclidean(vectors,i,v);
-                if(fabs(d)<1e-6) continue; // training vectors...
-                nbest.add(i,-d);
-            }
+            neighbors(nbest,v);
             result.resize(ncls);
             fill(result,0);
             for(int i=0;i<nbest.length();i++) {
@@ -404,30 +821,32 @@ namespace glinerec {
             }
             result /= sum(result);
 
-            int r = sqrt(ndim);
-            floatarray temp(r,r);
-            for(int i=0;i<ndim;i++) temp.at1d(i) = vectors(nbest[0],i);
-            dshown(temp,"d");
-            for(int i=0;i<ndim;i++) temp.at1d(i) = v.at1d(i);
-            dshown(temp,"c");
+            if(dactive()) {
+                int r = sqrt(ndim);
+                floatarray temp(r,r),p;
+                int c;
+                getproto(p,c,nbest[0]);
+                for(int i=0;i<ndim;i++) temp.at1d(i) = p(i);
+                dshown(temp,"d");
+                for(int i=0;i<ndim;i++) temp.at1d(i) = v.at1d(i);
+                dshown(temp,"c");
+            }
             return nbest.value(0);
         }
+        // leave-one-out error of the 1-NN rule on the prototypes
         float crossValidatedError() {
+            if(stale) updateModel();
+            int n = classes.length();
             int errs = 0;
-            for(int i=0;i<vectors.dim(0);i++) {
+#pragma omp parallel for reduction(+:errs) schedule(dynamic,16)
+            for(int i=0;i<n;i++) {
                 NBest nbest(1);
                 floatarray v;
-                rowget(v,vectors,i);
-#pragma omp parallel for
-                for(int j=0;j<vectors.dim(0);j++) {
-                    if(i==j) continue;
-                    double d = rowdist_euclidean(vectors,j,v);
-                    nbest.add(j,-d);
-                }
-                int c = classes(nbest[0]);
-                if(c!=classes(i)) errs++;
+                protos.get(v,position(i));
+                neighbors(nbest,v,i,false);
+                if(nbest.length()<1 || classes(nbest[0])!=classes(i)) errs++;
             }
-            return errs/float(vectors.dim(0));
+            return errs/float(n);
         }
     };
 
@@ -461,6 +880,60 @@ namespace glinerec {
             counts16[(v>>32)&0xffff]+counts16[(v>>48)&0xffff];
     }
 
+    // Hamming distance kernels over rows of n words.  They return as
+    // soon as the partial distance exceeds bound (checked once per
+    // 64 byte block), so the result is only exact if it is <= bound.
+
+    inline int hamming_table(const uint64 *p,const uint64 *q,int n,int bound) {
+        int total = 0;
+        for(int i=0;i<n;) {
+            int block = min(n,i+8);
+            for(;i<block;i++) total += bitcount(p[i]^q[i]);
+            if(total>bound) return total;
+        }
+        return total;
+    }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    inline int popcnt64(uint64 v) {
+        uint64 r;
+        asm("popcntq %1,%0" : "=r"(r) : "r"(v));
+        return int(r);
+    }
+
+    inline int hamming_popcnt(const uint64 *p,const uint64 *q,int n,int bound) {
+        int total = 0;
+        int i = 0;
+        // four independent sums per cache line to keep popcnt busy
+        for(;i+8<=n;i+=8) {
+            int t0 = popcnt64(p[i]^q[i]) + popcnt64(p[i+4]^q[i+4]);
+            int t1 = popcnt64(p[i+1]^q[i+1]) + popcnt64(p[i+5]^q[i+5]);
+            int t2 = popcnt64(p[i+2]^q[i+2]) + popcnt64(p[i+6]^q[i+6]);
+            int t3 = popcnt64(p[i+3]^q[i+3]) + popcnt64(p[i+7]^q[i+7]);
+            total += (t0+t1)+(t2+t3);
+            if(total>bound) return total;
+        }
+        for(;i<n;i++) total += popcnt64(p[i]^q[i]);
+        return total;
+    }
+
+    bool have_popcnt() {
+        unsigned a=1,b,c,d;
+        asm("cpuid" : "+a"(a),"=b"(b),"=c"(c),"=d"(d));
+        return (c>>23)&1;
+    }
+#else
+    inline int hamming_popcnt(const uint64 *p,const uint64 *q,int n,int bound) {
+        return hamming_table(p,q,n,bound);
+    }
+    bool have_popcnt() {
+        return false;
+    }
+#endif
+
+    typedef int (*hamming_fun)(const uint64 *,const uint64 *,int,int);
+    hamming_fun hamming = have_popcnt() ? hamming_popcnt : hamming_table;
+
     struct bitvec {
         enum { bpw=64 };
         int nwords;
@@ -542,15 +1015,70 @@ namespace glinerec {
             return total;
         }
         int dist(bitvec &other) {
-            int total = 0;
-            int n = min(nwords,other.nwords);
-            uint64 *p = data, *q = other.data;
-            for(int i=0;i<n;i++)
-                total += bitcount((*p++) ^ (*q++));
-            return total;
+            return hamming(data,other.data,min(nwords,other.nwords),INT_MAX);
         }
     };
 
+    // Bit vectors packed into one 64-byte aligned matrix; each row is
+    // padded with zero words to a whole number of cache lines.
+
+    struct BitMatrix {
+        uint64 *data;
+        int nrows,nwords,stride;
+        BitMatrix() {
+            data = 0;
+            nrows = nwords = stride = 0;
+        }
+        ~BitMatrix() {
+            clear();
+        }
+        void clear() {
+            free(data);
+            data = 0;
+            nrows = nwords = stride = 0;
+        }
+        void set(objlist<bitvec> &rows) {
+            clear();
+            if(rows.length()==0) return;
+            nrows = rows.length();
+            nwords = rows[0].nwords;
+            stride = (nwords+7)/8*8;
+            void *p = 0;
+            if(posix_memalign(&p,64,sizeof (uint64)*nrows*stride))
+                throw "BitMatrix: out of memory";
+            data = (uint64*)p;
+            for(int i=0;i<nrows;i++) {
+                CHECK(rows[i].nwords==nwords);
+                uint64 *r = row(i);
+                memcpy(r,rows[i].data,nwords * sizeof *r);
+                for(int j=nwords;j<stride;j++) r[j] = 0;
+            }
+        }
+        uint64 *row(int i) {
+            return data+i*stride;
+        }
+    };
+
+    // Find the k nearest rows to the padded query q, abandoning each
+    // row as soon as it can't make it into the k best.  Like
+    // knn_posterior, the first of several equally distant rows wins.
+
+    template <int (*H)(const uint64 *,const uint64 *,int,int)>
+    void bitmatrix_knn(NBest &nbest,BitMatrix &m,const uint64 *q) {
+        int bound = INT_MAX;
+        for(int j=0;j<m.nrows;j++) {
+            int d = H(m.row(j),q,m.stride,bound);
+            if(d>bound) continue;
+            nbest.add(j,-d);
+            if(nbest.length()==nbest.n) bound = int(-nbest.values[nbest.n-1]);
+        }
+    }
+
+    void bitmatrix_knn(NBest &nbest,BitMatrix &m,const uint64 *q) {
+        if(hamming==hamming_popcnt) bitmatrix_knn<hamming_popcnt>(nbest,m,q);
+        else bitmatrix_knn<hamming_table>(nbest,m,q);
+    }
+
     void bitvec_write(FILE *stream,bitvec &v) {
         magic_write(stream,"BV");
         CHECK(unsigned(v.nwords)<1000000);
@@ -582,9 +1110,14 @@ namespace glinerec {
         int nfeat;
         objlist<bitvec> prototypes;
         intarray classes;
+        int k;
+        BitMatrix packed;
+        bool stale;
         BitNN() {
             pdef("k",1,"number of nearest neighbors");
+            pbind("k",k);
             nfeat = 0;
+            stale = true;
         }
         const char *name() {
             return "bit";
@@ -592,7 +1125,7 @@ namespace glinerec {
         void info(int depth,FILE *stream) {
             iprintf(stream,depth,"BitNN\n");
             pprint(stream,depth);
-            int k = pgetf("k");
+            pupdate();
             iprintf(stream,depth,"nfeat %d nprotos %d nclasses %d k %d\n",
                     nfeat,prototypes.length(),max(classes)+1,k);
         }
@@ -610,6 +1143,7 @@ namespace glinerec {
             for(int i=0;i<classes.length();i++) {
                 bitvec_read(stream,prototypes[i]);
             }
+            updateModel();
         }
         int nfeatures() {
             return nfeat;
@@ -626,19 +1160,37 @@ namespace glinerec {
                 ds.input(v,i);
                 add(v,ds.cls(i));
             }
+            updateModel();
         }
         void add(floatarray &v,int c) {
             if(nfeat==0) nfeat = v.length();
             else CHECK(nfeat==v.length());
             prototypes.push().set(v);
             classes.push(c);
+            stale = true;
         }
         void updateModel() {
+            packed.set(prototypes);
+            stale = false;
         }
         float outputs(floatarray &p,floatarray &v) {
-            int k = pgetf("k");
+            pupdate();
             bitvec bv;
             bv.set(v);
+            if(!stale && packed.nrows>0) {
+                NBest nbest(k);
+                CHECK(bv.nwords==packed.nwords);
+                narray<uint64> q(packed.stride);
+                q.fill(0);
+                memcpy(&q(0),bv.data,bv.nwords * sizeof *bv.data);
+                bitmatrix_knn(nbest,packed,&q(0));
+                p.resize(max(classes)+1);
+                p.fill(0);
+                for(int i=0;i<nbest.length();i++)
+                    p(classes(nbest[i]))++;
+                p /= sum(p);
+                return -nbest.value(0)/10.0;
+            }
             int n = prototypes.length();
             floatarray dists(n);
 #pragma omp parallel for
@@ -763,6 +1315,306 @@ namespace glinerec {
         }
     }
 
+    ////////////////////////////////////////////////////////////////
+    // batch kernels for evaluating many vectors at once
+    ////////////////////////////////////////////////////////////////
+
+    // four dot products of x with the rows w0...w3 at once
+
+    inline void dot4(float *out,const float *x,const float *w0,const float *w1,
+                     const float *w2,const float *w3,int n) {
+        int k = 0;
+#ifdef __SSE2__
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+        __m128 s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+        for(;k+4<=n;k+=4) {
+            __m128 xv = _mm_loadu_ps(x+k);
+            s0 = _mm_add_ps(s0,_mm_mul_ps(xv,_mm_loadu_ps(w0+k)));
+            s1 = _mm_add_ps(s1,_mm_mul_ps(xv,_mm_loadu_ps(w1+k)));
+            s2 = _mm_add_ps(s2,_mm_mul_ps(xv,_mm_loadu_ps(w2+k)));
+            s3 = _mm_add_ps(s3,_mm_mul_ps(xv,_mm_loadu_ps(w3+k)));
+        }
+        // transpose so that each lane holds the sum for one row
+        _MM_TRANSPOSE4_PS(s0,s1,s2,s3);
+        __m128 total = _mm_add_ps(_mm_add_ps(s0,s1),_mm_add_ps(s2,s3));
+        _mm_storeu_ps(out,_mm_add_ps(_mm_loadu_ps(out),total));
+#endif
+        for(;k<n;k++) {
+            out[0] += x[k]*w0[k];
+            out[1] += x[k]*w1[k];
+            out[2] += x[k]*w2[k];
+            out[3] += x[k]*w3[k];
+        }
+    }
+
+    inline void dot1(float *out,const float *x,const float *w,int n) {
+        int k = 0;
+        float total = 0.0;
+#ifdef __SSE2__
+        __m128 s = _mm_setzero_ps();
+        for(;k+4<=n;k+=4)
+            s = _mm_add_ps(s,_mm_mul_ps(_mm_loadu_ps(x+k),_mm_loadu_ps(w+k)));
+        float temp[4];
+        _mm_storeu_ps(temp,s);
+        total = (temp[0]+temp[1])+(temp[2]+temp[3]);
+#endif
+        for(;k<n;k++) total += x[k]*w[k];
+        *out += total;
+    }
+
+    // out = a * transpose(b) for row-major a (n x d) and b (m x d); this
+    // is the product of a batch of input vectors with a weight matrix,
+    // and both operands are traversed along their rows.  The loops are
+    // blocked so that a block of b stays in cache while it is applied
+    // to a block of rows of a.
+
+    void matmul_abt(floatarray &out,floatarray &a,floatarray &b) {
+        enum { bi=16, bj=64, bk=256 };
+        int n = a.dim(0), m = b.dim(0), d = a.dim(1);
+        CHECK(b.dim(1)==d);
+        out.resize(n,m);
+        out.fill(0);
+        if(n==0 || m==0 || d==0) return;
+        float *ap = &a.unsafe_at(0,0);
+        float *bp = &b.unsafe_at(0,0);
+        float *op = &out.unsafe_at(0,0);
+#pragma omp parallel for schedule(dynamic,1)
+        for(int ii=0;ii<n;ii+=bi) {
+            int ie = min(ii+bi,n);
+            for(int kk=0;kk<d;kk+=bk) {
+                int kn = min(bk,d-kk);
+                for(int jj=0;jj<m;jj+=bj) {
+                    int je = min(jj+bj,m);
+                    for(int i=ii;i<ie;i++) {
+                        const float *x = ap+i*d+kk;
+                        float *o = op+i*m;
+                        int j = jj;
+                        for(;j+4<=je;j+=4)
+                            dot4(o+j,x,bp+j*d+kk,bp+(j+1)*d+kk,
+                                 bp+(j+2)*d+kk,bp+(j+3)*d+kk,kn);
+                        for(;j<je;j++)
+                            dot1(o+j,x,bp+j*d+kk,kn);
+                    }
+                }
+            }
+        }
+    }
+
+#ifdef __SSE2__
+    // exp(x) for four values at once, x in [-88,88]; uses the range
+    // reduction and polynomial from the Cephes library (relative error
+    // around 1e-7)
+
+    inline __m128 exp4(__m128 x) {
+        const __m128 log2e = _mm_set1_ps(1.44269504088896341f);
+        const __m128 c1 = _mm_set1_ps(0.693359375f);
+        const __m128 c2 = _mm_set1_ps(-2.12194440e-4f);
+        __m128 t = _mm_add_ps(_mm_mul_ps(x,log2e),_mm_set1_ps(0.5f));
+        // floor(t) using truncation and a correction for negative values
+        __m128i ti = _mm_cvttps_epi32(t);
+        __m128 fi = _mm_cvtepi32_ps(ti);
+        __m128 mask = _mm_cmpgt_ps(fi,t);
+        fi = _mm_sub_ps(fi,_mm_and_ps(mask,_mm_set1_ps(1.0f)));
+        ti = _mm_cvttps_epi32(fi);
+        x = _mm_sub_ps(x,_mm_mul_ps(fi,c1));
+        x = _mm_sub_ps(x,_mm_mul_ps(fi,c2));
+        __m128 z = _mm_mul_ps(x,x);
+        __m128 y = _mm_set1_ps(1.9875691500e-4f);
+        y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(1.3981999507e-3f));
+        y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(8.3334519073e-3f));
+        y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(4.1665795894e-2f));
+        y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(1.6666665459e-1f));
+        y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(5.0000001201e-1f));
+        y = _mm_add_ps(_mm_mul_ps(y,z),x);
+        y = _mm_add_ps(y,_mm_set1_ps(1.0f));
+        // multiply by 2^n by constructing the exponent bits
+        __m128i e = _mm_slli_epi32(_mm_add_epi32(ti,_mm_set1_epi32(127)),23);
+        return _mm_mul_ps(y,_mm_castsi128_ps(e));
+    }
+#endif
+
+    // add a bias vector to each row of a and apply the sigmoid
+    // function, with the same clipping as sigmoid() below
+
+    void add_sigmoid_rows(floatarray &a,floatarray &bias) {
+        int n = a.dim(0), m = a.dim(1);
+        CHECK(bias.length()==m);
+        float *bp = &bias.unsafe_at(0);
+#pragma omp parallel for
+        for(int i=0;i<n;i++) {
+            float *p = &a.unsafe_at(i,0);
+            int j = 0;
+#ifdef __SSE2__
+            const __m128 lo = _mm_set1_ps(-20.0f), hi = _mm_set1_ps(20.0f);
+            const __m128 one = _mm_set1_ps(1.0f);
+            for(;j+4<=m;j+=4) {
+                __m128 x = _mm_add_ps(_mm_loadu_ps(p+j),_mm_loadu_ps(bp+j));
+                x = _mm_min_ps(_mm_max_ps(x,lo),hi);
+                __m128 e = exp4(_mm_sub_ps(_mm_setzero_ps(),x));
+                _mm_storeu_ps(p+j,_mm_div_ps(one,_mm_add_ps(one,e)));
+            }
+#endif
+            for(;j<m;j++) {
+                float x = min(max(p[j]+bp[j],-20.0f),20.0f);
+                p[j] = 1.0/(1.0+exp(-x));
+            }
+        }
+    }
+
+    // out = transpose(a) for a rank 2 array
+
+    void transpose_to(floatarray &out,floatarray &a) {
+        int n = a.dim(0), m = a.dim(1);
+        out.resize(m,n);
+        for(int i=0;i<n;i++)
+            for(int j=0;j<m;j++)
+                out.unsafe_at(j,i) = a.unsafe_at(i,j);
+    }
+
+    // kernels for quantized networks; a quantized matrix holds integers
+    // in [-127,127], one row per vector, padded with zeros to a multiple
+    // of 8 columns, together with one float scale per row.  Values are
+    // kept as int16 in memory so that they can go straight into
+    // _mm_madd_epi16; on disk they take a byte each.
+
+    typedef narray<short> shortarray;
+
+    // four dot products of x with the rows w0...w3 (n a multiple of 8)
+
+    inline void idot4(int *out,const short *x,const short *w0,const short *w1,
+                      const short *w2,const short *w3,int n) {
+#ifdef __SSE2__
+        __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+        __m128i s2 = _mm_setzero_si128(), s3 = _mm_setzero_si128();
+        for(int k=0;k<n;k+=8) {
+            __m128i xv = _mm_loadu_si128((const __m128i*)(x+k));
+            s0 = _mm_add_epi32(s0,_mm_madd_epi16(xv,_mm_loadu_si128((const __m128i*)(w0+k))));
+            s1 = _mm_add_epi32(s1,_mm_madd_epi16(xv,_mm_loadu_si128((const __m128i*)(w1+k))));
+            s2 = _mm_add_epi32(s2,_mm_madd_epi16(xv,_mm_loadu_si128((const __m128i*)(w2+k))));
+            s3 = _mm_add_epi32(s3,_mm_madd_epi16(xv,_mm_loadu_si128((const __m128i*)(w3+k))));
+        }
+        // transpose so that each lane holds the sum for one row
+        __m128i t0 = _mm_unpacklo_epi32(s0,s1), t1 = _mm_unpackhi_epi32(s0,s1);
+        __m128i t2 = _mm_unpacklo_epi32(s2,s3), t3 = _mm_unpackhi_epi32(s2,s3);
+        __m128i total = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t0,t2),_mm_unpackhi_epi64(t0,t2)),
+                                      _mm_add_epi32(_mm_unpacklo_epi64(t1,t3),_mm_unpackhi_epi64(t1,t3)));
+        _mm_storeu_si128((__m128i*)out,total);
+#else
+        const short *w[4] = {w0,w1,w2,w3};
+        for(int r=0;r<4;r++) {
+            int total = 0;
+            for(int k=0;k<n;k++) total += x[k]*w[r][k];
+            out[r] = total;
+        }
+#endif
+    }
+
+    // quantize each row of a with a scale that maps its largest
+    // absolute value to 127
+
+    void quantize_rows(shortarray &q,floatarray &scales,floatarray &a) {
+        CHECK_ARG(a.rank()==2);
+        int n = a.dim(0), d = a.dim(1);
+        int stride = (d+7)/8*8;
+        q.resize(n,stride);
+        q.fill(0);
+        scales.resize(n);
+#pragma omp parallel for
+        for(int i=0;i<n;i++) {
+            const float *p = &a.unsafe_at(i,0);
+            short *o = &q.unsafe_at(i,0);
+            int j = 0;
+            float m = 0.0;
+#ifdef __SSE2__
+            const __m128 sign = _mm_set1_ps(-0.0f);
+            __m128 mv = _mm_setzero_ps();
+            for(;j+4<=d;j+=4)
+                mv = _mm_max_ps(mv,_mm_andnot_ps(sign,_mm_loadu_ps(p+j)));
+            float temp[4];
+            _mm_storeu_ps(temp,mv);
+            m = max(max(temp[0],temp[1]),max(temp[2],temp[3]));
+#endif
+            for(;j<d;j++) m = max(m,fabsf(p[j]));
+            float s = m>0 ? m/127.0 : 1.0;
+            float r = 1.0/s;
+            scales.unsafe_at(i) = s;
+            j = 0;
+#ifdef __SSE2__
+            // round to nearest and saturate to int16; |p[j]*r|<=127
+            const __m128 rv = _mm_set1_ps(r);
+            for(;j+8<=d;j+=8) {
+                __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(p+j),rv));
+                __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(p+j+4),rv));
+                _mm_storeu_si128((__m128i*)(o+j),_mm_packs_epi32(lo,hi));
+            }
+#endif
+            for(;j<d;j++) {
+                float v = p[j]*r;
+                o[j] = short(max(-127,min(127,int(v>=0 ? v+0.5f : v-0.5f))));
+            }
+        }
+    }
+
+    // conversion between the in-memory and the on-disk representation
+
+    void pack_int8(bytearray &out,shortarray &q) {
+        out.resize(q.dim(0),q.dim(1));
+        for(int i=0;i<q.length1d();i++)
+            out.at1d(i) = (unsigned char)(signed char)q.at1d(i);
+    }
+
+    void unpack_int8(shortarray &q,bytearray &in) {
+        q.resize(in.dim(0),in.dim(1));
+        for(int i=0;i<in.length1d();i++)
+            q.at1d(i) = (signed char)in.at1d(i);
+    }
+
+    // out = a * transpose(b) for quantized a (n x d) and b (m x d),
+    // blocked like matmul_abt; the integer dot products are accumulated
+    // per block of rows and scaled at the end
+
+    void int_matmul_abt(floatarray &out,shortarray &a,floatarray &sa,shortarray &b,floatarray &sb) {
+        enum { bi=16, bj=64, bk=512 };
+        int n = a.dim(0), m = b.dim(0), d = a.dim(1);
+        CHECK(b.dim(1)==d && d%8==0);
+        CHECK(sa.length()==n && sb.length()==m);
+        out.resize(n,m);
+        if(n==0 || m==0) return;
+        int m4 = (m+3)/4*4;
+        const short *ap = &a.unsafe_at(0,0);
+        const short *bp = &b.unsafe_at(0,0);
+#pragma omp parallel for schedule(dynamic,1)
+        for(int ii=0;ii<n;ii+=bi) {
+            int ie = min(ii+bi,n);
+            intarray acc(bi,m4);
+            acc.fill(0);
+            for(int kk=0;kk<d;kk+=bk) {
+                int kn = min(bk,d-kk);
+                for(int jj=0;jj<m;jj+=bj) {
+                    int je = min(jj+bj,m);
+                    for(int i=ii;i<ie;i++) {
+                        const short *x = ap+i*d+kk;
+                        int *o = &acc.unsafe_at(i-ii,0);
+                        for(int j=jj;j<je;j+=4) {
+                            // past the last row, repeat it; the extra
+                            // sums land in the padding of acc
+                            const short *r[4];
+                            for(int k=0;k<4;k++) r[k] = bp+min(j+k,m-1)*d+kk;
+                            int dots[4];
+                            idot4(dots,x,r[0],r[1],r[2],r[3],kn);
+                            for(int k=0;k<4;k++) o[j+k] += dots[k];
+                        }
+                    }
+                }
+            }
+            for(int i=ii;i<ie;i++) {
+                float s = sa.unsafe_at(i);
+                for(int j=0;j<m;j++)
+                    out.unsafe_at(i,j) = s * sb.unsafe_at(j) * acc.unsafe_at(i-ii,j);
+            }
+        }
+    }
+
     int count_zeros(floatarray &a) {
         int n = a.length1d();
         int count = 0;
@@ -800,6 +1652,9 @@ namespace glinerec {
         float cv_error;
         float nn_error;
         bool crossvalidate;
+        int sparse;
+        int batch;
+        bool hogwild;
 
         MlpClassifier() {
             pdef("eta",0.5,"default learning rate");
@@ -819,6 +1674,13 @@ namespace glinerec {
             pdef("normalization",-1,"kind of normalization of the input");
             pdef("noopt",0,"disable optimization search");
             pdef("crossvalidate",1,"perform crossvalidation");
+            pdef("nn_estimate",0,"estimate the nearest neighbor error before training");
+            pdef("batch",0,"mini-batch size (0=per-sample updates)");
+            pdef("hogwild",0,"per-sample updates from all threads without locking");
+            pbind("sparse",sparse);
+            pbind("crossvalidate",crossvalidate);
+            pbind("batch",batch);
+            pbind("hogwild",hogwild);
             eta = pgetf("eta");
             cv_error = 1e30;
             nn_error = 1e30;
@@ -904,7 +1766,7 @@ namespace glinerec {
         }
 
         float outputs(floatarray &z,floatarray &x_raw) {
-            int sparse = pgetf("sparse");
+            pupdate();
             floatarray y,x;
             x.copy(x_raw);
             mvmul0(y,w1,x);
@@ -917,6 +1779,24 @@ namespace glinerec {
             return fabs(sum(z)-1.0);
         }
 
+        void batchOutputs(floatarray &z,floatarray &costs,floatarray &x) {
+            pupdate();
+            // sparsification is per vector; use the generic version
+            if(sparse>0) {
+                IModel::batchOutputs(z,costs,x);
+                return;
+            }
+            CHECK(x.rank()==2 && x.dim(1)==w1.dim(1));
+            floatarray y;
+            matmul_abt(y,x,w1);
+            add_sigmoid_rows(y,b1);
+            matmul_abt(z,y,w2);
+            add_sigmoid_rows(z,b2);
+            costs.resize(z.dim(0));
+            for(int i=0;i<z.dim(0);i++)
+                costs(i) = fabs(rowsum(z,i)-1.0);
+        }
+
         void changeHidden(int newn) {
             MlpClassifier temp;
             int ninput = w1.dim(1);
@@ -987,7 +1867,6 @@ namespace glinerec {
         // do a single stochastic gradient descent step
 
         void trainOne(floatarray &z,floatarray &target,floatarray &x,float eta) {
-            int sparse = pgetf("sparse");
             int nhidden = this->nhidden();
             int noutput = nclasses();
             floatarray delta1(nhidden),delta2(noutput),y(nhidden);
@@ -1016,6 +1895,68 @@ namespace glinerec {
                 b1(i) -= eta * delta1(i);
         }
 
+        // one gradient step for the samples ds(rows(i)); the forward and
+        // backward passes are matrix products over the whole batch, and
+        // the step is eta times the summed gradient; returns the summed
+        // squared error
+
+        double trainMinibatch(IDataset &ds,intarray &rows,float eta) {
+            int n = rows.length();
+            int nhidden = this->nhidden();
+            int noutput = nclasses();
+            floatarray x,v,y,z,delta1,delta2,t,u;
+            x.resize(n,nfeatures());
+            for(int i=0;i<n;i++) {
+                ds.input(v,rows(i));
+                rowput(x,i,v);
+            }
+            matmul_abt(y,x,w1);
+            add_sigmoid_rows(y,b1);
+            if(sparse>0) {
+                for(int i=0;i<n;i++) {
+                    rowget(v,y,i);
+                    sparsify(v,sparse);
+                    rowput(y,i,v);
+                }
+            }
+            matmul_abt(z,y,w2);
+            add_sigmoid_rows(z,b2);
+
+            double err = 0.0;
+            delta2.resize(n,noutput);
+            for(int i=0;i<n;i++) {
+                int cls = ds.cls(rows(i));
+                for(int j=0;j<noutput;j++) {
+                    float d = z.unsafe_at(i,j)-(j==cls);
+                    err += d*d;
+                    delta2.unsafe_at(i,j) = d * dsigmoidy(z.unsafe_at(i,j));
+                }
+            }
+            transpose_to(t,w2);
+            matmul_abt(delta1,delta2,t);
+            for(int i=0;i<n;i++)
+                for(int j=0;j<nhidden;j++)
+                    delta1.unsafe_at(i,j) *= dsigmoidy(y.unsafe_at(i,j));
+
+            // weight gradients, summed over the batch
+            floatarray g1,g2;
+            transpose_to(t,delta2);
+            transpose_to(u,y);
+            matmul_abt(g2,t,u);
+            for(int j=0;j<noutput;j++)
+                b2(j) -= eta * rowsum(t,j);
+            transpose_to(t,delta1);
+            transpose_to(u,x);
+            matmul_abt(g1,t,u);
+            for(int j=0;j<nhidden;j++)
+                b1(j) -= eta * rowsum(t,j);
+            g1 *= -eta;
+            g2 *= -eta;
+            w1 += g1;
+            w2 += g2;
+            return err;
+        }
+
         void train(IDataset &ds) {
             dsection("mlp");
             int nclasses = ds.nclasses();
@@ -1025,7 +1966,47 @@ namespace glinerec {
             double err = 0.0;
             floatarray x,z,target(nclasses);
             int count = 0;
-            for(int i=0;i<niters;i++) {
+            pupdate();
+            // per-sample training keeps using the eta the net was
+            // constructed with; the batched modes follow the parameter,
+            // so that the eta search of the ensemble reaches them
+            float rate = (batch>1 || hogwild) ? pgetf("eta") : eta;
+            if(batch>1) {
+                // scaling the step by 1/sqrt(batch) keeps the eta search
+                // in the same range as for per-sample updates; batches of
+                // 16-32 reach the same error with fewer, larger products
+                intarray rows;
+                for(int i=0;i<niters;i+=batch) {
+                    rows.clear();
+                    for(int j=i;j<min(i+batch,niters);j++) {
+                        int row = j%ds.nsamples();
+                        if(ds.cls(row)<0) continue;
+                        rows.push(row);
+                    }
+                    if(rows.length()==0) continue;
+                    err += trainMinibatch(ds,rows,rate/sqrt(float(rows.length())));
+                    count += rows.length();
+                }
+            } else if(hogwild) {
+                // threads update the shared weights without locking;
+                // collisions are rare enough not to hurt convergence
+#pragma omp parallel reduction(+:err,count)
+                {
+                    floatarray x,z,target(nclasses);
+#pragma omp for schedule(static,64)
+                    for(int i=0;i<niters;i++) {
+                        int row = i%ds.nsamples();
+                        int cls = ds.cls(row);
+                        if(cls<0) continue;
+                        ds.input(x,row);
+                        target = 0;
+                        target(cls) = 1;
+                        trainOne(z,target,x,rate);
+                        err += dist2squared(z,target);
+                        count++;
+                    }
+                }
+            } else for(int i=0;i<niters;i++) {
                 int row = i%ds.nsamples();
                 int cls = ds.cls(row);
                 if(cls<0) continue;
@@ -1050,7 +2031,7 @@ namespace glinerec {
             }
             err /= count;
             debugf("training-detail","MlpClassifier n %d niters %d eta %g err %g\n",
-                   ds.nsamples(),niters,eta,err);
+                   ds.nsamples(),niters,rate,err);
         }
 
         void print() {
@@ -1071,6 +2052,7 @@ namespace glinerec {
 
         void train(IDataset &ds) {
             pset("%nsamples",ds.nsamples());
+            pupdate();
             float split = pgetf("cv_split");
             int mlp_cv_max = pgetf("cv_max");
             if(crossvalidate) {
@@ -1101,26 +2083,25 @@ namespace glinerec {
                 pset("%ntesting",testing.length());
                 Datasubset trs(ds,training);
                 Datasubset tss(ds,testing);
-#if 0
-                // too slow
-                debugf("info","computing nn error\n");
-                nn_error = nearest_neighbor_error(trs,tss);
-                debugf("info","nn error %g (%d,%d)\n",nn_error,trs.nsamples(),tss.nsamples());
-#endif
+                if(pgetf("nn_estimate")) {
+                    debugf("info","computing nn error\n");
+                    nn_error = nearest_neighbor_error(trs,tss);
+                    debugf("info","nn error %g (%d,%d)\n",nn_error,trs.nsamples(),tss.nsamples());
+                }
                 trainBatch(trs,tss);
             } else {
-#if 0
-                int nids = min(int(mlp_cv_split*ds.nsamples()),mlp_cv_max);
-                // too slow
-                debugf("info","computing nn error\n");
-                nn_error = nearest_neighbor_error(ds,nids);
-                debugf("info","nn error %g (%d,%d)\n",nn_error,ds.nsamples()-nids,nids);
-#endif
+                if(pgetf("nn_estimate")) {
+                    int nids = min(int((1.0-split)*ds.nsamples()),mlp_cv_max);
+                    debugf("info","computing nn error\n");
+                    nn_error = nearest_neighbor_error(ds,nids);
+                    debugf("info","nn error %g (%d,%d)\n",nn_error,ds.nsamples()-nids,nids);
+                }
                 trainBatch(ds,ds);
             }
         }
 
         void trainBatch(IDataset &ds,IDataset &ts) {
+            pupdate();
             float eta_init = pgetf("eta_init"); // 0.5
             float eta_varlog = pgetf("eta_varlog"); // 1.5
             float hidden_varlog = pgetf("hidden_varlog"); // 1.2
@@ -1160,15 +2141,20 @@ namespace glinerec {
                 etas(i) = rlognormal(eta_init,eta_varlog);
             }
 
+            // with batch or hogwild training, each net uses all the
+            // threads, so the nets are trained one after the other
+            bool inner = batch>1 || hogwild;
             debugf("info","[mlp training n %d nc %d]\n",ds.nsamples(),nclasses);
             for(int round=0;round<rounds;round++) {
                 errs.fill(-1);
-#pragma omp parallel for
+#pragma omp parallel for if(!inner)
                 for(int i=0;i<nn;i++) {
                     // nets(i).trainEpoch(data,classes,training,niters,etas(i)); // FIXME
                     nets(i).pset("eta",etas(i));
+                    nets(i).pset("batch",batch);
+                    nets(i).pset("hogwild",hogwild);
                     nets(i).train(ds);
-                    errs(i) = estimate_errors(nets(i),ts);
+                    errs(i) = inner ? estimate_errors_batch(nets(i),ts) : estimate_errors(nets(i),ts);
 
                     debugf("info","   [net %d (%d/%d) %g %g %g]\n",i,THREAD,NTHREADS,
                            errs(i),nets(i).complexity(),etas(i));
@@ -1208,6 +2194,143 @@ namespace glinerec {
 
     };
 
+    ////////////////////////////////////////////////////////////////
+    // MLP with int8 weights, made from a trained MLP by quantizing
+    // each weight row with its own scale; inputs and hidden unit
+    // activations are quantized per vector on the fly
+    ////////////////////////////////////////////////////////////////
+
+    struct QuantizedMlp : IModel {
+        shortarray w1,w2;
+        floatarray s1,b1,s2,b2;
+        int ninput;
+        int sparse;
+
+        QuantizedMlp() {
+            pdef("sparse",-1,"sparsify the hidden layer");
+            pbind("sparse",sparse);
+            ninput = 0;
+        }
+        const char *name() {
+            return "qmlp";
+        }
+        void info(int depth,FILE *stream) {
+            iprintf(stream,depth,"Quantized MLP\n");
+            pprint(stream,depth);
+            iprintf(stream,depth,"ninput %d nhidden %d noutput %d\n",ninput,nhidden(),nclasses());
+        }
+        int nfeatures() {
+            return ninput;
+        }
+        int nhidden() {
+            return w1.dim(0);
+        }
+        int nclasses() {
+            return w2.dim(0);
+        }
+        float complexity() {
+            return w1.dim(0);
+        }
+
+        void set(MlpClassifier &mlp) {
+            mlp.pupdate();
+            pset("sparse",mlp.sparse);
+            ninput = mlp.w1.dim(1);
+            if(mlp.w1.length()>0) {
+                quantize_rows(w1,s1,mlp.w1);
+                quantize_rows(w2,s2,mlp.w2);
+            }
+            b1.copy(mlp.b1);
+            b2.copy(mlp.b2);
+        }
+
+        void save(FILE *stream) {
+            magic_write(stream,"qmlp");
+            psave(stream);
+            scalar_write(stream,ninput);
+            bytearray temp;
+            pack_int8(temp,w1);
+            narray_write(stream,temp);
+            narray_write(stream,s1);
+            narray_write(stream,b1);
+            pack_int8(temp,w2);
+            narray_write(stream,temp);
+            narray_write(stream,s2);
+            narray_write(stream,b2);
+        }
+        void load(FILE *stream) {
+            magic_read(stream,"qmlp");
+            pload(stream);
+            scalar_read(stream,ninput);
+            bytearray temp;
+            narray_read(stream,temp);
+            unpack_int8(w1,temp);
+            narray_read(stream,s1);
+            narray_read(stream,b1);
+            narray_read(stream,temp);
+            unpack_int8(w2,temp);
+            narray_read(stream,s2);
+            narray_read(stream,b2);
+        }
+
+        void train(IDataset &ds) {
+            throw "qmlp: quantized networks can't be trained; train an mlp and quantize it";
+        }
+
+        float outputs(floatarray &z,floatarray &x) {
+            floatarray xs(1,x.length()),zs,costs;
+            for(int j=0;j<x.length();j++) xs(0,j) = x.at1d(j);
+            batchOutputs(zs,costs,xs);
+            rowget(z,zs,0);
+            return costs(0);
+        }
+
+        void batchOutputs(floatarray &z,floatarray &costs,floatarray &x) {
+            pupdate();
+            CHECK(x.rank()==2 && x.dim(1)==ninput);
+            shortarray xq,yq;
+            floatarray sx,sy,y;
+            quantize_rows(xq,sx,x);
+            int_matmul_abt(y,xq,sx,w1,s1);
+            add_sigmoid_rows(y,b1);
+            if(sparse>0) {
+                floatarray v;
+                for(int i=0;i<y.dim(0);i++) {
+                    rowget(v,y,i);
+                    sparsify(v,sparse);
+                    rowput(y,i,v);
+                }
+            }
+            quantize_rows(yq,sy,y);
+            int_matmul_abt(z,yq,sy,w2,s2);
+            add_sigmoid_rows(z,b2);
+            costs.resize(z.dim(0));
+            for(int i=0;i<z.dim(0);i++)
+                costs(i) = fabs(rowsum(z,i)-1.0);
+        }
+    };
+
+    // replace every MLP inside model (looking through submodels) with
+    // its quantized version; returns the number of networks replaced
+
+    int quantize_mlps(IModel &model) {
+        int count = 0;
+        for(int i=0;i<model.nmodels();i++) {
+            IModel *sub = model.getModel(i);
+            if(!sub) continue;
+            MlpClassifier *mlp = dynamic_cast<MlpClassifier*>(sub);
+            if(mlp) {
+                QuantizedMlp *q = new QuantizedMlp();
+                q->set(*mlp);
+                model.setModel(q,i);
+                count++;
+            } else {
+                count += quantize_mlps(*sub);
+            }
+        }
+        return count;
+    }
+
     ////////////////////////////////////////////////////////////////
     // Float8Buffer is a classifier that allows incremental training
     // with an efficient float8 internall buffer.
@@ -1216,6 +2339,7 @@ namespace glinerec {
     struct Float8Buffer : IModel {
         autodel<IModel> cf;
         RowDataset<float8> ds8;
+        narray< autodel<MmapDataset> > mapped;
         Float8Buffer() {
         }
         void info(int depth,FILE *stream) {
@@ -1226,7 +2350,9 @@ namespace glinerec {
         const char *command(const char *argv[]) {
             static char buf[100];
             if(!strcmp(argv[0],"total")) {
-                sprintf(buf,"%d",ds8.nsamples());
+                int total = ds8.nsamples();
+                for(int i=0;i<mapped.length();i++) total += mapped(i)->nsamples();
+                sprintf(buf,"%d",total);
                 return buf;
             } else {
                 return cf->command(argv);
@@ -1238,8 +2364,8 @@ namespace glinerec {
         void setModel(IModel *cf,int which) {
             this->cf = cf;
         }
-        IModel &getModel(int i) {
-            return *cf;
+        IModel *getModel(int i) {
+            return cf.ptr();
         }
         int nfeatures() {
             return cf->nfeatures();
@@ -1273,6 +2399,9 @@ namespace glinerec {
         float outputs(floatarray &z,floatarray &x) {
             return cf->outputs(z,x);
         }
+        void batchOutputs(floatarray &z,floatarray &costs,floatarray &x) {
+            cf->batchOutputs(z,costs,x);
+        }
         void train(IDataset &ds) {
             cf->train(ds);
         }
@@ -1280,15 +2409,47 @@ namespace glinerec {
             ds8.add(v,c);
         }
         void updateModel() {
-            train(ds8);
+            if(mapped.length()==0) {
+                train(ds8);
+                return;
+            }
+            // train on the buffer and the mapped files as one dataset
+            ShardedDataset all;
+            if(ds8.nsamples()>0) all.add(ds8);
+            for(int i=0;i<mapped.length();i++) all.add(*mapped(i));
+            debugf("info","Float8Buffer training on %d samples in %d shards\n",
+                   all.nsamples(),all.nshards());
+            train(all);
         }
         void saveData(FILE *stream) {
             debugf("info","Float8Buffer saving %d samples with %d features and %d classes\n",
                    ds8.nsamples(),ds8.nfeatures(),ds8.nclasses());
-            ds8.save(stream);
+            ds8_write(stream,ds8);
         }
+        // ds8 files are mapped and added as shards, older datasets are
+        // read into the buffer
         void loadData(FILE *stream) {
-            ds8.load(stream);
+            if(ds8_check_magic(stream)) {
+                MmapDataset *ds = new MmapDataset();
+                mapped.push() = ds;
+                ds->open(stream);
+                debugf("info","Float8Buffer mapped %d samples with %d features and %d classes\n",
+                       ds->nsamples(),ds->nfeatures(),ds->nclasses());
+                return;
+            }
+            if(ds8.nsamples()==0) {
+                ds8.load(stream);
+            } else {
+                // RowDataset::load doesn't append
+                RowDataset<float8> more;
+                more.load(stream);
+                CHECK(more.nfeatures()==ds8.nfeatures());
+                floatarray v;
+                for(int i=0;i<more.nsamples();i++) {
+                    more.input(v,i);
+                    ds8.add(v,more.cls(i));
+                }
+            }
             debugf("info","Float8Buffer loaded %d samples with %d features and %d classes\n",
                    ds8.nsamples(),ds8.nfeatures(),ds8.nclasses());
         }
@@ -1344,8 +2505,8 @@ namespace glinerec {
         void setModel(IModel *cf,int which) {
             models[which] = cf;
         }
-        IModel &getModel(int i) {
-            return *models[i];
+        IModel *getModel(int i) {
+            return models[i].ptr();
         }
 
         void save(FILE *stream) {
@@ -1565,10 +2726,12 @@ namespace glinerec {
 
     struct CascadedMLP : IModel {
         narray< autodel<IModel> > models;
+        int lrounds;
 
         CascadedMLP() {
             pdef("rounds",2,"number of cascaded networks");
             pdef("lrounds",999,"number of rounds to use during classification");
+            pbind("lrounds",lrounds);
         }
 
         int nfeatures() {
@@ -1609,6 +2772,16 @@ namespace glinerec {
             }
         }
 
+        int nmodels() {
+            return models.length();
+        }
+        void setModel(IModel *cf,int which) {
+            models[which] = cf;
+        }
+        IModel *getModel(int which) {
+            return models[which].ptr();
+        }
+
         IModel *make_Model() {
             return make_model("mappedmlp");
         }
@@ -1636,7 +2809,7 @@ namespace glinerec {
         }
 
         float outputs(floatarray &result,floatarray &v) {
-            int lrounds = pgetf("lrounds");
+            pupdate();
             result.resize(nclasses());
             result = 0;
             floatarray a;
@@ -1662,6 +2835,7 @@ namespace glinerec {
         autodel<IModel> junkclass;
         autodel<IModel> charclass;
         autodel<IModel> ulclass;
+        bool use_junk,use_ul;
 
         LatinClassifier() {
             pdef("junkclass","mlp","junk classifier");
@@ -1669,6 +2843,8 @@ namespace glinerec {
             pdef("junk",1,"train a separate junk classifier");
             pdef("ul",0,"do upper/lower reclassification");
             pdef("ulclass","mlp","upper/lower classifier");
+            pbind("junk",use_junk);
+            pbind("ul",use_ul);
         }
         int nfeatures() {
             return charclass->nfeatures();
@@ -1680,19 +2856,21 @@ namespace glinerec {
             return "latin";
         }
         void info(int depth,FILE *stream) {
-            charclass->info(depth+1,stream);
-            ulclass->info(depth+1,stream);
+            if(!!charclass) charclass->info(depth+1,stream);
+            if(!!ulclass) ulclass->info(depth+1,stream);
         }
         int nmodels() {
-            return 2;
+            return 3;
         }
         void setModel(IModel *cf,int which) {
             if(which==0) charclass = cf;
             else if(which==1) ulclass = cf;
+            else if(which==2) junkclass = cf;
         }
-        IModel &getModel(int which) {
-            if(which==0) return *charclass;
-            else if(which==1) return *ulclass;
+        IModel *getModel(int which) {
+            if(which==0) return charclass.ptr();
+            else if(which==1) return ulclass.ptr();
+            else if(which==2) return junkclass.ptr();
             throw "oops";
         }
 
@@ -1762,9 +2940,10 @@ namespace glinerec {
             floatarray ul;
             floatarray junk;
 
+            pupdate();
             charclass->outputs(chars,v);
 
-            if(pgetf("junk") && junkclass) {
+            if(use_junk && junkclass) {
                 junkclass->outputs(junk,v);
                 chars /= sum(chars);
                 chars *= junk(0);
@@ -1772,7 +2951,7 @@ namespace glinerec {
                 chars('~') = junk(1);
             }
 
-            if(pgetf("ul") && ulclass) {
+            if(use_ul && ulclass) {
                 ulclass->outputs(ul,v);
                 ul /= sum(ul);
                 for(int c='A';c<='Z';c++) {
@@ -1785,6 +2964,44 @@ namespace glinerec {
             result = chars;
             return 0.0;
         }
+
+        void batchOutputs(floatarray &result,floatarray &costs,floatarray &v) {
+            floatarray chars,ul,junk,unused;
+            int n = v.dim(0);
+
+            pupdate();
+            charclass->batchOutputs(chars,unused,v);
+
+            if(use_junk && junkclass) {
+                junkclass->batchOutputs(junk,unused,v);
+                int m = max(chars.dim(1),'~'+1);
+                floatarray temp(n,m);
+                temp.fill(0);
+                for(int i=0;i<n;i++) {
+                    double total = rowsum(chars,i);
+                    for(int j=0;j<chars.dim(1);j++)
+                        temp(i,j) = chars(i,j)/total*junk(i,0);
+                    temp(i,'~') = junk(i,1);
+                }
+                chars.move(temp);
+            }
+
+            if(use_ul && ulclass) {
+                ulclass->batchOutputs(ul,unused,v);
+                for(int i=0;i<n;i++) {
+                    double total = ul(i,0)+ul(i,1);
+                    for(int c='A';c<='Z';c++) {
+                        float ctotal = chars(i,c) + chars(i,c-'A'+'a');
+                        chars(i,c) = ul(i,1)/total * ctotal;
+                        chars(i,c-'A'+'a') = ul(i,0)/total * ctotal;
+                    }
+                }
+            }
+
+            result.move(chars);
+            costs.resize(n);
+            costs.fill(0);
+        }
     };
 
     void init_glclass() {
@@ -1799,6 +3016,7 @@ namespace glinerec {
         component_register<BitNN>("bit");
 
         component_register<AutoMlpClassifier>("mlp");
+        component_register<QuantizedMlp>("qmlp");
         component_register2<MappedClassifier,AutoMlpClassifier>("mappedmlp");
 
         component_register<AdaBoost>("adaboost");
@@ -0,0 +1,263 @@
+// on-disk float8 datasets (memory mapped and append mode)
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "glinerec.h"
+
+namespace glinerec {
+    using namespace colib;
+    using namespace narray_io;
+
+    static const char ds8_magic[8] = {'o','c','r','o','d','s','8','\n'};
+
+    static int ds8_header_size() {
+        int size = sizeof (Ds8Header) + ds8_nhist * sizeof (int);
+        return (size+4095)/4096*4096;
+    }
+
+    static int ds8_record_size(int nfeatures) {
+        return (2*sizeof (int) + nfeatures + 7)/8*8;
+    }
+
+    static void ds8_init(Ds8Header &header,intarray &hist,int nfeatures) {
+        memset(&header,0,sizeof header);
+        memcpy(header.magic,ds8_magic,sizeof header.magic);
+        header.version = ds8_version;
+        header.header_size = ds8_header_size();
+        header.nfeatures = nfeatures;
+        header.record_size = ds8_record_size(nfeatures);
+        header.nhist = ds8_nhist;
+        hist.resize(ds8_nhist);
+        hist.fill(0);
+    }
+
+    static void ds8_check(Ds8Header &header) {
+        if(memcmp(header.magic,ds8_magic,sizeof header.magic))
+            throw "ds8: bad magic number";
+        if(header.version!=ds8_version)
+            throwf("ds8: unsupported version %d",header.version);
+        CHECK(header.nfeatures>0 && header.nfeatures<1000000);
+        CHECK(header.record_size==ds8_record_size(header.nfeatures));
+        CHECK(header.nhist>=0 && sizeof header+header.nhist*sizeof (int)<=unsigned(header.header_size));
+        CHECK(header.nsamples>=0 && header.nsamples<(1LL<<31));
+    }
+
+    // encode a sample the way float8 does
+    static void ds8_encode(char *record,floatarray &v,int c,int id) {
+        ((int*)record)[0] = c;
+        ((int*)record)[1] = id;
+        signed char *p = (signed char*)(record+2*sizeof (int));
+        // round rather than truncate like float8 does, so that values
+        // that already went through float8 come back unchanged
+        for(int j=0;j<v.length();j++) {
+            float x = v.at1d(j);
+            if(x<-1.2||x>1.2) throw "float8: value out of range";
+            p[j] = (signed char)floor(x*100+0.5);
+        }
+    }
+
+    static void ds8_count(Ds8Header &header,intarray &hist,int c) {
+        if(c>=header.nclasses) header.nclasses = c+1;
+        if(unsigned(c)<unsigned(hist.length())) hist(c)++;
+    }
+
+    bool ds8_check_magic(FILE *stream) {
+        char buf[sizeof ds8_magic];
+        long where = ftell(stream);
+        int n = fread(buf,1,sizeof buf,stream);
+        fseek(stream,where,SEEK_SET);
+        return n==int(sizeof buf) && !memcmp(buf,ds8_magic,sizeof buf);
+    }
+
+    void ds8_write(FILE *stream,IDataset &ds) {
+        if(ds.nfeatures()<1) throw "ds8_write: empty dataset";
+        Ds8Header header;
+        intarray hist;
+        ds8_init(header,hist,ds.nfeatures());
+        for(int i=0;i<ds.nsamples();i++)
+            ds8_count(header,hist,ds.cls(i));
+        header.nsamples = ds.nsamples();
+        header.next_id = ds.nsamples();
+        bytearray head(header.header_size);
+        head.fill(0);
+        memcpy(&head(0),&header,sizeof header);
+        memcpy(&head(sizeof header),&hist(0),hist.length()*sizeof (int));
+        CHECK(fwrite(&head(0),1,head.length(),stream)==unsigned(head.length()));
+        bytearray record(header.record_size);
+        floatarray v;
+        for(int i=0;i<ds.nsamples();i++) {
+            record.fill(0);
+            ds.input(v,i);
+            CHECK(v.length()==header.nfeatures);
+            ds8_encode((char*)&record(0),v,ds.cls(i),ds.id(i));
+            CHECK(fwrite(&record(0),1,record.length(),stream)==unsigned(record.length()));
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // MmapDataset
+    ////////////////////////////////////////////////////////////////
+
+    MmapDataset::MmapDataset() {
+        memset(&header,0,sizeof header);
+        hist = 0;
+        records = 0;
+        base = 0;
+        mapped = 0;
+    }
+
+    MmapDataset::~MmapDataset() {
+        close();
+    }
+
+    void MmapDataset::close() {
+        if(base) munmap(base,mapped);
+        memset(&header,0,sizeof header);
+        hist = 0;
+        records = 0;
+        base = 0;
+        mapped = 0;
+    }
+
+    void MmapDataset::open(const char *path) {
+        stdio stream(path,"r");
+        open(stream);
+    }
+
+    void MmapDataset::open(FILE *stream) {
+        close();
+        // the header is read (rather than mapped) so that samples that
+        // are appended while we're reading don't change nsamples
+        long start = ftell(stream);
+        CHECK(fread(&header,sizeof header,1,stream)==1);
+        ds8_check(header);
+        size_t size = header.header_size + size_t(header.nsamples)*header.record_size;
+        struct stat sbuf;
+        CHECK(fstat(fileno(stream),&sbuf)==0);
+        if(size_t(sbuf.st_size)<start+size) throw "ds8: file is truncated";
+        // mmap offsets must be page aligned
+        long page = sysconf(_SC_PAGESIZE);
+        long aligned = start/page*page;
+        mapped = size+(start-aligned);
+        base = mmap(0,mapped,PROT_READ,MAP_SHARED,fileno(stream),aligned);
+        if(base==MAP_FAILED) {
+            base = 0;
+            throwf("ds8: mmap failed: %s",strerror(errno));
+        }
+        char *p = (char*)base+(start-aligned);
+        hist = (int*)(p+sizeof header);
+        records = p+header.header_size;
+        // leave the stream positioned after the dataset, like load()
+        fseek(stream,start+size,SEEK_SET);
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // Ds8Writer
+    ////////////////////////////////////////////////////////////////
+
+    Ds8Writer::Ds8Writer() {
+        nfeatures = -1;
+        record_size = 0;
+        last_id = -1;
+        buffered = 0;
+    }
+
+    Ds8Writer::~Ds8Writer() {
+        try {
+            close();
+        } catch(const char *err) {
+            fprintf(stderr,"Ds8Writer: %s\n",err);
+        }
+    }
+
+    void Ds8Writer::open(const char *path) {
+        close();
+        this->path = path;
+    }
+
+    void Ds8Writer::add(floatarray &v,int c,bool same_id) {
+        CHECK(path.length()>0);
+        CHECK(c>=-1 && c<1000000);
+        if(nfeatures<0) {
+            nfeatures = v.length();
+            record_size = ds8_record_size(nfeatures);
+            buffer.resize(batch*record_size);
+        }
+        CHECK(v.length()==nfeatures);
+        if(buffered==batch) flush();
+        char *record = (char*)&buffer(buffered*record_size);
+        memset(record,0,record_size);
+        ds8_encode(record,v,c,-1);
+        pending.push(same_id);
+        buffered++;
+    }
+
+    void Ds8Writer::flush() {
+        if(buffered==0) return;
+        int fd = ::open(path,O_RDWR|O_CREAT,0644);
+        if(fd<0) throwf("%s: %s",path.c_str(),strerror(errno));
+        if(flock(fd,LOCK_EX)<0) {
+            ::close(fd);
+            throwf("%s: lock failed: %s",path.c_str(),strerror(errno));
+        }
+        try {
+            Ds8Header header;
+            intarray hist;
+            struct stat sbuf;
+            CHECK(fstat(fd,&sbuf)==0);
+            if(sbuf.st_size==0) {
+                ds8_init(header,hist,nfeatures);
+            } else {
+                CHECK(pread(fd,&header,sizeof header,0)==sizeof header);
+                ds8_check(header);
+                if(header.nfeatures!=nfeatures)
+                    throwf("%s: has %d features, appending %d",path.c_str(),header.nfeatures,nfeatures);
+                hist.resize(header.nhist);
+                if(header.nhist>0)
+                    CHECK(pread(fd,&hist(0),header.nhist*sizeof (int),sizeof header)==
+                          ssize_t(header.nhist*sizeof (int)));
+            }
+            // assign file-wide ids now that we own the file
+            for(int i=0;i<buffered;i++) {
+                int *record = (int*)&buffer(i*record_size);
+                if(!pending(i) || last_id<0) last_id = int(header.next_id++);
+                record[1] = last_id;
+                ds8_count(header,hist,record[0]);
+            }
+            // records first, then the header that makes them visible
+            off_t where = header.header_size + off_t(header.nsamples)*record_size;
+            ssize_t size = ssize_t(buffered)*record_size;
+            if(pwrite(fd,&buffer(0),size,where)!=size)
+                throwf("%s: write failed: %s",path.c_str(),strerror(errno));
+            header.nsamples += buffered;
+            bytearray head(header.header_size);
+            head.fill(0);
+            memcpy(&head(0),&header,sizeof header);
+            if(hist.length()>0) memcpy(&head(sizeof header),&hist(0),hist.length()*sizeof (int));
+            if(pwrite(fd,&head(0),head.length(),0)!=head.length())
+                throwf("%s: write failed: %s",path.c_str(),strerror(errno));
+        } catch(...) {
+            flock(fd,LOCK_UN);
+            ::close(fd);
+            throw;
+        }
+        flock(fd,LOCK_UN);
+        ::close(fd);
+        buffered = 0;
+        pending.clear();
+    }
+
+    void Ds8Writer::close() {
+        if(path.length()>0) flush();
+        path = "";
+        nfeatures = -1;
+        buffer.dealloc();
+        pending.clear();
+        buffered = 0;
+    }
+}
@@ -246,6 +246,115 @@ namespace {
 }
 
 namespace glinerec {
+    // Gaussian smoothing with the same mask and border handling as
+    // gauss2d, but in float and along contiguous rows
+
+    static void smooth_level(floatarray &a,float sigma) {
+        int w = a.dim(0), h = a.dim(1);
+        if(w==0 || h==0) return;
+        int range = 1+int(3.0*sigma);
+        int nmask = 2*range+1;
+        floatarray mask(nmask);
+        double total = 0.0;
+        for(int i=0;i<=range;i++) {
+            mask(range+i) = mask(range-i) = exp(-i*i/2.0/sigma/sigma);
+            total += (i?2:1)*mask(range+i);
+        }
+        mask /= total;
+        const float *m = &mask(0);
+        floatarray temp(w,h),row(h+2*range);
+        float *p = &a.unsafe_at(0,0);
+        float *t = &temp.unsafe_at(0,0);
+        float *r = &row(0);
+        // along the second dimension, which is contiguous
+        for(int i=0;i<w;i++) {
+            const float *in = p+i*h;
+            for(int j=0;j<range;j++) r[j] = in[0];
+            for(int j=0;j<h;j++) r[range+j] = in[j];
+            for(int j=0;j<range;j++) r[range+h+j] = in[h-1];
+            float *out = t+i*h;
+            for(int j=0;j<h;j++) {
+                float sum = 0;
+                for(int k=0;k<nmask;k++) sum += m[k]*r[j+k];
+                out[j] = sum;
+            }
+        }
+        // along the first dimension, one row at a time
+        for(int i=0;i<w;i++) {
+            float *out = p+i*h;
+            for(int j=0;j<h;j++) out[j] = 0;
+            for(int k=0;k<nmask;k++) {
+                const float *in = t+max(0,min(w-1,i+k-range))*h;
+                float mk = m[k];
+                for(int j=0;j<h;j++) out[j] += mk*in[j];
+            }
+        }
+    }
+
+    // A scale space for one feature map of a line.  Level 0 is the map
+    // itself, level k>0 is the map smoothed with sigma 0.5*sqrt(2)^(k-1)
+    // and, whenever sigma reaches a pixel of the previous level,
+    // subsampled by two.  Each level is computed from the previous one,
+    // so building the whole pyramid costs little more than smoothing
+    // the map once.  Sigmas above the top level use the top level.
+
+    struct MapPyramid {
+        void *source;
+        narray<floatarray> levels;
+        floatarray sigmas;
+        intarray factors;
+
+        template <class S>
+        void init(narray<S> &map) {
+            source = &map;
+            levels.resize(1);
+            levels(0) = map;
+        }
+
+        void build(float maxsigma) {
+            levels.resize(1);
+            sigmas.clear();
+            sigmas.push(0);
+            factors.clear();
+            factors.push(1);
+            float sigma = 0.5;
+            for(;;) {
+                int k = levels.length();
+                int f = factors(k-1);
+                floatarray &level = levels.push();
+                level = levels(k-1);
+                // additional smoothing in the pixels of the previous level
+                float ds = sqrt(sqr(sigma)-sqr(sigmas(k-1)))/f;
+                smooth_level(level,ds);
+                if(sigma>=f && level.dim(0)>2 && level.dim(1)>2) {
+                    floatarray half((level.dim(0)+1)/2,(level.dim(1)+1)/2);
+                    for(int i=0;i<half.dim(0);i++)
+                        for(int j=0;j<half.dim(1);j++)
+                            half(i,j) = level(2*i,2*j);
+                    level.move(half);
+                    f *= 2;
+                }
+                sigmas.push(sigma);
+                factors.push(f);
+                if(sigma>=maxsigma) break;
+                sigma *= sqrt(2.0);
+            }
+        }
+
+        // the level whose sigma is closest to the given one
+        int level(float sigma) {
+            if(sigma<sigmas(1)/sqrt(2.0)) return 0;
+            int k = 1;
+            while(k+1<sigmas.length() && sigmas(k+1)<=sigma*sqrt(sqrt(2.0))) k++;
+            return k;
+        }
+
+        // value at (x,y) of the original map, interpolated bilinearly
+        float at(int k,float x,float y) {
+            return bilin(levels(k),x/factors(k),y/factors(k));
+        }
+    };
+
     struct SimpleFeatureMap : IFeatureMap {
         bytearray line;
         bytearray binarized;
@@ -257,8 +366,15 @@ namespace glinerec {
         floatarray dt;
         floatarray dt_x,dt_y;
         narray<floatarray> dt_maps;
+        objlist<MapPyramid> pyramids;
         int pad;
 
+        // parameters used per feature map (bound with pbind)
+        iucstring ftypes;
+        int csize;
+        float scontext,aa,maxheight,context;
+        bool pyramid;
+
         SimpleFeatureMap() {
             // parameters affecting all features
             pdef("ftypes","bejh","which feature types to extract (bgxyhejrt)");
@@ -267,6 +383,7 @@ namespace glinerec {
             pdef("scontext",0.3,"value to multiply context pixels with (e.g., -1, 0, 1, 0.5)");
             pdef("aa",0.5,"amount of anti aliasing (-1 = use other algorithm)");
             pdef("maxheight",300,"maximum height for feature extraction");
+            pdef("pyramid",0,"smooth each map once per line and sample the nearest scale (aa>0 only)");
 
             // parameters specific to individual feature maps
             pdef("skel_pre_smooth",0.0,"smooth by this amount prior to skeletal extraction");
@@ -282,6 +399,13 @@ namespace glinerec {
             pdef("dt_asigma",0.7,"power to which to raise the distance transform");
             pdef("dt_which","inside","inside, outside, or both");
             pdef("dt_grad_smooth",1.0,"smoothing of the distance transform before gradient computation");
+            pbind("ftypes",ftypes);
+            pbind("csize",csize);
+            pbind("context",context);
+            pbind("scontext",scontext);
+            pbind("aa",aa);
+            pbind("maxheight",maxheight);
+            pbind("pyramid",pyramid);
             pad = 10;
         }
 
@@ -300,7 +424,7 @@ namespace glinerec {
         }
 
         virtual void setLine(bytearray &image_) {
-            const char *ftypes = pget("ftypes");
+            pupdate();
             maps.resize(int(pgetf("ridge_nmaps")));
             line = image_;
             dsection("setline");
@@ -427,15 +551,49 @@ namespace glinerec {
                 }
             }
 
+            pyramids.clear();
+            if(pyramid && aa>0) buildPyramids();
+
             dwait();
         }
 
+        // build the pyramids for all the maps that extractFeatures uses;
+        // this has to happen here because features are extracted in
+        // parallel afterwards
+
+        void buildPyramids() {
+            // candidate boxes rarely get much bigger than twice the line height
+            float maxsigma = aa*min(maxheight,2.0f*line.dim(1))/csize;
+            if(strchr(ftypes,'b')) pyramids.push().init(binarized);
+            if(strchr(ftypes,'h')) pyramids.push().init(holes);
+            if(strchr(ftypes,'j')) pyramids.push().init(junctions);
+            if(strchr(ftypes,'e')) pyramids.push().init(endpoints);
+            if(strchr(ftypes,'r'))
+                for(int i=0;i<maps.length();i++) pyramids.push().init(maps(i));
+            if(strchr(ftypes,'t')) pyramids.push().init(troughs);
+            if(strchr(ftypes,'D')) pyramids.push().init(dt);
+            if(strchr(ftypes,'G')) {
+                pyramids.push().init(dt_x);
+                pyramids.push().init(dt_y);
+            }
+            if(strchr(ftypes,'M'))
+                for(int i=0;i<dt_maps.length();i++) pyramids.push().init(dt_maps(i));
+#pragma omp parallel for schedule(dynamic,1)
+            for(int i=0;i<pyramids.length();i++)
+                pyramids(i).build(maxsigma);
+        }
+
+        MapPyramid *findPyramid(void *source) {
+            for(int i=0;i<pyramids.length();i++)
+                if(pyramids(i).source==source) return &pyramids(i);
+            return 0;
+        }
+
         void extractFeatures(floatarray &v,rectangle b,bytearray &mask) {
             dsection("features");
             b.shift_by(pad,pad);
 
             CHECK(b.width()==mask.dim(0) && b.height()==mask.dim(1));
-            const char *ftypes = pget("ftypes");
             floatarray u;
             v.clear();
             if(strchr(ftypes,'b')) {
@@ -491,7 +649,6 @@ namespace glinerec {
             }
 
             if(dactive()) {
-                int csize = pgetf("csize");
                 floatarray temp;
                 temp = v;
                 temp.reshape(temp.length()/csize,csize);
@@ -505,7 +662,7 @@ namespace glinerec {
         void extractFeatures(floatarray &v,rectangle b,bytearray &mask,
                              narray<S> &source,bool masked=true) {
             rectangle bp = rectangle(b.x0+pad,b.y0+pad,b.x1+pad,b.y1+pad);
-            if(pgetf("aa")>=0) {
+            if(aa>=0) {
                 extractFeaturesAA(v,b,mask,source,masked);
             } else {
                 extractFeaturesNonAA(v,b,mask,source,masked);
@@ -515,29 +672,43 @@ namespace glinerec {
         template <class S>
         void extractFeaturesAA(floatarray &v,rectangle b,bytearray &mask,
                              narray<S> &source,bool masked=true) {
-            float scontext = pgetf("scontext");
-            int csize = pgetf("csize");
             CHECK(mask.dim(0)==b.width() && mask.dim(1)==b.height());
-            CHECK_ARG(v.dim(1)<pgetf("maxheight"));
-            CHECK_ARG(b.height()<pgetf("maxheight"));
-
-            floatarray sub(b.width(),b.height());
-            get_rectangle(sub,source,b);
-            float s = max(sub.dim(0),sub.dim(1))/float(csize);
-            float sig = s * pgetf("aa");
-            if(sig>0) gauss2d(sub,sig,sig);
+            CHECK_ARG(v.dim(1)<maxheight);
+            CHECK_ARG(b.height()<maxheight);
+
+            float s = max(b.width(),b.height())/float(csize);
+            float sig = s * aa;
             bytearray dmask;
             dmask = mask;
             if(int(sig)>0) binary_dilate_circle(dmask,int(sig));
 
-            v.resize(csize,csize);
-            v = 0;
-            for(int i=0;i<csize;i++) {
-                for(int j=0;j<csize;j++) {
-                    int mval = bat(dmask,i*s,j*s,0);
-                    float value = bilin(sub,i*s,j*s);
-                    if(masked && !mval) value = scontext * value;
-                    v(i,j) = value;
+            floatarray sub;
+            MapPyramid *p = findPyramid(&source);
+            if(p) {
+                // sample the smoothed map of the whole line
+                int k = p->level(sig);
+                v.resize(csize,csize);
+                for(int i=0;i<csize;i++) {
+                    for(int j=0;j<csize;j++) {
+                        int mval = bat(dmask,i*s,j*s,0);
+                        float value = p->at(k,b.x0+i*s,b.y0+j*s);
+                        if(masked && !mval) value = scontext * value;
+                        v(i,j) = value;
+                    }
+                }
+            } else {
+                sub.resize(b.width(),b.height());
+                get_rectangle(sub,source,b);
+                if(sig>0) gauss2d(sub,sig,sig);
+                v.resize(csize,csize);
+                v = 0;
+                for(int i=0;i<csize;i++) {
+                    for(int j=0;j<csize;j++) {
+                        int mval = bat(dmask,i*s,j*s,0);
+                        float value = bilin(sub,i*s,j*s);
+                        if(masked && !mval) value = scontext * value;
+                        v(i,j) = value;
+                    }
                 }
             }
 
@@ -547,9 +718,14 @@ namespace glinerec {
             CHECK(min(v)>=-1.1 && max(v)<=1.1);
 
             dsection("dfeats");
-            dshown(sub,"a");
+            if(dactive() && sub.length()>0) {
+                dshown(sub,"a");
+                floatarray temp;
+                temp = sub;
+                temp -= dmask;
+                dshown(temp,"d");
+            }
             dshown(dmask,"b");
-            {floatarray temp; temp = sub; temp -= dmask; dshown(temp,"d");}
             dshown(v,"c");
             dwait();
         }
@@ -558,9 +734,6 @@ namespace glinerec {
         void extractFeaturesNonAA(floatarray &v,rectangle b,bytearray &mask,
                              narray<S> &source,bool masked=true) {
             // FIXME bool use_centroid = pgetf("use_centroid");
-            float context = pgetf("context");
-            float scontext = pgetf("scontext");
-            int csize = pgetf("csize");
             float xc = b.xcenter();
             float yc = b.ycenter();
             int xm = mask.dim(0)/2;
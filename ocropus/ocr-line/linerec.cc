@@ -111,6 +111,13 @@ namespace glinerec {
         autodel<IFeatureMap> featuremap;
         int ntrained;
 
+        // parameters used per segment (bound with pbind)
+        float maxheight,maxaspect,context,abs_xhmul;
+        int mdilate,csize,njitter,batchsize;
+        bool use_props,use_reject,abs_truncate,correct_lineinfo;
+        iucstring cnorm,ds8_append;
+        autodel<Ds8Writer> ds8out;
+
         LinerecExtracted() {
             pdef("classifier","latin","character classifier");
             pdef("cpreload","none","classifier to be loaded prior to training");
@@ -134,6 +141,22 @@ namespace glinerec {
             pdef("space_max",1.1,"maximum space threshold (in xheight)");
             pdef("maxheight",300,"maximum height of input line");
             pdef("maxaspect",0.5,"maximum height/width ratio of input line");
+            pdef("batchsize",256,"number of segments classified together in recognizeLine");
+            pdef("ds8_append","","append training samples to this ds8 file instead of buffering them");
+            pbind("maxheight",maxheight);
+            pbind("maxaspect",maxaspect);
+            pbind("context",context);
+            pbind("abs_xhmul",abs_xhmul);
+            pbind("mdilate",mdilate);
+            pbind("csize",csize);
+            pbind("njitter",njitter);
+            pbind("batchsize",batchsize);
+            pbind("use_props",use_props);
+            pbind("use_reject",use_reject);
+            pbind("abs_truncate",abs_truncate);
+            pbind("correct_lineinfo",correct_lineinfo);
+            pbind("cnorm",cnorm);
+            pbind("ds8_append",ds8_append);
             segmenter = make_DpSegmenter();
             grouper = make_SimpleGrouper();
             featuremap = dynamic_cast<IFeatureMap*>(component_construct(pget("fmap")));
@@ -151,7 +174,9 @@ namespace glinerec {
             iprintf(stream,depth,"LinerecExtracted\n");
             pprint(stream,depth);
             iprintf(stream,depth,"segmenter: %s\n",!segmenter?"null":segmenter->description());
+            if(!!segmenter) segmenter->pprint(stream,depth+1);
             iprintf(stream,depth,"grouper: %s\n",!grouper?"null":grouper->description());
+            if(!!grouper) grouper->pprint(stream,depth+1);
             featuremap->info(depth,stream);
             classifier->info(depth,stream);
         }
@@ -163,12 +188,64 @@ namespace glinerec {
             const char *key = argv[0];
             const char *value = argv[1];
             if(key && value && !strcmp(key,"save_ds8")) {
+                if(!!ds8out) {
+                    // the samples went to ds8_append instead
+                    ds8out->close();
+                    ds8out = 0;
+                    debugf("info","samples were appended to %s, not saving %s\n",
+                           ds8_append.c_str(),value);
+                    return "ok";
+                }
                 classifier->saveData(stdio(value,"w"));
                 return "ok";
             } else if(key && value && !strcmp(key,"load_ds8")) {
                 classifier->loadData(stdio(value,"r"));
                 current_recognizer_ = this;
                 return "ok";
+            } else if(key && !strcmp(key,"quantize")) {
+                static char buf[100];
+                sprintf(buf,"%d",quantize_mlps(*classifier));
+                return buf;
+            } else if(key && value && !strcmp(key,"evaluate_ds8")) {
+                // error rate, classification time and #samples on a dataset
+                // (ds8 files are mapped, older datasets are read)
+                static char buf[100];
+                stdio stream(value,"r");
+                MmapDataset mapped;
+                RowDataset<float8> loaded;
+                IDataset *ds = &mapped;
+                if(ds8_check_magic(stream)) {
+                    mapped.open(stream);
+                } else {
+                    loaded.load(stream);
+                    ds = &loaded;
+                }
+                double seconds;
+                float error = estimate_errors_batch(*classifier,*ds,&seconds);
+                sprintf(buf,"%g %g %d",error,seconds,ds->nsamples());
+                return buf;
+            } else if(key && value && !strcmp(key,"time_features")) {
+                // time the feature map on a line image, optionally with
+                // the feature map parameter pyramid set to argv[2];
+                // returns #vectors, setLine seconds, extraction seconds
+                static char buf[100];
+                if(argv[2] && featuremap->pexists("pyramid"))
+                    featuremap->pset("pyramid",argv[2]);
+                bytearray image;
+                read_image_gray(image,value);
+                setLine(image);
+                double start = now();
+                featuremap->setLine(image);
+                double setline = now()-start;
+                int n = grouper->length();
+                start = now();
+#pragma omp parallel for schedule(dynamic,10)
+                for(int i=0;i<n;i++) {
+                    floatarray v;
+                    extractFeatures(v,i);
+                }
+                sprintf(buf,"%d %g %g",n,setline,now()-start);
+                return buf;
             } else {
                 return classifier->command(argv);
             }
@@ -206,6 +283,12 @@ namespace glinerec {
         }
 
         void finishTraining() {
+            if(!!ds8out) {
+                // the samples are on disk; train with loadseg
+                ds8out->close();
+                ds8out = 0;
+                return;
+            }
             classifier->updateModel();
         }
 
@@ -248,7 +331,9 @@ namespace glinerec {
 
         bytearray binarized;
         void setLine(bytearray &image) {
-            CHECK_ARG(image.dim(1)<pgetf("maxheight"));
+            StatsTimer timer("setLine");
+            pupdate();
+            CHECK_ARG(image.dim(1)<maxheight);
             // initialize the feature map to the line image
             featuremap->setLine(image);
 
@@ -274,7 +359,7 @@ namespace glinerec {
             // compute line info
             get_extended_line_info(intercept,slope,xheight,
                                    descender_sink,ascender_rise,segmentation);
-            if(pgetf("correct_lineinfo"))
+            if(correct_lineinfo)
                 correct_extended_line_info(intercept,slope,xheight,
                                            descender_sink,ascender_rise,segmentation);
             debugf("detail","LineInfo %g %g %g %g %g\n",intercept,slope,xheight,descender_sink,ascender_rise);
@@ -286,8 +371,7 @@ namespace glinerec {
         }
 
         void extractFeatures(floatarray &v,int i) {
-            const char *cnorm = pget("cnorm");
-            CHECK_ARG(v.dim(1)<pgetf("maxheight"));
+            CHECK_ARG(v.dim(1)<maxheight);
             if(!strcmp(cnorm,"center")) extractFeaturesCenter(v,i);
             else if(!strcmp(cnorm,"abs")) extractFeaturesAbs(v,i);
             else throwf("%s: unknown cnorm",cnorm);
@@ -295,13 +379,11 @@ namespace glinerec {
 
         void extractFeaturesCenter(floatarray &v,int i) {
             dsection("featcenter");
-            CHECK_ARG(v.dim(1)<pgetf("maxheight"));
+            CHECK_ARG(v.dim(1)<maxheight);
             rectangle b;
             bytearray mask;
-            float context = pgetf("context");
-            int mdilate = pgetf("mdilate");
             grouper->getMask(b,mask,i,0);
-            CHECK_ARG(b.height()<pgetf("maxheight"));
+            CHECK_ARG(b.height()<maxheight);
             if(mdilate>0) {
                 pad_by(mask,mdilate,mdilate);
                 b.pad_by(mdilate,mdilate);
@@ -347,13 +429,13 @@ namespace glinerec {
         }
 
         void extractFeaturesAbs(floatarray &v,int i) {
-            CHECK_ARG(v.dim(1)<pgetf("maxheight"));
+            CHECK_ARG(v.dim(1)<maxheight);
             rectangle b;
             bytearray mask;
             float x=0,y=0;
             dsection("featabs");
             grouper->getMask(b,mask,i,0);
-            CHECK_ARG(b.height()<pgetf("maxheight"));
+            CHECK_ARG(b.height()<maxheight);
             dshown(mask,"b");
             centroid(x,y,mask);
             CHECK(x>=0 && y>=0);
@@ -362,8 +444,6 @@ namespace glinerec {
             int xi = int(x);
             int yi = int(y);
             int r;
-            float abs_xhmul = pgetf("abs_xhmul");
-            bool abs_truncate = pgetf("abs_truncate");
             r = int(abs_xhmul*xheight/2);
             if(!abs_truncate) r = max(max(r,b.width()),b.height());
             CHECK(r>0 && r<1000);
@@ -390,7 +470,6 @@ namespace glinerec {
             float width = b.width() / float(xheight);
             float height = b.height() / float(xheight);
             float aspect = log(b.height() / float(b.width()));
-            int csize = pgetf("csize");
             push_unary(v,top,-1,4,csize);
             push_unary(v,bottom,-1,4,csize);
             push_unary(v,width,-1,4,csize);
@@ -405,14 +484,19 @@ namespace glinerec {
         }
 
         void addTrainingLine(intarray &cseg,bytearray &image,nustring &tr) {
-            if(image.dim(1)>pgetf("maxheight")) 
+            pupdate();
+            long lookups = global_param_lookups;
+            if(image.dim(1)>maxheight) 
                 throwf("input line too high (%d x %d)",image.dim(0),image.dim(1));
-            if(image.dim(1)*1.0/image.dim(0)>pgetf("maxaspect")) 
+            if(image.dim(1)*1.0/image.dim(0)>maxaspect) 
                 throwf("input line has bad aspect ratio (%d x %d)",image.dim(0),image.dim(1));
-            bool use_reject = pgetf("use_reject");
             dsection("training");
             CHECK(image.dim(0)==cseg.dim(0) && image.dim(1)==cseg.dim(1));
             current_recognizer_ = this;
+            if(ds8_append.length()>0 && !ds8out) {
+                ds8out = new Ds8Writer();
+                ds8out->open(ds8_append);
+            }
 
             // check and set the transcript
             transcript.copy(tr);
@@ -461,8 +545,6 @@ namespace glinerec {
                 if(c==reject_class) junk++;
 
                 // extract the character and add it to the classifier
-                int njitter = pgetf("njitter");
-                bool use_props = pgetf("use_props");
                 floatarray v;
                 for(int k=0;k<njitter;k++) {
                     extractFeatures(v,i);
@@ -472,11 +554,9 @@ namespace glinerec {
                     total++;
 #pragma omp critical
                     {
-                        if(use_reject) {
-                            classifier->add(v,c);
-                        } else {
-                            if(c!=reject_class)
-                                classifier->add(v,c);
+                        if(use_reject || c!=reject_class) {
+                            if(!!ds8out) ds8out->add(v,c,k>0);
+                            else classifier->add(v,c);
                         }
                     }
                 }
@@ -485,6 +565,8 @@ namespace glinerec {
             }
             debugf("detail","addTrainingLine trained %d chars, %d junk, %s total\n",total-junk,junk,
                     classifier->command("total"));
+            debugf("plookups","addTrainingLine %ld parameter lookups\n",
+                   global_param_lookups-lookups);
             dwait();
         }
 
@@ -523,66 +605,103 @@ namespace glinerec {
         }
 
         void recognizeLine(intarray &segmentation_,IGenericFst &result,bytearray &image_) {
-            if(image_.dim(1)>pgetf("maxheight")) 
+            StatsTimer timer("recognizeLine");
+            pupdate();
+            long lookups = global_param_lookups;
+            if(image_.dim(1)>maxheight) 
                 throwf("input line too high (%d x %d)",image_.dim(0),image_.dim(1));
-            if(image_.dim(1)*1.0/image_.dim(0)>pgetf("maxaspect")) 
+            if(image_.dim(1)*1.0/image_.dim(0)>maxaspect) 
                 throwf("input line has bad aspect ratio (%d x %d)",image_.dim(0),image_.dim(1));
-            bool use_reject = pgetf("use_reject");
             bytearray image;
             image = image_;
             dsection("recognizing");
             logger.log("input\n",image);
             setLine(image);
             segmentation_ = segmentation;
-            bytearray available;
-            floatarray v,p,cp,ccosts,props;
             int ncomponents = grouper->length();
-            rectangle b;
 
             estimateSpaceSize();
+            CHECK_ARG(batchsize>0);
 
-#pragma omp parallel for schedule(dynamic,10) private(p,v,b,props)
-            for(int i=0;i<ncomponents;i++) {
-#if 0
-                bytearray raw;
-                grouper->extract(raw,binarized,0,i);
-                floatarray v;
-                features->extract(v,raw);
-#else
-                extractFeatures(v,i);
-#endif
-                v.reshape(v.length());
-                pushProps(v,i);
-                float ccost = classifier->outputs(p,v);
-#pragma omp critical
+            // extract the features for a batch of segments in parallel,
+            // then classify the whole batch with a single call
+            for(int start=0;start<ncomponents;start+=batchsize) {
+                int n = min(batchsize,ncomponents-start);
+                narray<floatarray> vs(n);
+                {
+                    StatsTimer timer("features");
+#pragma omp parallel for schedule(dynamic,10)
+                    for(int k=0;k<n;k++) {
+                        floatarray &v = vs(k);
+                        extractFeatures(v,start+k);
+                        v.reshape(v.length());
+                        pushProps(v,start+k);
+                    }
+                }
+                for(int k=1;k<n;k++)
+                    CHECK(vs(k).length()==vs(0).length());
+                floatarray inputs,outputs,ccosts;
+                rowstack(inputs,vs);
+                vs.dealloc();
                 {
-                    if(use_reject) {
+                    StatsTimer timer("classify");
+                    classifier->batchOutputs(outputs,ccosts,inputs);
+                }
+
+                // turn the outputs into a table of costs in parallel;
+                // the grouper takes each row with a single call
+                // a classifier without classes leaves outputs with no columns;
+                // then every segment is treated as unclassifiable below
+                int no = outputs.length()>0 ? outputs.dim(1) : 0;
+                int nc = max(no,int('~')+1);
+                floatarray costs(n,nc);
+                costs.fill(INFINITY);
+#pragma omp parallel for schedule(dynamic,10)
+                for(int k=0;k<n;k++) {
+                    int i = start+k;
+                    float ccost = ccosts(k);
+                    float *p = no>0 ? &outputs(k,0) : 0;
+                    float *c = &costs(k,0);
+                    if(use_reject && no>0) {
                         ccost = 0;
-                        p /= sum(p);
+                        float total = rowsum(outputs,k);
+                        for(int j=0;j<no;j++) p[j] /= total;
                     }
                     int count = 0;
-                    for(int j=0;j<p.length();j++) {
+                    for(int j=0;j<no;j++) {
                         if(j==reject_class) continue;
-                        float pcost = p(j)>1e-6?-log(p(j)):-log(1e-6);
+                        float pcost = p[j]>1e-6?-log(p[j]):-log(1e-6);
                         debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
-                        grouper->setClass(i,j,pcost+ccost);
+                        c[j] = pcost+ccost;
                         count++;
                     }
                     if(count==0) {
+                        rectangle b = grouper->boundingBox(i);
                         if(b.height()<xheight/2 && b.width()<xheight/2) {
-                            grouper->setClass(i,'~',high_cost/2);
+                            c['~'] = high_cost/2;
                         } else {
-                            grouper->setClass(i,'#',(b.width()/xheight)*high_cost);
+                            c['#'] = (b.width()/xheight)*high_cost;
                         }
                     }
+                }
+
+                floatarray row;
+                for(int k=0;k<n;k++) {
+                    int i = start+k;
+                    rowget(row,costs,k);
+                    grouper->setClasses(i,row);
                     if(grouper->pixelSpace(i)>space_threshold) {
                         debugf("spaces","space %d\n",grouper->pixelSpace(i));
                         grouper->setSpaceCost(i,1.0,5.0);
                     }
-                    // dwait();
                 }
             }
-            grouper->getLattice(result);
+            {
+                StatsTimer timer("getLattice");
+                grouper->getLattice(result);
+            }
+            debugf("plookups","recognizeLine %ld parameter lookups\n",
+                   global_param_lookups-lookups);
         }
 
         void align(nustring &chars,intarray &seg,floatarray &costs,
@@ -54,6 +54,7 @@ namespace {
             came_from.resize(n);
             fill(came_from, -1);
             g.resize(n);
+            fill(g, 1e38); // stays so for unreachable nodes
 
             // insert the start node
             int s = fst.getStart();
@@ -101,6 +102,13 @@ namespace {
             return false;
         }
 
+        // unlike loop(), go on after the accept node has popped up,
+        // so that g is final for every reachable node
+        void settle() {
+            while(heap.length())
+                step();
+        }
+
         bool reconstruct_vertices(intarray &result_vertices) {
             intarray vertices;
             if(accepted_from == -1)
@@ -151,20 +159,151 @@ namespace {
         }
     };
 
-    struct AStarCompositionSearch : AStarSearch {
-        floatarray &g1, &g2; // well, that's against our convention,
-        CompositionFst &c;   // but I let it go since it's so local.
+    struct AStarFrozenSearch : AStarSearch {
+        float *h;
 
         virtual double heuristic(int index) {
-            int i1, i2;
-            c.splitIndex(i1, i2, index);
-            return g1[i1] + g2[i2];
+            return h[index];
         }
 
-        AStarCompositionSearch(floatarray &g1, floatarray &g2, CompositionFst &c) : AStarSearch(c), g1(g1), g2(g2), c(c) {
+        AStarFrozenSearch(FrozenFst &fst) : AStarSearch(fst), h(fst.heuristics) {
         }
     };
 
+    /// A* in a LazyComposition, using the sum of the heuristics of the
+    /// operands.  The arrays grow with the states of the composition as
+    /// they're reached, so unreachable states cost nothing.
+    template <class Composition>
+    struct AStarCompositionSearch {
+        Composition &c;
+        float *g1, *g2;
+
+        intarray came_from; // -1 for unseen, self for the start
+        floatarray g;
+        // the best arc into each state
+        intarray came_input;
+        intarray came_output;
+        floatarray came_cost;
+        int accepted_from;
+        float g_accept;
+        Heap heap;          // state i is node i + 1, node 0 is the accept
+
+        intarray inputs, targets, outputs;
+        floatarray costs;
+
+        double heuristic(int index) {
+            return g1[c.states.first[index]] + g2[c.states.second[index]];
+        }
+
+        void grow() {
+            int n = c.nStates();
+            while(came_from.length() < n) {
+                came_from.push(-1);
+                g.push(1e38);
+                came_input.push(0);
+                came_output.push(0);
+                came_cost.push(0);
+            }
+            heap.grow(n + 1);
+        }
+
+        AStarCompositionSearch(Composition &c, float *g1, float *g2)
+            : c(c), g1(g1), g2(g2), accepted_from(-1), heap(1) {
+            int s = c.getStart();
+            grow();
+            g[s] = 0;
+            came_from[s] = s;
+            heap.push(s + 1, heuristic(s));
+        }
+
+        bool step() {
+            int node = heap.pop() - 1;
+            if(node < 0)
+                return true;  // accept has popped up
+            c.arcs(inputs, targets, outputs, costs, node);
+            grow();
+            for(int i = 0; i < targets.length(); i++) {
+                int t = targets[i];
+                if(came_from[t] == -1 || g[node] + costs[i] < g[t]) {
+                    came_from[t] = node;
+                    g[t] = g[node] + costs[i];
+                    came_input[t] = inputs[i];
+                    came_output[t] = outputs[i];
+                    came_cost[t] = costs[i];
+                    heap.push(t + 1, g[t] + heuristic(t));
+                }
+            }
+            float accept = c.getAcceptCost(node);
+            if(accepted_from == -1 || g[node] + accept < g_accept) {
+                accepted_from = node;
+                g_accept = g[node] + accept;
+                heap.push(0, g_accept);
+            }
+            return false;
+        }
+
+        bool loop() {
+            while(heap.length()) {
+                if(step())
+                    return true;
+            }
+            return false;
+        }
+
+        /// Same output as AStarSearch's reconstruct_vertices() and
+        /// reconstruct_edges(), with the states split into pairs.
+        bool reconstruct(intarray &r_inputs,
+                         intarray &vertices1,
+                         intarray &vertices2,
+                         intarray &r_outputs,
+                         floatarray &r_costs) {
+            if(accepted_from == -1)
+                return false;
+            intarray path;
+            for(int v = accepted_from; ; v = came_from[v]) {
+                path.push(v);
+                if(came_from[v] == v)
+                    break;
+            }
+            int n = path.length();
+            vertices1.resize(n);
+            vertices2.resize(n);
+            r_inputs.resize(n);
+            r_outputs.resize(n);
+            r_costs.resize(n);
+            for(int i = 0; i < n; i++) {
+                int v = path[n - 1 - i];
+                c.splitIndex(vertices1[i], vertices2[i], v);
+                if(i < n - 1) {
+                    // the arc from vertex i to vertex i + 1
+                    int next = path[n - 2 - i];
+                    r_inputs[i] = came_input[next];
+                    r_outputs[i] = came_output[next];
+                    r_costs[i] = came_cost[next];
+                }
+            }
+            r_inputs[n - 1] = 0;
+            r_outputs[n - 1] = 0;
+            r_costs[n - 1] = c.getAcceptCost(accepted_from);
+            return true;
+        }
+    };
+
+    template <class Composition>
+    bool a_star_lazy(intarray &inputs,
+                     intarray &vertices1,
+                     intarray &vertices2,
+                     intarray &outputs,
+                     floatarray &costs,
+                     Composition &composition,
+                     float *g1,
+                     float *g2) {
+        AStarCompositionSearch<Composition> a(composition, g1, g2);
+        if(!a.loop())
+            return false;
+        return a.reconstruct(inputs, vertices1, vertices2, outputs, costs);
+    }
+
     /*struct AStarN : AStarSearch {
         narray<floatarray> &g;
         narray< autodel<CompositionFst> > &c;
@@ -188,27 +327,6 @@ namespace {
         }
     };*/
 
-    bool a_star2_internal(intarray &inputs,
-                          intarray &vertices1,
-                          intarray &vertices2,
-                          intarray &outputs,
-                          floatarray &costs,
-                          IGenericFst &fst1,
-                          IGenericFst &fst2,
-                          floatarray &g1,
-                          floatarray &g2,
-                          CompositionFst& composition) {
-        intarray vertices;
-        AStarCompositionSearch a(g1, g2, composition);
-        if(!a.loop())
-            return false;
-        if(!a.reconstruct_vertices(vertices))
-            return false;
-        a.reconstruct_edges(inputs, outputs, costs, vertices);
-        composition.splitIndices(vertices1, vertices2, vertices);
-        return true;
-    }
-
     /*
     // Pointers - eek... I know.
     // But we don't have a non-owning wrapper yet, do we?
@@ -267,6 +385,21 @@ namespace ocropus {
         remove_epsilons(result, outputs);
         return sum(costs);
     }
+
+    double a_star(nustring &result, FrozenFst &fst) {
+        intarray inputs;
+        intarray vertices;
+        intarray outputs;
+        floatarray costs;
+        AStarFrozenSearch a(fst);
+        if(!a.loop())
+            return 1e38;
+        if(!a.reconstruct_vertices(vertices))
+            return 1e38;
+        a.reconstruct_edges(inputs, outputs, costs, vertices);
+        remove_epsilons(result, outputs);
+        return sum(costs);
+    }
 }
 
 namespace {
@@ -317,24 +450,17 @@ namespace ocropus {
                                floatarray &costs,
                                OcroFST &fst1,
                                OcroFST &fst2) {
-        autodel<CompositionFst> composition(make_CompositionFst(&fst1, &fst2));
-        bool result;
-        try {
-            floatarray g1, g2;
-            fst1.calculateHeuristics();
-            fst2.calculateHeuristics();
-            result = a_star2_internal(inputs, vertices1, vertices2, outputs,
-                                      costs, fst1, fst2,
-                                      fst1.heuristics(),
-                                      fst2.heuristics(), *composition);
-        } catch(...) {
-            composition->move1();
-            composition->move2();
-            throw;
-        }
-        composition->move1();
-        composition->move2();
-        return result;
+        fst1.calculateHeuristics();
+        fst2.calculateHeuristics();
+        return a_star_in_composition(inputs, vertices1, vertices2, outputs,
+                                     costs, fst1, fst1.heuristics(),
+                                     fst2, fst2.heuristics());
+    }
+
+    void a_star_forward(floatarray &costs_for_all_nodes, IGenericFst &fst) {
+        AStarSearch a(fst);
+        a.settle();
+        copy(costs_for_all_nodes, a.g);
     }
 
     void a_star_backwards(floatarray &costs_for_all_nodes, IGenericFst &fst) {
@@ -358,19 +484,12 @@ namespace ocropus {
                                floatarray &g1,
                                OcroFST &fst2,
                                floatarray &g2) {
-        autodel<CompositionFst> composition(make_CompositionFst(&fst1, &fst2));
-        bool result;
-        try {
-            result = a_star2_internal(inputs, vertices1, vertices2, outputs,
-                                      costs, fst1, fst2, g1, g2, *composition);
-        } catch(...) {
-            composition->move1();
-            composition->move2();
-            throw;
-        }
-        composition->move1();
-        composition->move2();
-        return result;
+        fst1.sortByOutput();
+        fst2.sortByInput();
+        OcroArcs arcs1(&fst1), arcs2(&fst2);
+        LazyComposition<OcroArcs, OcroArcs> composition(arcs1, arcs2);
+        return a_star_lazy(inputs, vertices1, vertices2, outputs, costs,
+                           composition, g1.data, g2.data);
     }
 
     double a_star(nustring &result, OcroFST &fst1, OcroFST &fst2) {
@@ -385,6 +504,24 @@ namespace ocropus {
         return sum(costs);
     }
 
+    double a_star(nustring &result, OcroFST &fst1, FrozenFst &fst2) {
+        intarray inputs;
+        intarray v1;
+        intarray v2;
+        intarray outputs;
+        floatarray costs;
+        fst1.calculateHeuristics();
+        fst1.sortByOutput();
+        LazyComposition<OcroArcs, FrozenArcs> composition(
+                OcroArcs(&fst1), FrozenArcs(fst2, fst2.by_input));
+        bool found = a_star_lazy(inputs, v1, v2, outputs, costs, composition,
+                                 fst1.heuristics().data, fst2.heuristics);
+        if(!found)
+            return 1e38;
+        remove_epsilons(result, outputs);
+        return sum(costs);
+    }
+
 
 
 /*    bool a_star_in_composition(colib::intarray &inputs,
@@ -26,6 +26,7 @@
 
 namespace ocropus {
     void a_star_backwards(floatarray &costs_for_all_nodes, IGenericFst &fst);
+    void a_star_forward(floatarray &costs_for_all_nodes, IGenericFst &fst);
 };
 
 #endif
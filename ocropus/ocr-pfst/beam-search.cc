@@ -21,8 +21,11 @@
 // Primary Repository:
 // Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
 
+#include <omp.h>
 #include "ocr-pfst.h"
 #include "fst-heap.h"
+#include "lattice.h"
+#include "stats.h"
 
 using namespace colib;
 using namespace ocropus;
@@ -76,6 +79,45 @@ namespace {
             reverse(r_costs, t_c);
         }
 
+        /// Drop all nodes that aren't ancestors of the given ones, and
+        /// renumber those in place.  Parents keep coming before their
+        /// children.
+        void compact(intarray &ids, int &id) {
+            int n = parents.length();
+            intarray renumber(n);
+            fill(renumber, -1);
+            for(int i = -1; i < ids.length(); i++) {
+                int current = i < 0 ? id : ids[i];
+                while(current != -1 && renumber[current] == -1) {
+                    renumber[current] = 0;
+                    current = parents[current];
+                }
+            }
+            int k = 0;
+            for(int i = 0; i < n; i++) {
+                if(renumber[i] == -1)
+                    continue;
+                renumber[i] = k;
+                parents[k] = parents[i] == -1 ? -1 : renumber[parents[i]];
+                v1[k] = v1[i];
+                v2[k] = v2[i];
+                inputs[k] = inputs[i];
+                outputs[k] = outputs[i];
+                costs[k] = costs[i];
+                k++;
+            }
+            // shrinking with resize keeps the first k elements
+            parents.resize(k);
+            v1.resize(k);
+            v2.resize(k);
+            inputs.resize(k);
+            outputs.resize(k);
+            costs.resize(k);
+            for(int i = 0; i < ids.length(); i++)
+                ids[i] = renumber[ids[i]];
+            id = renumber[id];
+        }
+
         int add(int parent, int vertex1, int vertex2,
                    int input, int output, float cost) {
             int n = parents.length();
@@ -91,35 +133,126 @@ namespace {
         }
     };
     
+    /// The index of a state is kept in pool as the number d of distinct
+    /// non-epsilon input labels, the labels in ascending order, and d+1
+    /// positions in the state's arcs (sorted by input) where the arcs
+    /// with each label start.  slots holds the position of a state's
+    /// index in pool plus one, -1 for a state that didn't fit, and 0 for
+    /// one that wasn't reached yet.  A state is only written once, under
+    /// the lock, and pool never moves, so readers don't need the lock.
+    struct LmStateCacheImpl : LmStateCache {
+        // states with fewer arcs, or fewer than min_ratio times the
+        // arcs of the lattice state, are merged
+        enum { min_arcs = 16, min_ratio = 4 };
+        FrozenFst &fst;
+        intarray slots;
+        intarray pool;
+        int used;
+        int states;
+
+        LmStateCacheImpl(FrozenFst &fst, long maxbytes) : fst(fst) {
+            slots.resize(fst.nstates);
+            fill(slots, 0);
+            pool.resize(int(min(maxbytes / long(sizeof(int)), long(1<<30))));
+            used = 0;
+            states = 0;
+        }
+        void counts(int &nstates, long &bytes) {
+#pragma omp critical(lmstatecache)
+            {
+                nstates = states;
+                bytes = long(used) * long(sizeof(int));
+            }
+        }
+        /// the index of the state, or 0 if it has none
+        int *find(int node) {
+            int slot;
+#pragma omp atomic read
+            slot = slots.data[node];
+            if(slot == 0)
+                slot = add(node);
+            return slot > 0 ? pool.data + slot - 1 : 0;
+        }
+        int add(int node) {
+            int slot;
+#pragma omp critical(lmstatecache)
+            {
+                slot = slots.data[node];
+                if(slot == 0) {
+                    FrozenFst::Arc *arcs = fst.by_input + fst.offsets[node];
+                    int n = fst.offsets[node + 1] - fst.offsets[node];
+                    int k0 = 0;
+                    while(k0 < n && !arcs[k0].input) k0++;
+                    int d = 0;
+                    for(int k = k0; k < n; k++)
+                        if(k == k0 || arcs[k].input != arcs[k - 1].input) d++;
+                    if(n < min_arcs || used + 2 * d + 2 > pool.length()) {
+                        slot = -1;
+                    } else {
+                        int *index = pool.data + used;
+                        int *labels = index + 1;
+                        int *starts = labels + d;
+                        index[0] = d;
+                        int j = 0;
+                        for(int k = k0; k < n; k++) {
+                            if(k > k0 && arcs[k].input == arcs[k - 1].input)
+                                continue;
+                            labels[j] = arcs[k].input;
+                            starts[j] = k;
+                            j++;
+                        }
+                        starts[d] = n;
+                        slot = used + 1;
+                        used += 2 * d + 2;
+                        states++;
+                    }
+#pragma omp flush
+#pragma omp atomic write
+                    slots.data[node] = slot;
+                }
+            }
+            return slot;
+        }
+    };
+
+    template <class Arcs1, class Arcs2>
     struct BeamSearch {
-        OcroFST &fst1;
-        OcroFST &fst2;
+        Arcs1 fst1;
+        Arcs2 fst2;
+        LmStateCacheImpl *cache;  // only for a FrozenFst sorted by input
         SearchTree stree;
 
         intarray beam; // indices into stree
         floatarray beamcost; // global cost, corresponds to the beam
 
-        PriorityQueue nbest;
+        BeamHeap nbest;
+        intarray ranked; // tags from nbest, best first
         intarray all_inputs;
         intarray all_targets1;
         intarray all_targets2;
         intarray all_outputs;
         floatarray all_costs;
         intarray parent_trails; // indices into the beam
+        intarray new_beam;
+        floatarray new_beamcost;
         int beam_width;
         int accepted_from1;
         int accepted_from2;
         float g_accept;   // best cost for accept so far
         int best_so_far;  // ID into stree (-1 for start)
         float best_cost_so_far;
+        int compact_at;   // stree size at which it gets compacted
+        BeamStats stats;
 
-        BeamSearch(OcroFST &fst1, OcroFST &fst2, int beam_width): 
+        BeamSearch(Arcs1 fst1, Arcs2 fst2, int beam_width): 
                 fst1(fst1),
                 fst2(fst2),
+                cache(0),
                 nbest(beam_width),
                 beam_width(beam_width),
                 accepted_from1(-1),
                 accepted_from2(-1) {
+            stats.beam_width = beam_width;
         }
 
         void clear() {
@@ -138,9 +271,8 @@ namespace {
                    double base_cost, int trail_index) {
             //logger.format("relaxing %d %d -> %d %d (bcost %f, cost %f)", f1, f2, t1, t2, base_cost, cost);
             
-            if(!nbest.add_replacing_id(t1 * fst2.nStates() + t2,
-                                       all_costs.length(),
-                                       - base_cost - cost))
+            if(!nbest.add_replacing(t1, t2, all_costs.length(),
+                                    - base_cost - cost))
                 return;
             
             //logger.format("nbest changed");
@@ -181,48 +313,72 @@ namespace {
         /// Call relax() for each arc going out of the given node.
         void traverse(int n1, int n2, double cost, int trail_index) {
             //logger.format("traversing %d %d", n1, n2);
-            intarray &o1 = fst1.outputs(n1);
-            intarray &i1 = fst1.inputs(n1);
-            intarray &t1 = fst1.targets(n1);
-            floatarray &c1 = fst1.costs(n1);
-
-            intarray &o2 = fst2.outputs(n2);
-            intarray &i2 = fst2.inputs(n2);
-            intarray &t2 = fst2.targets(n2);
-            floatarray &c2 = fst2.costs(n2);
-
-            // for optimization
-            int *O1 = o1.data;
-            int *O2 = o2.data;
-            int *I1 = i1.data;
-            int *I2 = i2.data;
-            int *T1 = t1.data;
-            int *T2 = t2.data;
-            float *C1 = c1.data;
-            float *C2 = c2.data;
+            fst1.load(n1);
+            fst2.load(n2);
+            int l1 = fst1.n;
+            int l2 = fst2.n;
 
             // Relax outbound arcs in the composition
             int k1, k2;
             // relaxing fst1 epsilon moves
-            for(k1 = 0; k1 < o1.length() && !O1[k1]; k1++) {
-                relax(n1, n2, T1[k1], n2, C1[k1], k1, -1, 
-                      I1[k1], 0, 0, cost, trail_index);
+            for(k1 = 0; k1 < l1 && !fst1.output(k1); k1++) {
+                relax(n1, n2, fst1.target(k1), n2, fst1.cost(k1), k1, -1, 
+                      fst1.input(k1), 0, 0, cost, trail_index);
             }
             // relaxing fst2 epsilon moves
-            for(k2 = 0; k2 < o2.length() && !I2[k2]; k2++) {
-                relax(n1, n2, n1, T2[k2], C2[k2], -1, k2, 0,
-                      0, O2[k2], cost, trail_index);
+            for(k2 = 0; k2 < l2 && !fst2.input(k2); k2++) {
+                relax(n1, n2, n1, fst2.target(k2), fst2.cost(k2), -1, k2, 0,
+                      0, fst2.output(k2), cost, trail_index);
             }
-            
-            // relaxing non-epsilon moves
-            while(k1 < o1.length() && k2 < i2.length()) {
-                while(k1 < o1.length() && O1[k1] < I2[k2]) k1++;
-                if(k1 >= o1.length()) break;
-                while(k2 < i2.length() && O1[k1] > I2[k2]) k2++;
-                while(k1 < o1.length() && k2 < i2.length() && O1[k1] == I2[k2]){
-                    for(int j = k2; j < i2.length() && O1[k1] == I2[j]; j++)
-                        relax(n1, n2, T1[k1], T2[j], C1[k1] + C2[j],
-                              k1, j, I1[k1], O1[k1], O2[j], cost, trail_index);
+
+            // relaxing non-epsilon moves, through the index of fst2's state
+            // if it has many more arcs than fst1's (otherwise merging is
+            // just as fast); the arcs are relaxed in the same order
+            int *index = 0;
+            if(cache && l2 >= LmStateCacheImpl::min_arcs
+               && l2 > LmStateCacheImpl::min_ratio * l1)
+                index = cache->find(n2);
+            if(index) {
+                stats.indexed++;
+                int d = index[0];
+                int *labels = index + 1;
+                int *starts = labels + d;
+                int lo = 0;
+                for(; k1 < l1; k1++) {
+                    int label = fst1.output(k1);
+                    // the labels of fst1 ascend too, so search forward
+                    // from the last one, in steps that double
+                    int step = 1;
+                    while(lo + step < d && labels[lo + step] < label) {
+                        lo += step;
+                        step *= 2;
+                    }
+                    int hi = min(lo + step, d);
+                    while(lo < hi) {
+                        int mid = (lo + hi) / 2;
+                        if(labels[mid] < label) lo = mid + 1;
+                        else hi = mid;
+                    }
+                    if(lo >= d) break;
+                    if(labels[lo] != label) continue;
+                    for(int j = starts[lo]; j < starts[lo + 1]; j++)
+                        relax(n1, n2, fst1.target(k1), fst2.target(j),
+                              fst1.cost(k1) + fst2.cost(j),
+                              k1, j, fst1.input(k1), label,
+                              fst2.output(j), cost, trail_index);
+                }
+                return;
+            }
+            while(k1 < l1 && k2 < l2) {
+                while(k1 < l1 && fst1.output(k1) < fst2.input(k2)) k1++;
+                if(k1 >= l1) break;
+                while(k2 < l2 && fst1.output(k1) > fst2.input(k2)) k2++;
+                while(k1 < l1 && k2 < l2 && fst1.output(k1) == fst2.input(k2)){
+                    for(int j = k2; j < l2 && fst1.output(k1) == fst2.input(j); j++)
+                        relax(n1, n2, fst1.target(k1), fst2.target(j),
+                              fst1.cost(k1) + fst2.cost(j),
+                              k1, j, fst1.input(k1), fst1.output(k1),
+                              fst2.output(j), cost, trail_index);
                     k1++;
                 }
             }
@@ -251,10 +407,14 @@ namespace {
                 try_accept(i);
 
 
-            intarray new_beam;
-            floatarray new_beamcost;
-            for(int i = 0; i < nbest.length(); i++) {
-                int k = nbest.tag(i);
+            stats.generations++;
+            stats.entries += nbest.length();
+            stats.load += nbest.load();
+            nbest.drain(ranked);
+            new_beam.clear();
+            new_beamcost.clear();
+            for(int i = 0; i < ranked.length(); i++) {
+                int k = ranked[i];
                 if(parent_trails[k] < 0) // skip the control beam nodes
                     continue;
                 new_beam.push(stree.add(beam[parent_trails[k]],
@@ -265,8 +425,17 @@ namespace {
                 //logger.format("to new beam: trail index %d, stree %d, target %d,%d",
                         //k, new_beam[new_beam.length() - 1], all_targets1[k], all_targets2[k]);
             }
-            move(beam, new_beam);
-            move(beamcost, new_beamcost);
+            // swap rather than move, so that both keep their storage
+            swap(beam, new_beam);
+            swap(beamcost, new_beamcost);
+
+            // Most of the tree consists of dead ends; compacting whenever
+            // it doubles keeps its size proportional to the live part.
+            if(stree.parents.length() > compact_at) {
+                stats.max_tree = max(stats.max_tree, stree.parents.length());
+                stree.compact(beam, best_so_far);
+                compact_at = max(2 * stree.parents.length(), 8 * beam_width);
+            }
         }
 
         // Relax the accept arc from the beam node number i.
@@ -285,6 +454,8 @@ namespace {
         void bestpath(intarray &v1, intarray &v2, intarray &inputs, 
                       intarray &outputs, floatarray &costs) {
             stree.clear();
+            compact_at = 8 * beam_width;
+            nbest.clearCounters();
 
             beam.resize(1);
             beamcost.resize(1);
@@ -293,11 +464,19 @@ namespace {
 
             best_so_far = 0;
             best_cost_so_far = fst1.getAcceptCost(fst1.getStart()) + 
-                               fst2.getAcceptCost(fst1.getStart());
+                               fst2.getAcceptCost(fst2.getStart());
 
             while(beam.length())
                 radiate();
 
+            stats.lines++;
+            stats.max_tree = max(stats.max_tree, stree.parents.length());
+            stats.insertions += nbest.insertions;
+            stats.replacements += nbest.replacements;
+            stats.evictions += nbest.evictions;
+            stats.rejections += nbest.rejections;
+            stats.probes += nbest.probes;
+
             stree.get(v1, v2, inputs, outputs, costs, best_so_far);
             costs.push(fst1.getAcceptCost(stree.v1[best_so_far]) + 
                        fst2.getAcceptCost(stree.v2[best_so_far]));
@@ -306,6 +485,101 @@ namespace {
         }
     };
 
+    /// The search state (search tree, beam and candidate arrays) is
+    /// kept from one lattice to the next; only fst1 changes.
+    struct BeamDecoderImpl : BeamDecoder {
+        BeamSearch<OcroArcs, FrozenArcs> search;
+        intarray v1, v2, inputs;
+        intarray outputs;
+        floatarray costs;
+
+        BeamDecoderImpl(FrozenFst &fst2, int beam_width,
+                        LmStateCacheImpl *cache = 0)
+            : search(OcroArcs(), FrozenArcs(fst2, fst2.by_input), beam_width) {
+            search.cache = cache;
+        }
+        void decode(intarray &vertices1,
+                    intarray &vertices2,
+                    intarray &inputs,
+                    intarray &outputs,
+                    floatarray &costs,
+                    OcroFST &fst1) {
+            StatsTimer timer("beam_search");
+            fst1.sortByOutput();
+            search.fst1 = OcroArcs(&fst1);
+            search.bestpath(vertices1, vertices2, inputs, outputs, costs);
+        }
+        double decode(nustring &result, OcroFST &fst1) {
+            decode(v1, v2, inputs, outputs, costs, fst1);
+            remove_epsilons(result, outputs);
+            return sum(costs);
+        }
+        BeamStats &stats() {
+            return search.stats;
+        }
+    };
+
+    struct BatchDecoderImpl : BatchDecoder {
+        FrozenFst &fst2;
+        int beam_width;
+        LmStateCacheImpl lmcache;
+        narray<BeamDecoderImpl*> decoders;  // one per thread
+
+        BatchDecoderImpl(FrozenFst &fst2, int beam_width, long cache_bytes)
+            : fst2(fst2), beam_width(beam_width), lmcache(fst2, cache_bytes) {
+        }
+        ~BatchDecoderImpl() {
+            for(int i = 0; i < decoders.length(); i++)
+                delete decoders[i];
+        }
+        void decode(objlist<DecodedLine> &result, narray<OcroFST*> &lattices) {
+            int n = lattices.length();
+            result.clear();
+            for(int i = 0; i < n; i++)
+                result.push();
+            while(decoders.length() < omp_get_max_threads())
+                decoders.push(new BeamDecoderImpl(fst2, beam_width, &lmcache));
+#pragma omp parallel for schedule(dynamic,1)
+            for(int i = 0; i < n; i++) {
+                DecodedLine &line = result(i);
+                BeamDecoderImpl &decoder = *decoders[omp_get_thread_num()];
+                double start = omp_get_wtime();
+                line.cost = 1e38;
+                try {
+                    decoder.decode(line.vertices1, line.vertices2, line.inputs,
+                                   line.outputs, line.costs, *lattices[i]);
+                    line.cost = sum(line.costs);
+                } catch(const char *error) {
+                    line.error = error;
+                } catch(...) {
+                    // nothing may leave the parallel loop
+                    line.error = "beam search failed";
+                }
+                line.time = omp_get_wtime() - start;
+            }
+        }
+        void stats(BeamStats &result) {
+            result = BeamStats();
+            result.beam_width = beam_width;
+            for(int i = 0; i < decoders.length(); i++) {
+                BeamStats &s = decoders[i]->stats();
+                result.lines += s.lines;
+                result.generations += s.generations;
+                result.entries += s.entries;
+                result.load += s.load;
+                result.insertions += s.insertions;
+                result.replacements += s.replacements;
+                result.evictions += s.evictions;
+                result.rejections += s.rejections;
+                result.probes += s.probes;
+                result.max_tree = max(result.max_tree, s.max_tree);
+                result.indexed += s.indexed;
+            }
+        }
+        LmStateCache &cache() {
+            return lmcache;
+        }
+    };
 };
 
 namespace ocropus {
@@ -317,12 +591,46 @@ namespace ocropus {
                      OcroFST &fst1, 
                      OcroFST &fst2,
                      int beam_width) {
-        BeamSearch b(fst1, fst2, beam_width);
+        StatsTimer timer("beam_search");
         fst1.sortByOutput();
         fst2.sortByInput();
+        BeamSearch<OcroArcs, OcroArcs> b(OcroArcs(&fst1), OcroArcs(&fst2),
+                                         beam_width);
         b.bestpath(vertices1, vertices2, inputs, outputs, costs);
     }
 
+    void beam_search(intarray &vertices1,
+                     intarray &vertices2,
+                     intarray &inputs,
+                     intarray &outputs,
+                     floatarray &costs,
+                     OcroFST &fst1, 
+                     FrozenFst &fst2,
+                     int beam_width) {
+        BeamDecoderImpl decoder(fst2, beam_width);
+        decoder.decode(vertices1, vertices2, inputs, outputs, costs, fst1);
+    }
+
+    BeamDecoder *make_BeamDecoder(FrozenFst &fst2, int beam_width) {
+        return new BeamDecoderImpl(fst2, beam_width);
+    }
+
+    LmStateCache *make_LmStateCache(FrozenFst &fst2, long maxbytes) {
+        return new LmStateCacheImpl(fst2, maxbytes);
+    }
+
+    BeamDecoder *make_BeamDecoder(FrozenFst &fst2, LmStateCache &cache,
+                                  int beam_width) {
+        LmStateCacheImpl &impl = dynamic_cast<LmStateCacheImpl&>(cache);
+        CHECK_ARG(&impl.fst == &fst2);
+        return new BeamDecoderImpl(fst2, beam_width, &impl);
+    }
+
+    BatchDecoder *make_BatchDecoder(FrozenFst &fst2, int beam_width,
+                                    long cache_bytes) {
+        return new BatchDecoderImpl(fst2, beam_width, cache_bytes);
+    }
+
     double beam_search(nustring &result, OcroFST &fst1, OcroFST &fst2,
                        int beam_width) {
         intarray v1;
@@ -334,4 +642,10 @@ namespace ocropus {
         remove_epsilons(result, o);
         return sum(c);
     }
+
+    double beam_search(nustring &result, OcroFST &fst1, FrozenFst &fst2,
+                       int beam_width) {
+        BeamDecoderImpl decoder(fst2, beam_width);
+        return decoder.decode(result, fst1);
+    }
 }
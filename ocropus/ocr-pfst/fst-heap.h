@@ -84,6 +84,70 @@ namespace ocropus {
 
 
 
+    /// \brief A bounded n-best list of search states for beam search.
+    ///
+    /// Unlike PriorityQueue, the entries are kept in a heap with the worst
+    /// entry at the top, and an open-addressing hash table maps the states
+    /// (pairs of vertices) to their heap slots.  So adding, replacing and
+    /// evicting an entry are O(log n) instead of O(n).  drain() returns the
+    /// entries in the order PriorityQueue keeps them: highest value first,
+    /// and among equal values, the entry added or improved first.
+    class BeamHeap {
+        int n;
+        int fill;
+        int stamp;
+        int mask;               // table size - 1
+        // the heap; slot 0 holds the worst entry
+        colib::intarray states1;
+        colib::intarray states2;
+        colib::intarray tags;
+        colib::floatarray values;
+        colib::intarray stamps;
+        colib::intarray where;  // table[where[i]] == i + 1
+        // the hash table; heap slot + 1, 0 for empty
+        colib::intarray table;
+
+        bool worse(int i, int j) {
+            return values[i] < values[j]
+                || (values[i] == values[j] && stamps[i] > stamps[j]);
+        }
+        int hash(int state1, int state2) {
+            unsigned h = (unsigned(state1) * 0x9e3779b1u) ^ unsigned(state2);
+            h *= 0x85ebca6bu;
+            return (h ^ (h >> 16)) & mask;
+        }
+        int find(int state1, int state2);
+        void link(int i);
+        void unlink(int i);
+        void heapswap(int i, int j);
+        void heapify_up(int i);
+        void heapify_down(int i);
+
+    public:
+        long insertions;        // new states
+        long replacements;      // better paths to states in the heap
+        long evictions;         // states pushed out of a full heap
+        long rejections;        // offers that didn't change the heap
+        long probes;            // hash table probes
+
+        BeamHeap(int n);
+        void clear();
+        void clearCounters();
+
+        /// Offer state (state1, state2) with the given value; an existing
+        /// entry for the same state is kept if its value is at least as
+        /// high.
+        /// \returns True if the heap was changed
+        bool add_replacing(int state1, int state2, int tag, float value);
+
+        /// Remove all entries, returning their tags best first.
+        void drain(colib::intarray &result);
+
+        int length() { return fill; }
+        int capacity() { return n; }
+        double load() { return fill / double(table.length()); }
+    };
+
     // We need heap reimplementation here since we need to change costs on the fly.
     // We maintain `heapback' array for that.
     class Heap {
@@ -107,6 +171,12 @@ namespace ocropus {
         /// Create a heap storing node indices from 0 to n - 1.
         inline Heap(int n) : heapback(n) { fill(heapback, -1); }
 
+        /// Allow node indices up to n - 1.
+        inline void grow(int n) {
+            while(heapback.length() < n)
+                heapback.push(-1);
+        }
+
         inline int length() { return heap.length(); }
 
         /// Return the item with the least cost and remove it from the heap.
@@ -24,6 +24,7 @@
 
 #include "ocr-pfst.h"
 #include "lattice.h"
+#include "a-star.h"
 
 using namespace colib;
 using namespace ocropus;
@@ -275,17 +276,81 @@ namespace ocropus {
         }
     }
 
+    void fst_prune(IGenericFst &dst, IGenericFst &src, float beam, int max_arcs) {
+        int n = src.nStates();
+        floatarray forward, backward;
+        a_star_forward(forward, src);
+        a_star_backwards(backward, src);
+        double best = 1e38;
+        for(int i = 0; i < n; i++)
+            best = min(best, double(forward[i]) + src.getAcceptCost(i));
+        if(best >= 1e30) {
+            fst_copy(dst, src);
+            return;
+        }
+        // forward and backward are sums of floats taken in different
+        // orders; the slack keeps the best path itself from being cut
+        double limit = beam < 0 ? 1e30 : best + beam + 1e-4 * (1 + fabs(best));
+        dst.clear();
+        for(int i = 0; i < n; i++)
+            dst.newState();
+        dst.setStart(src.getStart());
+        intarray targets, outputs, inputs;
+        floatarray costs, through;
+        intarray permutation;
+        bytearray keep;
+        for(int i = 0; i < n; i++) {
+            float accept = src.getAcceptCost(i);
+            if(forward[i] + double(accept) <= limit)
+                dst.setAccept(i, accept);
+            src.arcs(inputs, targets, outputs, costs, i);
+            int m = inputs.length();
+            through.resize(m);
+            keep.resize(m);
+            for(int j = 0; j < m; j++) {
+                through[j] = forward[i] + double(costs[j]) + backward[targets[j]];
+                keep[j] = through[j] <= limit;
+            }
+            if(max_arcs > 0) {
+                // the arcs between two states are the classes of one
+                // segment; keep the best max_arcs of them
+                quicksort(permutation, through);
+                inthash< Integer<0> > count;
+                for(int k = 0; k < m; k++) {
+                    int j = permutation[k];
+                    if(!keep[j]) continue;
+                    if(count(targets[j]) >= max_arcs)
+                        keep[j] = 0;
+                    else
+                        count(targets[j])++;
+                }
+            }
+            for(int j = 0; j < m; j++)
+                if(keep[j])
+                    dst.addTransition(i, targets[j], outputs[j], costs[j], inputs[j]);
+        }
+    }
+
     void fst_expand_composition(IGenericFst &out,
                                 OcroFST &f1, OcroFST &f2) {
-        autodel<CompositionFst> composition(make_CompositionFst(&f1, &f2));
-        try {
-            fst_copy(out, *composition);
-        } catch(...) {
-            composition->move1();
-            composition->move2();
-            throw;
+        f1.sortByOutput();
+        f2.sortByInput();
+        OcroArcs arcs1(&f1), arcs2(&f2);
+        LazyComposition<OcroArcs, OcroArcs> composition(arcs1, arcs2);
+        out.clear();
+        out.setStart(out.newState());
+        CHECK(composition.getStart() == 0);
+        intarray inputs, targets, outputs;
+        floatarray costs;
+        // states are numbered as they are reached, so this visits
+        // exactly the reachable ones
+        for(int i = 0; i < composition.nStates(); i++) {
+            composition.arcs(inputs, targets, outputs, costs, i);
+            while(out.nStates() < composition.nStates())
+                out.newState();
+            out.setAccept(i, composition.getAcceptCost(i));
+            for(int j = 0; j < targets.length(); j++)
+                out.addTransition(i, targets[j], outputs[j], costs[j], inputs[j]);
         }
-        composition->move1();
-        composition->move2();
     }
 };
@@ -72,6 +72,189 @@ namespace ocropus {
                                         int override_start = -1,
                                         int override_finish = -1);
 
+    /// Arc access for searches in compositions.  load() makes the arcs
+    /// of a state current; they have to be sorted by output in the first
+    /// FST of a composition and by input in the second one.
+    struct OcroArcs {
+        OcroFST *fst;
+        int *I, *O, *T;
+        float *C;
+        int n;
+
+        OcroArcs(OcroFST *fst = 0) : fst(fst), I(0), O(0), T(0), C(0), n(0) {}
+        int nStates() { return fst->nStates(); }
+        int getStart() { return fst->getStart(); }
+        float getAcceptCost(int node) { return fst->getAcceptCost(node); }
+        void load(int node) {
+            I = fst->inputs(node).data;
+            O = fst->outputs(node).data;
+            T = fst->targets(node).data;
+            C = fst->costs(node).data;
+            n = fst->targets(node).length();
+        }
+        int input(int k) { return I[k]; }
+        int output(int k) { return O[k]; }
+        int target(int k) { return T[k]; }
+        float cost(int k) { return C[k]; }
+    };
+
+    /// The same for a FrozenFst; the arc records are in one array, so
+    /// all fields of an arc share a cache line.
+    struct FrozenArcs {
+        FrozenFst &fst;
+        FrozenFst::Arc *arcs;
+        FrozenFst::Arc *A;
+        int n;
+
+        FrozenArcs(FrozenFst &fst, FrozenFst::Arc *sorted)
+            : fst(fst), arcs(sorted), A(0), n(0) {}
+        int nStates() { return fst.nStates(); }
+        int getStart() { return fst.getStart(); }
+        float getAcceptCost(int node) { return fst.accept_costs[node]; }
+        void load(int node) {
+            int first = fst.offsets[node];
+            A = arcs + first;
+            n = fst.offsets[node + 1] - first;
+        }
+        int input(int k) { return A[k].input; }
+        int output(int k) { return A[k].output; }
+        int target(int k) { return A[k].target; }
+        float cost(int k) { return A[k].cost; }
+    };
+
+
+    /// Dense ids for pairs of ints, in the order in which the pairs are
+    /// first seen.
+    struct PairIndex {
+        intarray first;
+        intarray second;
+        intarray table;     // id + 1, 0 for empty
+        int mask;
+
+        PairIndex() {
+            clear();
+        }
+        void clear() {
+            first.clear();
+            second.clear();
+            table.resize(64);
+            fill(table, 0);
+            mask = table.length() - 1;
+        }
+        int length() {
+            return first.length();
+        }
+        int hash(int a, int b) {
+            unsigned h = (unsigned(a) * 0x9e3779b1u) ^ unsigned(b);
+            h *= 0x85ebca6bu;
+            return (h ^ (h >> 16)) & mask;
+        }
+        /// Return the id of the pair, adding it if it's new.
+        int id(int a, int b) {
+            int j = hash(a, b);
+            while(table[j]) {
+                int i = table[j] - 1;
+                if(first[i] == a && second[i] == b)
+                    return i;
+                j = (j + 1) & mask;
+            }
+            int i = first.length();
+            first.push(a);
+            second.push(b);
+            table[j] = i + 1;
+            if(2 * first.length() > table.length())
+                rehash();
+            return i;
+        }
+        void rehash() {
+            table.resize(2 * table.length());
+            fill(table, 0);
+            mask = table.length() - 1;
+            for(int i = 0; i < first.length(); i++) {
+                int j = hash(first[i], second[i]);
+                while(table[j])
+                    j = (j + 1) & mask;
+                table[j] = i + 1;
+            }
+        }
+    };
+
+    /// The composition of two FSTs, with states numbered in the order in
+    /// which they are reached.  Unlike CompositionFst, which numbers the
+    /// pairs of states densely, nothing is allocated for unreachable
+    /// states, and the arcs of the operands are used in their presorted
+    /// order.  The search functions using it grow their arrays as
+    /// nStates() grows.
+    template <class Arcs1, class Arcs2>
+    struct LazyComposition {
+        Arcs1 fst1;
+        Arcs2 fst2;
+        PairIndex states;
+
+        LazyComposition(Arcs1 fst1, Arcs2 fst2) : fst1(fst1), fst2(fst2) {
+        }
+        /// the number of states reached so far
+        int nStates() {
+            return states.length();
+        }
+        int getStart() {
+            return states.id(fst1.getStart(), fst2.getStart());
+        }
+        float getAcceptCost(int node) {
+            return fst1.getAcceptCost(states.first[node])
+                 + fst2.getAcceptCost(states.second[node]);
+        }
+        void splitIndex(int &result1, int &result2, int node) {
+            result1 = states.first[node];
+            result2 = states.second[node];
+        }
+        void arcs(intarray &inputs,
+                  intarray &targets,
+                  intarray &outputs,
+                  floatarray &costs,
+                  int node) {
+            inputs.clear();
+            targets.clear();
+            outputs.clear();
+            costs.clear();
+            int n1 = states.first[node];
+            int n2 = states.second[node];
+            fst1.load(n1);
+            fst2.load(n2);
+            int l1 = fst1.n;
+            int l2 = fst2.n;
+            int k1, k2;
+            // fst1 epsilon moves
+            for(k1 = 0; k1 < l1 && !fst1.output(k1); k1++) {
+                inputs.push(fst1.input(k1));
+                targets.push(states.id(fst1.target(k1), n2));
+                outputs.push(0);
+                costs.push(fst1.cost(k1));
+            }
+            // fst2 epsilon moves
+            for(k2 = 0; k2 < l2 && !fst2.input(k2); k2++) {
+                inputs.push(0);
+                targets.push(states.id(n1, fst2.target(k2)));
+                outputs.push(fst2.output(k2));
+                costs.push(fst2.cost(k2));
+            }
+            // non-epsilon moves
+            while(k1 < l1 && k2 < l2) {
+                while(k1 < l1 && fst1.output(k1) < fst2.input(k2)) k1++;
+                if(k1 >= l1) break;
+                while(k2 < l2 && fst1.output(k1) > fst2.input(k2)) k2++;
+                while(k1 < l1 && k2 < l2 && fst1.output(k1) == fst2.input(k2)) {
+                    for(int j = k2; j < l2 && fst1.output(k1) == fst2.input(j); j++) {
+                        inputs.push(fst1.input(k1));
+                        targets.push(states.id(fst1.target(k1), fst2.target(j)));
+                        outputs.push(fst2.output(j));
+                        costs.push(fst1.cost(k1) + fst2.cost(j));
+                    }
+                    k1++;
+                }
+            }
+        }
+    };
 
     /// Reverse the FST's arcs, adding a new start vertex (former accept).
     /// @param no_accept
@@ -0,0 +1,251 @@
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: n-best.cc
+// Purpose: k shortest paths by A* over partial paths
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include "ocr-pfst.h"
+#include "fst-heap.h"
+#include "lattice.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    /// A single OcroFST, as seen by NBestSearch.
+    struct SingleGraph {
+        OcroFST &fst;
+        float *h;
+
+        SingleGraph(OcroFST &fst) : fst(fst) {
+            fst.calculateHeuristics();
+            h = fst.heuristics().data;
+        }
+        int getStart() {
+            return fst.getStart();
+        }
+        float getAcceptCost(int node) {
+            return fst.getAcceptCost(node);
+        }
+        void arcs(intarray &inputs, intarray &targets, intarray &outputs,
+                  floatarray &costs, int node) {
+            fst.arcs(inputs, targets, outputs, costs, node);
+        }
+        float heuristic(int node) {
+            return h[node];
+        }
+    };
+
+    /// A LazyComposition, as seen by NBestSearch; the heuristic is the
+    /// sum of those of the operands.
+    template <class Arcs1, class Arcs2>
+    struct CompositionGraph {
+        LazyComposition<Arcs1, Arcs2> c;
+        float *g1, *g2;
+
+        CompositionGraph(Arcs1 arcs1, Arcs2 arcs2, float *g1, float *g2)
+            : c(arcs1, arcs2), g1(g1), g2(g2) {
+        }
+        int getStart() {
+            return c.getStart();
+        }
+        float getAcceptCost(int node) {
+            return c.getAcceptCost(node);
+        }
+        void arcs(intarray &inputs, intarray &targets, intarray &outputs,
+                  floatarray &costs, int node) {
+            c.arcs(inputs, targets, outputs, costs, node);
+        }
+        float heuristic(int node) {
+            return g1[c.states.first[node]] + g2[c.states.second[node]];
+        }
+    };
+
+    /// A* over partial paths rather than states: a state is expanded
+    /// once for every path to it that is popped, and complete paths pop
+    /// up in the order of their cost.  Since the heuristics are
+    /// consistent, the paths to a state also pop up in the order of
+    /// their cost, so a state that has been expanded n times can't be on
+    /// any of the n best paths again.
+    ///
+    /// For unique outputs, the outputs of the partial paths are
+    /// interned in a trie.  A path that reaches a state with the same
+    /// output as an earlier one can only lead to outputs that the
+    /// earlier one leads to at a lower cost, so it is dropped, and the
+    /// limit of n applies to the different outputs at each state.
+    template <class Graph>
+    class NBestSearch : public NBestPaths {
+        autodel<Graph> graph;
+        int n;
+        bool unique;
+
+        // the tree of partial paths; path 0 is the empty path at the
+        // start, and a path whose state is -1 is complete (its last
+        // "arc" is the accept cost)
+        intarray parent;
+        intarray state;
+        intarray input;
+        intarray output;
+        floatarray cost;
+        floatarray g;
+        Heap heap;
+
+        intarray expanded;          // how often each state was expanded
+        // for unique: prefix is the output of each path, as a node of
+        // the trie (parent node, label), with 0 for the empty output;
+        // visited has (state, prefix) for each expanded path and
+        // (-1, prefix) for each returned one
+        intarray prefix;
+        PairIndex trie;
+        PairIndex visited;
+
+        intarray inputs, targets, outputs;
+        floatarray costs;
+
+        enum { max_paths = 4000000 };
+
+        void add(int from, int s, int in, int out, float c, float h) {
+            int p = parent.length();
+            parent.push(from);
+            state.push(s);
+            input.push(in);
+            output.push(out);
+            cost.push(c);
+            g.push((from < 0 ? 0 : g[from]) + c);
+            if(unique) {
+                int q = from < 0 ? 0 : prefix[from];
+                prefix.push(out ? trie.id(q, out) + 1 : q);
+            }
+            heap.grow(p + 1);
+            heap.push(p, g[p] + h);
+        }
+
+        // false if p has the output of an earlier path with the same state
+        bool first_visit(int s, int p) {
+            int before = visited.length();
+            visited.id(s, prefix[p]);
+            return visited.length() > before;
+        }
+
+        void expand(int p) {
+            int s = state[p];
+            while(expanded.length() <= s)
+                expanded.push(0);
+            if(expanded[s] >= n)
+                return;
+            if(unique && !first_visit(s, p))
+                return;
+            expanded[s]++;
+            graph->arcs(inputs, targets, outputs, costs, s);
+            for(int i = 0; i < targets.length(); i++) {
+                int t = targets[i];
+                if(t < expanded.length() && expanded[t] >= n)
+                    continue;   // would be dropped when it pops up
+                float h = graph->heuristic(t);
+                if(costs[i] >= 1e30 || h >= 1e30)
+                    continue;   // no way to an accept state
+                add(p, t, inputs[i], outputs[i], costs[i], h);
+            }
+            float accept = graph->getAcceptCost(s);
+            if(accept < 1e30)
+                add(p, -1, 0, 0, accept, 0);
+        }
+
+    public:
+        NBestSearch(Graph *graph, int n, bool unique)
+            : graph(graph), n(n), unique(unique), heap(1) {
+            int s = graph->getStart();
+            if(graph->heuristic(s) < 1e30)
+                add(-1, s, 0, 0, 0, graph->heuristic(s));
+        }
+
+        bool next(intarray &path_inputs,
+                  intarray &path_outputs,
+                  floatarray &path_costs) {
+            while(heap.length() && parent.length() < max_paths) {
+                int p = heap.pop();
+                if(state[p] >= 0) {
+                    expand(p);
+                    continue;
+                }
+                if(unique && !first_visit(-1, p))
+                    continue;
+                path_inputs.clear();
+                path_outputs.clear();
+                path_costs.clear();
+                // the complete path holds the accept cost; the
+                // empty path at the root holds nothing
+                for(int q = p; parent[q] >= 0; q = parent[q]) {
+                    path_inputs.push(input[q]);
+                    path_outputs.push(output[q]);
+                    path_costs.push(cost[q]);
+                }
+                reverse(path_inputs);
+                reverse(path_outputs);
+                reverse(path_costs);
+                return true;
+            }
+            return false;
+        }
+
+        bool next(nustring &result, double &total) {
+            intarray path_inputs, path_outputs;
+            floatarray path_costs;
+            if(!next(path_inputs, path_outputs, path_costs))
+                return false;
+            remove_epsilons(result, path_outputs);
+            total = sum(path_costs);
+            return true;
+        }
+
+        bool truncated() {
+            return heap.length() > 0 && parent.length() >= max_paths;
+        }
+    };
+}
+
+namespace ocropus {
+    NBestPaths *make_NBestPaths(OcroFST &fst, int n, bool unique) {
+        return new NBestSearch<SingleGraph>(new SingleGraph(fst), n, unique);
+    }
+
+    NBestPaths *make_NBestPaths(OcroFST &fst1, OcroFST &fst2, int n, bool unique) {
+        typedef CompositionGraph<OcroArcs, OcroArcs> Graph;
+        fst1.calculateHeuristics();
+        fst2.calculateHeuristics();
+        fst1.sortByOutput();
+        fst2.sortByInput();
+        OcroArcs arcs1(&fst1), arcs2(&fst2);
+        Graph *graph = new Graph(arcs1, arcs2, fst1.heuristics().data,
+                                 fst2.heuristics().data);
+        return new NBestSearch<Graph>(graph, n, unique);
+    }
+
+    NBestPaths *make_NBestPaths(OcroFST &fst1, FrozenFst &fst2, int n, bool unique) {
+        typedef CompositionGraph<OcroArcs, FrozenArcs> Graph;
+        fst1.calculateHeuristics();
+        fst1.sortByOutput();
+        OcroArcs arcs1(&fst1);
+        FrozenArcs arcs2(fst2, fst2.by_input);
+        Graph *graph = new Graph(arcs1, arcs2, fst1.heuristics().data,
+                                 fst2.heuristics);
+        return new NBestSearch<Graph>(graph, n, unique);
+    }
+}
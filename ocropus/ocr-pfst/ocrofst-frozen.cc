@@ -0,0 +1,341 @@
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: ocrofst-frozen.cc
+// Purpose: read-only FST with flat arc storage
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ocr-pfst.h"
+#include "fst-io.h"
+#include "a-star.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    int read_only() {
+        throw "FrozenFst: this FST is read-only";
+    }
+
+    const char frozen_magic[8] = {'o','c','r','o','f','s','t','\n'};
+    enum { frozen_version = 1, frozen_align = 64, nsections = 5 };
+
+    struct FrozenHeader {
+        char magic[8];          // "ocrofst\n"
+        int version;
+        int byte_order;         // 0x01020304
+        int start;
+        int nstates;
+        int narcs;
+        int reserved0;
+        // file offsets of the offsets, accept costs, heuristics, arcs by
+        // input and arcs by output
+        long long sections[nsections];
+        long long size;
+        int reserved[8];
+    };
+
+    bool little_endian() {
+        int one = 1;
+        return *(char*)&one == 1;
+    }
+
+    long long aligned(long long n) {
+        return (n + frozen_align - 1) / frozen_align * frozen_align;
+    }
+
+    void frozen_layout(FrozenHeader &header, int nstates, int narcs) {
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, frozen_magic, sizeof header.magic);
+        header.version = frozen_version;
+        header.byte_order = 0x01020304;
+        header.nstates = nstates;
+        header.narcs = narcs;
+        long long sizes[nsections] = {
+            (nstates + 1) * (long long)sizeof (int),
+            nstates * (long long)sizeof (float),
+            nstates * (long long)sizeof (float),
+            narcs * (long long)sizeof (FrozenFst::Arc),
+            narcs * (long long)sizeof (FrozenFst::Arc)
+        };
+        long long at = aligned(sizeof header);
+        for(int i = 0; i < nsections; i++) {
+            header.sections[i] = at;
+            at = aligned(at + sizes[i]);
+        }
+        header.size = at;
+    }
+
+    void frozen_check(FrozenHeader &header) {
+        if(memcmp(header.magic, frozen_magic, sizeof header.magic))
+            throw "FrozenFst: bad magic number";
+        if(header.version != frozen_version)
+            throwf("FrozenFst: unsupported version %d", header.version);
+        if(header.byte_order != 0x01020304)
+            throw "FrozenFst: file has the wrong byte order";
+        if(header.nstates < 0 || header.narcs < 0)
+            throw "FrozenFst: bad header";
+        if(header.nstates > 0 && unsigned(header.start) >= unsigned(header.nstates))
+            throw "FrozenFst: bad start state";
+        FrozenHeader expected;
+        frozen_layout(expected, header.nstates, header.narcs);
+        if(memcmp(expected.sections, header.sections, sizeof header.sections)
+           || expected.size != header.size)
+            throw "FrozenFst: bad section table";
+    }
+
+    void frozen_point(FrozenFst &fst, FrozenHeader &header, char *p) {
+        fst.start = header.start;
+        fst.nstates = header.nstates;
+        fst.narcs = header.narcs;
+        fst.offsets = (int *) (p + header.sections[0]);
+        fst.accept_costs = (float *) (p + header.sections[1]);
+        fst.heuristics = (float *) (p + header.sections[2]);
+        fst.by_input = (FrozenFst::Arc *) (p + header.sections[3]);
+        fst.by_output = (FrozenFst::Arc *) (p + header.sections[4]);
+    }
+
+    // the search indexes with offsets and targets without checking
+    // them, so a damaged file must be caught before it is used
+
+    bool frozen_valid(FrozenFst &fst) {
+        if(fst.offsets[0] != 0 || fst.offsets[fst.nstates] != fst.narcs)
+            return false;
+        for(int i = 0; i < fst.nstates; i++)
+            if(fst.offsets[i + 1] < fst.offsets[i])
+                return false;
+        for(int i = 0; i < fst.narcs; i++) {
+            if(unsigned(fst.by_input[i].target) >= unsigned(fst.nstates)
+               || unsigned(fst.by_output[i].target) >= unsigned(fst.nstates))
+                return false;
+        }
+        return true;
+    }
+}
+
+namespace ocropus {
+    FrozenFst::FrozenFst() : allocated(0), base(0), mapped(0) {
+        allocate(0, 0);
+    }
+
+    FrozenFst::~FrozenFst() {
+        release();
+    }
+
+    const char *FrozenFst::description() {
+        return "FrozenFst";
+    }
+
+    int FrozenFst::nStates() {
+        return nstates;
+    }
+
+    int FrozenFst::getStart() {
+        return start;
+    }
+
+    float FrozenFst::getAcceptCost(int node) {
+        if(unsigned(node) >= unsigned(nstates))
+            throw "FrozenFst: state out of range";
+        return accept_costs[node];
+    }
+
+    void FrozenFst::arcs(intarray &inputs,
+                         intarray &targets,
+                         intarray &outputs,
+                         floatarray &costs,
+                         int from) {
+        if(unsigned(from) >= unsigned(nstates))
+            throw "FrozenFst: state out of range";
+        int first = offsets[from];
+        int n = offsets[from + 1] - first;
+        inputs.resize(n);
+        targets.resize(n);
+        outputs.resize(n);
+        costs.resize(n);
+        for(int i = 0; i < n; i++) {
+            Arc &arc = by_input[first + i];
+            inputs[i] = arc.input;
+            targets[i] = arc.target;
+            outputs[i] = arc.output;
+            costs[i] = arc.cost;
+        }
+    }
+
+    void FrozenFst::bestpath(nustring &result) {
+        a_star(result, *this);
+    }
+
+    void FrozenFst::release() {
+        if(base)
+            munmap(base, mapped);
+        base = 0;
+        mapped = 0;
+        image = 0;
+        allocated = 0;
+        start = 0;
+        nstates = 0;
+        narcs = 0;
+        offsets = 0;
+        by_input = 0;
+        by_output = 0;
+        accept_costs = 0;
+        heuristics = 0;
+    }
+
+    void FrozenFst::allocate(int nstates, int narcs) {
+        release();
+        FrozenHeader header;
+        frozen_layout(header, nstates, narcs);
+        if((long long) size_t(header.size) != header.size)
+            throw "FrozenFst: too large for this platform";
+        image = (char *) calloc(size_t(header.size), 1);
+        if(!image)
+            throw "FrozenFst: out of memory";
+        allocated = size_t(header.size);
+        memcpy(image.ptr(), &header, sizeof header);
+        frozen_point(*this, header, image.ptr());
+    }
+
+    void FrozenFst::save(const char *path) {
+        if(!little_endian())
+            throw "FrozenFst: the native format is little-endian";
+        char *p = base ? (char *) base : image.ptr();
+        CHECK(p != 0);
+        FrozenHeader header;
+        memcpy(&header, p, sizeof header);
+        header.start = start;
+        stdio stream(path, "wb");
+        size_t rest = size_t(header.size) - sizeof header;
+        if(fwrite(&header, sizeof header, 1, stream) != 1
+           || fwrite(p + sizeof header, 1, rest, stream) != rest)
+            throwf("%s: write failed", path);
+    }
+
+    void FrozenFst::map(const char *path) {
+        if(!little_endian())
+            throw "FrozenFst: the native format is little-endian";
+        release();
+        stdio stream(path, "rb");
+        FrozenHeader header;
+        if(fread(&header, sizeof header, 1, stream) != 1)
+            throwf("%s: file is truncated", path);
+        frozen_check(header);
+        struct stat sbuf;
+        CHECK(fstat(fileno(stream), &sbuf) == 0);
+        if(sbuf.st_size < header.size)
+            throwf("%s: file is truncated", path);
+        if((long long) size_t(header.size) != header.size)
+            throwf("%s: too large for this platform", path);
+        // nothing is parsed or copied; the pages are shared with every
+        // other process mapping the same file
+        void *p = mmap(0, size_t(header.size), PROT_READ, MAP_SHARED, fileno(stream), 0);
+        if(p == MAP_FAILED)
+            throwf("%s: mmap failed: %s", path, strerror(errno));
+        base = p;
+        mapped = size_t(header.size);
+        frozen_point(*this, header, (char *) base);
+        if(!frozen_valid(*this)) {
+            release();
+            throwf("%s: bad offsets or arc targets", path);
+        }
+    }
+
+    void FrozenFst::load(const char *path) {
+        if(fst_frozen_check_magic(path)) {
+            map(path);
+            return;
+        }
+        autodel<OcroFST> fst(make_OcroFST());
+        fst->load(path);
+        fst_freeze(*this, *fst);
+    }
+
+    void FrozenFst::clear() {
+        read_only();
+    }
+
+    int FrozenFst::newState() {
+        return read_only();
+    }
+
+    void FrozenFst::addTransition(int from,int to,int output,float cost,int input) {
+        read_only();
+    }
+
+    void FrozenFst::setStart(int node) {
+        read_only();
+    }
+
+    void FrozenFst::setAccept(int node,float cost) {
+        read_only();
+    }
+
+    int FrozenFst::special(const char *s) {
+        return 0;
+    }
+
+    bool fst_frozen_check_magic(const char *path) {
+        stdio stream(path, "rb");
+        char buf[sizeof frozen_magic];
+        return fread(buf, 1, sizeof buf, stream) == sizeof buf
+            && !memcmp(buf, frozen_magic, sizeof buf);
+    }
+
+    void fst_freeze(FrozenFst &frozen, OcroFST &fst) {
+        int n = fst.nStates();
+        fst.sortByInput();
+        int total = 0;
+        for(int i = 0; i < n; i++)
+            total += fst.targets(i).length();
+        frozen.allocate(n, total);
+        frozen.start = fst.getStart();
+        frozen.offsets[0] = 0;
+        for(int i = 0; i < n; i++)
+            frozen.offsets[i + 1] = frozen.offsets[i] + fst.targets(i).length();
+        intarray permutation;
+        for(int i = 0; i < n; i++) {
+            intarray &inputs = fst.inputs(i);
+            intarray &outputs = fst.outputs(i);
+            intarray &targets = fst.targets(i);
+            floatarray &costs = fst.costs(i);
+            FrozenFst::Arc *arcs = &frozen.by_input[frozen.offsets[i]];
+            for(int j = 0; j < inputs.length(); j++) {
+                arcs[j].input = inputs[j];
+                arcs[j].output = outputs[j];
+                arcs[j].target = targets[j];
+                arcs[j].cost = costs[j];
+            }
+            quicksort(permutation, outputs);
+            FrozenFst::Arc *sorted = &frozen.by_output[frozen.offsets[i]];
+            for(int j = 0; j < permutation.length(); j++)
+                sorted[j] = arcs[permutation[j]];
+            frozen.accept_costs[i] = fst.getAcceptCost(i);
+        }
+        floatarray h;
+        a_star_backwards(h, fst);
+        CHECK(h.length() == n);
+        for(int i = 0; i < n; i++)
+            frozen.heuristics[i] = h[i];
+    }
+}
@@ -28,6 +28,8 @@ namespace {
     int left(int i) {  return 2 * i + 1; }
     int right(int i) {  return 2 * i + 2; }
     int parent(int i) {  return (i - 1) / 2; }
+    template <class T>
+    void exchange(T &a, T &b) { T t = a; a = b; b = t; }
 }
 
 namespace ocropus {
@@ -92,6 +94,170 @@ namespace ocropus {
         return true;
     }
 
+    BeamHeap::BeamHeap(int n) : n(n), fill(0), stamp(0) {
+        int size = 1;
+        while(size < 2 * n)
+            size *= 2;
+        mask = size - 1;
+        states1.resize(n);
+        states2.resize(n);
+        tags.resize(n);
+        values.resize(n);
+        stamps.resize(n);
+        where.resize(n);
+        table.resize(size);
+        colib::fill(table, 0);
+        clearCounters();
+    }
+
+    void BeamHeap::clear() {
+        // only the used slots of the table need clearing
+        for(int i = 0; i < fill; i++)
+            table[where[i]] = 0;
+        fill = 0;
+        stamp = 0;
+    }
+
+    void BeamHeap::clearCounters() {
+        insertions = 0;
+        replacements = 0;
+        evictions = 0;
+        rejections = 0;
+        probes = 0;
+    }
+
+    int BeamHeap::find(int state1, int state2) {
+        int j = hash(state1, state2);
+        while(table[j]) {
+            probes++;
+            int i = table[j] - 1;
+            if(states1[i] == state1 && states2[i] == state2)
+                return i;
+            j = (j + 1) & mask;
+        }
+        return -1;
+    }
+
+    void BeamHeap::link(int i) {
+        int j = hash(states1[i], states2[i]);
+        while(table[j])
+            j = (j + 1) & mask;
+        table[j] = i + 1;
+        where[i] = j;
+    }
+
+    // Remove heap slot i from the table, moving back later entries of
+    // the same probe run, so that no tombstones are needed.
+    void BeamHeap::unlink(int i) {
+        int hole = where[i];
+        table[hole] = 0;
+        int j = hole;
+        while(1) {
+            j = (j + 1) & mask;
+            if(!table[j])
+                return;
+            int k = table[j] - 1;
+            int home = hash(states1[k], states2[k]);
+            // the entry may move if the hole lies between home and j
+            if(((j - home) & mask) >= ((j - hole) & mask)) {
+                table[hole] = table[j];
+                where[k] = hole;
+                table[j] = 0;
+                hole = j;
+            }
+        }
+    }
+
+    void BeamHeap::heapswap(int i, int j) {
+        exchange(states1[i], states1[j]);
+        exchange(states2[i], states2[j]);
+        exchange(tags[i], tags[j]);
+        exchange(values[i], values[j]);
+        exchange(stamps[i], stamps[j]);
+        exchange(where[i], where[j]);
+        table[where[i]] = i + 1;
+        table[where[j]] = j + 1;
+    }
+
+    void BeamHeap::heapify_up(int i) {
+        while(i) {
+            int j = parent(i);
+            if(!worse(i, j))
+                return;
+            heapswap(i, j);
+            i = j;
+        }
+    }
+
+    void BeamHeap::heapify_down(int i) {
+        while(1) {
+            int j = left(i);
+            int k = right(i);
+            int m = i;
+            if(j < fill && worse(j, m)) m = j;
+            if(k < fill && worse(k, m)) m = k;
+            if(m == i)
+                return;
+            heapswap(i, m);
+            i = m;
+        }
+    }
+
+    bool BeamHeap::add_replacing(int state1, int state2, int tag, float value) {
+        // nothing in a full heap is worse than its root, so an offer
+        // that isn't better than the root can't change anything
+        if(fill == n && (n == 0 || values[0] >= value)) {
+            rejections++;
+            return false;
+        }
+        int i = find(state1, state2);
+        if(i >= 0) {
+            if(values[i] >= value) {
+                rejections++;
+                return false;
+            }
+            tags[i] = tag;
+            values[i] = value;
+            stamps[i] = stamp++;
+            heapify_down(i);
+            replacements++;
+            return true;
+        }
+        if(fill == n) {
+            // the offer beats the root (see above), so evict the worst
+            // entry and put the new one in its place
+            unlink(0);
+            i = 0;
+            evictions++;
+        } else {
+            i = fill++;
+        }
+        states1[i] = state1;
+        states2[i] = state2;
+        tags[i] = tag;
+        values[i] = value;
+        stamps[i] = stamp++;
+        link(i);
+        if(i == 0)
+            heapify_down(i);
+        else
+            heapify_up(i);
+        insertions++;
+        return true;
+    }
+
+    void BeamHeap::drain(colib::intarray &result) {
+        result.resize(fill);
+        while(fill > 0) {
+            result[fill - 1] = tags[0];
+            fill--;
+            heapswap(0, fill);
+            table[where[fill]] = 0;
+            heapify_down(0);
+        }
+        stamp = 0;
+    }
+
     int Heap::rotate(int i) {
         int size = heap.length();
         int j = left(i);
@@ -103,6 +103,7 @@ namespace ocropus {
             return accept_costs.length() - 1;
         }
         virtual void addTransition(int from,int to,int output,float cost,int input) {
+            flags = 0; // the new arc may be out of order
             m_targets[from].push(to);
             m_outputs[from].push(output);
             m_inputs[from].push(input);
@@ -139,7 +140,13 @@ namespace ocropus {
             fst_write(path, *this);
         }
         virtual void load(const char *path) {
-            fst_read(*this, path);
+            if(fst_frozen_check_magic(path)) {
+                FrozenFst frozen;
+                frozen.map(path);
+                fst_copy(*this, frozen);
+            } else {
+                fst_read(*this, path);
+            }
         }
 
     private:
@@ -168,6 +175,8 @@ namespace ocropus {
                 permute(m_targets[node], permutation);
                 permute(m_costs[node], permutation);
             }
+            // the arcs can only be in one order at a time
+            flags &= ~(SORTED_BY_INPUT | SORTED_BY_OUTPUT);
             flags |= flag;
         }
     public:
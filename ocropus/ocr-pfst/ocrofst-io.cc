@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "ocr-pfst.h"
+#include "stats.h"
 
 using namespace colib;
 using namespace ocropus;
@@ -41,19 +42,22 @@ enum {
     PROPERTIES = 3 // expanded, mutable
 };
 
+// fst_read() and fst_write() hold the stream lock, so the byte-wise
+// functions don't take it for every byte; that is expensive on streams
+// that aren't files (e.g. from fmemopen).
 static int32_t read_int32_LE(FILE *stream) {
-    int n = fgetc(stream);
-    n |= fgetc(stream) << 8;
-    n |= fgetc(stream) << 16;
-    n |= fgetc(stream) << 24;
+    int n = getc_unlocked(stream);
+    n |= getc_unlocked(stream) << 8;
+    n |= getc_unlocked(stream) << 16;
+    n |= getc_unlocked(stream) << 24;
     return n;
 }
 
 static void write_int32_LE(FILE *stream, int32_t n) {
-    fputc(n, stream);
-    fputc(n >> 8, stream);
-    fputc(n >> 16, stream);
-    fputc(n >> 24, stream);
+    putc_unlocked(n, stream);
+    putc_unlocked(n >> 8, stream);
+    putc_unlocked(n >> 16, stream);
+    putc_unlocked(n >> 24, stream);
 }
 
 static int64_t read_int64_LE(FILE *stream) {
@@ -72,7 +76,7 @@ static bool read_magic_string(FILE *stream, const char *s) {
     if(strlen(s) != n)
         return false;
     for(int i = 0; i < n; i++) {
-        if(fgetc(stream) != s[i])
+        if(getc_unlocked(stream) != s[i])
             return false;
     }
     return true;
@@ -87,7 +91,7 @@ static void write_string(FILE *stream, const char *s) {
     int n = strlen(s);
     write_int32_LE(stream, n);
     for(int i = 0; i < n; i++)
-        fputc(s[i], stream);
+        putc_unlocked(s[i], stream);
 }
 
 // This is probably not a good way but that's what OpenFST does anyway.
@@ -206,20 +210,42 @@ static void read_node(FILE *stream, IGenericFst &fst, int index) {
     }
 }
 
+namespace {
+    struct StreamLock {
+        FILE *stream;
+        StreamLock(FILE *stream) : stream(stream) {
+            flockfile(stream);
+        }
+        ~StreamLock() {
+            funlockfile(stream);
+        }
+    };
+}
+
 namespace ocropus {
 
     void fst_write(FILE *stream, IGenericFst &fst) {
+        StatsTimer timer("fst_write");
+        StreamLock lock(stream);
+        long start = stats_enabled ? ftell(stream) : -1;
         write_header_and_symbols(stream, fst);
         for(int i = 0; i < fst.nStates(); i++)
             write_node(stream, fst, i);
+        if(start >= 0)
+            stats_count("fst_bytes_written", ftell(stream) - start);
     }
 
     void fst_read(IGenericFst &fst, FILE *stream) {
+        StatsTimer timer("fst_read");
+        StreamLock lock(stream);
+        long start = stats_enabled ? ftell(stream) : -1;
         const char *errmsg = read_header_and_symbols(fst, stream);
         if(errmsg)
             throw errmsg;
         for(int i = 0; i < fst.nStates(); i++)
             read_node(stream, fst, i);
+        if(start >= 0)
+            stats_count("fst_bytes_read", ftell(stream) - start);
     }
 
     void fst_write(const char *path, IGenericFst &fst) {
@@ -0,0 +1,655 @@
+// Copyright 2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: ocrofst-optimize.cc
+// Purpose: offline optimization of language models: trimming, epsilon
+//          removal, determinization, weight pushing and minimization
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <math.h>
+#include "ocr-pfst.h"
+#include "fst-heap.h"
+#include "lattice.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    // Weights are compared after rounding to this many steps per unit,
+    // so that sums taken in different orders still match.
+    const float quantum = 1024;
+
+    inline int quantize(float cost) {
+        if(cost >= 1e30)
+            return 0x7fffffff;
+        return int(floor(cost * quantum + .5));
+    }
+
+    inline float dequantize(int q) {
+        return q / quantum;
+    }
+
+    // An FST with all arcs in flat arrays; the arcs of state i are
+    // offsets[i] .. offsets[i+1]-1.
+    struct Graph {
+        int start;
+        floatarray accept;
+        intarray offsets;
+        intarray inputs;
+        intarray outputs;
+        intarray targets;
+        floatarray costs;
+
+        Graph() {
+            clear();
+        }
+        int nStates() {
+            return accept.length();
+        }
+        int nArcs() {
+            return targets.length();
+        }
+        void clear() {
+            start = 0;
+            accept.clear();
+            offsets.clear();
+            offsets.push(0);
+            inputs.clear();
+            outputs.clear();
+            targets.clear();
+            costs.clear();
+        }
+        /// Add a state; the arcs added after this belong to it.
+        int newState(float cost) {
+            accept.push(cost);
+            offsets.push(targets.length());
+            return accept.length() - 1;
+        }
+        void addArc(int input, int output, int target, float cost) {
+            inputs.push(input);
+            outputs.push(output);
+            targets.push(target);
+            costs.push(cost);
+            offsets.last() = targets.length();
+        }
+        bool epsilon(int arc) {
+            return inputs[arc] == 0 && outputs[arc] == 0;
+        }
+        void read(IGenericFst &fst) {
+            clear();
+            int n = fst.nStates();
+            intarray in, to, out;
+            floatarray c;
+            for(int i = 0; i < n; i++) {
+                newState(fst.getAcceptCost(i));
+                fst.arcs(in, to, out, c, i);
+                for(int j = 0; j < to.length(); j++)
+                    addArc(in[j], out[j], to[j], c[j]);
+            }
+            if(n)
+                start = fst.getStart();
+        }
+        void write(IGenericFst &fst) {
+            fst.clear();
+            int n = nStates();
+            for(int i = 0; i < n; i++)
+                fst.newState();
+            if(!n)
+                return;
+            fst.setStart(start);
+            for(int i = 0; i < n; i++) {
+                if(accept[i] < 1e30)
+                    fst.setAccept(i, accept[i]);
+                for(int k = offsets[i]; k < offsets[i + 1]; k++)
+                    fst.addTransition(i, targets[k], outputs[k], costs[k], inputs[k]);
+            }
+        }
+    };
+
+    // The sources of the arcs into each state, for going backwards.
+    void reverse_arcs(intarray &roffsets, intarray &rarcs, intarray &sources, Graph &g) {
+        int n = g.nStates();
+        int m = g.nArcs();
+        sources.resize(m);
+        for(int i = 0; i < n; i++)
+            for(int k = g.offsets[i]; k < g.offsets[i + 1]; k++)
+                sources[k] = i;
+        roffsets.resize(n + 1);
+        fill(roffsets, 0);
+        for(int k = 0; k < m; k++)
+            roffsets[g.targets[k] + 1]++;
+        for(int i = 0; i < n; i++)
+            roffsets[i + 1] += roffsets[i];
+        intarray at;
+        copy(at, roffsets);
+        rarcs.resize(m);
+        for(int k = 0; k < m; k++)
+            rarcs[at[g.targets[k]]++] = k;
+    }
+
+    // The cost of the best path from each state to acceptance
+    // (Dijkstra on the reversed graph); 1e38 where there is none.
+    void costs_to_accept(floatarray &result, Graph &g) {
+        int n = g.nStates();
+        intarray roffsets, rarcs, sources;
+        reverse_arcs(roffsets, rarcs, sources, g);
+        result.resize(n);
+        fill(result, 1e38);
+        Heap heap(n);
+        for(int i = 0; i < n; i++) {
+            if(g.accept[i] < 1e30) {
+                result[i] = g.accept[i];
+                heap.push(i, result[i]);
+            }
+        }
+        while(heap.length()) {
+            int t = heap.pop();
+            for(int j = roffsets[t]; j < roffsets[t + 1]; j++) {
+                int k = rarcs[j];
+                int s = sources[k];
+                float c = result[t] + g.costs[k];
+                if(c < result[s]) {
+                    result[s] = c;
+                    heap.push(s, c);
+                }
+            }
+        }
+    }
+
+    // Keep the states that are on some path from the start to acceptance,
+    // numbered in breadth-first order.
+    void connect(Graph &out, Graph &g) {
+        int n = g.nStates();
+        floatarray to_accept;
+        costs_to_accept(to_accept, g);
+        out.clear();
+        if(!n)
+            return;
+        intarray renumber(n);
+        fill(renumber, -1);
+        intarray order;
+        order.push(g.start);
+        renumber[g.start] = 0;
+        for(int i = 0; i < order.length(); i++) {
+            int q = order[i];
+            if(to_accept[q] >= 1e30)
+                continue;
+            for(int k = g.offsets[q]; k < g.offsets[q + 1]; k++) {
+                int t = g.targets[k];
+                if(renumber[t] < 0 && to_accept[t] < 1e30) {
+                    renumber[t] = order.length();
+                    order.push(t);
+                }
+            }
+        }
+        for(int i = 0; i < order.length(); i++) {
+            int q = order[i];
+            out.newState(g.accept[q]);
+            if(to_accept[q] >= 1e30)
+                continue;
+            for(int k = g.offsets[q]; k < g.offsets[q + 1]; k++) {
+                int t = g.targets[k];
+                if(to_accept[t] < 1e30)
+                    out.addArc(g.inputs[k], g.outputs[k], renumber[t], g.costs[k]);
+            }
+        }
+        out.start = 0;
+    }
+
+    // Replace the epsilon arcs (no input, no output) of every state by
+    // the arcs and the acceptance of the states its epsilon closure
+    // reaches, at the cost of the best epsilon path there.
+    void remove_epsilons(Graph &out, Graph &g) {
+        int n = g.nStates();
+        floatarray d(n);
+        fill(d, 1e38);
+        Heap heap(n);
+        intarray reached;
+        PairIndex labels;   // (input, output)
+        PairIndex arcs;     // (label, target) in the current state
+        intarray first;     // arcs[i] -> index of its copy in out
+        out.clear();
+        out.start = g.start;
+        for(int q = 0; q < n; q++) {
+            reached.clear();
+            d[q] = 0;
+            reached.push(q);
+            heap.push(q, 0);
+            while(heap.length()) {
+                int p = heap.pop();
+                for(int k = g.offsets[p]; k < g.offsets[p + 1]; k++) {
+                    if(!g.epsilon(k))
+                        continue;
+                    if(g.costs[k] < 0)
+                        throw "fst_remove_epsilons: negative epsilon costs aren't supported";
+                    int t = g.targets[k];
+                    float c = d[p] + g.costs[k];
+                    if(c < d[t]) {
+                        if(d[t] >= 1e30)
+                            reached.push(t);
+                        d[t] = c;
+                        heap.push(t, c);
+                    }
+                }
+            }
+            float accept = 1e38;
+            for(int i = 0; i < reached.length(); i++) {
+                int p = reached[i];
+                if(g.accept[p] < 1e30)
+                    accept = min(accept, d[p] + g.accept[p]);
+            }
+            out.newState(accept);
+            if(reached.length() == 1) {
+                // nothing to merge
+                for(int k = g.offsets[q]; k < g.offsets[q + 1]; k++)
+                    if(!g.epsilon(k))
+                        out.addArc(g.inputs[k], g.outputs[k], g.targets[k], g.costs[k]);
+            } else {
+                // the same arc can be reached along several epsilon paths;
+                // only the cheapest copy is kept
+                arcs.clear();
+                first.clear();
+                for(int i = 0; i < reached.length(); i++) {
+                    int p = reached[i];
+                    for(int k = g.offsets[p]; k < g.offsets[p + 1]; k++) {
+                        if(g.epsilon(k))
+                            continue;
+                        int label = labels.id(g.inputs[k], g.outputs[k]);
+                        int a = arcs.id(label, g.targets[k]);
+                        float c = d[p] + g.costs[k];
+                        if(a == first.length()) {
+                            first.push(out.nArcs());
+                            out.addArc(g.inputs[k], g.outputs[k], g.targets[k], c);
+                        } else if(c < out.costs[first[a]]) {
+                            out.costs[first[a]] = c;
+                        }
+                    }
+                }
+            }
+            for(int i = 0; i < reached.length(); i++)
+                d[reached[i]] = 1e38;
+        }
+    }
+
+    // The states of a determinized FST: sets of (state, residual cost),
+    // the residuals quantized, the states in increasing order.
+    struct SubsetIndex {
+        intarray offsets;   // the members of subset i are offsets[i] .. offsets[i+1]-1
+        intarray states;
+        intarray residuals;
+        intarray table;     // id + 1, 0 for empty
+        int mask;
+
+        SubsetIndex() {
+            offsets.push(0);
+            table.resize(1024);
+            fill(table, 0);
+            mask = table.length() - 1;
+        }
+        int length() {
+            return offsets.length() - 1;
+        }
+        unsigned hash(int *s, int *r, int n) {
+            unsigned h = 2166136261u;
+            for(int i = 0; i < n; i++) {
+                h = (h ^ unsigned(s[i])) * 16777619u;
+                h = (h ^ unsigned(r[i])) * 16777619u;
+            }
+            return h ^ (h >> 15);
+        }
+        bool same(int id, intarray &s, intarray &r) {
+            int first = offsets[id];
+            int n = offsets[id + 1] - first;
+            if(n != s.length())
+                return false;
+            for(int i = 0; i < n; i++)
+                if(states[first + i] != s[i] || residuals[first + i] != r[i])
+                    return false;
+            return true;
+        }
+        void link(int id) {
+            int first = offsets[id];
+            int j = hash(&states[first], &residuals[first], offsets[id + 1] - first) & mask;
+            while(table[j])
+                j = (j + 1) & mask;
+            table[j] = id + 1;
+        }
+        /// Return the id of the subset, adding it if it's new.
+        int id(intarray &s, intarray &r) {
+            int j = hash(&s[0], &r[0], s.length()) & mask;
+            while(table[j]) {
+                int i = table[j] - 1;
+                if(same(i, s, r))
+                    return i;
+                j = (j + 1) & mask;
+            }
+            for(int i = 0; i < s.length(); i++) {
+                states.push(s[i]);
+                residuals.push(r[i]);
+            }
+            offsets.push(states.length());
+            int result = length() - 1;
+            table[j] = result + 1;
+            if(2 * length() > table.length()) {
+                table.resize(2 * table.length());
+                fill(table, 0);
+                mask = table.length() - 1;
+                for(int i = 0; i < length(); i++)
+                    link(i);
+            }
+            return result;
+        }
+    };
+
+    // Weighted subset construction, treating the (input, output) pairs
+    // as the labels.  Every state of the result is a set of states of g
+    // with the cost each is behind the best of them.  Gives up when the
+    // result gets more than max_arcs arcs (if max_arcs > 0).
+    bool determinize(Graph &out, Graph &g, int max_arcs) {
+        int n = g.nStates();
+        int m = g.nArcs();
+        out.clear();
+        if(!n)
+            return true;
+        PairIndex labels;
+        intarray label(m);
+        for(int k = 0; k < m; k++)
+            label[k] = labels.id(g.inputs[k], g.outputs[k]);
+        SubsetIndex subsets;
+        intarray s, r;
+        s.push(g.start);
+        r.push(0);
+        subsets.id(s, r);
+        out.start = 0;
+        intarray candidates, permutation;
+        narray<double> keys;
+        for(int i = 0; i < subsets.length(); i++) {
+            if(max_arcs > 0 && out.nArcs() > max_arcs)
+                return false;
+            float accept = 1e38;
+            candidates.clear();
+            keys.clear();
+            for(int j = subsets.offsets[i]; j < subsets.offsets[i + 1]; j++) {
+                int q = subsets.states[j];
+                float w = dequantize(subsets.residuals[j]);
+                if(g.accept[q] < 1e30)
+                    accept = min(accept, w + g.accept[q]);
+                for(int k = g.offsets[q]; k < g.offsets[q + 1]; k++) {
+                    candidates.push(j);
+                    candidates.push(k);
+                    keys.push(double(label[k]) * n + g.targets[k]);
+                }
+            }
+            out.newState(accept);
+            quicksort(permutation, keys);
+            // the candidates are now grouped by label, then by target
+            int nc = permutation.length();
+            for(int a = 0; a < nc; ) {
+                int l = label[candidates[2 * permutation[a] + 1]];
+                int b = a;
+                float best = 1e38;
+                for(; b < nc; b++) {
+                    int j = candidates[2 * permutation[b]];
+                    int k = candidates[2 * permutation[b] + 1];
+                    if(label[k] != l)
+                        break;
+                    best = min(best, dequantize(subsets.residuals[j]) + g.costs[k]);
+                }
+                s.clear();
+                r.clear();
+                for(int c = a; c < b; c++) {
+                    int j = candidates[2 * permutation[c]];
+                    int k = candidates[2 * permutation[c] + 1];
+                    int residual = quantize(dequantize(subsets.residuals[j]) + g.costs[k] - best);
+                    if(s.length() && s.last() == g.targets[k]) {
+                        r.last() = min(r.last(), residual);
+                    } else {
+                        s.push(g.targets[k]);
+                        r.push(residual);
+                    }
+                }
+                int t = subsets.id(s, r);
+                out.addArc(labels.first[l], labels.second[l], t, best);
+                a = b;
+            }
+        }
+        return true;
+    }
+
+    // Move the costs as close to the start as possible: every arc gets
+    // the difference that it makes to the best cost to acceptance.  The
+    // remaining cost of the best path stays on the arcs out of the
+    // start, so the cost of every path is unchanged.  costs_to_accept()
+    // is exact only for nonnegative costs; then v[q] <= c + v[t] holds
+    // for every arc in float arithmetic too, and no new cost comes out
+    // negative.
+    void push_weights(Graph &out, Graph &g) {
+        int n = g.nStates();
+        for(int k = 0; k < g.nArcs(); k++)
+            if(g.costs[k] < 0)
+                throw "fst_push_weights: negative costs aren't supported";
+        for(int q = 0; q < n; q++)
+            if(g.accept[q] < 0)
+                throw "fst_push_weights: negative accept costs aren't supported";
+        floatarray v;
+        costs_to_accept(v, g);
+        out.clear();
+        if(!n)
+            return;
+        out.start = g.start;
+        for(int q = 0; q < n; q++) {
+            out.newState(g.accept[q] < 1e30 ? g.accept[q] - v[q] : 1e38);
+            if(v[q] >= 1e30)
+                continue;
+            for(int k = g.offsets[q]; k < g.offsets[q + 1]; k++) {
+                int t = g.targets[k];
+                if(v[t] < 1e30)
+                    out.addArc(g.inputs[k], g.outputs[k], t, g.costs[k] + v[t] - v[q]);
+            }
+        }
+        float total = v[g.start];
+        if(total == 0 || total >= 1e30)
+            return;
+        bool reentered = false;
+        for(int k = 0; k < out.nArcs(); k++)
+            if(out.targets[k] == g.start)
+                reentered = true;
+        if(reentered) {
+            // a copy of the start that isn't reentered carries the cost
+            int q = g.start;
+            int first = out.offsets[q], last = out.offsets[q + 1];
+            out.start = out.newState(out.accept[q] < 1e30 ? out.accept[q] + total : 1e38);
+            for(int k = first; k < last; k++)
+                out.addArc(out.inputs[k], out.outputs[k], out.targets[k], out.costs[k] + total);
+        } else {
+            int q = g.start;
+            if(out.accept[q] < 1e30)
+                out.accept[q] += total;
+            for(int k = out.offsets[q]; k < out.offsets[q + 1]; k++)
+                out.costs[k] += total;
+        }
+    }
+
+    // Merge the states that can't be told apart by their acceptance
+    // costs and by the labels, costs and targets of their arcs (Moore's
+    // partition refinement).  The costs are compared quantized.
+    void minimize(Graph &out, Graph &g) {
+        int n = g.nStates();
+        int m = g.nArcs();
+        out.clear();
+        if(!n)
+            return;
+        // the arcs of each state sorted by label
+        PairIndex labels;
+        intarray label(m), qcost(m), sorted(m);
+        for(int k = 0; k < m; k++) {
+            label[k] = labels.id(g.inputs[k], g.outputs[k]);
+            qcost[k] = quantize(g.costs[k]);
+        }
+        floatarray keys;
+        intarray permutation;
+        for(int q = 0; q < n; q++) {
+            int first = g.offsets[q];
+            keys.resize(g.offsets[q + 1] - first);
+            for(int i = 0; i < keys.length(); i++)
+                keys[i] = label[first + i];
+            quicksort(permutation, keys);
+            for(int i = 0; i < keys.length(); i++)
+                sorted[first + i] = first + permutation[i];
+        }
+        intarray cls(n), next(n), reps;
+        PairIndex initial;
+        for(int q = 0; q < n; q++)
+            cls[q] = initial.id(quantize(g.accept[q]), 0);
+        int nclasses = initial.length();
+        intarray table;
+        for(;;) {
+            int size = 64;
+            while(size < 2 * n)
+                size *= 2;
+            table.resize(size);
+            fill(table, 0);
+            int mask = size - 1;
+            reps.clear();
+            for(int q = 0; q < n; q++) {
+                unsigned h = unsigned(cls[q]) * 0x9e3779b1u;
+                for(int i = g.offsets[q]; i < g.offsets[q + 1]; i++) {
+                    int k = sorted[i];
+                    h = (h ^ unsigned(label[k])) * 16777619u;
+                    h = (h ^ unsigned(qcost[k])) * 16777619u;
+                    h = (h ^ unsigned(cls[g.targets[k]])) * 16777619u;
+                }
+                int j = (h ^ (h >> 15)) & mask;
+                for(;;) {
+                    if(!table[j]) {
+                        reps.push(q);
+                        table[j] = reps.length();
+                        next[q] = reps.length() - 1;
+                        break;
+                    }
+                    int p = reps[table[j] - 1];
+                    bool same = cls[p] == cls[q]
+                        && g.offsets[p + 1] - g.offsets[p] == g.offsets[q + 1] - g.offsets[q];
+                    for(int i = 0; same && i < g.offsets[q + 1] - g.offsets[q]; i++) {
+                        int kp = sorted[g.offsets[p] + i];
+                        int kq = sorted[g.offsets[q] + i];
+                        same = label[kp] == label[kq] && qcost[kp] == qcost[kq]
+                            && cls[g.targets[kp]] == cls[g.targets[kq]];
+                    }
+                    if(same) {
+                        next[q] = table[j] - 1;
+                        break;
+                    }
+                    j = (j + 1) & mask;
+                }
+            }
+            // refining never merges classes, so the same count means
+            // the same partition
+            bool stable = reps.length() == nclasses;
+            nclasses = reps.length();
+            copy(cls, next);
+            if(stable)
+                break;
+        }
+        for(int c = 0; c < nclasses; c++) {
+            int p = reps[c];
+            out.newState(g.accept[p]);
+            for(int k = g.offsets[p]; k < g.offsets[p + 1]; k++)
+                out.addArc(g.inputs[k], g.outputs[k], cls[g.targets[k]], g.costs[k]);
+        }
+        out.start = cls[g.start];
+    }
+}
+
+namespace ocropus {
+    void fst_connect(IGenericFst &dst, IGenericFst &src) {
+        Graph g, result;
+        g.read(src);
+        connect(result, g);
+        result.write(dst);
+    }
+
+    void fst_remove_epsilons(IGenericFst &dst, IGenericFst &src) {
+        Graph g, result;
+        g.read(src);
+        remove_epsilons(result, g);
+        result.write(dst);
+    }
+
+    bool fst_determinize(IGenericFst &dst, IGenericFst &src, int max_arcs) {
+        Graph g, result;
+        g.read(src);
+        if(!determinize(result, g, max_arcs))
+            return false;
+        result.write(dst);
+        return true;
+    }
+
+    void fst_push_weights(IGenericFst &dst, IGenericFst &src) {
+        Graph g, result;
+        g.read(src);
+        push_weights(result, g);
+        result.write(dst);
+    }
+
+    void fst_minimize(IGenericFst &dst, IGenericFst &src) {
+        Graph g, result;
+        g.read(src);
+        minimize(result, g);
+        result.write(dst);
+    }
+
+    void fst_word_list(IGenericFst &dst, objlist<nustring> &words, floatarray &costs) {
+        CHECK_ARG(costs.length() == words.length());
+        // a trie, then a space back to the start after every word
+        PairIndex children;     // (state, character) -> child
+        intarray child_state;
+        floatarray word_cost;
+        word_cost.push(1e38);
+        for(int i = 0; i < words.length(); i++) {
+            nustring &word = words(i);
+            if(!word.length())
+                continue;
+            int q = 0;
+            for(int j = 0; j < word.length(); j++) {
+                int c = children.id(q, word[j].ord());
+                if(c == child_state.length()) {
+                    child_state.push(word_cost.length());
+                    word_cost.push(1e38);
+                }
+                q = child_state[c];
+            }
+            word_cost[q] = min(word_cost[q], costs[i]);
+        }
+        dst.clear();
+        for(int q = 0; q < word_cost.length(); q++)
+            dst.newState();
+        dst.setStart(0);
+        for(int c = 0; c < children.length(); c++) {
+            int ch = children.second[c];
+            dst.addTransition(children.first[c], child_state[c], ch, 0, ch);
+        }
+        for(int q = 0; q < word_cost.length(); q++) {
+            if(word_cost[q] >= 1e30)
+                continue;
+            dst.setAccept(q, word_cost[q]);
+            dst.addTransition(q, 0, ' ', word_cost[q], ' ');
+        }
+    }
+}
@@ -0,0 +1,666 @@
+// -*- C++ -*-
+
+// Copyright 2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: bookstore.cc
+// Purpose: a book (line images, lattices, transcripts) in a single file
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "colib/colib.h"
+#include "bookstore.h"
+#include "sysutil.h"
+#include "stats.h"
+
+namespace ocropus {
+    using namespace colib;
+
+    namespace {
+        // The file is a header, the records, then the index: the entries,
+        // the kind names (each terminated by a 0), and the footer.  All
+        // parts start at multiples of 8 bytes.
+        const char book_magic[8] = {'o','c','r','o','b','o','o','k'};
+        const char record_magic[8] = {'o','c','r','o','r','e','c','\n'};
+        const char index_magic[8] = {'o','c','r','o','i','d','x','\n'};
+        enum { book_version = 1 };
+
+        struct BookHeader {
+            char magic[8];
+            int version;
+            int byte_order;     // 0x01020304
+        };
+
+        struct RecordHeader {
+            char magic[8];
+            int page,line;
+            int kind_length;    // without the terminating 0
+            int reserved;
+            long long size;
+        };
+
+        struct BookFooter {
+            long long index;    // offset of the entries
+            int nentries;
+            int nkinds;
+            long long kinds_size;
+            char magic[8];
+        };
+
+        bool little_endian() {
+            int one = 1;
+            return *(char*)&one == 1;
+        }
+
+        long long aligned(long long n) {
+            return (n+7)/8*8;
+        }
+
+        void write_at(int fd,const void *data,long long size,long long offset) {
+            const char *p = (const char *)data;
+            while(size>0) {
+                ssize_t n = pwrite(fd,p,size_t(size),offset);
+                if(n<0 && errno==EINTR) continue;
+                if(n<=0) throwf("BookStore: write failed: %s",strerror(errno));
+                p += n;
+                size -= n;
+                offset += n;
+            }
+        }
+
+        void read_at(int fd,void *data,long long size,long long offset) {
+            char *p = (char *)data;
+            while(size>0) {
+                ssize_t n = pread(fd,p,size_t(size),offset);
+                if(n<0 && errno==EINTR) continue;
+                if(n<=0) throw "BookStore: read failed";
+                p += n;
+                size -= n;
+                offset += n;
+            }
+        }
+
+        struct Lock {
+            pthread_mutex_t &mutex;
+            Lock(pthread_mutex_t &mutex):mutex(mutex) {
+                pthread_mutex_lock(&mutex);
+            }
+            ~Lock() {
+                pthread_mutex_unlock(&mutex);
+            }
+        };
+
+        // the page, line and kind of dir/%04d/%04d<kind> or dir/%04d<kind>
+        bool parse_name(int &page,int &line,iucstring &kind,const char *path,const char *dir) {
+            int n = strlen(dir);
+            if(strncmp(path,dir,n) || path[n]!='/') return false;
+            const char *p = path+n+1;
+            char *end;
+            page = strtol(p,&end,10);
+            if(end-p!=4) return false;
+            if(*end=='/') {
+                p = end+1;
+                line = strtol(p,&end,10);
+                if(end-p!=4) return false;
+            } else {
+                line = -1;
+            }
+            if(*end!='.') return false;
+            kind = end;
+            return true;
+        }
+    }
+
+    BookStore::BookStore() {
+        fd = -1;
+        writable = false;
+        dirty = false;
+        base = 0;
+        mapped = 0;
+        readable = 0;
+        end = 0;
+        pthread_mutex_init(&mutex,0);
+    }
+
+    BookStore::~BookStore() {
+        try {
+            close();
+        } catch(const char *message) {
+            fprintf(stderr,"%s\n",message);
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+
+    int BookStore::slot(int page,int line,int kind) {
+        unsigned h = unsigned(page)*2654435761u ^ unsigned(line)*40503u ^ unsigned(kind)*97u;
+        h ^= h>>15;
+        return h & (table.length()-1);
+    }
+
+    void BookStore::link(int i) {
+        Entry &e = entries[i];
+        int mask = table.length()-1;
+        int j = slot(e.page,e.line,e.kind);
+        while(table[j]) {
+            Entry &other = entries[table[j]-1];
+            if(other.page==e.page && other.line==e.line && other.kind==e.kind) {
+                // the newer record replaces the older one
+                table[j] = i+1;
+                return;
+            }
+            j = (j+1) & mask;
+        }
+        table[j] = i+1;
+    }
+
+    void BookStore::rehash() {
+        int size = 1024;
+        while(size<4*entries.length()) size *= 2;
+        table.resize(size);
+        fill(table,0);
+        for(int i=0;i<entries.length();i++)
+            link(i);
+    }
+
+    int BookStore::kindId(const char *kind) {
+        for(int i=0;i<kinds.length();i++)
+            if(!strcmp(kinds[i].c_str(),kind)) return i;
+        kinds.push() = kind;
+        return kinds.length()-1;
+    }
+
+    void BookStore::open(const char *path,bool writable) {
+        close();
+        if(!little_endian())
+            throw "BookStore: the format is little-endian";
+        fd = ::open(path,writable?O_RDWR|O_CREAT:O_RDONLY,0666);
+        if(fd<0) throwf("%s: %s",path,strerror(errno));
+        this->writable = writable;
+        struct stat sbuf;
+        CHECK(fstat(fd,&sbuf)==0);
+        long long size = sbuf.st_size;
+        if(size==0 && writable) {
+            BookHeader header;
+            memset(&header,0,sizeof header);
+            memcpy(header.magic,book_magic,sizeof header.magic);
+            header.version = book_version;
+            header.byte_order = 0x01020304;
+            write_at(fd,&header,sizeof header,0);
+            size = sizeof header;
+        }
+        if(size<(long long)sizeof (BookHeader)) {
+            close();
+            throwf("%s: not a book",path);
+        }
+        void *p = mmap(0,size_t(size),PROT_READ,MAP_SHARED,fd,0);
+        if(p==MAP_FAILED) {
+            close();
+            throwf("%s: mmap failed: %s",path,strerror(errno));
+        }
+        base = (char *)p;
+        mapped = size;
+        BookHeader &header = *(BookHeader *)base;
+        if(memcmp(header.magic,book_magic,sizeof header.magic)
+           || header.version!=book_version || header.byte_order!=0x01020304) {
+            close();
+            throwf("%s: not a book",path);
+        }
+        BookFooter footer;
+        bool indexed = false;
+        if(size>=(long long)(sizeof header+sizeof footer)) {
+            memcpy(&footer,base+size-sizeof footer,sizeof footer);
+            long long index_size = footer.nentries*(long long)sizeof (Entry)+aligned(footer.kinds_size);
+            indexed = !memcmp(footer.magic,index_magic,sizeof footer.magic)
+                && footer.index>=(long long)sizeof header && footer.nentries>=0
+                && footer.nkinds>=0 && footer.kinds_size>=0
+                && footer.index+index_size+(long long)sizeof footer==size;
+        }
+        if(indexed) {
+            Entry *index = (Entry *)(base+footer.index);
+            entries.resize(footer.nentries);
+            for(int i=0;i<footer.nentries;i++) {
+                entries[i] = index[i];
+                if(entries[i].offset<0 || entries[i].offset+entries[i].size>footer.index) {
+                    close();
+                    throwf("%s: bad index",path);
+                }
+            }
+            const char *names = base+footer.index+footer.nentries*sizeof (Entry);
+            const char *names_end = names+footer.kinds_size;
+            for(int i=0;i<footer.nkinds;i++) {
+                const char *e = (const char *)memchr(names,0,names_end-names);
+                if(!e) {
+                    close();
+                    throwf("%s: bad index",path);
+                }
+                kinds.push() = names;
+                names = e+1;
+            }
+            for(int i=0;i<entries.length();i++)
+                if(unsigned(entries[i].kind)>=unsigned(kinds.length())) {
+                    close();
+                    throwf("%s: bad index",path);
+                }
+            end = footer.index;
+            if(writable) {
+                // new records go over the old index, so it has to go
+                // now; close() writes a new one, and until then the
+                // records can still be recovered by scanning
+                if(ftruncate(fd,end)) {
+                    close();
+                    throwf("%s: truncate failed: %s",path,strerror(errno));
+                }
+                dirty = true;
+            }
+        } else {
+            scan(size);
+            if(writable) dirty = true;
+        }
+        readable = end;
+        rehash();
+        compact();
+    }
+
+    // Rebuild the index from the record headers; this is the recovery
+    // path for a book whose writer didn't get to close().
+    void BookStore::scan(long long size) {
+        long long at = aligned(sizeof (BookHeader));
+        while(at+(long long)sizeof (RecordHeader)<=size) {
+            RecordHeader &r = *(RecordHeader *)(base+at);
+            if(memcmp(r.magic,record_magic,sizeof r.magic)) break;
+            if(r.kind_length<=0 || r.size<0) break;
+            long long data = at+sizeof r+aligned(r.kind_length+1);
+            if(data+r.size>size) break;
+            const char *kind = base+at+sizeof r;
+            if(kind[r.kind_length]) break;
+            Entry &e = entries.push();
+            e.page = r.page;
+            e.line = r.line;
+            e.kind = kindId(kind);
+            e.reserved = 0;
+            e.offset = data;
+            e.size = r.size;
+            at = aligned(data+r.size);
+        }
+        end = at;
+    }
+
+    // Drop the entries of records that were replaced by later ones.
+    void BookStore::compact() {
+        narray<Entry> kept;
+        for(int i=0;i<entries.length();i++) {
+            Entry &e = entries[i];
+            if(lookup(e.page,e.line,e.kind)==i) kept.push(e);
+        }
+        if(kept.length()==entries.length()) return;
+        swap(entries,kept);
+        rehash();
+    }
+
+    void BookStore::close() {
+        if(fd<0) return;
+        if(writable && dirty) {
+            // only the latest record for each key goes into the index,
+            // in the order they were written
+            compact();
+            narray<Entry> &index = entries;
+            bytearray names;
+            for(int i=0;i<kinds.length();i++) {
+                const char *s = kinds[i].c_str();
+                for(int k=0;s[k];k++) names.push(s[k]);
+                names.push(0);
+            }
+            while(names.length()%8) names.push(0);
+            BookFooter footer;
+            memset(&footer,0,sizeof footer);
+            footer.index = end;
+            footer.nentries = index.length();
+            footer.nkinds = kinds.length();
+            footer.kinds_size = names.length();
+            memcpy(footer.magic,index_magic,sizeof footer.magic);
+            long long at = end;
+            if(index.length()>0)
+                write_at(fd,&index[0],index.length()*(long long)sizeof (Entry),at);
+            at += index.length()*(long long)sizeof (Entry);
+            if(names.length()>0)
+                write_at(fd,&names[0],names.length(),at);
+            at += names.length();
+            write_at(fd,&footer,sizeof footer,at);
+            at += sizeof footer;
+            if(ftruncate(fd,at)) throwf("BookStore: truncate failed: %s",strerror(errno));
+        }
+        if(base) munmap(base,size_t(mapped));
+        ::close(fd);
+        fd = -1;
+        base = 0;
+        mapped = 0;
+        readable = 0;
+        end = 0;
+        dirty = false;
+        entries.dealloc();
+        kinds.dealloc();
+        table.dealloc();
+    }
+
+    int BookStore::lookup(int page,int line,int kind) {
+        int mask = table.length()-1;
+        for(int j=slot(page,line,kind);table[j];j=(j+1)&mask) {
+            Entry &e = entries[table[j]-1];
+            if(e.page==page && e.line==line && e.kind==kind) return table[j]-1;
+        }
+        return -1;
+    }
+
+    int BookStore::length() {
+        Lock lock(mutex);
+        return entries.length();
+    }
+
+    int BookStore::page(int i) {
+        Lock lock(mutex);
+        return entries[i].page;
+    }
+
+    int BookStore::line(int i) {
+        Lock lock(mutex);
+        return entries[i].line;
+    }
+
+    const char *BookStore::kind(int i) {
+        Lock lock(mutex);
+        return kinds[entries[i].kind].c_str();
+    }
+
+    long long BookStore::size(int i) {
+        Lock lock(mutex);
+        return entries[i].size;
+    }
+
+    int BookStore::find(int page,int line,const char *kind) {
+        Lock lock(mutex);
+        for(int i=0;i<kinds.length();i++)
+            if(!strcmp(kinds[i].c_str(),kind)) return lookup(page,line,i);
+        return -1;
+    }
+
+    void BookStore::get(bytearray &data,int i) {
+        Entry e;
+        {
+            Lock lock(mutex);
+            e = entries[i];
+        }
+        data.resize(int(e.size));
+        if(e.size==0) return;
+        if(e.offset+e.size<=readable)
+            memcpy(&data[0],base+e.offset,size_t(e.size));
+        else
+            read_at(fd,&data[0],e.size,e.offset);
+    }
+
+    FILE *BookStore::reader(int i) {
+        Entry e;
+        {
+            Lock lock(mutex);
+            e = entries[i];
+        }
+        // records that were there when the book was opened are read in
+        // place; later ones (and empty ones, which fmemopen refuses) are
+        // copied
+        if(e.size>0 && e.offset+e.size<=readable) {
+            FILE *stream = fmemopen(base+e.offset,size_t(e.size),"r");
+            if(!stream) throwf("BookStore: fmemopen failed: %s",strerror(errno));
+            setvbuf(stream,0,_IOFBF,BUFSIZ);
+            return stream;
+        }
+        FILE *stream = tmpfile();
+        if(!stream) throwf("BookStore: tmpfile failed: %s",strerror(errno));
+        bytearray data;
+        get(data,i);
+        if(data.length()>0 && fwrite(&data[0],1,data.length(),stream)!=size_t(data.length())) {
+            fclose(stream);
+            throw "BookStore: write failed";
+        }
+        rewind(stream);
+        return stream;
+    }
+
+    void BookStore::put(int page,int line,const char *kind,const void *data,long long size) {
+        if(!writable) throw "BookStore: book is read-only";
+        int kind_length = strlen(kind);
+        CHECK_ARG(kind_length>0 && size>=0);
+        long long header_size = sizeof (RecordHeader)+aligned(kind_length+1);
+        long long offset;
+        {
+            // reserve the space; the data is written outside the lock
+            Lock lock(mutex);
+            offset = end;
+            end = aligned(offset+header_size+size);
+            Entry &e = entries.push();
+            e.page = page;
+            e.line = line;
+            e.kind = kindId(kind);
+            e.reserved = 0;
+            e.offset = offset+header_size;
+            e.size = size;
+            if(table.length()<2*entries.length()) rehash();
+            else link(entries.length()-1);
+            dirty = true;
+        }
+        bytearray header;
+        header.resize(int(header_size));
+        fill(header,0);
+        RecordHeader &r = *(RecordHeader *)&header[0];
+        memcpy(r.magic,record_magic,sizeof r.magic);
+        r.page = page;
+        r.line = line;
+        r.kind_length = kind_length;
+        r.size = size;
+        memcpy(&header[sizeof r],kind,kind_length);
+        write_at(fd,&header[0],header_size,offset);
+        if(size>0) write_at(fd,data,size,offset+header_size);
+    }
+
+    bool is_bookstore(const char *path) {
+        int n = strlen(path);
+        return n>5 && !strcmp(path+n-5,".book");
+    }
+
+    Book::Book(const char *path,bool writable) {
+        this->path = path;
+        if(is_bookstore(path)) {
+            store = new BookStore();
+            store->open(path,writable);
+        }
+    }
+
+    void Book::name(iucstring &result,int page,int line,const char *kind) {
+        if(line<0) sprintf(result,"%s/%04d%s",path.c_str(),page,kind);
+        else sprintf(result,"%s/%04d/%04d%s",path.c_str(),page,line,kind);
+    }
+
+    bool Book::exists(int page,int line,const char *kind) {
+        if(store) return store->find(page,line,kind)>=0;
+        iucstring s;
+        name(s,page,line,kind);
+        struct stat sbuf;
+        return stat(s.c_str(),&sbuf)==0;
+    }
+
+    void Book::list(intarray &pages,intarray &lines,const char *kind) {
+        pages.clear();
+        lines.clear();
+        intarray keys;
+        if(store) {
+            for(int i=0;i<store->length();i++) {
+                if(store->line(i)<0 || strcmp(store->kind(i),kind)) continue;
+                if(store->find(store->page(i),store->line(i),kind)!=i) continue;
+                pages.push(store->page(i));
+                lines.push(store->line(i));
+            }
+        } else {
+            iucstring pattern;
+            sprintf(pattern,"%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9]%s",path.c_str(),kind);
+            glob_t g;
+            glob(pattern.c_str(),0,0,&g);
+            for(unsigned i=0;i<g.gl_pathc;i++) {
+                int page,line;
+                iucstring k;
+                if(!parse_name(page,line,k,g.gl_pathv[i],path.c_str())) continue;
+                pages.push(page);
+                lines.push(line);
+            }
+            globfree(&g);
+        }
+        for(int i=0;i<pages.length();i++)
+            keys.push(pages[i]*10000+lines[i]);
+        intarray permutation;
+        quicksort(permutation,keys);
+        permute(pages,permutation);
+        permute(lines,permutation);
+    }
+
+    int book_copy(Book &dst,Book &src) {
+        int count = 0;
+        if(src.store) {
+            BookStore &store = *src.store;
+            bytearray data;
+            for(int i=0;i<store.length();i++) {
+                if(store.find(store.page(i),store.line(i),store.kind(i))!=i) continue;
+                store.get(data,i);
+                BookWriter out(dst,store.page(i),store.line(i),store.kind(i));
+                if(data.length()>0 && fwrite(&data[0],1,data.length(),out)!=size_t(data.length()))
+                    throwf("%s: write failed",dst.path.c_str());
+                out.close();
+                count++;
+            }
+            return count;
+        }
+        const char *patterns[] = {
+            "%s/[0-9][0-9][0-9][0-9].*",
+            "%s/[0-9][0-9][0-9][0-9]/[0-9][0-9][0-9][0-9].*"
+        };
+        for(int p=0;p<2;p++) {
+            iucstring pattern;
+            sprintf(pattern,patterns[p],src.path.c_str());
+            glob_t g;
+            glob(pattern.c_str(),0,0,&g);
+            for(unsigned i=0;i<g.gl_pathc;i++) {
+                int page,line;
+                iucstring kind;
+                if(!parse_name(page,line,kind,g.gl_pathv[i],src.path.c_str())) continue;
+                struct stat sbuf;
+                if(stat(g.gl_pathv[i],&sbuf) || !S_ISREG(sbuf.st_mode)) continue;
+                BookReader in(src,page,line,kind.c_str());
+                BookWriter out(dst,page,line,kind.c_str());
+                char buf[65536];
+                size_t n;
+                while((n=fread(buf,1,sizeof buf,in))>0)
+                    if(fwrite(buf,1,n,out)!=n)
+                        throwf("%s: write failed",dst.path.c_str());
+                out.close();
+                count++;
+            }
+            globfree(&g);
+        }
+        return count;
+    }
+
+    BookReader::BookReader(Book &book,int page,int line,const char *kind) {
+        if(book.store) {
+            int i = book.store->find(page,line,kind);
+            if(i<0) throwf("%s: no %04d/%04d%s",book.path.c_str(),page,line,kind);
+            stream = book.store->reader(i);
+        } else {
+            iucstring s;
+            book.name(s,page,line,kind);
+            stream = fopen(s.c_str(),"r");
+            if(!stream) throwf("%s: cannot open",s.c_str());
+        }
+    }
+
+    // the files of a book are read and written from the start
+    static void count_bytes(const char *name,FILE *stream) {
+        if(!stats_enabled) return;
+        long n = ftell(stream);
+        if(n>0) stats_count(name,n);
+    }
+
+    BookReader::~BookReader() {
+        count_bytes("bytes_read",stream);
+        fclose(stream);
+    }
+
+    BookWriter::BookWriter(Book &book,int page,int line,const char *kind)
+        : book(book),page(page),line(line),kind(kind) {
+        data = 0;
+        size = 0;
+        if(book.store) {
+            stream = open_memstream(&data,&size);
+            if(!stream) throwf("open_memstream failed: %s",strerror(errno));
+        } else {
+            iucstring s;
+            book.name(s,page,line,kind);
+            stream = fopen(s.c_str(),"w");
+            if(!stream && errno==ENOENT && line>=0) {
+                // the first file of a page
+                iucstring dir;
+                sprintf(dir,"%s/%04d",book.path.c_str(),page);
+                mkdir_if_necessary(dir.c_str());
+                stream = fopen(s.c_str(),"w");
+            }
+            if(!stream) throwf("%s: cannot open for writing",s.c_str());
+        }
+    }
+
+    void BookWriter::close() {
+        if(!stream) return;
+        count_bytes("bytes_written",stream);
+        bool failed = ferror(stream);
+        if(fclose(stream)) failed = true;
+        stream = 0;
+        if(book.store) {
+            // data belongs to us once the stream is closed
+            autofree<char> buffer(data);
+            data = 0;
+            if(failed) throw "BookStore: cannot buffer the record";
+            book.store->put(page,line,kind.c_str(),buffer.ptr(),size);
+        } else if(failed) {
+            iucstring s;
+            book.name(s,page,line,kind.c_str());
+            throwf("%s: write failed",s.c_str());
+        }
+    }
+
+    BookWriter::~BookWriter() {
+        try {
+            close();
+        } catch(const char *message) {
+            fprintf(stderr,"%s: %04d/%04d%s: %s\n",book.path.c_str(),page,line,kind.c_str(),message);
+        }
+    }
+}
@@ -0,0 +1,153 @@
+// -*- C++ -*-
+
+// Copyright 2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: bookstore.h
+// Purpose: a book (line images, lattices, transcripts) in a single file
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#ifndef h_bookstore_
+#define h_bookstore_
+
+#include <stdio.h>
+#include <pthread.h>
+#include "colib/colib.h"
+
+namespace ocropus {
+    using namespace colib;
+
+    /// The files of an OCR working directory in one file.
+    ///
+    /// What is otherwise dir/%04d/%04d<kind> (e.g. kind ".png", ".fst",
+    /// ".gt.txt") is a record (page, line, kind); page files
+    /// dir/%04d<kind> have line -1.  Records are appended to the file,
+    /// each after a small header, and close() appends an index of all of
+    /// them and a footer pointing to it.  A book is read through mmap,
+    /// with random access through the index.  If the footer is missing
+    /// because the writer didn't finish, open() rebuilds the index from
+    /// the record headers.  A record replaces any earlier one with the
+    /// same (page, line, kind).  put() and find() can be called from
+    /// several threads.
+
+    struct BookStore {
+        struct Entry {
+            int page,line,kind;
+            int reserved;
+            long long offset;   // of the data
+            long long size;
+        };
+
+        int fd;
+        bool writable;
+        bool dirty;
+        char *base;             // the file as it was when opened
+        long long mapped;
+        long long readable;     // records below this are read in place
+        long long end;          // where the next record goes
+        narray<Entry> entries;
+        narray<iucstring> kinds;
+        intarray table;         // entry + 1, 0 for empty
+        pthread_mutex_t mutex;
+
+        BookStore();
+        ~BookStore();
+        /// A writable book is created if it doesn't exist.
+        void open(const char *path,bool writable=false);
+        /// Write the index if anything was added, and release the file.
+        void close();
+        // these take the lock too, since put() can add entries meanwhile
+        int length();
+        int page(int i);
+        int line(int i);
+        /// valid until a record of a new kind is put
+        const char *kind(int i);
+        long long size(int i);
+        /// The record for (page, line, kind), or -1.
+        int find(int page,int line,const char *kind);
+        /// Copy the data of record i.
+        void get(bytearray &data,int i);
+        /// A stream reading record i; the caller closes it.
+        FILE *reader(int i);
+        void put(int page,int line,const char *kind,const void *data,long long size);
+
+    private:
+        int kindId(const char *kind);
+        int lookup(int page,int line,int kind);
+        int slot(int page,int line,int kind);
+        void link(int i);
+        void rehash();
+        void compact();
+        void scan(long long size);
+        BookStore(const BookStore &);
+        void operator=(const BookStore &);
+    };
+
+    /// \brief Check whether a path names a BookStore rather than a directory.
+    bool is_bookstore(const char *path);
+
+    /// The files of a book, either in the directory layout or in a
+    /// BookStore (when the path ends in .book).
+    struct Book {
+        iucstring path;
+        autodel<BookStore> store;
+
+        Book(const char *path,bool writable=false);
+        /// the pages and lines that have a file of the given kind, sorted
+        void list(intarray &pages,intarray &lines,const char *kind);
+        bool exists(int page,int line,const char *kind);
+        /// the name of the file for messages (the path in a directory)
+        void name(iucstring &result,int page,int line,const char *kind);
+    };
+
+    /// A file of a book open for reading; throws if there is none.
+    struct BookReader {
+        FILE *stream;
+        BookReader(Book &book,int page,int line,const char *kind);
+        ~BookReader();
+        operator FILE *() {
+            return stream;
+        }
+    };
+
+    /// A file of a book open for writing; in a BookStore, the record is
+    /// added when the BookWriter is closed.  close() throws if the file
+    /// or the record couldn't be written.  A BookWriter that goes away
+    /// without close() is closed then, but errors are only printed.
+    struct BookWriter {
+        Book &book;
+        int page,line;
+        iucstring kind;
+        FILE *stream;
+        char *data;
+        size_t size;
+        BookWriter(Book &book,int page,int line,const char *kind);
+        ~BookWriter();
+        void close();
+        operator FILE *() {
+            return stream;
+        }
+    };
+
+    /// \brief Copy all the files of one book to another (e.g. a
+    /// directory into a BookStore); returns the number of files.
+    int book_copy(Book &dst,Book &src);
+}
+
+#endif
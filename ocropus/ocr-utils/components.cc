@@ -46,6 +46,8 @@ namespace ocropus {
     // line program to print the default parameters for components
     const char *global_verbose_params;
 
+    long global_param_lookups = 0;
+
     void IComponent::check_parameters_() {
         // TODO/tmb rewrite this more cleanly in terms of iustring
         if(checked) return;
@@ -46,6 +46,10 @@ namespace ocropus {
 
     extern const char *global_verbose_params;
 
+    // total number of string parameter lookups (pget/pgetf) performed by
+    // all components; useful for finding parameter lookups in inner loops
+    extern long global_param_lookups;
+
     /// Base class for OCR components.
 
     struct IComponent {
@@ -54,6 +58,7 @@ namespace ocropus {
         IComponent() {
 	    verbose_pattern = "%%%";
             checked = false;
+            pstale = false;
             bool enabled = true;
 #ifdef _OPENMP
             enabled = (omp_get_thread_num()==0);
@@ -107,6 +112,21 @@ namespace ocropus {
         strhash<iucstring> params;
         strhash<bool> shown;
         bool checked;
+        struct pbinding {
+            const char *name;
+            char kind;
+            void *dest;
+        };
+        narray<pbinding> pbindings;
+        bool pstale;
+        void pbind_(const char *name,char kind,void *dest) {
+            if(!params.find(name)) throwf("pbind: %s: no such parameter",name);
+            pbinding &b = pbindings.push();
+            b.name = name;
+            b.kind = kind;
+            b.dest = dest;
+            pstale = true;
+        }
     public:
         /// verify that there are no extra parameters in the environment
         virtual void check_parameters_();
@@ -165,6 +185,7 @@ namespace ocropus {
         virtual void pset(const char *name,const char *value) {
             if(name[0]!='%' && !params.find(name)) throwf("pset: %s: no such parameter",name);
             params(name) = value;
+            pstale = true;
             if(strstr(name,verbose_pattern))
                 fprintf(stderr,"set %s_%s=%s\n",this->name(),name,value);
         }
@@ -184,6 +205,8 @@ namespace ocropus {
         // what current parameter settings are.
         const char *pget(const char *name) {
             if(!checked) check_parameters_();
+#pragma omp atomic
+            global_param_lookups++;
             if(!params.find(name)) throwf("pget: %s: no such parameter",name);
             return params(name).c_str();
         }
@@ -194,6 +217,55 @@ namespace ocropus {
                 throwf("pgetf: %s=%s: bad number format",name,params(name).c_str());
             return value;
         }
+        // Bind a parameter to a typed variable (usually a member of the
+        // component).  Code that runs per segment or per feature should
+        // read the bound variable instead of calling pget/pgetf, which
+        // look up and parse a string each time.  Bind parameters in the
+        // constructor after their pdef, and call pupdate() before using
+        // the bound values; it only does work after the parameter table
+        // has changed through pset or pload.
+        void pbind(const char *name,double &dest) { pbind_(name,'d',&dest); }
+        void pbind(const char *name,float &dest) { pbind_(name,'f',&dest); }
+        void pbind(const char *name,int &dest) { pbind_(name,'i',&dest); }
+        void pbind(const char *name,bool &dest) { pbind_(name,'b',&dest); }
+        void pbind(const char *name,iucstring &dest) { pbind_(name,'s',&dest); }
+        // Copy the current parameter values into the bound variables.
+        // Safe to call from multiple threads, but the values should not be
+        // changed with pset while other threads are using them.
+        void pupdate() {
+            bool stale;
+#pragma omp atomic read
+            stale = pstale;
+            if(!stale) return;
+            // an exception must not leave the critical section
+            const char *error = 0;
+#pragma omp critical(pupdate)
+            {
+                if(pstale) {
+                    try {
+                        for(int i=0;i<pbindings.length();i++) {
+                            pbinding &b = pbindings[i];
+                            switch(b.kind) {
+                            case 'd': *(double*)b.dest = pgetf(b.name); break;
+                            case 'f': *(float*)b.dest = pgetf(b.name); break;
+                            case 'i': *(int*)b.dest = int(pgetf(b.name)); break;
+                            case 'b': *(bool*)b.dest = !!pgetf(b.name); break;
+                            case 's': *(iucstring*)b.dest = pget(b.name); break;
+                            default: throw "pupdate: bad binding";
+                            }
+                        }
+#pragma omp flush
+#pragma omp atomic write
+                        pstale = false;
+                    } catch(const char *s) {
+                        error = s;
+                    } catch(...) {
+                        error = "pupdate: cannot update the bound parameters";
+                    }
+                }
+            }
+            if(error) throw error;
+        }
         // Save the parameters to the string.  This should get called from save().
         // The format is binary and not necessarily fit for human consumption.
         void psave(FILE *stream) {
@@ -216,6 +288,7 @@ namespace ocropus {
                 }
                 params(key) = value;
             }
+            pstale = true;
             if(!ok) throw("parameters not properly terminated in save file");
         }
         // Print the parameters in some human-readable format.
@@ -230,6 +303,13 @@ namespace ocropus {
 
         virtual ~IComponent() {}
 
+    private:
+        // the bindings point into this object, so a copy would update
+        // the parameters of the original
+        IComponent(const IComponent &);
+        void operator=(const IComponent &);
+    public:
+
         // The following methods are obsolete for setting and getting parameters.
         // However, they cannot be converted automatically (since they might
         // trigger actions).
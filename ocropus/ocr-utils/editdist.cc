@@ -57,6 +57,168 @@ namespace {
         }
     }
 
+    // Myers' algorithm keeps a column of the unit-cost table as the
+    // differences between adjacent cells: bit j of P is set if cell j+1
+    // is one more than cell j, bit j of M if it is one less.  Each
+    // character of the text advances the column by one.
+
+    typedef unsigned long long Word;
+    enum { word_bits = 64 };
+    const Word high_bit = Word(1) << (word_bits - 1);
+
+    inline int popcount(Word w) {
+        int n = 0;
+        for(; w; w &= w - 1)
+            n++;
+        return n;
+    }
+
+    // mask of the bits of the last word that hold cells
+    Word last_word_mask(int m) {
+        return m % word_bits ? (Word(1) << (m % word_bits)) - 1 : ~Word(0);
+    }
+
+    /// For each character of the pattern, the bit vector of its
+    /// positions in the pattern; characters that don't occur in the
+    /// pattern get the zero vector in the last row.
+    struct MatchVectors {
+        int nwords, nchars;
+        narray<Word> vectors;
+        inthash< Integer<-1> > index;
+
+        MatchVectors(nustring &pattern) {
+            nwords = (pattern.length() + word_bits - 1) / word_bits;
+            nchars = 0;
+            for(int j = 0; j < pattern.length(); j++) {
+                int &k = index(pattern[j].ord());
+                if(k < 0) k = nchars++;
+            }
+            vectors.resize((nchars + 1) * nwords);
+            fill(vectors, Word(0));
+            for(int j = 0; j < pattern.length(); j++)
+                vectors[index(pattern[j].ord()) * nwords + j / word_bits] |=
+                    Word(1) << (j % word_bits);
+        }
+
+        Word *operator()(nuchar c) {
+            Integer<-1> *k = index.find(c.ord());
+            return &vectors[(k ? int(*k) : nchars) * nwords];
+        }
+    };
+
+    /// One word of a step of the column; hin is the difference between
+    /// the new and the old cell above the word, and the result the one
+    /// for its last cell.
+    inline int myers_step(Word &P, Word &M, Word eq, int hin) {
+        Word Xv = eq | M;
+        if(hin < 0) eq |= 1;
+        Word Xh = (((eq & P) + P) ^ P) | eq;
+        Word Ph = M | ~(Xh | P);
+        Word Mh = P & Xh;
+        int hout = (Ph & high_bit) ? 1 : (Mh & high_bit) ? -1 : 0;
+        Ph <<= 1;
+        Mh <<= 1;
+        if(hin < 0) Mh |= 1;
+        else if(hin > 0) Ph |= 1;
+        P = Mh | ~(Xv | Ph);
+        M = Ph & Xv;
+        return hout;
+    }
+
+    /// Advance all the words of the column; the top cell of the table
+    /// grows by one with every character of the text.
+    inline void myers_column(Word *P, Word *M, Word *eq, int nwords) {
+        int h = 1;
+        for(int b = 0; b < nwords; b++)
+            h = myers_step(P[b], M[b], eq[b], h);
+    }
+
+    /// Sum, lowest and highest prefix sum of the differences coded in
+    /// eight bits of P and M, for finding the minimum of a column and
+    /// the cells above a bound a byte at a time.
+    struct Chunk {
+        signed char sum, lo, hi;
+    };
+
+    struct ChunkTable {
+        Chunk chunks[256 * 256];
+        ChunkTable() {
+            for(int p = 0; p < 256; p++) {
+                for(int m = 0; m < 256; m++) {
+                    int s = 0, lo = 0, hi = 0;
+                    for(int t = 0; t < 8; t++) {
+                        s += ((p >> t) & 1) - ((m >> t) & 1);
+                        lo = min(lo, s);
+                        hi = max(hi, s);
+                    }
+                    Chunk &chunk = chunks[p * 256 + m];
+                    chunk.sum = s;
+                    chunk.lo = lo;
+                    chunk.hi = hi;
+                }
+            }
+        }
+        Chunk &operator()(Word P, Word M, int t) {
+            return chunks[((P >> (8 * t)) & 0xff) * 256 + ((M >> (8 * t)) & 0xff)];
+        }
+    };
+
+    ChunkTable chunk_table;
+
+    /// Clamp the column to at most bound, given its top cell; returns
+    /// the new top cell.  A difference becomes zero where either of
+    /// its cells is above the bound.
+    int clamp_column(Word *P, Word *M, int nwords, int top, int bound) {
+        int v = top;
+        for(int b = 0; b < nwords; b++) {
+            for(int t = 0; t < word_bits / 8; t++) {
+                Chunk &chunk = chunk_table(P[b], M[b], t);
+                if(v + chunk.hi <= bound) {
+                    v += chunk.sum;
+                    continue;
+                }
+                if(v > bound && v + chunk.lo > bound) {
+                    Word keep = ~(Word(0xff) << (8 * t));
+                    P[b] &= keep;
+                    M[b] &= keep;
+                    v += chunk.sum;
+                    continue;
+                }
+                for(int k = 8 * t; k < 8 * t + 8; k++) {
+                    Word bit = Word(1) << k;
+                    int next = v + ((P[b] & bit) ? 1 : 0) - ((M[b] & bit) ? 1 : 0);
+                    if(v > bound || next > bound) {
+                        P[b] &= ~bit;
+                        M[b] &= ~bit;
+                    }
+                    v = next;
+                }
+            }
+        }
+        return min(top, bound);
+    }
+
+    int column_minimum(Word *P, Word *M, int nwords, int top) {
+        int v = top, best = top;
+        for(int b = 0; b < nwords; b++) {
+            for(int t = 0; t < word_bits / 8; t++) {
+                Chunk &chunk = chunk_table(P[b], M[b], t);
+                best = min(best, v + chunk.lo);
+                v += chunk.sum;
+            }
+        }
+        return best;
+    }
+
+    int column_bottom(Word *P, Word *M, int nwords, int m, int top) {
+        int v = top;
+        Word last = last_word_mask(m);
+        for(int b = 0; b < nwords; b++) {
+            Word mask = b == nwords - 1 ? last : ~Word(0);
+            v += popcount(P[b] & mask) - popcount(M[b] & mask);
+        }
+        return v;
+    }
 }
 
 
@@ -76,6 +238,14 @@ namespace ocropus {
                         float del_cost,
                         float ins_cost,
                         float sub_cost) {
+        // most lines of a good transcription are right, and the
+        // backtrace of those only runs down the diagonal
+        if(equal(str1, str2)) {
+            for(int i = 0; i < str1.length(); i++)
+                confusion(str1[i].ord(), str2[i].ord())++;
+            return 0;
+        }
+
         floatarray d;
         fill_edit_distance_table(d, str1, str2, del_cost, ins_cost, sub_cost);
 
@@ -111,6 +281,59 @@ namespace ocropus {
         return d(str1.length(), str2.length());
     }
 
+    int fast_edit_distance(nustring &str1, nustring &str2) {
+        // the longer string goes into the bit vectors, which takes
+        // fewer steps
+        nustring &pattern = str1.length() >= str2.length() ? str1 : str2;
+        nustring &text = str1.length() >= str2.length() ? str2 : str1;
+        int m = pattern.length();
+        if(m == 0)
+            return 0;
+        MatchVectors peq(pattern);
+        int nwords = peq.nwords;
+        narray<Word> P(nwords), M(nwords);
+        fill(P, ~Word(0));
+        fill(M, Word(0));
+        for(int i = 0; i < text.length(); i++)
+            myers_column(P.data, M.data, peq(text[i]), nwords);
+        return column_bottom(P.data, M.data, nwords, m, text.length());
+    }
+
+    int bounded_edit_distance(nustring &str1, nustring &str2, int max_cost) {
+        CHECK_ARG(max_cost >= 0);
+        int m = str1.length();
+        int n = str2.length();
+        int k = max_cost;
+        int inf = k + 1;
+        if(abs(m - n) > k)
+            return inf;
+        // cells more than k off the diagonal are never looked at, and
+        // the ones right next to the band hold inf
+        intarray upper(n + 1), row(n + 1);
+        for(int j = 0; j <= n; j++)
+            upper[j] = j <= k ? j : inf;
+        for(int i = 1; i <= m; i++) {
+            int lo = max(1, i - k);
+            int hi = min(n, i + k);
+            row[lo - 1] = lo == 1 && i <= k ? i : inf;
+            int best = row[lo - 1];
+            for(int j = lo; j <= hi; j++) {
+                int v = upper[j - 1] + (str1[i - 1] == str2[j - 1] ? 0 : 1);
+                v = min(v, upper[j] + 1);
+                v = min(v, row[j - 1] + 1);
+                row[j] = min(v, inf);
+                best = min(best, row[j]);
+            }
+            if(hi < n)
+                row[hi + 1] = inf;
+            // every path to the last cell crosses this row
+            if(best > k)
+                return inf;
+            swap(row, upper);
+        }
+        return upper[n];
+    }
+
     float block_move_edit_cost(nustring &from, nustring &to, float c) {
         floatarray upper, row;
         row.resize(from.length() + 1);
@@ -146,6 +369,39 @@ namespace ocropus {
         return row[from.length()];
     }
 
+    // The rows of block_move_edit_cost() are the columns of Myers'
+    // algorithm over from, followed by clamping to the minimum plus c.
+    // Clamping keeps adjacent cells (in both directions) within one of
+    // each other, so with a whole c the rows stay representable as
+    // bit vectors.
+    float fast_block_move_edit_cost(nustring &from, nustring &to, float c) {
+        int k = int(c);
+        int m = from.length();
+        if(k != c || k < 0 || m == 0)
+            return block_move_edit_cost(from, to, c);
+        MatchVectors peq(from);
+        int nwords = peq.nwords;
+        Word last = last_word_mask(m);
+        // the first row is min(c,j)
+        narray<Word> P(nwords), M(nwords);
+        fill(M, Word(0));
+        for(int b = 0; b < nwords; b++) {
+            int ones = min(int(word_bits), max(0, k - b * word_bits));
+            P[b] = ones == word_bits ? ~Word(0) : (Word(1) << ones) - 1;
+        }
+        P[nwords - 1] &= last;
+        int top = 0;
+        for(int i = 0; i < to.length(); i++) {
+            myers_column(P.data, M.data, peq(to[i]), nwords);
+            P[nwords - 1] &= last;
+            M[nwords - 1] &= last;
+            top++;
+            int bound = column_minimum(P.data, M.data, nwords, top) + k;
+            top = clamp_column(P.data, M.data, nwords, top, bound);
+        }
+        return column_bottom(P.data, M.data, nwords, m, top);
+    }
+
     /// Same as block_move_edit_cost(), but also records all block movements
     /// (aka cursor jumps) in the form of two integer arrays.
     float block_move_edit_cost_record_jumps(intarray &jumps_from, intarray &jumps_to, nustring &from, nustring &to, float c) {
@@ -299,8 +555,8 @@ namespace ocropus {
 
 
     float block_move_edit_distance(nustring &a, nustring &b, float c) {
-        return (block_move_edit_cost(a, b, c)
-              + block_move_edit_cost(b, a, c)) / 2;
+        return (fast_block_move_edit_cost(a, b, c)
+              + fast_block_move_edit_cost(b, a, c)) / 2;
     }
 
     void analyze_jumps(bytearray &area_covered_by_non_jumps,
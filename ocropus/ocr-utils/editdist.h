@@ -38,6 +38,17 @@ namespace ocropus {
                         float ins_cost=1,
                         float sub_cost=1);
 
+    /// Unit-cost edit_distance() by Myers' bit-parallel algorithm (in
+    /// Hyyro's formulation): 64 cells of the table per step, and no
+    /// table at all.
+    int fast_edit_distance(colib::nustring &str1, colib::nustring &str2);
+
+    /// Unit-cost edit distance if it is at most max_cost, and
+    /// max_cost+1 otherwise.  Only the band of the table within
+    /// max_cost of the diagonal is computed, and the computation stops
+    /// as soon as a row exceeds max_cost.
+    int bounded_edit_distance(colib::nustring &str1, colib::nustring &str2, int max_cost);
+
 
     /// Asymmetric edit cost with block movement.
     /// \param[in] from     The string where editing starts.
@@ -46,7 +57,13 @@ namespace ocropus {
     float block_move_edit_cost(colib::nustring &from,
                                colib::nustring &to,
                                float c);
-    
+
+    /// Same as block_move_edit_cost(), but bit-parallel when c is a
+    /// whole number (and the same computation otherwise).
+    float fast_block_move_edit_cost(colib::nustring &from,
+                                    colib::nustring &to,
+                                    float c);
+
     /// Symmetrization of block_move_edit_cost().
     float block_move_edit_distance(colib::nustring &a,
                                    colib::nustring &b,
@@ -380,6 +380,14 @@ namespace ocropus {
             classifications(index,cls) = cost;
         }
 
+        void setClasses(int index,floatarray &costs) {
+            maybeInit();
+            CHECK(costs.length()<=classifications.dim(1));
+            float *row = &classifications(index,0);
+            for(int cls=0;cls<costs.length();cls++)
+                if(costs(cls)<INFINITY) row[cls] = costs(cls);
+        }
+
         // Get spacing to the next component.
 
         int pixelSpace(int i) {
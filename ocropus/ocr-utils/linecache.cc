@@ -0,0 +1,417 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: linecache.cc
+// Purpose: cache of recognition results for repeated text lines
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <stdio.h>
+#include <math.h>
+#include "ocropus.h"
+#include "narray-binio.h"
+
+namespace ocropus {
+    using namespace colib;
+    using namespace narray_io;
+
+    namespace {
+        const unsigned long long fnv_basis = 14695981039346656037ULL;
+        const unsigned long long fnv_prime = 1099511628211ULL;
+
+        inline void fnv(unsigned long long &h,unsigned value) {
+            for(int i=0;i<4;i++) {
+                h ^= (value>>(8*i))&0xff;
+                h *= fnv_prime;
+            }
+        }
+
+        // run-length code an array of labels
+
+        void rle_encode(intarray &out,intarray &in) {
+            out.clear();
+            int n = in.length1d();
+            for(int i=0;i<n;) {
+                int value = in.at1d(i);
+                int j = i+1;
+                while(j<n && in.at1d(j)==value) j++;
+                out.push(value);
+                out.push(j-i);
+                i = j;
+            }
+        }
+
+        void rle_decode(intarray &out,intarray &in,int w,int h) {
+            out.resize(w,h);
+            int k = 0;
+            for(int i=0;i<in.length();i+=2)
+                for(int j=0;j<in(i+1);j++)
+                    out.at1d(k++) = in(i);
+            CHECK(k==w*h);
+        }
+    }
+
+    // The line is thresholded halfway between its darkest and its
+    // brightest pixel, cropped to the ink and scaled to a height of
+    // 24 pixels by averaging; that removes most of the differences
+    // between scans of the same text, but keeps different page
+    // numbers apart.
+
+    unsigned long long line_image_hash(bytearray &image) {
+        enum { target=24 };
+        unsigned long long h = fnv_basis;
+        int w = image.dim(0), ht = image.dim(1);
+        if(image.length()==0) return h;
+        int lo = min(image), hi = max(image);
+        int threshold = (lo+hi)/2;
+        int x0 = w, y0 = ht, x1 = -1, y1 = -1;
+        if(hi>lo) {
+            for(int i=0;i<w;i++) {
+                for(int j=0;j<ht;j++) {
+                    if(image(i,j)>threshold) continue;
+                    x0 = min(x0,i); x1 = max(x1,i);
+                    y0 = min(y0,j); y1 = max(y1,j);
+                }
+            }
+        }
+        if(x1<0) return h;
+        int bw = x1-x0+1, bh = y1-y0+1;
+        float scale = bh/float(target);
+        int nw = max(1,int(bw/scale+0.5));
+        fnv(h,nw);
+        for(int i=0;i<nw;i++) {
+            int xa = x0+int(i*scale), xb = max(xa+1,x0+int((i+1)*scale));
+            unsigned word = 0;
+            for(int j=0;j<target;j++) {
+                int ya = y0+int(j*scale), yb = max(ya+1,y0+int((j+1)*scale));
+                int ink = 0, total = 0;
+                for(int x=xa;x<xb && x<=x1;x++) {
+                    for(int y=ya;y<yb && y<=y1;y++) {
+                        ink += image(x,y)<=threshold;
+                        total++;
+                    }
+                }
+                if(2*ink>total) word |= 1<<j;
+            }
+            fnv(h,word);
+        }
+        return h;
+    }
+
+    unsigned long long file_hash(const char *path) {
+        unsigned long long h = fnv_basis;
+        stdio stream(path,"rb");
+        unsigned char buf[65536];
+        size_t n;
+        while((n = fread(buf,1,sizeof buf,stream))>0) {
+            for(size_t i=0;i<n;i++) {
+                h ^= buf[i];
+                h *= fnv_prime;
+            }
+        }
+        return h;
+    }
+
+    // The parameters are taken from the text that info() prints, so
+    // that parameters of parts (segmenter, feature map, classifier)
+    // that the component doesn't expose are included as well.
+
+    unsigned long long component_hash(IComponent &component) {
+        unsigned long long h = fnv_basis;
+        stdio stream(tmpfile());
+        component.info(0,stream);
+        rewind(stream);
+        int c;
+        while((c = fgetc(stream))!=EOF) {
+            h ^= (unsigned char)c;
+            h *= fnv_prime;
+        }
+        return h;
+    }
+
+    long LineCache::Entry::size() {
+        return sizeof *this + sizeof (int)*(arcs.length()+rseg.length()) +
+            sizeof (float)*(costs.length()+accept.length());
+    }
+
+    LineCache::LineCache(long maxbytes) : maxbytes(maxbytes) {
+        newest = oldest = 0;
+        nentries = 0;
+        model_key = 0;
+        bytes = 0;
+        hits = 0;
+        misses = 0;
+        buckets.resize(1024);
+        fill(buckets,(Entry*)0);
+    }
+
+    LineCache::~LineCache() {
+        clear();
+    }
+
+    void LineCache::clear() {
+        while(oldest) {
+            Entry *e = oldest;
+            unlink(e);
+            delete e;
+        }
+        bytes = 0;
+    }
+
+    void LineCache::setModel(const char *path,IComponent &linerec) {
+        unsigned long long key = file_hash(path);
+        unsigned long long params = component_hash(linerec);
+        fnv(key,unsigned(params));
+        fnv(key,unsigned(params>>32));
+#pragma omp critical(linecache)
+        {
+            if(key!=model_key) clear();
+            model_key = key;
+        }
+    }
+
+    unsigned long long LineCache::key(bytearray &image) {
+        unsigned long long h = line_image_hash(image);
+        fnv(h,unsigned(model_key));
+        fnv(h,unsigned(model_key>>32));
+        return h;
+    }
+
+    LineCache::Entry *LineCache::find(unsigned long long key) {
+        Entry *e = buckets(int(key%buckets.length()));
+        while(e && e->key!=key) e = e->next;
+        return e;
+    }
+
+    // put e into its bucket and at the front of the list
+
+    void LineCache::link(Entry *e) {
+        if(nentries>=buckets.length()) rehash(2*buckets.length());
+        Entry *&bucket = buckets(int(e->key%buckets.length()));
+        e->next = bucket;
+        bucket = e;
+        e->older = newest;
+        e->newer = 0;
+        if(newest) newest->newer = e;
+        else oldest = e;
+        newest = e;
+        nentries++;
+        bytes += e->size();
+    }
+
+    void LineCache::unlink(Entry *e) {
+        Entry **p = &buckets(int(e->key%buckets.length()));
+        while(*p!=e) p = &(*p)->next;
+        *p = e->next;
+        if(e->newer) e->newer->older = e->older;
+        else newest = e->older;
+        if(e->older) e->older->newer = e->newer;
+        else oldest = e->newer;
+        nentries--;
+        bytes -= e->size();
+    }
+
+    void LineCache::touch(Entry *e) {
+        if(e==newest) return;
+        e->newer->older = e->older;
+        if(e->older) e->older->newer = e->newer;
+        else oldest = e->newer;
+        e->older = newest;
+        e->newer = 0;
+        newest->newer = e;
+        newest = e;
+    }
+
+    void LineCache::rehash(int n) {
+        narray<Entry*> old;
+        move(old,buckets);
+        buckets.resize(n);
+        fill(buckets,(Entry*)0);
+        for(int i=0;i<old.length();i++) {
+            Entry *e = old(i);
+            while(e) {
+                Entry *next = e->next;
+                Entry *&bucket = buckets(int(e->key%n));
+                e->next = bucket;
+                bucket = e;
+                e = next;
+            }
+        }
+    }
+
+    void LineCache::evict() {
+        while(bytes>maxbytes && oldest) {
+            Entry *e = oldest;
+            unlink(e);
+            delete e;
+        }
+    }
+
+    bool LineCache::lookup(intarray &segmentation,IGenericFst &result,bytearray &image) {
+        unsigned long long k = key(image);
+        bool found = false;
+        // copy the entry out under the lock, since another thread may
+        // evict it as soon as the lock is released
+        Entry e;
+#pragma omp critical(linecache)
+        {
+            Entry *entry = find(k);
+            if(entry) {
+                touch(entry);
+                e.w = entry->w;
+                e.h = entry->h;
+                e.start = entry->start;
+                copy(e.arcs,entry->arcs);
+                copy(e.costs,entry->costs);
+                copy(e.accept,entry->accept);
+                copy(e.rseg,entry->rseg);
+                hits++;
+                found = true;
+            } else {
+                misses++;
+            }
+        }
+        if(!found) return false;
+        result.clear();
+        for(int i=0;i<e.accept.length();i++)
+            result.newState();
+        for(int i=0;i<e.costs.length();i++)
+            result.addTransition(e.arcs(4*i),e.arcs(4*i+1),e.arcs(4*i+3),e.costs(i),e.arcs(4*i+2));
+        result.setStart(e.start);
+        for(int i=0;i<e.accept.length();i++)
+            if(e.accept(i)<1e30) result.setAccept(i,e.accept(i));
+        if(e.rseg.length()>0 && e.w==image.dim(0) && e.h==image.dim(1))
+            rle_decode(segmentation,e.rseg,e.w,e.h);
+        else
+            segmentation.clear();
+        return true;
+    }
+
+    void LineCache::insert(intarray &segmentation,IGenericFst &result,bytearray &image) {
+        unsigned long long k = key(image);
+        Entry *e = new Entry();
+        e->key = k;
+        e->w = image.dim(0);
+        e->h = image.dim(1);
+        e->start = result.getStart();
+        int n = result.nStates();
+        e->accept.resize(n);
+        intarray inputs,targets,outputs;
+        floatarray costs;
+        for(int i=0;i<n;i++) {
+            e->accept(i) = result.getAcceptCost(i);
+            result.arcs(inputs,targets,outputs,costs,i);
+            for(int j=0;j<targets.length();j++) {
+                e->arcs.push(i);
+                e->arcs.push(targets(j));
+                e->arcs.push(inputs(j));
+                e->arcs.push(outputs(j));
+                e->costs.push(costs(j));
+            }
+        }
+        if(segmentation.length()>0 && segmentation.dim(0)==e->w && segmentation.dim(1)==e->h)
+            rle_encode(e->rseg,segmentation);
+#pragma omp critical(linecache)
+        {
+            if(find(k)) {
+                // another thread recognized the same line meanwhile
+                delete e;
+            } else {
+                link(e);
+                evict();
+            }
+        }
+    }
+
+    void LineCache::recognizeLine(IRecognizeLine &linerec,intarray &segmentation,
+                                  IGenericFst &result,bytearray &image) {
+        if(lookup(segmentation,result,image)) return;
+        segmentation.clear();
+        try {
+            linerec.recognizeLine(segmentation,result,image);
+        } catch(Unimplemented unimplemented) {
+            linerec.recognizeLine(result,image);
+        }
+        insert(segmentation,result,image);
+    }
+
+    void LineCache::counts(int &hits,int &misses,int &entries) {
+#pragma omp critical(linecache)
+        {
+            hits = this->hits;
+            misses = this->misses;
+            entries = nentries;
+        }
+    }
+
+    // entries are written from the least to the most recently used, so
+    // that loading them restores the order
+
+    void LineCache::save(const char *path) {
+        stdio stream(path,"wb");
+#pragma omp critical(linecache)
+        {
+            magic_write(stream,"linecache");
+            scalar_write(stream,model_key);
+            scalar_write(stream,nentries);
+            for(Entry *e=oldest;e;e=e->newer) {
+                scalar_write(stream,e->key);
+                scalar_write(stream,e->w);
+                scalar_write(stream,e->h);
+                scalar_write(stream,e->start);
+                narray_write(stream,e->arcs);
+                narray_write(stream,e->costs);
+                narray_write(stream,e->accept);
+                narray_write(stream,e->rseg);
+            }
+        }
+    }
+
+    void LineCache::load(const char *path) {
+        stdio stream(path,"rb");
+        magic_read(stream,"linecache");
+        unsigned long long key;
+        int n;
+        scalar_read(stream,key);
+        if(key!=model_key) return;
+        scalar_read(stream,n);
+        CHECK(n>=0);
+        for(int i=0;i<n;i++) {
+            Entry *e = new Entry();
+            scalar_read(stream,e->key);
+            scalar_read(stream,e->w);
+            scalar_read(stream,e->h);
+            scalar_read(stream,e->start);
+            narray_read(stream,e->arcs);
+            narray_read(stream,e->costs);
+            narray_read(stream,e->accept);
+            narray_read(stream,e->rseg);
+#pragma omp critical(linecache)
+            {
+                if(find(e->key)) {
+                    delete e;
+                } else {
+                    link(e);
+                    evict();
+                }
+            }
+        }
+    }
+}
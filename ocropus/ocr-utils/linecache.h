@@ -0,0 +1,114 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: linecache.h
+// Purpose: cache of recognition results for repeated text lines
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#ifndef h_linecache_
+#define h_linecache_
+
+namespace ocropus {
+    using namespace colib;
+
+    /// Hash of a line image that ignores gray levels and scale: the
+    /// image is binarized, cropped to the ink and resampled to a fixed
+    /// height before hashing.
+
+    unsigned long long line_image_hash(bytearray &image);
+
+    /// Hash of the contents of a file (e.g., a character model).
+
+    unsigned long long file_hash(const char *path);
+
+    /// Hash of the parameters of a component and of its parts, as
+    /// printed by its info() method.
+
+    unsigned long long component_hash(IComponent &component);
+
+    /// A cache of line recognition results.  Books repeat running
+    /// headers, page numbers and boilerplate on every page; with the
+    /// cache, each of them is recognized only once.  Entries are keyed
+    /// by line_image_hash and by a key for the recognizer, and hold the
+    /// lattice and the run-length coded segmentation.  They are found
+    /// through a hash table and kept on a list in order of use; when
+    /// the cache holds more than maxbytes, the least recently used
+    /// entries are dropped.  All methods can be called from several
+    /// threads.
+
+    struct LineCache {
+        struct Entry {
+            unsigned long long key;
+            Entry *next;            // next entry in the same bucket
+            Entry *newer,*older;    // neighbors in order of use
+            int w,h;
+            int start;
+            intarray arcs;          // from, to, input, output for each arc
+            floatarray costs;
+            floatarray accept;
+            intarray rseg;          // value, count, value, count...
+            long size();
+        };
+
+        LineCache(long maxbytes=64<<20);
+        ~LineCache();
+        /// results from different models, or from the same model with
+        /// different parameters, never match; linerec is the recognizer
+        /// loaded from path
+        void setModel(const char *path,IComponent &linerec);
+        /// look up a line; on a hit, copies the lattice into result, and
+        /// the segmentation into segmentation if the stored one is for an
+        /// image of the same size (otherwise segmentation is cleared)
+        bool lookup(intarray &segmentation,IGenericFst &result,bytearray &image);
+        void insert(intarray &segmentation,IGenericFst &result,bytearray &image);
+        /// recognizeLine with the cache in front of linerec; the
+        /// segmentation is empty if linerec doesn't provide one
+        void recognizeLine(IRecognizeLine &linerec,intarray &segmentation,
+                           IGenericFst &result,bytearray &image);
+        /// number of hits, misses and entries so far
+        void counts(int &hits,int &misses,int &entries);
+        /// the file holds the entries for one model; load ignores
+        /// files written with another model
+        void save(const char *path);
+        void load(const char *path);
+    private:
+        narray<Entry*> buckets;
+        Entry *newest,*oldest;
+        int nentries;
+        unsigned long long model_key;
+        long maxbytes;
+        long bytes;
+        int hits,misses;
+
+        LineCache(const LineCache &);
+        void operator=(const LineCache &);
+        unsigned long long key(bytearray &image);
+        Entry *find(unsigned long long key);
+        void link(Entry *e);
+        void unlink(Entry *e);
+        void touch(Entry *e);
+        void rehash(int n);
+        void evict();
+        void clear();
+    };
+}
+
+#endif
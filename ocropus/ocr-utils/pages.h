@@ -100,28 +100,18 @@ namespace ocropus {
             current_index = -1;
         }
         void loadImage() {
-            has_gray = false;
-            has_color = false;
-            binary.clear();
             gray.clear();
-            color.clear();
-            iulib::read_image_gray(gray,current_file);
-            if(autoinv) {
-                iulib::make_page_black(gray);
-                invert(gray);
-            }
-            if(!binarizer) {
-                float v0 = min(gray);
-                float v1 = max(gray);
-                float threshold = (v1+v0)/2;
-                makelike(binary,gray);
-                for(int i=0;i<gray.length1d();i++)
-                    binary.at1d(i) = (gray.at1d(i) > threshold) ? 255:0;
-            } else {
-                colib::floatarray temp;
-                copy(temp,gray);
-                binarizer->binarize(binary,temp);
+            {
+                StatsTimer timer("read_image");
+                iulib::read_image_gray(gray,current_file);
             }
+            prepare();
+        }
+        /// use an image that didn't come from a file (e.g. from a request)
+        void setImage(colib::bytearray &image) {
+            current_file = "";
+            copy(gray,image);
+            prepare();
         }
         const char *getFileName() {
             return (const char *)current_file;
@@ -151,6 +141,30 @@ namespace ocropus {
             copy(dst,color);
         }
     private:
+        // invert and binarize the gray image
+        void prepare() {
+            has_gray = false;
+            has_color = false;
+            binary.clear();
+            color.clear();
+            if(autoinv) {
+                iulib::make_page_black(gray);
+                invert(gray);
+            }
+            if(!binarizer) {
+                StatsTimer timer("binarize");
+                float v0 = min(gray);
+                float v1 = max(gray);
+                float threshold = (v1+v0)/2;
+                makelike(binary,gray);
+                for(int i=0;i<gray.length1d();i++)
+                    binary.at1d(i) = (gray.at1d(i) > threshold) ? 255:0;
+            } else {
+                colib::floatarray temp;
+                copy(temp,gray);
+                binarizer->binarize(binary,temp);
+            }
+        }
         void invert(bytearray &a) {
             int n = a.length1d();
             for (int i = 0; i < n; i++) {
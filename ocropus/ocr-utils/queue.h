@@ -27,6 +27,7 @@
 #ifndef h_queue_
 #define h_queue_
 
+#include <pthread.h>
 #include "ocropus.h"
 
 namespace ocropus {
@@ -76,6 +77,103 @@ private:
     void operator=(Queue<T> &);
 };
 
+/// A bounded queue for handing work from one group of threads to the
+/// next.  put() blocks while the queue is full (offer() returns false
+/// instead) and get() while it is empty.  Every producer calls close()
+/// when it's done; after the last one, get() returns false once the
+/// queue is drained.
+template <class T>
+struct BlockingQueue {
+    Queue<T> queue;
+    int capacity,fill,producers;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty,not_full;
+
+    BlockingQueue(int capacity,int producers=1)
+        : queue(capacity+1),capacity(capacity),fill(0),producers(producers) {
+        CHECK_ARG(capacity>0);
+        pthread_mutex_init(&mutex,0);
+        pthread_cond_init(&not_empty,0);
+        pthread_cond_init(&not_full,0);
+    }
+    ~BlockingQueue() {
+        pthread_cond_destroy(&not_full);
+        pthread_cond_destroy(&not_empty);
+        pthread_mutex_destroy(&mutex);
+    }
+    void put(T value) {
+        pthread_mutex_lock(&mutex);
+        while(fill>=capacity)
+            pthread_cond_wait(&not_full,&mutex);
+        queue.enqueue(value);
+        fill++;
+        pthread_cond_signal(&not_empty);
+        pthread_mutex_unlock(&mutex);
+    }
+    bool offer(T value) {
+        pthread_mutex_lock(&mutex);
+        bool result = fill<capacity;
+        if(result) {
+            queue.enqueue(value);
+            fill++;
+            pthread_cond_signal(&not_empty);
+        }
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+    bool get(T &value) {
+        pthread_mutex_lock(&mutex);
+        while(fill==0 && producers>0)
+            pthread_cond_wait(&not_empty,&mutex);
+        bool result = fill>0;
+        if(result) {
+            value = queue.dequeue();
+            fill--;
+            pthread_cond_signal(&not_full);
+        }
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+    void close() {
+        pthread_mutex_lock(&mutex);
+        CHECK(producers>0);
+        if(--producers==0)
+            pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&mutex);
+    }
+    int length() {
+        pthread_mutex_lock(&mutex);
+        int result = fill;
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+private:
+    BlockingQueue(const BlockingQueue<T> &);
+    void operator=(const BlockingQueue<T> &);
+};
+
+/// A group of threads running the same function, for the stages
+/// connected by BlockingQueues.
+struct ThreadGroup {
+    colib::narray<pthread_t> threads;
+    ~ThreadGroup() {
+        join();
+    }
+    void start(void *(*run)(void *),void *arg,int n=1) {
+        for(int i=0;i<n;i++) {
+            pthread_t thread;
+            if(pthread_create(&thread,0,run,arg))
+                throw "ThreadGroup: cannot create a thread";
+            threads.push(thread);
+        }
+    }
+    void join() {
+        for(int i=0;i<threads.length();i++)
+            pthread_join(threads[i],0);
+        threads.clear();
+    }
+};
+
 }
 
 #endif
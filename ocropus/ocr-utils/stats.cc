@@ -0,0 +1,239 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: stats.cc
+// Purpose: timings and counters of the stages of recognition
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "colib/colib.h"
+#include "sysutil.h"
+#include "stats.h"
+
+namespace ocropus {
+    using namespace colib;
+
+    bool stats_enabled = false;
+
+    namespace {
+        // bin b holds durations up to 2^(b/4) microseconds
+        enum { nbins = 128 };
+
+        int bin_of(double seconds) {
+            double us = seconds*1e6;
+            if(us<=1) return 0;
+            int b = int(ceil(4*log2(us)));
+            return b<nbins ? b : nbins-1;
+        }
+
+        // the geometric middle of a bin
+        double bin_value(int b) {
+            return 1e-6*pow(2.0,(b-0.5)/4);
+        }
+
+        struct Stage {
+            const char *name;
+            int parent,child,sibling;   // -1 for none
+            long long count;
+            double total;
+            long long bins[nbins];
+            Stage() {}
+            Stage(const char *name,int parent)
+                : name(name),parent(parent),child(-1),sibling(-1),count(0),total(0) {
+                memset(bins,0,sizeof bins);
+            }
+            void add(Stage &other) {
+                count += other.count;
+                total += other.total;
+                for(int i=0;i<nbins;i++) bins[i] += other.bins[i];
+            }
+            double percentile(double p) {
+                long long limit = (long long)ceil(p*count);
+                long long sum = 0;
+                for(int i=0;i<nbins;i++) {
+                    sum += bins[i];
+                    if(sum>=limit && sum>0) return bin_value(i);
+                }
+                return 0;
+            }
+        };
+
+        struct Counter {
+            const char *name;
+            long long value;
+        };
+
+        // what one thread recorded; the stages form a tree, with the
+        // stage being timed in current (-1 at the top)
+        struct ThreadStats {
+            narray<Stage> stages;
+            narray<Counter> counters;
+            int current;
+            ThreadStats() : current(-1) {}
+            int child(int parent,const char *name) {
+                int first = parent<0 ? (stages.length()>0 ? 0 : -1) : stages[parent].child;
+                int last = -1;
+                for(int i=first;i>=0;i=stages[i].sibling) {
+                    if(stages[i].name==name || !strcmp(stages[i].name,name)) return i;
+                    last = i;
+                }
+                int i = stages.length();
+                stages.push(Stage(name,parent));
+                if(last>=0) stages[last].sibling = i;
+                else if(parent>=0) stages[parent].child = i;
+                return i;
+            }
+        };
+
+        pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_key_t key;
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        // kept after their threads end, until the stats are written
+        narray<ThreadStats*> all_threads;
+        double started;
+
+        void make_key() {
+            pthread_key_create(&key,0);
+        }
+
+        ThreadStats &thread_stats() {
+            ThreadStats *stats = (ThreadStats*)pthread_getspecific(key);
+            if(!stats) {
+                stats = new ThreadStats();
+                pthread_setspecific(key,stats);
+                pthread_mutex_lock(&mutex);
+                all_threads.push(stats);
+                pthread_mutex_unlock(&mutex);
+            }
+            return *stats;
+        }
+
+        void path(iucstring &result,narray<Stage> &stages,int i) {
+            if(stages[i].parent>=0) {
+                path(result,stages,stages[i].parent);
+                result += "/";
+            } else {
+                result = "";
+            }
+            result += stages[i].name;
+        }
+
+        void json_string(FILE *stream,const char *s) {
+            fputc('"',stream);
+            for(;*s;s++) {
+                if(*s=='"' || *s=='\\') fputc('\\',stream);
+                fputc(*s,stream);
+            }
+            fputc('"',stream);
+        }
+    }
+
+    void stats_enable() {
+        pthread_once(&once,make_key);
+        started = now();
+        stats_enabled = true;
+    }
+
+    void StatsTimer::begin(const char *name) {
+        ThreadStats &stats = thread_stats();
+        node = stats.child(stats.current,name);
+        stats.current = node;
+        start = now();
+    }
+
+    void StatsTimer::end() {
+        double elapsed = now()-start;
+        ThreadStats &stats = thread_stats();
+        Stage &stage = stats.stages[node];
+        stage.count++;
+        stage.total += elapsed;
+        stage.bins[bin_of(elapsed)]++;
+        stats.current = stage.parent;
+    }
+
+    void stats_add(const char *name,long long n) {
+        narray<Counter> &counters = thread_stats().counters;
+        for(int i=0;i<counters.length();i++) {
+            if(counters[i].name==name || !strcmp(counters[i].name,name)) {
+                counters[i].value += n;
+                return;
+            }
+        }
+        Counter counter = { name,n };
+        counters.push(counter);
+    }
+
+    void stats_write(FILE *stream,const char *command) {
+        // merge the threads by the paths of the stages and the names of
+        // the counters, in the order they first appear
+        narray<iucstring> paths;
+        narray<Stage> stages;
+        narray<Counter> counters;
+        pthread_mutex_lock(&mutex);
+        for(int t=0;t<all_threads.length();t++) {
+            ThreadStats &thread = *all_threads[t];
+            for(int i=0;i<thread.stages.length();i++) {
+                iucstring p;
+                path(p,thread.stages,i);
+                int j = 0;
+                while(j<paths.length() && paths[j]!=p) j++;
+                if(j==paths.length()) {
+                    paths.push(p);
+                    stages.push(Stage(thread.stages[i].name,-1));
+                }
+                stages[j].add(thread.stages[i]);
+            }
+            for(int i=0;i<thread.counters.length();i++) {
+                int j = 0;
+                while(j<counters.length() && strcmp(counters[j].name,thread.counters[i].name)) j++;
+                if(j==counters.length()) {
+                    Counter counter = { thread.counters[i].name,0 };
+                    counters.push(counter);
+                }
+                counters[j].value += thread.counters[i].value;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+
+        fprintf(stream,"{\n  \"command\": ");
+        json_string(stream,command);
+        fprintf(stream,",\n  \"seconds\": %.6f,\n",now()-started);
+        fprintf(stream,"  \"user\": %.6f,\n  \"system\": %.6f,\n",user_time(),system_time());
+        fprintf(stream,"  \"stages\": [");
+        for(int i=0;i<stages.length();i++) {
+            Stage &s = stages[i];
+            fprintf(stream,"%s\n    {\"stage\": ",i?",":"");
+            json_string(stream,paths[i].c_str());
+            fprintf(stream,", \"count\": %lld, \"total\": %.6f, "
+                    "\"p50\": %.6f, \"p95\": %.6f, \"p99\": %.6f}",
+                    s.count,s.total,s.percentile(0.5),s.percentile(0.95),s.percentile(0.99));
+        }
+        fprintf(stream,"\n  ],\n  \"counters\": {");
+        for(int i=0;i<counters.length();i++) {
+            fprintf(stream,"%s\n    ",i?",":"");
+            json_string(stream,counters[i].name);
+            fprintf(stream,": %lld",counters[i].value);
+        }
+        fprintf(stream,"\n  }\n}\n");
+    }
+}
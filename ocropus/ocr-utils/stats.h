@@ -0,0 +1,79 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: stats.h
+// Purpose: timings and counters of the stages of recognition
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#ifndef h_stats_
+#define h_stats_
+
+#include <stdio.h>
+
+namespace ocropus {
+
+    /// Timings of the stages of recognition and counters (e.g. bytes
+    /// read), for comparing runs and releases.  Nothing is recorded
+    /// until stats_enable() is called; until then, a StatsTimer or a
+    /// stats_count costs a test of stats_enabled.
+    ///
+    /// Timers nest: a StatsTimer("setLine") inside a
+    /// StatsTimer("recognizeLine") is the stage "recognizeLine/setLine".
+    /// Every thread records into its own table, without locking; the
+    /// tables are merged when the stats are written.  The percentiles are
+    /// estimated from a histogram with four bins per factor of two, so
+    /// they are within 10% of the true ones.
+
+    extern bool stats_enabled;
+
+    void stats_enable();
+
+    /// Time the enclosing scope as a stage; name must be a string constant.
+    struct StatsTimer {
+        int node;
+        double start;
+        StatsTimer(const char *name) {
+            node = -1;
+            if(stats_enabled) begin(name);
+        }
+        ~StatsTimer() {
+            if(node>=0) end();
+        }
+    private:
+        void begin(const char *name);
+        void end();
+        StatsTimer(const StatsTimer &);
+        void operator=(const StatsTimer &);
+    };
+
+    void stats_add(const char *name,long long n);
+
+    /// Add n to a counter; name must be a string constant.
+    inline void stats_count(const char *name,long long n=1) {
+        if(stats_enabled) stats_add(name,n);
+    }
+
+    /// \brief Write the stages and counters of all threads as a JSON
+    /// object; call it when the other threads are done.
+    void stats_write(FILE *stream,const char *command);
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <colib/colib.h>
+#include "bookstore.h"
+
+using namespace colib;
+using namespace ocropus;
+
+static char path[] = "/tmp/test-bookstore-XXXXXX";
+
+enum { nthreads = 4, nlines = 300 };
+
+// the contents of a record, so that they can be checked after reading
+static void contents(bytearray &data, int page, int line, const char *kind) {
+    data.resize((page * 7 + line * 13 + strlen(kind)) % 1000);
+    for(int i = 0; i < data.length(); i++)
+        data[i] = (page + line * 3 + i) & 0xff;
+}
+
+static void check_record(BookStore &store, int page, int line, const char *kind) {
+    int i = store.find(page, line, kind);
+    CHECK_CONDITION(i >= 0);
+    bytearray expected, actual;
+    contents(expected, page, line, kind);
+    store.get(actual, i);
+    CHECK_CONDITION(expected.equal(actual));
+    FILE *stream = store.reader(i);
+    bytearray read(expected.length() + 1);
+    CHECK_CONDITION(fread(&read[0], 1, read.length(), stream) == size_t(expected.length()));
+    fclose(stream);
+    for(int j = 0; j < expected.length(); j++)
+        CHECK_CONDITION(read[j] == expected[j]);
+}
+
+struct Writer {
+    BookStore *store;
+    int page;
+};
+
+static void *put_lines(void *arg) {
+    BookStore &store = *((Writer *) arg)->store;
+    int page = ((Writer *) arg)->page;
+    for(int line = 0; line < nlines; line++) {
+        const char *kind = line % 2 ? ".png" : ".fst";
+        bytearray data;
+        contents(data, page, line, kind);
+        store.put(page, line, kind, data.length() ? &data[0] : 0, data.length());
+    }
+    return 0;
+}
+
+// records written from several threads at once are all there, after
+// writing and after reopening
+static void test_concurrent_put() {
+    BookStore store;
+    store.open(path, true);
+    pthread_t threads[nthreads];
+    Writer writers[nthreads];
+    for(int t = 0; t < nthreads; t++) {
+        writers[t].store = &store;
+        writers[t].page = t + 1;
+        pthread_create(&threads[t], 0, put_lines, &writers[t]);
+    }
+    for(int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], 0);
+    CHECK_CONDITION(store.length() == nthreads * nlines);
+    check_record(store, 2, 5, ".png");
+    store.close();
+    store.open(path);
+    CHECK_CONDITION(store.length() == nthreads * nlines);
+    for(int page = 1; page <= nthreads; page++)
+        for(int line = 0; line < nlines; line++)
+            check_record(store, page, line, line % 2 ? ".png" : ".fst");
+    CHECK_CONDITION(store.find(1, 0, ".png") < 0);
+    CHECK_CONDITION(store.find(nthreads + 1, 1, ".png") < 0);
+}
+
+// appending to a closed book keeps the old records, and a new record
+// replaces the old one with the same key
+static void test_append_and_replace() {
+    BookStore store;
+    store.open(path, true);
+    bytearray data;
+    contents(data, 9, -1, ".seg.png");
+    store.put(9, -1, ".seg.png", &data[0], data.length());
+    store.put(1, 1, ".png", "x", 1);
+    store.close();
+    store.open(path);
+    CHECK_CONDITION(store.length() == nthreads * nlines + 1);
+    check_record(store, 9, -1, ".seg.png");
+    check_record(store, 1, 3, ".png");
+    bytearray replaced;
+    store.get(replaced, store.find(1, 1, ".png"));
+    CHECK_CONDITION(replaced.length() == 1 && replaced[0] == 'x');
+}
+
+// without the index (the writer died before close), the records are
+// found by scanning
+static void test_recovery() {
+    BookStore store;
+    store.open(path, true);
+    store.put(7, 7, ".txt", "hello", 5);
+    // what the file looks like before close() writes the index
+    bytearray image;
+    {
+        stdio stream(path, "rb");
+        fseek(stream, 0, SEEK_END);
+        image.resize(ftell(stream));
+        rewind(stream);
+        CHECK_CONDITION(fread(&image[0], 1, image.length(), stream) == size_t(image.length()));
+    }
+    store.close();
+    {
+        stdio stream(path, "wb");
+        CHECK_CONDITION(fwrite(&image[0], 1, image.length(), stream) == size_t(image.length()));
+    }
+    store.open(path);
+    CHECK_CONDITION(store.length() == nthreads * nlines + 2);
+    check_record(store, 3, 17, ".png");
+    bytearray hello;
+    store.get(hello, store.find(7, 7, ".txt"));
+    CHECK_CONDITION(hello.length() == 5 && !memcmp(&hello[0], "hello", 5));
+}
+
+// BookWriter::close() throws when the record can't be added
+static void test_writer_close() {
+    iucstring book_path;
+    sprintf(book_path, "%s.book", path);
+    {
+        Book book(book_path.c_str(), true);
+        BookWriter writer(book, 1, 1, ".txt");
+        fprintf(writer, "hello");
+        writer.close();
+    }
+    Book book(book_path.c_str());
+    CHECK_CONDITION(book.exists(1, 1, ".txt"));
+    BookWriter writer(book, 1, 2, ".txt");
+    fprintf(writer, "hello");
+    bool thrown = false;
+    try {
+        writer.close();
+    } catch(const char *message) {
+        thrown = true;
+    }
+    CHECK_CONDITION(thrown);
+    CHECK_CONDITION(!book.exists(1, 2, ".txt"));
+    unlink(book_path.c_str());
+}
+
+int main() {
+    int fd = mkstemp(path);
+    CHECK_CONDITION(fd >= 0);
+    close(fd);
+    test_concurrent_put();
+    test_append_and_replace();
+    test_recovery();
+    test_writer_close();
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <colib/colib.h>
+#include "editdist.h"
+
+using namespace colib;
+using namespace ocropus;
+
+// random strings over a small alphabet, so that there are many matches,
+// with lengths on both sides of the word size
+static void random_string(nustring &s, int maxlen, int nchars) {
+    s.resize(rand() % (maxlen + 1));
+    for(int i = 0; i < s.length(); i++)
+        s[i] = nuchar('a' + rand() % nchars);
+}
+
+// a copy of s with a few random edits
+static void mutate(nustring &result, nustring &s, int nedits) {
+    copy(result, s);
+    for(int e = 0; e < nedits; e++) {
+        int i = result.length() ? rand() % result.length() : 0;
+        nuchar c('a' + rand() % 4);
+        switch(rand() % 3) {
+        case 0:
+            if(result.length()) result[i] = c;
+            break;
+        case 1:
+            insert_at(result, i, c);
+            break;
+        case 2:
+            if(result.length()) delete_at(result, i);
+            break;
+        }
+    }
+}
+
+static void test_fast_edit_distance() {
+    for(int trial = 0; trial < 2000; trial++) {
+        nustring a, b;
+        random_string(a, trial % 2 ? 20 : 200, 2 + trial % 5);
+        random_string(b, trial % 3 ? 20 : 200, 2 + trial % 5);
+        CHECK_CONDITION(fast_edit_distance(a, b) == int(edit_distance(a, b)));
+    }
+}
+
+static void test_bounded_edit_distance() {
+    for(int trial = 0; trial < 2000; trial++) {
+        nustring a, b;
+        random_string(a, 150, 4);
+        mutate(b, a, trial % 12);
+        int d = int(edit_distance(a, b));
+        for(int k = 0; k < 15; k++) {
+            int bounded = bounded_edit_distance(a, b, k);
+            CHECK_CONDITION(d <= k ? bounded == d : bounded == k + 1);
+        }
+    }
+}
+
+static void test_fast_block_move_edit_cost() {
+    float costs[] = {0, 1, 2, 3, 5, 10, 70, 2.5};
+    for(int trial = 0; trial < 2000; trial++) {
+        nustring a, b;
+        random_string(a, trial % 2 ? 30 : 300, 2 + trial % 5);
+        if(trial % 4)
+            mutate(b, a, trial % 20);
+        else
+            random_string(b, 300, 2 + trial % 5);
+        float c = costs[trial % (sizeof costs / sizeof costs[0])];
+        CHECK_CONDITION(fast_block_move_edit_cost(a, b, c) ==
+                        block_move_edit_cost(a, b, c));
+    }
+}
+
+int main() {
+    srand(1);
+    test_fast_edit_distance();
+    test_bounded_edit_distance();
+    test_fast_block_move_edit_cost();
+    return 0;
+}
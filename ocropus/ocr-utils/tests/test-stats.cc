@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <colib/colib.h>
+#include "stats.h"
+
+using namespace colib;
+using namespace ocropus;
+
+enum { nthreads = 4, nlines = 100 };
+
+static void recognize_line() {
+    StatsTimer timer("recognizeLine");
+    {
+        StatsTimer timer("setLine");
+    }
+    for(int i = 0; i < 3; i++) {
+        StatsTimer timer("classify");
+    }
+    stats_count("bytes_read", 10);
+}
+
+static void *recognize_lines(void *) {
+    for(int i = 0; i < nlines; i++)
+        recognize_line();
+    return 0;
+}
+
+// the JSON summary written by stats_write
+static void summary(iucstring &result) {
+    FILE *stream = tmpfile();
+    CHECK_CONDITION(stream);
+    stats_write(stream, "test");
+    rewind(stream);
+    result = "";
+    int c;
+    while((c = fgetc(stream)) != EOF)
+        result.push_back(char(c));
+    fclose(stream);
+}
+
+int main() {
+    // nothing is recorded before stats_enable
+    recognize_line();
+    stats_enable();
+    iucstring s;
+    summary(s);
+    CHECK_CONDITION(strstr(s.c_str(), "\"command\": \"test\""));
+    CHECK_CONDITION(!strstr(s.c_str(), "recognizeLine"));
+    CHECK_CONDITION(!strstr(s.c_str(), "bytes_read"));
+
+    // nested timers from several threads are merged by their paths
+    pthread_t threads[nthreads];
+    for(int t = 0; t < nthreads; t++)
+        pthread_create(&threads[t], 0, recognize_lines, 0);
+    for(int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], 0);
+    {
+        StatsTimer timer("page");
+        recognize_line();
+    }
+    summary(s);
+    char expected[100];
+    sprintf(expected, "{\"stage\": \"recognizeLine\", \"count\": %d,", nthreads * nlines);
+    CHECK_CONDITION(strstr(s.c_str(), expected));
+    sprintf(expected, "{\"stage\": \"recognizeLine/classify\", \"count\": %d,", 3 * nthreads * nlines);
+    CHECK_CONDITION(strstr(s.c_str(), expected));
+    CHECK_CONDITION(strstr(s.c_str(), "{\"stage\": \"page/recognizeLine/setLine\", \"count\": 1,"));
+    sprintf(expected, "\"bytes_read\": %d", 10 * (nthreads * nlines + 1));
+    CHECK_CONDITION(strstr(s.c_str(), expected));
+    return 0;
+}
@@ -139,6 +139,7 @@ namespace ocropus {
     }
 
     void SegmentPageByVORONOI::segment(intarray &out_image,bytearray &in_image){
+        StatsTimer timer("segment");
 
         if(!contains_only(in_image,byte(0),byte(255))){
             fprintf(stderr,"Voronoi algorithm needs binary input image.\n");